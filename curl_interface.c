@@ -22,7 +22,30 @@
 #include <curl/curl.h>
 #include <curl/multi.h>
 
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+// Give up on a throttled request after this many attempts
+const int max_attempts = 8;
+// The first retry waits up to this long, doubling for each retry after
+const long backoff_base_ms = 250;
+// No single wait is longer than this
+const long backoff_max_ms = 32000;
+// A longer Retry-After is not honoured in full
+const long retry_after_max_ms = 60000;
+// A wait before retrying polls for cancellation this often
+const long backoff_slice_ms = 100;
+// Give up on connecting to the server after this long
+const long connect_timeout_ms = 10000;
+// A transfer slower than low_speed_limit bytes/second for low_speed_time
+// seconds is considered stalled, and is aborted and resumed
+const long low_speed_limit = 1024;
+const long low_speed_time = 20;
 
 /** Initialize a request.
  *
@@ -34,8 +57,10 @@
  *  @uri          struct str_t*     the uri for the initial request
  *  @header_count size_t            the number of elements in headers[]
  *  @headers      struct str_t[]    the headers, if any, for this request
- *  @msg          const char*       a message for POST, NULL if not POST
+ *  @msg          const char*       a message for POST or PUT, NULL otherwise
  *  @type         enum request_type the type of the request, GET, POST, ...
+ *
+ *  A PUT without msg sends an empty body until ci_set_upload() is called.
  */
 int ci_init(struct request_t* request, struct str_t* uri,
 		size_t header_count, const struct str_t const headers[],
@@ -56,6 +81,15 @@ int ci_init(struct request_t* request, struct str_t* uri,
 	curl_easy_setopt(handle, CURLOPT_VERBOSE, 1);
 	curl_easy_setopt(handle, CURLOPT_USE_SSL, CURLUSESSL_ALL); // SSL
 
+	curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1); // We are multithreaded
+	curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT_MS, connect_timeout_ms);
+	curl_easy_setopt(handle, CURLOPT_LOW_SPEED_LIMIT, low_speed_limit);
+	curl_easy_setopt(handle, CURLOPT_LOW_SPEED_TIME, low_speed_time);
+	// Lets us notice cancellation even while no data is arriving
+	curl_easy_setopt(handle, CURLOPT_NOPROGRESS, 0);
+	curl_easy_setopt(handle, CURLOPT_XFERINFOFUNCTION, ci_progress_callback);
+	curl_easy_setopt(handle, CURLOPT_XFERINFODATA, request);
+
 	curl_easy_setopt(handle, CURLOPT_HEADER, 1); // Enable headers, necessary?
 	// set curl_post_callback for parsing the server response
 	curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, ci_callback_controller);
@@ -77,11 +111,28 @@ int ci_init(struct request_t* request, struct str_t* uri,
 		case POST:
 			curl_easy_setopt(handle, CURLOPT_POSTFIELDS, msg);
 			break;
+		case PUT:
+			request->upload_fd = -1;
+			if(msg)
+			{
+				curl_easy_setopt(handle, CURLOPT_POSTFIELDS, msg);
+				curl_easy_setopt(handle, CURLOPT_CUSTOMREQUEST, "PUT");
+				break;
+			}
+			curl_easy_setopt(handle, CURLOPT_UPLOAD, 1);
+			curl_easy_setopt(handle, CURLOPT_READFUNCTION, ci_read_callback);
+			curl_easy_setopt(handle, CURLOPT_READDATA, request);
+			curl_easy_setopt(handle, CURLOPT_INFILESIZE_LARGE, (curl_off_t) 0);
+			break;
+		case DELETE:
+			curl_easy_setopt(handle, CURLOPT_CUSTOMREQUEST, "DELETE");
+			break;
 		default:
 			break;
 	}
 
 	request->handle = handle;
+	request->type = type;
 
 	ret = ci_set_uri(request, uri);
 
@@ -111,6 +162,98 @@ int ci_set_uri(struct request_t* request, struct str_t* uri)
 	return curl_easy_setopt(request->handle, CURLOPT_URL, uri->str); // set URI
 }
 
+/** Set the scheduler class for a request.
+ *
+ *  This also applies the bandwidth cap for that class to the handle.
+ *
+ *  @request  struct request_t*       the request to set
+ *  @priority enum request_priority_e the class to queue this request in
+ */
+int ci_set_priority(struct request_t* request, enum request_priority_e priority)
+{
+	request->priority = priority;
+	return curl_easy_setopt(request->handle, CURLOPT_MAX_RECV_SPEED_LARGE,
+			rs_recv_speed(priority));
+}
+
+/** Set the time budget for a request.
+ *
+ *  The budget covers every attempt ci_request() makes, including time spent
+ *  waiting for the scheduler and backing off.
+ *
+ *  @request     struct request_t* the request to set
+ *  @deadline_ms long              milliseconds allowed, 0 for no limit
+ */
+void ci_set_deadline(struct request_t* request, long deadline_ms)
+{
+	request->deadline_ms = deadline_ms;
+}
+
+/** Set a function to poll for cancellation of a request.
+ *
+ *  While the request is in progress the function is polled about once a
+ *  second, when it returns nonzero the transfer is aborted.
+ *
+ *  @request   struct request_t* the request to set
+ *  @cancelled int (*)(void)     the function to poll, or NULL
+ */
+void ci_set_cancel(struct request_t* request, int (*cancelled)(void))
+{
+	request->cancelled = cancelled;
+}
+
+/** Request only part of the body.
+ *
+ *  @request struct request_t* the request to set
+ *  @start   curl_off_t        the offset of the first byte wanted
+ *  @length  curl_off_t        the number of bytes wanted, 0 for the whole body
+ */
+int ci_set_range(struct request_t* request, curl_off_t start, curl_off_t length)
+{
+	char range[64];
+
+	request->range_start = start;
+	request->range_length = length;
+	if(!length)
+		return curl_easy_setopt(request->handle, CURLOPT_RANGE, NULL);
+
+	snprintf(range, sizeof(range), "%lld-%lld", (long long) start,
+			(long long) (start + length - 1));
+	return curl_easy_setopt(request->handle, CURLOPT_RANGE, range);
+}
+
+/** Accept the body in any encoding libcurl can decode, such as gzip.
+ *
+ *  Worth it for large text bodies like listings. A stalled transfer of a
+ *  compressed body starts over rather than resuming.
+ *
+ *  @request struct request_t* the request to set
+ */
+int ci_set_compressed(struct request_t* request)
+{
+	request->compressed = 1;
+	return curl_easy_setopt(request->handle, CURLOPT_ACCEPT_ENCODING, "");
+}
+
+/** Set the body of a PUT request to part of a file.
+ *
+ *  The file is read as the request is sent, so it is never held in memory,
+ *  and read again from the start if the request has to be made again.
+ *
+ *  @request struct request_t* the PUT request to set
+ *  @fd      int               the file to send from, must stay open
+ *  @offset  curl_off_t        where in the file the body starts
+ *  @length  curl_off_t        the number of bytes to send
+ */
+int ci_set_upload(struct request_t* request, int fd, curl_off_t offset, curl_off_t length)
+{
+	request->upload_fd = fd;
+	request->upload_offset = offset;
+	request->upload_length = length;
+	request->upload_sent = 0;
+	return curl_easy_setopt(request->handle, CURLOPT_INFILESIZE_LARGE, length);
+}
+
 /** Create the header for a request from an array of str_ts.
  *
  *  Takes an array of str_ts and creates a header from them.
@@ -141,13 +284,527 @@ int ci_create_header(struct request_t* request,
 }
 
 /** Make a request.
+ *
+ *  Waits for the scheduler to admit this request's priority class before
+ *  anything is sent.
  *
  *  @request struct request_t* the initialized request_t for making this request
  */
 int ci_request(struct request_t* request)
 {
+	int ret = CURLE_OK;
+	int attempt;
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	request->resume_offset = 0;
+
+	for(attempt = 0; attempt < max_attempts; ++attempt)
+	{
+		long remaining = ci_remaining_ms(request, &start);
+		if(remaining < 0)
+		{
+			ret = CURLE_OPERATION_TIMEDOUT;
+			break;
+		}
+		if(request->cancelled && request->cancelled())
+		{
+			ret = CURLE_ABORTED_BY_CALLBACK;
+			break;
+		}
+		curl_easy_setopt(request->handle, CURLOPT_TIMEOUT_MS, remaining);
+		ci_reset_flags(request);
+		request->upload_sent = 0;
+
+		rs_acquire(request->priority);
+		ret = curl_easy_perform(request->handle);
+		rs_release(request->priority);
+
+		request->status = 0;
+		curl_easy_getinfo(request->handle, CURLINFO_RESPONSE_CODE, &request->status);
+
+		// The server ignored our range and sent everything again
+		if(request->resume_offset && request->status == 200 && !request->range_length)
+			ci_discard_resumed(request);
+
+		if(ret == CURLE_ABORTED_BY_CALLBACK)
+			break;
+
+		if(ci_is_stalled(request, ret, &start))
+		{
+			ci_resume(request);
+			if(attempt + 1 < max_attempts)
+			{
+				int waited = ci_backoff(request, attempt, &start);
+				if(waited != CURLE_OK)
+				{
+					ret = waited;
+					break;
+				}
+			}
+			continue;
+		}
+
+		if(!ci_is_throttled(request))
+		{
+			if(ret == CURLE_OK)
+				rs_success();
+			break;
+		}
+
+		rs_throttled();
+		if(attempt + 1 < max_attempts)
+		{
+			// The throttled response stands if there is no time to retry
+			int waited = ci_backoff(request, attempt, &start);
+			if(waited != CURLE_OK)
+			{
+				ret = waited;
+				break;
+			}
+			ci_clear_response(request);
+			request->resume_offset = 0;
+			curl_easy_setopt(request->handle, CURLOPT_RESUME_FROM_LARGE, (curl_off_t) 0);
+		}
+	}
+
+	if(request->resume_offset)
+	{
+		curl_easy_setopt(request->handle, CURLOPT_RESUME_FROM_LARGE, (curl_off_t) 0);
+		ci_set_range(request, request->range_start, request->range_length);
+	}
+
+	return ret;
+}
+
+/** Feed the time a hedgeable request took to its first byte to the scheduler.
+ *
+ *  Nothing is recorded if no response was received.
+ *
+ *  @request struct request_t* the request, after it was made
+ */
+static void ci_record_first_byte(const struct request_t* request)
+{
+	double first_byte = 0;
+
+	if(!request->response.headers.len)
+		return;
+	curl_easy_getinfo(request->handle, CURLINFO_STARTTRANSFER_TIME, &first_byte);
+	rs_record_latency((long) (first_byte * 1000));
+}
+
+/** Make a request, racing a duplicate against it if it is slow to start.
+ *
+ *  If request has not received a single byte after the scheduler's hedge
+ *  delay, a duplicate is built with init and sent as well, and whichever
+ *  completes first wins, the other transfer is abandoned. Nothing is built
+ *  for requests that start in time. The winning response always ends up in
+ *  request, if neither succeeds request keeps its own result. Only if the
+ *  race cannot be set up at all is the request made with ci_request(), as it
+ *  is until the scheduler has timed enough requests to pick a hedge delay.
+ *
+ *  @request struct request_t* the initialized request to make
+ *  @init    int (*)(struct request_t*, void*) initializes the duplicate,
+ *           returns nonzero on failure
+ *  @arg     void*             passed to init
+ *
+ *  @returns the curl result of the winning transfer, or of request
+ */
+int ci_request_hedged(struct request_t* request,
+		int (*init)(struct request_t* hedge, void* arg), void* arg)
+{
+	struct request_t hedge;
+	struct request_t* racers[2] = { request, &hedge };
+	int done[2] = { 0, 0 };
+	int results[2] = { CURLE_OK, CURLE_OK };
+	int hedged = 0;
+	int built = 0;
+	int winner = -1;
+	int running;
+	struct timespec start, now;
+
+	long delay = rs_hedge_delay();
+	CURLM *multi = (delay < 0) ? NULL : curl_multi_init();
+	if(multi != NULL && curl_multi_add_handle(multi, request->handle) != CURLM_OK)
+	{
+		curl_multi_cleanup(multi);
+		multi = NULL;
+	}
+	if(multi == NULL)
+	{
+		// Until there are enough of these there is no hedge delay to use
+		int ret = ci_request(request);
+		ci_record_first_byte(request);
+		return ret;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	ci_reset_flags(request);
-	return curl_easy_perform(request->handle);
+	curl_easy_setopt(request->handle, CURLOPT_TIMEOUT_MS, request->deadline_ms);
+	request->status = 0;
+
+	rs_acquire(request->priority);
+
+	while(1)
+	{
+		CURLMsg *msg;
+		int left;
+
+		curl_multi_perform(multi, &running);
+		while((msg = curl_multi_info_read(multi, &left)))
+		{
+			if(msg->msg != CURLMSG_DONE)
+				continue;
+
+			int i = (msg->easy_handle == request->handle) ? 0 : 1;
+			struct request_t *racer = racers[i];
+			done[i] = 1;
+			results[i] = msg->data.result;
+			curl_easy_getinfo(racer->handle, CURLINFO_RESPONSE_CODE, &racer->status);
+			if(winner < 0 && results[i] == CURLE_OK && racer->status >= 200
+					&& racer->status < 300)
+				winner = i;
+		}
+
+		if(winner >= 0 || (done[0] && (!hedged || done[1])))
+			break;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		long elapsed = (now.tv_sec - start.tv_sec) * 1000 +
+			(now.tv_nsec - start.tv_nsec) / 1000000;
+
+		// Tried once, a hedge that cannot be built or sent leaves the primary
+		// to run on alone
+		if(!built && !done[0] && elapsed >= delay && !request->response.headers.len
+				&& rs_acquire_hedge(request->priority))
+		{
+			built = (init(&hedge, arg) == 0) ? 1 : -1;
+			long remaining = request->deadline_ms ? request->deadline_ms - elapsed : 0;
+			if(built > 0)
+			{
+				curl_easy_setopt(hedge.handle, CURLOPT_TIMEOUT_MS, remaining > 0 ? remaining : 1);
+				ci_reset_flags(&hedge);
+				hedged = curl_multi_add_handle(multi, hedge.handle) == CURLM_OK;
+			}
+			if(!hedged)
+				rs_release(request->priority);
+		}
+
+		curl_multi_wait(multi, NULL, 0, 20, NULL);
+	}
+
+	// Feed how long the primary took to start back into the hedge delay, if it
+	// never started this is a lower bound, which is still worth knowing
+	if(request->response.headers.len)
+		ci_record_first_byte(request);
+	else
+	{
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		rs_record_latency((now.tv_sec - start.tv_sec) * 1000 +
+				(now.tv_nsec - start.tv_nsec) / 1000000);
+	}
+
+	curl_multi_remove_handle(multi, request->handle);
+	rs_release(request->priority);
+	if(hedged)
+	{
+		curl_multi_remove_handle(multi, hedge.handle);
+		rs_release(request->priority);
+	}
+	curl_multi_cleanup(multi);
+
+	if(winner == 1)
+	{
+		str_swap(&request->response.body, &hedge.response.body);
+		str_swap(&request->response.headers, &hedge.response.headers);
+		request->status = hedge.status;
+	}
+	if(built > 0)
+		ci_destroy(&hedge);
+
+	if(winner >= 0)
+	{
+		rs_success();
+		return results[winner];
+	}
+
+	// The primary's own answer stands, an error from the server or a deadline
+	// that passed is not made better by asking again
+	if(ci_is_throttled(request))
+		rs_throttled();
+	return results[0];
+}
+
+/** Find how much of a request's time budget is left.
+ *
+ *  @request struct request_t* the request being made
+ *  @start   struct timespec*  when ci_request() was called
+ *
+ *  @returns milliseconds left, 0 if there is no deadline, -1 if it has passed
+ */
+long ci_remaining_ms(const struct request_t* request,
+		const struct timespec* start)
+{
+	struct timespec now;
+
+	if(!request->deadline_ms)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long elapsed = (now.tv_sec - start->tv_sec) * 1000 +
+		(now.tv_nsec - start->tv_nsec) / 1000000;
+	if(elapsed >= request->deadline_ms)
+		return -1;
+	return request->deadline_ms - elapsed;
+}
+
+/** Check if a transfer failed in a way that reconnecting may fix.
+ *
+ *  This covers connections that could not be made, were dropped part way
+ *  through, or fell under the low speed limit. Curl reports the deadline
+ *  running out the same way as the low speed limit, a transfer that ran out
+ *  of time is not stalled.
+ *
+ *  @request struct request_t*      the request being made
+ *  @code    CURLcode               the result of curl_easy_perform()
+ *  @start   const struct timespec* when ci_request() was called
+ */
+int ci_is_stalled(const struct request_t* request, CURLcode code,
+		const struct timespec* start)
+{
+	switch(code)
+	{
+		case CURLE_OPERATION_TIMEDOUT:
+			return ci_remaining_ms(request, start) >= 0;
+		case CURLE_COULDNT_CONNECT:
+		case CURLE_PARTIAL_FILE:
+		case CURLE_SEND_ERROR:
+		case CURLE_RECV_ERROR:
+		case CURLE_GOT_NOTHING:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+/** Prepare a stalled request to be made again.
+ *
+ *  A GET that already received part of a successful uncompressed body keeps
+ *  what it has and asks the server for the rest, anything else starts over.
+ *
+ *  @request struct request_t* the stalled request
+ */
+void ci_resume(struct request_t* request)
+{
+	if(request->type == GET && request->status >= 200 && request->status < 300
+			&& request->response.body.len && !request->compressed)
+	{
+		request->resume_offset = request->response.body.len;
+		str_destroy(&request->response.headers);
+		str_init(&request->response.headers);
+		if(request->range_length)
+		{
+			// Ask for what is left of the range rather than the rest of the body
+			char range[64];
+			snprintf(range, sizeof(range), "%lld-%lld",
+					(long long) (request->range_start + request->resume_offset),
+					(long long) (request->range_start + request->range_length - 1));
+			curl_easy_setopt(request->handle, CURLOPT_RANGE, range);
+		}
+		else
+			curl_easy_setopt(request->handle, CURLOPT_RESUME_FROM_LARGE,
+					(curl_off_t) request->resume_offset);
+	}
+	else
+	{
+		ci_clear_response(request);
+		if(request->resume_offset)
+			ci_set_range(request, request->range_start, request->range_length);
+		request->resume_offset = 0;
+		curl_easy_setopt(request->handle, CURLOPT_RESUME_FROM_LARGE, (curl_off_t) 0);
+	}
+}
+
+/** Drop the part of a body kept from before a resume.
+ *
+ *  Used when the server answers a resumed request with the whole body.
+ *
+ *  @request struct request_t* the resumed request
+ */
+void ci_discard_resumed(struct request_t* request)
+{
+	struct str_t *body = &request->response.body;
+	size_t offset = request->resume_offset;
+
+	if(offset > body->len)
+		offset = body->len;
+	memmove(body->str, body->str + offset, body->len - offset);
+	body->len -= offset;
+	body->str[body->len] = 0;
+	request->resume_offset = 0;
+}
+
+/** Curl progress callback, aborts the transfer if it was cancelled.
+ *
+ *  @store struct request_t* the request this callback is for
+ *
+ *  @returns nonzero to make curl abort the transfer
+ */
+int ci_progress_callback(void *store, curl_off_t dltotal, curl_off_t dlnow,
+		curl_off_t ultotal, curl_off_t ulnow)
+{
+	struct request_t* req = (struct request_t*) store;
+	if(req->cancelled && req->cancelled())
+		return 1;
+	return 0;
+}
+
+/** Check if the server refused a request because of rate limiting.
+ *
+ *  Drive signals this with 429 or 503, or with a 403 whose error reason is
+ *  rateLimitExceeded or userRateLimitExceeded. A 500 is also worth retrying.
+ *
+ *  @request struct request_t* the request with a completed response
+ *
+ *  @returns 1 if the request should be retried later, 0 otherwise
+ */
+int ci_is_throttled(const struct request_t* request)
+{
+	switch(request->status)
+	{
+		case 429:
+		case 500:
+		case 503:
+			return 1;
+		case 403:
+			if(request->response.body.str &&
+					strstr(request->response.body.str, "RateLimitExceeded"))
+				return 1;
+			if(request->response.body.str &&
+					strstr(request->response.body.str, "rateLimitExceeded"))
+				return 1;
+			return 0;
+		default:
+			return 0;
+	}
+}
+
+/** Find the delay the server asked for in a Retry-After header.
+ *
+ *  Only the delta-seconds form is understood.
+ *
+ *  @request struct request_t* the request with a completed response
+ *
+ *  @returns the delay in milliseconds, 0 if there was none
+ */
+long ci_retry_after(const struct request_t* request)
+{
+	const char field[] = "Retry-After:";
+	const char *iter = request->response.headers.str;
+
+	while(iter && *iter)
+	{
+		if(strncasecmp(iter, field, sizeof(field) - 1) == 0)
+			return strtol(iter + sizeof(field) - 1, NULL, 10) * 1000;
+		iter = strchr(iter, '\n');
+		if(iter)
+			++iter;
+	}
+
+	return 0;
+}
+
+/** Find the value of a header in a response.
+ *
+ *  Leading and trailing whitespace is stripped from the value.
+ *
+ *  @request struct request_t* the request with a completed response
+ *  @field   const char*       the header name, without the colon
+ *  @value   struct str_t*     an initialized str_t that receives the value
+ *
+ *  @returns 0 if the header was found, 1 if it was not or on failure
+ */
+int ci_get_header(const struct request_t* request, const char* field,
+		struct str_t* value)
+{
+	size_t length = strlen(field);
+	const char *iter = request->response.headers.str;
+
+	while(iter && *iter)
+	{
+		if(strncasecmp(iter, field, length) == 0 && iter[length] == ':')
+		{
+			const char *start = iter + length + 1;
+			const char *end = start;
+			while(*end && *end != '\r' && *end != '\n')
+				++end;
+			while(start < end && (*start == ' ' || *start == '\t'))
+				++start;
+			while(end > start && (end[-1] == ' ' || end[-1] == '\t'))
+				--end;
+			str_clear(value);
+			return str_char_concat(value, start, end - start) ? 1 : 0;
+		}
+		iter = strchr(iter, '\n');
+		if(iter)
+			++iter;
+	}
+
+	return 1;
+}
+
+/** Sleep before retrying a throttled or stalled request.
+ *
+ *  Uses exponential backoff with full jitter: a random delay between zero and
+ *  backoff_base_ms * 2^attempt, capped at backoff_max_ms. Clients that were
+ *  throttled together then come back spread out rather than as one burst.
+ *  The server's Retry-After is honoured up to retry_after_max_ms.
+ *
+ *  The wait never runs past the request's deadline, and is sliced so a
+ *  cancelled request stops waiting within backoff_slice_ms.
+ *
+ *  @request struct request_t*      the request to retry
+ *  @attempt int                    the number of retries made so far
+ *  @start   const struct timespec* when ci_request() was called
+ *
+ *  @returns CURLE_OK once it is time to retry, CURLE_OPERATION_TIMEDOUT if the
+ *           deadline would pass first, CURLE_ABORTED_BY_CALLBACK if cancelled
+ */
+int ci_backoff(const struct request_t* request, int attempt,
+		const struct timespec* start)
+{
+	static __thread unsigned int seed = 0;
+	if(!seed)
+		seed = (unsigned int) time(NULL) ^ (unsigned int) (size_t) &seed;
+
+	long ceiling = backoff_base_ms << attempt;
+	if(ceiling > backoff_max_ms || ceiling <= 0)
+		ceiling = backoff_max_ms;
+
+	long delay = rand_r(&seed) % (ceiling + 1);
+	long asked = ci_retry_after(request);
+	if(asked > retry_after_max_ms)
+		asked = retry_after_max_ms;
+	if(asked > delay)
+		delay = asked;
+
+	// No retry could be made in time
+	long remaining = ci_remaining_ms(request, start);
+	if(remaining < 0 || (request->deadline_ms && delay >= remaining))
+		return CURLE_OPERATION_TIMEDOUT;
+
+	while(delay > 0)
+	{
+		if(request->cancelled && request->cancelled())
+			return CURLE_ABORTED_BY_CALLBACK;
+		long slice = (delay < backoff_slice_ms) ? delay : backoff_slice_ms;
+		struct timespec wait = { slice / 1000, (slice % 1000) * 1000000 };
+		while(nanosleep(&wait, &wait) == -1 && errno == EINTR)
+			;
+		delay -= slice;
+	}
+
+	return CURLE_OK;
 }
 
 /** Reset the request.response data.
@@ -211,6 +868,38 @@ size_t ci_callback_controller(void *data, size_t size, size_t nmemb, void *store
 	return size*nmemb;
 }
 
+/** Curl callback supplying the body of a PUT from the request's upload file.
+ *
+ *  @buffer char*             where curl wants the data
+ *  @size   size_t            size of one element in buffer
+ *  @nitems size_t            number of size chunks that fit in buffer
+ *  @store  struct request_t* the request this callback is for
+ *
+ *  @returns the number of bytes supplied, 0 once the body is done
+ */
+size_t ci_read_callback(char *buffer, size_t size, size_t nitems, void *store)
+{
+	struct request_t* req = (struct request_t*) store;
+	curl_off_t remaining = req->upload_length - req->upload_sent;
+	size_t wanted = size*nitems;
+
+	if(req->upload_fd < 0 || remaining <= 0)
+		return 0;
+	if((curl_off_t) wanted > remaining)
+		wanted = remaining;
+
+	ssize_t count = pread(req->upload_fd, buffer, wanted,
+			req->upload_offset + req->upload_sent);
+	if(count < 0 && errno == EINTR)
+		count = pread(req->upload_fd, buffer, wanted,
+				req->upload_offset + req->upload_sent);
+	if(count <= 0)
+		return CURL_READFUNC_ABORT;
+
+	req->upload_sent += count;
+	return count;
+}
+
 /** Resets the flags for a request.
  *
  *  @request struct request_t* the request we wish to reset
@@ -21,16 +21,20 @@
 
 #include <curl/curl.h>
 #include <curl/multi.h>
+#include <time.h>
 
 #include "str.h"
 #include "stack.h"
 #include "functional_stack.h"
+#include "request_scheduler.h"
 
 /** The type of an HTTP request
  */
 enum request_type_e {
 	POST,
 	GET,
+	PUT,
+	DELETE,
 };
 
 struct request_flags_t {
@@ -73,6 +77,34 @@ struct request_t {
 	// What type of request this is.
 	enum request_type_e type;
 
+	// Which scheduler class this request is queued in, defaults to interactive
+	enum request_priority_e priority;
+
+	// The HTTP status code of the last response, 0 if none was received
+	long status;
+
+	// Milliseconds ci_request() may take over every attempt, 0 for no limit
+	long deadline_ms;
+	// Polled during transfers, the transfer is aborted when it returns nonzero
+	int (*cancelled)(void);
+	// How much of the body was kept when a stalled transfer was resumed
+	size_t resume_offset;
+
+	// The byte range requested, range_length is 0 for the whole body
+	curl_off_t range_start;
+	curl_off_t range_length;
+
+	// Set if the body may be sent compressed, such a body cannot be resumed
+	// part way as its offsets are not those of the decoded bytes
+	int compressed;
+
+	// The body of a PUT is read from upload_fd, upload_length bytes starting
+	// at upload_offset. upload_sent counts what the current attempt has sent.
+	int upload_fd;
+	curl_off_t upload_offset;
+	curl_off_t upload_length;
+	curl_off_t upload_sent;
+
 	// Any bit flags for control purposes (parsing etc)
 	struct request_flags_t flags;
 };
@@ -85,12 +117,37 @@ int ci_destroy(struct request_t* request);
 int ci_create_header(struct request_t* request,
 		size_t header_count, const struct str_t headers[]);
 int ci_set_uri(struct request_t* request, struct str_t* uri);
+int ci_set_priority(struct request_t* request, enum request_priority_e priority);
+void ci_set_deadline(struct request_t* request, long deadline_ms);
+void ci_set_cancel(struct request_t* request, int (*cancelled)(void));
+int ci_set_range(struct request_t* request, curl_off_t start, curl_off_t length);
+int ci_set_compressed(struct request_t* request);
+int ci_set_upload(struct request_t* request, int fd, curl_off_t offset, curl_off_t length);
 
 int ci_request(struct request_t* request);
+int ci_request_hedged(struct request_t* request,
+		int (*init)(struct request_t* hedge, void* arg), void* arg);
 
 void ci_clear_response(struct request_t* request);
 
 size_t ci_callback_controller(void *data, size_t size, size_t nmemb, void *store);
+size_t ci_read_callback(char *buffer, size_t size, size_t nitems, void *store);
+int ci_progress_callback(void *store, curl_off_t dltotal, curl_off_t dlnow,
+		curl_off_t ultotal, curl_off_t ulnow);
 
 void ci_reset_flags(struct request_t* request);
+
+int ci_is_throttled(const struct request_t* request);
+long ci_retry_after(const struct request_t* request);
+int ci_get_header(const struct request_t* request, const char* field,
+		struct str_t* value);
+int ci_backoff(const struct request_t* request, int attempt,
+		const struct timespec* start);
+
+long ci_remaining_ms(const struct request_t* request,
+		const struct timespec* start);
+int ci_is_stalled(const struct request_t* request, CURLcode code,
+		const struct timespec* start);
+void ci_resume(struct request_t* request);
+void ci_discard_resumed(struct request_t* request);
 #endif
@@ -0,0 +1,534 @@
+/*
+	fuse-google-drive: a fuse filesystem wrapper for Google Drive
+	Copyright (C) 2012  James Cline
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2 as
+ 	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <json.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "curl_interface.h"
+#include "gd_auth.h"
+#include "gd_interface.h"
+#include "str.h"
+
+static struct gda_state_t auth;
+
+const char auth_uri[] = "https://accounts.google.com/o/oauth2/auth";
+const char token_uri[] = "https://accounts.google.com/o/oauth2/token";
+const char *scopes[] = {
+	"https://www.googleapis.com/auth/drive",
+	"https://www.googleapis.com/auth/userinfo.email",
+	"https://www.googleapis.com/auth/userinfo.profile",
+	"https://docs.google.com/feeds/",
+	"https://docs.googleusercontent.com/",
+	"https://spreadsheets.google.com/feeds/",
+};
+
+const char refresh_token_file[] = "refresh_token";
+// Access tokens are renewed this long before they expire, in seconds
+const long renew_margin = 300;
+// A renewal that failed is tried again after this many seconds
+const long renew_retry = 30;
+// Time allowed for a token request
+const long token_deadline_ms = 30000;
+// A replaced Authorization header is freed this many seconds later, by when
+// the requests that were copying it have their own copy
+const long retire_grace = 60;
+
+void* gda_renewer(void* arg);
+static int gda_refresh();
+static int gda_authorize();
+
+/** Check that the saved refresh token can be trusted.
+ *
+ *  It must be a regular file of ours that nobody else can read or write,
+ *  anything else is ignored and the user asked to authorize again.
+ *
+ *  @returns nonzero if the file is there and may be used
+ */
+static int gda_token_file_ok()
+{
+	struct stat info;
+
+	if(lstat(auth.token_file, &info))
+		return 0;
+	if(!S_ISREG(info.st_mode) || info.st_uid != getuid()
+			|| (info.st_mode & (S_IRWXG | S_IRWXO)))
+	{
+		printf("Ignoring %s, it must be a file only you can read and write.\n",
+				auth.token_file);
+		return 0;
+	}
+	return access(auth.token_file, R_OK) == 0;
+}
+
+/** Authorize this mount.
+ *
+ *  Uses the refresh token saved by an earlier mount if there is one, and
+ *  only asks the user to authorize us in a browser if that fails. The
+ *  renewer is started by gda_start().
+ *
+ *  @state struct gdi_state* the state for this mount, with the client id and
+ *         secret loaded
+ *  @path  const char*       the configuration directory, with a trailing '/'
+ *
+ *  @returns 0 on success, 1 on failure
+ */
+int gda_init(struct gdi_state* state, const char* path)
+{
+	pthread_condattr_t attr;
+	int ret = 1;
+
+	memset(&auth, 0, sizeof(struct gda_state_t));
+	auth.gdi = state;
+	state->oauth_header = NULL;
+
+	auth.token_file = (char*) malloc(strlen(path) + sizeof(refresh_token_file));
+	if(auth.token_file == NULL)
+		return 1;
+	memcpy(auth.token_file, path, strlen(path));
+	memcpy(auth.token_file + strlen(path), refresh_token_file, sizeof(refresh_token_file));
+
+	pthread_mutex_init(&auth.lock, NULL);
+	// Renewal times are monotonic
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&auth.cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if(gda_token_file_ok())
+	{
+		char *saved = load_file(path, refresh_token_file);
+		if(saved)
+		{
+			// Tolerate a trailing newline from hand editing
+			saved[strcspn(saved, " \t\r\n")] = 0;
+			str_init_create(&state->refresh_token, saved, 0);
+			free(saved);
+			ret = gda_refresh();
+			if(ret)
+				printf("The saved authorization did not work, please authorize again.\n");
+		}
+	}
+
+	if(ret)
+		ret = gda_authorize();
+	if(ret)
+	{
+		gda_destroy();
+		return 1;
+	}
+
+	return 0;
+}
+
+/** Start the renewer.
+ *
+ *  Apart from gda_init() so that it runs in the process that serves the
+ *  mount, threads do not survive fuse_daemonize().
+ *
+ *  @returns 0 on success, 1 on failure
+ */
+int gda_start()
+{
+	if(pthread_create(&auth.renewer, NULL, gda_renewer, NULL))
+		return 1;
+	auth.started = 1;
+	return 0;
+}
+
+/** Stop the renewer and free every header.
+ *
+ *  Must only be called once nothing sends requests any more.
+ */
+void gda_destroy()
+{
+	struct gdi_state *state = auth.gdi;
+
+	if(auth.started)
+	{
+		pthread_mutex_lock(&auth.lock);
+		auth.stopping = 1;
+		pthread_cond_broadcast(&auth.cond);
+		pthread_mutex_unlock(&auth.lock);
+		pthread_join(auth.renewer, NULL);
+	}
+
+	while(auth.retired)
+	{
+		struct gda_retired_t *next = auth.retired->next;
+		str_destroy(auth.retired->header);
+		free(auth.retired->header);
+		free(auth.retired);
+		auth.retired = next;
+	}
+	if(state->oauth_header)
+	{
+		str_destroy(state->oauth_header);
+		free(state->oauth_header);
+		state->oauth_header = NULL;
+	}
+
+	str_destroy(&state->access_token);
+	str_destroy(&state->refresh_token);
+	str_destroy(&state->token_type);
+	str_destroy(&state->id_token);
+
+	pthread_cond_destroy(&auth.cond);
+	pthread_mutex_destroy(&auth.lock);
+	free(auth.token_file);
+}
+
+/** Publish a new Authorization header for state->access_token.
+ *
+ *  Requests already made keep the header they were built with, the old
+ *  header is retired rather than freed as requests being built right now
+ *  may be copying it. Headers retired retire_grace seconds ago are freed.
+ *
+ *  @returns 0 on success, 1 if out of memory
+ */
+static int gda_set_header()
+{
+	struct gdi_state *state = auth.gdi;
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	// Those retired long enough ago are not being read any more
+	struct gda_retired_t **link = &auth.retired;
+	while(*link != NULL)
+	{
+		struct gda_retired_t *old = *link;
+		if(now.tv_sec - old->retired_at.tv_sec < retire_grace)
+		{
+			link = &old->next;
+			continue;
+		}
+		*link = old->next;
+		str_destroy(old->header);
+		free(old->header);
+		free(old);
+	}
+
+	struct str_t *header = (struct str_t*) malloc(sizeof(struct str_t));
+	if(header == NULL)
+		return 1;
+	struct gda_retired_t *retired = (struct gda_retired_t*) malloc(sizeof(struct gda_retired_t));
+	if(retired == NULL)
+	{
+		free(header);
+		return 1;
+	}
+
+	str_init_create(header, "Authorization: OAuth ", 0);
+	str_char_concat(header, state->access_token.str, state->access_token.len);
+
+	// Readers load the pointer without a lock, the header must be complete
+	// before it is published
+	__sync_synchronize();
+	struct str_t *old = state->oauth_header;
+	state->oauth_header = header;
+
+	if(old)
+	{
+		retired->header = old;
+		retired->retired_at = now;
+		retired->next = auth.retired;
+		auth.retired = retired;
+	}
+	else
+		free(retired);
+	return 0;
+}
+
+/** Schedule the next renewal for a token valid for expires_in seconds.
+ */
+static void gda_schedule(long expires_in)
+{
+	struct timespec now;
+	long wait = expires_in - renew_margin;
+	if(wait < expires_in / 2)
+		wait = expires_in / 2;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pthread_mutex_lock(&auth.lock);
+	auth.renew_at = now;
+	auth.renew_at.tv_sec += wait;
+	pthread_cond_broadcast(&auth.cond);
+	pthread_mutex_unlock(&auth.lock);
+}
+
+/** Save the refresh token so the next mount can skip authorization.
+ *
+ *  The file is only readable by us, created afresh and replaced atomically
+ *  so a crash never leaves a partial token behind.
+ *
+ *  @returns 0 on success, 1 on failure
+ */
+static int gda_save_refresh_token()
+{
+	const struct str_t *token = &auth.gdi->refresh_token;
+	int ret = 0;
+
+	char *tmp = (char*) malloc(strlen(auth.token_file) + 5);
+	if(tmp == NULL)
+		return 1;
+	memcpy(tmp, auth.token_file, strlen(auth.token_file));
+	memcpy(tmp + strlen(auth.token_file), ".tmp", 5);
+
+	// A file left behind may have any mode or owner, so it is never reused
+	unlink(tmp);
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+	if(fd < 0 || write(fd, token->str, token->len) != (ssize_t) token->len
+			|| fsync(fd) || rename(tmp, auth.token_file))
+	{
+		printf("Could not save %s: %s\n", auth.token_file, strerror(errno));
+		unlink(tmp);
+		ret = 1;
+	}
+	if(fd >= 0)
+		close(fd);
+
+	free(tmp);
+	return ret;
+}
+
+/** Append a form field to a request body.
+ *
+ *  @body  struct str_t* the body, fields after the first are separated by '&'
+ *  @name  const char*   the field name, which needs no escaping
+ *  @value const char*   the value, escaped here
+ */
+static void gda_form_add(struct str_t* body, const char* name, const char* value)
+{
+	if(body->len)
+		str_char_concat(body, "&", 1);
+	str_char_concat(body, name, strlen(name));
+	str_char_concat(body, "=", 1);
+
+	struct str_t *escaped = str_urlencode_char(value, 0);
+	if(escaped)
+		str_char_concat(body, escaped->str, escaped->len);
+	str_destroy(escaped);
+	free(escaped);
+}
+
+/** Replace a token field of the state with one from a token reply, if the
+ *  reply has it.
+ */
+static void gda_take(struct json_object* json, const char* name, struct str_t* field)
+{
+	const char *value = json_object_get_string(json_object_object_get(json, name));
+	if(value == NULL)
+		return;
+	str_destroy(field);
+	str_init_create(field, value, 0);
+}
+
+/** Exchange a grant for an access token.
+ *
+ *  On success the state takes the tokens from the reply, a new header is
+ *  published and the next renewal is scheduled.
+ *
+ *  @body const struct str_t* the form describing the grant
+ *
+ *  @returns 0 on success, -EACCES if the grant was refused, -EIO otherwise
+ */
+static int gda_token_request(const struct str_t* body)
+{
+	struct gdi_state *state = auth.gdi;
+	struct request_t request;
+	struct str_t uri;
+	int ret = -EIO;
+
+	str_init_create(&uri, token_uri, 0);
+	ci_init(&request, &uri, 0, NULL, body->str, POST);
+	// Every other request needs the token, so it does not queue behind them
+	ci_set_priority(&request, PRIORITY_OPEN);
+	ci_set_deadline(&request, token_deadline_ms);
+
+	struct json_object *json = NULL;
+	if(ci_request(&request) == CURLE_OK && request.response.body.str)
+		json = json_tokener_parse(request.response.body.str);
+
+	struct json_object *error = json ? json_object_object_get(json, "error") : NULL;
+	if(error)
+	{
+		const char *reason = json_object_get_string(error);
+		fprintf(stderr, "Error: %s\n", reason);
+		if(reason && strcmp(reason, "invalid_grant") == 0)
+			ret = -EACCES;
+	}
+	else if(json && gdi_request_ok(&request, CURLE_OK)
+			&& json_object_object_get(json, "access_token"))
+	{
+		gda_take(json, "access_token", &state->access_token);
+		gda_take(json, "token_type", &state->token_type);
+		gda_take(json, "id_token", &state->id_token);
+		// The first exchange has one, renewals may replace it
+		if(json_object_object_get(json, "refresh_token"))
+		{
+			gda_take(json, "refresh_token", &state->refresh_token);
+			gda_save_refresh_token();
+		}
+
+		struct json_object *expires = json_object_object_get(json, "expires_in");
+		state->token_expiration = expires ? json_object_get_int(expires) : 3600;
+
+		if(!gda_set_header())
+		{
+			gda_schedule(state->token_expiration);
+			ret = 0;
+		}
+	}
+
+	if(json)
+		json_object_put(json);
+	ci_destroy(&request);
+	str_destroy(&uri);
+	return ret;
+}
+
+/** Get a new access token with the refresh token.
+ *
+ *  @returns 0 on success, -EACCES if the refresh token was revoked, -EIO
+ *           otherwise
+ */
+static int gda_refresh()
+{
+	struct gdi_state *state = auth.gdi;
+	struct str_t body;
+
+	if(!state->refresh_token.len)
+		return -EACCES;
+
+	str_init(&body);
+	gda_form_add(&body, "refresh_token", state->refresh_token.str);
+	gda_form_add(&body, "client_id", state->clientid);
+	gda_form_add(&body, "client_secret", state->clientsecrets);
+	gda_form_add(&body, "grant_type", "refresh_token");
+
+	int ret = gda_token_request(&body);
+	str_destroy(&body);
+	return ret;
+}
+
+/** Ask the user to authorize us in a browser and exchange the code they
+ *  paste for tokens.
+ *
+ *  @returns 0 on success, 1 on failure
+ */
+static int gda_authorize()
+{
+	struct gdi_state *state = auth.gdi;
+	struct str_t uri;
+	struct str_t scope;
+	struct str_t body;
+	char code[512];
+	size_t length = 0;
+	size_t iter;
+	int c;
+
+	str_init(&scope);
+	for(iter = 0; iter < sizeof(scopes) / sizeof(scopes[0]); ++iter)
+	{
+		if(iter)
+			str_char_concat(&scope, " ", 1);
+		str_char_concat(&scope, scopes[iter], strlen(scopes[iter]));
+	}
+
+	str_init(&body);
+	gda_form_add(&body, "response_type", "code");
+	gda_form_add(&body, "scope", scope.str);
+	gda_form_add(&body, "redirect_uri", state->redirecturi);
+	gda_form_add(&body, "client_id", state->clientid);
+	str_init_create(&uri, auth_uri, 0);
+	str_char_concat(&uri, "?", 1);
+	str_char_concat(&uri, body.str, body.len);
+	str_destroy(&body);
+	str_destroy(&scope);
+
+	printf("Please open this in a web browser and authorize fuse-google-drive:\n%s\n", uri.str);
+	printf("\n\nOnce you authenticate, Google should give you a code, please paste it here:\n");
+	str_destroy(&uri);
+
+	// Read in the code from Google, skipping whitespace
+	while(length < sizeof(code) - 1 && (c = getc(stdin)) != EOF && c != '\n')
+		if(c != ' ' && c != '\t' && c != '\r')
+			code[length++] = c;
+	code[length] = 0;
+
+	if(length < 5)
+	{
+		printf("You did not enter a correct authentication code.\n");
+		return 1;
+	}
+
+	// Exchange the code for an access token
+	str_init(&body);
+	gda_form_add(&body, "code", code);
+	gda_form_add(&body, "client_id", state->clientid);
+	gda_form_add(&body, "client_secret", state->clientsecrets);
+	gda_form_add(&body, "redirect_uri", state->redirecturi);
+	gda_form_add(&body, "grant_type", "authorization_code");
+	int ret = gda_token_request(&body);
+	str_destroy(&body);
+	return ret ? 1 : 0;
+}
+
+/** Renew the access token before it expires.
+ *
+ *  A renewal that fails is tried again every renew_retry seconds. Requests
+ *  keep using the old token meanwhile, which stays valid until it expires.
+ */
+void* gda_renewer(void* arg)
+{
+	pthread_mutex_lock(&auth.lock);
+	while(!auth.stopping)
+	{
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if(now.tv_sec < auth.renew_at.tv_sec || (now.tv_sec == auth.renew_at.tv_sec
+					&& now.tv_nsec < auth.renew_at.tv_nsec))
+		{
+			pthread_cond_timedwait(&auth.cond, &auth.lock, &auth.renew_at);
+			continue;
+		}
+
+		pthread_mutex_unlock(&auth.lock);
+		int ret = gda_refresh();
+		pthread_mutex_lock(&auth.lock);
+
+		if(ret)
+		{
+			if(ret == -EACCES)
+				fprintf(stderr, "The refresh token was revoked, remount to authorize again\n");
+			clock_gettime(CLOCK_MONOTONIC, &auth.renew_at);
+			auth.renew_at.tv_sec += renew_retry;
+		}
+	}
+	pthread_mutex_unlock(&auth.lock);
+
+	return NULL;
+}
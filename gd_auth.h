@@ -0,0 +1,68 @@
+/*
+	fuse-google-drive: a fuse filesystem wrapper for Google Drive
+	Copyright (C) 2012  James Cline
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2 as
+ 	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef _GOOGLE_DRIVE_AUTH_H
+#define _GOOGLE_DRIVE_AUTH_H
+
+#include <pthread.h>
+#include <time.h>
+
+#include "gd_interface.h"
+#include "str.h"
+
+// A header replaced by a renewal
+struct gda_retired_t {
+	struct str_t *header;
+	// When it was replaced, monotonic
+	struct timespec retired_at;
+	struct gda_retired_t *next;
+};
+
+/** The state of OAuth authorization for this mount.
+ *
+ *  The refresh token is kept in the configuration directory, so only the
+ *  first mount asks the user to authorize us. A renewer thread gets a new
+ *  access token before the current one expires and publishes a new
+ *  Authorization header in state->oauth_header.
+ */
+struct gda_state_t {
+	struct gdi_state *gdi;
+	// Where the refresh token is kept
+	char *token_file;
+
+	pthread_t renewer;
+	int started;
+	// Protects renew_at and stopping
+	pthread_mutex_t lock;
+	// Signalled when the renewer should stop
+	pthread_cond_t cond;
+	// When the renewer next gets a new access token, monotonic
+	struct timespec renew_at;
+	int stopping;
+
+	// Headers replaced by renewals. Requests being built may still be
+	// reading them, so they are only freed retire_grace seconds later.
+	struct gda_retired_t *retired;
+};
+
+int gda_init(struct gdi_state* state, const char* path);
+int gda_start();
+void gda_destroy();
+
+#endif
@@ -0,0 +1,382 @@
+/*
+	fuse-google-drive: a fuse filesystem wrapper for Google Drive
+	Copyright (C) 2012  James Cline
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2 as
+ 	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libxml/tree.h>
+
+#include "curl_interface.h"
+#include "gd_batch.h"
+#include "gd_cache.h"
+#include "gd_interface.h"
+#include "request_scheduler.h"
+#include "str.h"
+
+static struct gdb_state_t batcher;
+
+const char batch_uri[] = "https://docs.google.com/feeds/default/private/full/batch";
+const char batch_id_prefix[] = "https://docs.google.com/feeds/id/";
+const char batch_ns[] = "http://schemas.google.com/gdata/batch";
+
+// Queries wait at most this long for others to share a batch with
+const long batch_window_ms = 10;
+// The most operations the server accepts in one batch
+const size_t batch_max = 100;
+// Time allowed for a batch
+const long batch_deadline_ms = 30000;
+
+void* gdb_sender(void* arg);
+
+/** Start the batcher.
+ *
+ *  @state struct gdi_state* the state for this mount
+ *
+ *  @returns 0 on success, 1 on failure
+ */
+int gdb_init(struct gdi_state* state)
+{
+	pthread_condattr_t attr;
+
+	memset(&batcher, 0, sizeof(struct gdb_state_t));
+	batcher.gdi = state;
+
+	pthread_mutex_init(&batcher.lock, NULL);
+	// Query due times are monotonic
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&batcher.cond, &attr);
+	pthread_cond_init(&batcher.answered, &attr);
+	pthread_condattr_destroy(&attr);
+
+	for(; batcher.started < GDB_SENDERS; ++batcher.started)
+		if(pthread_create(&batcher.senders[batcher.started], NULL, gdb_sender, NULL))
+			break;
+
+	if(!batcher.started)
+	{
+		pthread_cond_destroy(&batcher.answered);
+		pthread_cond_destroy(&batcher.cond);
+		pthread_mutex_destroy(&batcher.lock);
+		return 1;
+	}
+
+	return 0;
+}
+
+/** Stop the batcher, once every queued query is answered.
+ */
+void gdb_destroy()
+{
+	pthread_mutex_lock(&batcher.lock);
+	batcher.stopping = 1;
+	pthread_cond_broadcast(&batcher.cond);
+	pthread_mutex_unlock(&batcher.lock);
+
+	size_t iter;
+	for(iter = 0; iter < batcher.started; ++iter)
+		pthread_join(batcher.senders[iter], NULL);
+
+	pthread_cond_destroy(&batcher.answered);
+	pthread_cond_destroy(&batcher.cond);
+	pthread_mutex_destroy(&batcher.lock);
+}
+
+/** Take a query off the queue before it was sent.
+ *
+ *  Must be called with batcher.lock held.
+ */
+static void gdb_unqueue(struct gdb_query_t* query)
+{
+	struct gdb_query_t **iter;
+	struct gdb_query_t *prev = NULL;
+
+	for(iter = &batcher.head; *iter != NULL; iter = &(*iter)->next)
+	{
+		if(*iter == query)
+		{
+			*iter = query->next;
+			if(batcher.tail == query)
+				batcher.tail = prev;
+			--batcher.queued;
+			return;
+		}
+		prev = *iter;
+	}
+}
+
+/** Ask the server for the current md5 of an entry.
+ *
+ *  The query goes out in a batch with whatever other queries are made
+ *  within batch_window_ms, the caller waits for its answer. A caller whose
+ *  FUSE request is interrupted stops waiting unless its batch is on the wire.
+ *
+ *  @entry struct gd_fs_entry_t* the entry to ask about
+ *  @md5   struct str_t*         receives the md5, empty if there is none
+ *
+ *  @returns 0 on success, -1 if the server did not answer
+ */
+int gdb_query_md5(struct gd_fs_entry_t* entry, struct str_t* md5)
+{
+	struct gdb_query_t query;
+
+	memset(&query, 0, sizeof(struct gdb_query_t));
+	pthread_mutex_lock(&entry->lock);
+	if(entry->resourceID.len)
+		str_init_create(&query.id, entry->resourceID.str, entry->resourceID.len);
+	pthread_mutex_unlock(&entry->lock);
+	if(!query.id.len)
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &query.due);
+	query.due.tv_nsec += batch_window_ms * 1000000;
+	if(query.due.tv_nsec >= 1000000000)
+	{
+		++query.due.tv_sec;
+		query.due.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&batcher.lock);
+	if(batcher.tail)
+		batcher.tail->next = &query;
+	else
+		batcher.head = &query;
+	batcher.tail = &query;
+	++batcher.queued;
+	pthread_cond_broadcast(&batcher.cond);
+
+	while(query.state != 2)
+	{
+		struct timespec wait;
+		clock_gettime(CLOCK_MONOTONIC, &wait);
+		++wait.tv_sec;
+		pthread_cond_timedwait(&batcher.answered, &batcher.lock, &wait);
+		if(query.state == 0 && gdi_interrupted())
+		{
+			gdb_unqueue(&query);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&batcher.lock);
+
+	int ret = (query.state == 2 && query.status == 200) ? 0 : -1;
+	if(!ret)
+		str_swap(md5, &query.md5);
+	str_destroy(&query.md5);
+	str_destroy(&query.id);
+	return ret;
+}
+
+/** Build the batch feed asking about a list of queries.
+ *
+ *  Each operation's batch:id is the query's position in the list.
+ */
+static void gdb_build(struct str_t* body, struct gdb_query_t* queries)
+{
+	char id[32];
+	size_t index = 0;
+
+	str_init_create(body, "<?xml version='1.0' encoding='UTF-8'?>"
+			"<feed xmlns=\"http://www.w3.org/2005/Atom\""
+			" xmlns:batch=\"http://schemas.google.com/gdata/batch\">", 0);
+	for(; queries != NULL; queries = queries->next, ++index)
+	{
+		snprintf(id, sizeof(id), "%lu", (unsigned long) index);
+		str_char_concat(body, "<entry><batch:id>", 17);
+		str_char_concat(body, id, strlen(id));
+		str_char_concat(body, "</batch:id><batch:operation type=\"query\"/><id>", 46);
+		str_char_concat(body, batch_id_prefix, sizeof(batch_id_prefix) - 1);
+		str_char_concat(body, queries->id.str, queries->id.len);
+		str_char_concat(body, "</id></entry>", 13);
+	}
+	str_char_concat(body, "</feed>", 7);
+}
+
+/** Match the entries of a batch reply to their queries.
+ *
+ *  @xml     const struct str_t* the reply
+ *  @queries struct gdb_query_t* the queries sent, in batch:id order
+ *  @count   size_t              the number of queries
+ */
+static void gdb_parse(const struct str_t* xml, struct gdb_query_t* queries, size_t count)
+{
+	struct gdb_query_t **index;
+	xmlNodePtr node, child;
+	size_t iter;
+
+	if(xml->str == NULL)
+		return;
+	const char *start = strstr(xml->str, "<feed");
+	if(start == NULL)
+		return;
+
+	index = (struct gdb_query_t**) malloc(sizeof(struct gdb_query_t*) * count);
+	if(index == NULL)
+		return;
+	for(iter = 0; iter < count; ++iter, queries = queries->next)
+		index[iter] = queries;
+
+	xmlDocPtr xmldoc = xmlParseMemory(start, xml->len - (start - xml->str));
+	if(xmldoc == NULL || xmldoc->children == NULL)
+	{
+		xmlFreeDoc(xmldoc);
+		free(index);
+		return;
+	}
+
+	for(node = xmldoc->children->children; node != NULL; node = node->next)
+	{
+		if(strcmp(node->name, "entry"))
+			continue;
+
+		struct gdb_query_t *query = NULL;
+		long status = 0;
+		xmlChar *md5 = NULL;
+		for(child = node->children; child != NULL; child = child->next)
+		{
+			int batch = child->ns && strcmp(child->ns->href, batch_ns) == 0;
+			xmlChar *value = NULL;
+			if(batch && strcmp(child->name, "id") == 0)
+			{
+				value = xmlNodeListGetString(xmldoc, child->children, 1);
+				unsigned long id = value ? strtoul(value, NULL, 10) : count;
+				query = (id < count) ? index[id] : NULL;
+			}
+			else if(batch && strcmp(child->name, "status") == 0)
+			{
+				value = xmlGetProp(child, "code");
+				status = value ? strtol(value, NULL, 10) : 0;
+			}
+			else if(strcmp(child->name, "md5Checksum") == 0 && md5 == NULL)
+				md5 = xmlNodeListGetString(xmldoc, child->children, 1);
+			xmlFree(value);
+		}
+
+		if(query)
+		{
+			query->status = status;
+			if(md5)
+				str_init_create(&query->md5, md5, 0);
+		}
+		xmlFree(md5);
+	}
+
+	xmlFreeDoc(xmldoc);
+	free(index);
+}
+
+/** Send one batch and record the answers in its queries.
+ *
+ *  @queries struct gdb_query_t* the queries, linked by next
+ *  @count   size_t              the number of queries
+ */
+static void gdb_send(struct gdb_query_t* queries, size_t count)
+{
+	struct request_t request;
+	struct str_t headers[3];
+	struct str_t body;
+	struct str_t uri;
+
+	gdb_build(&body, queries);
+
+	headers[0] = *batcher.gdi->oauth_header;
+	str_init_create(&headers[1], "GData-Version: 3.0", 0);
+	str_init_create(&headers[2], "Content-Type: application/atom+xml", 0);
+	str_init_create(&uri, batch_uri, 0);
+
+	ci_init(&request, &uri, 3, headers, body.str, POST);
+	ci_set_priority(&request, PRIORITY_OPEN);
+	ci_set_deadline(&request, batch_deadline_ms);
+
+	if(gdi_request_ok(&request, ci_request(&request)))
+		gdb_parse(&request.response.body, queries, count);
+
+	ci_destroy(&request);
+	str_destroy(&uri);
+	str_destroy(&headers[2]);
+	str_destroy(&headers[1]);
+	str_destroy(&body);
+}
+
+/** Send batches of queued queries.
+ *
+ *  A batch goes out once batch_max queries are queued, or once the oldest
+ *  has waited batch_window_ms. Several of these run at once, so a slow batch
+ *  does not hold up the next one.
+ */
+void* gdb_sender(void* arg)
+{
+	pthread_mutex_lock(&batcher.lock);
+	while(1)
+	{
+		struct timespec now;
+
+		if(batcher.head == NULL)
+		{
+			if(batcher.stopping)
+				break;
+			pthread_cond_wait(&batcher.cond, &batcher.lock);
+			continue;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		const struct timespec *due = &batcher.head->due;
+		if(batcher.queued < batch_max && !batcher.stopping && (due->tv_sec > now.tv_sec
+					|| (due->tv_sec == now.tv_sec && due->tv_nsec > now.tv_nsec)))
+		{
+			pthread_cond_timedwait(&batcher.cond, &batcher.lock, due);
+			continue;
+		}
+
+		struct gdb_query_t *queries = batcher.head;
+		struct gdb_query_t *last = queries;
+		size_t count = 1;
+		last->state = 1;
+		while(count < batch_max && last->next)
+		{
+			last = last->next;
+			last->state = 1;
+			++count;
+		}
+		batcher.head = last->next;
+		if(batcher.head == NULL)
+			batcher.tail = NULL;
+		batcher.queued -= count;
+		last->next = NULL;
+
+		pthread_mutex_unlock(&batcher.lock);
+		gdb_send(queries, count);
+		pthread_mutex_lock(&batcher.lock);
+
+		// The queries live on their callers' stacks, they may return as soon
+		// as their state changes
+		struct gdb_query_t *iter = queries;
+		while(iter)
+		{
+			struct gdb_query_t *next = iter->next;
+			iter->state = 2;
+			iter = next;
+		}
+		pthread_cond_broadcast(&batcher.answered);
+	}
+	pthread_mutex_unlock(&batcher.lock);
+
+	return NULL;
+}
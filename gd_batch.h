@@ -0,0 +1,83 @@
+/*
+	fuse-google-drive: a fuse filesystem wrapper for Google Drive
+	Copyright (C) 2012  James Cline
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2 as
+ 	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef _GOOGLE_DRIVE_BATCH_H
+#define _GOOGLE_DRIVE_BATCH_H
+
+#include <pthread.h>
+#include <time.h>
+
+#include "gd_cache.h"
+#include "gd_interface.h"
+#include "str.h"
+
+// Batches sent at once, each by its own sender
+#define GDB_SENDERS 4
+
+/** A metadata query waiting to go out in a batch.
+ *
+ *  Lives on the stack of the thread that asked, which waits for it to be
+ *  answered.
+ */
+struct gdb_query_t {
+	// The resourceID asked about
+	struct str_t id;
+	// When this query goes out at the latest, unless the batch fills first
+	struct timespec due;
+	// 0 while queued, 1 while its batch is being sent, 2 once answered
+	int state;
+	// The HTTP status of this query within the batch, 0 if the batch failed
+	long status;
+	// The md5 the server has, empty if it has none
+	struct str_t md5;
+
+	struct gdb_query_t *next;
+};
+
+/** The state of the metadata batcher for this mount.
+ *
+ *  Queries made at about the same time, such as the revalidations of a tree
+ *  being opened, are collected for a short window and sent together as one
+ *  batch feed. Each reply entry is matched back to its query by batch:id.
+ */
+struct gdb_state_t {
+	struct gdi_state *gdi;
+
+	pthread_t senders[GDB_SENDERS];
+	size_t started;
+	// Protects the queue, the state of every query and stopping
+	pthread_mutex_t lock;
+	// Signalled when a query is queued or the senders should stop
+	pthread_cond_t cond;
+	// Signalled when a batch is answered
+	pthread_cond_t answered;
+	// Queries not yet taken by a sender, oldest first
+	struct gdb_query_t *head;
+	struct gdb_query_t *tail;
+	size_t queued;
+	// Set by gdb_destroy(), the senders drain the queue and exit
+	int stopping;
+};
+
+int gdb_init(struct gdi_state* state);
+void gdb_destroy();
+
+int gdb_query_md5(struct gd_fs_entry_t* entry, struct str_t* md5);
+
+#endif
@@ -16,14 +16,68 @@
 	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 */
 
+#define _GNU_SOURCE // tdestroy()
 #include <errno.h>
+#include <json.h>
 #include <stdio.h>
-#include <search.h>
+#include <search.h> // tsearch()
 #include <string.h>
+#include <unistd.h>
 
 #include "gd_cache.h"
 #include "str.h"
 
+// Both the filename and inode tables are searched from many FUSE threads
+static pthread_rwlock_t table_lock = PTHREAD_RWLOCK_INITIALIZER;
+// A tsearch() tree of every entry, ordered by inode number
+static void *inode_table = NULL;
+// Every named entry by filename, a chained hash table linked through
+// name_next. It doubles when it gets as full as it is long.
+static struct gd_fs_entry_t **name_table = NULL;
+static size_t name_buckets = 0;
+static size_t name_count = 0;
+
+// A Bloom filter of the filenames in the filename table. Every name added
+// since it was last rebuilt has its bits set, so a name missing a bit is not
+// in the table and a lookup of it need not take table_lock. It is read
+// without the lock, so filters replaced when the table grows are kept until
+// the tables are destroyed.
+struct name_bloom_t {
+	// How many bits words holds, a power of two
+	size_t bits;
+	struct name_bloom_t *retired;
+	uint64_t words[];
+};
+static struct name_bloom_t *name_bloom = NULL;
+// Bits per bucket of the filename table, and bits set per name
+static const size_t bloom_bits_per_bucket = 16;
+static const int bloom_probes = 4;
+
+// The filenames in the filename table are also indexed by the runs of three
+// bytes in them, so gd_fs_entry_grep() need not look at every name. Each
+// trigram hashes to a bucket listing every entry with a trigram hashing to
+// it, at most once. Protected by table_lock like the tables. If there is no
+// memory for it the index is dropped, and every name is looked at instead.
+struct trigram_bucket_t {
+	struct gd_fs_entry_t **entries;
+	size_t count;
+	size_t reserved;
+};
+static struct trigram_bucket_t *trigram_table = NULL;
+static const size_t trigram_buckets = 65536;
+
+// Names replaced by renames, the filename table may still point at them
+struct retired_name_t {
+	char *name;
+	struct retired_name_t *next;
+};
+static struct retired_name_t *retired_names = NULL;
+
+// Counts changes to what folders list, see gd_fs_entry_changed()
+static unsigned long listing_generation = 0;
+// When what the root lists last changed
+static unsigned long root_changed = 0;
+
 char filenameunsafe[] = 
 {
 	'%',
@@ -98,6 +152,118 @@ char* filenameencode (const char *filename, size_t *length)
 	return result;
 }
 
+/** Reverses filenameencode().
+ *
+ *  @filename the escaped string
+ *  @length   length of filename
+ *
+ *  @returns the original, null terminated string, or NULL on failure
+ */
+char* filenamedecode (const char *filename, size_t length)
+{
+	char *result = (char *) malloc(sizeof(char) * (length + 1));
+	if(result == NULL)
+		return NULL;
+
+	char *iter = result;
+	size_t i;
+	for(i = 0; i < length; ++i)
+	{
+		if(filename[i] == '%' && i + 2 < length)
+		{
+			char hex[3] = { filename[i+1], filename[i+2], 0 };
+			*iter = (char) strtol(hex, NULL, 16);
+			i += 2;
+		}
+		else
+			*iter = filename[i];
+		++iter;
+	}
+	*iter = 0;
+
+	return result;
+}
+
+/** Creates an empty gd_fs_entry_t.
+ *
+ *  Used for files created locally, which have no resourceID until they are
+ *  first uploaded.
+ *
+ *  @filename the escaped name of the entry, as FUSE sees it
+ *
+ *  @returns the new entry, or NULL on failure
+ */
+struct gd_fs_entry_t* gd_fs_entry_create(const char* filename)
+{
+	struct gd_fs_entry_t* entry;
+
+	entry = (struct gd_fs_entry_t*) malloc(sizeof(struct gd_fs_entry_t));
+	if(entry == NULL)
+		return NULL;
+	memset(entry, 0, sizeof(struct gd_fs_entry_t));
+
+	if(str_init_create(&entry->filename, filename, 0))
+	{
+		free(entry);
+		return NULL;
+	}
+	pthread_mutex_init(&entry->lock, NULL);
+	pthread_cond_init(&entry->cond, NULL);
+	entry->staging_fd = -1;
+	// Created here and now, the server's times replace these once uploaded
+	entry->mtime = entry->ctime = time(NULL);
+	gd_fs_entry_stat(entry);
+
+	return entry;
+}
+
+/** Fill in the attributes getattr() copies from the rest of the entry.
+ *
+ *  Called once an entry is parsed, and again whenever its size, times or
+ *  type change. getattr() reads them without a lock, as it did the fields
+ *  they are made from.
+ *
+ *  @entry struct gd_fs_entry_t* the entry
+ */
+void gd_fs_entry_stat(struct gd_fs_entry_t* entry)
+{
+	struct stat *attr = &entry->attr;
+
+	if(entry->is_folder)
+	{
+		attr->st_mode = S_IFDIR | 0700;
+		attr->st_nlink = 2;
+		attr->st_size = 0;
+	}
+	else
+	{
+		attr->st_mode = S_IFREG | 0600;
+		attr->st_nlink = 1;
+		attr->st_size = entry->size;
+	}
+	// Google documents take no quota and report no size, they have no blocks
+	attr->st_blocks = (attr->st_size + 511) / 512;
+	attr->st_atime = entry->mtime;
+	attr->st_mtime = entry->mtime;
+	attr->st_ctime = entry->ctime > entry->mtime ? entry->ctime : entry->mtime;
+}
+
+/** Record a change made here to the contents of an entry.
+ *
+ *  Must be called with entry->lock held.
+ *
+ *  @entry struct gd_fs_entry_t* the entry
+ *  @size  unsigned long         its size after the change
+ */
+void gd_fs_entry_modified(struct gd_fs_entry_t* entry, unsigned long size)
+{
+	entry->size = size;
+	entry->mtime = time(NULL);
+	// The upload brings the new one
+	str_destroy(&entry->revision);
+	gd_fs_entry_stat(entry);
+}
+
 /** Creates and fills in a gd_fs_entry_t from an <entry>...</entry> in xml.
  *
  *  @xml  the xml containing the entry
@@ -112,6 +278,9 @@ struct gd_fs_entry_t* gd_fs_entry_from_xml(xmlDocPtr xml, xmlNodePtr node)
 	entry = (struct gd_fs_entry_t*) malloc(sizeof(struct gd_fs_entry_t));
 	if(entry == NULL) {} // TODO: ERROR
 	memset(entry, 0, sizeof(struct gd_fs_entry_t));
+	pthread_mutex_init(&entry->lock, NULL);
+	pthread_cond_init(&entry->cond, NULL);
+	entry->staging_fd = -1;
 
 	size_t length;
 	xmlNodePtr c1, c2;
@@ -194,6 +363,18 @@ struct gd_fs_entry_t* gd_fs_entry_from_xml(xmlDocPtr xml, xmlNodePtr node)
 					{
 						// This entry is inside one (or more?) collections
 						// These entries are the folders for this entry
+						// The href ends in the folder's escaped resourceID, only
+						// the first folder is kept
+						xmlChar *href = xmlGetProp(c1, "href");
+						const char *id = href ? strrchr((char*) href, '/') : NULL;
+						if(id && !entry->parent.len)
+						{
+							char *decoded = filenamedecode(id + 1, strlen(id + 1));
+							if(decoded)
+								str_init_create(&entry->parent, decoded, 0);
+							free(decoded);
+						}
+						xmlFree(href);
 					}
 					else if(strcmp(value, "alternate") == 0)
 					{
@@ -210,7 +391,10 @@ struct gd_fs_entry_t* gd_fs_entry_from_xml(xmlDocPtr xml, xmlNodePtr node)
 					}
 					else if(strcmp(value, "edit") == 0)
 					{
-						// For writes?
+						// For renaming and deleting
+						xmlChar *href = xmlGetProp(c1, "href");
+						str_init_create(&entry->edit, href, 0);
+						xmlFree(href);
 					}
 					/*
 					else if(strcmp(value, "edit-media") == 0)
@@ -220,8 +404,10 @@ struct gd_fs_entry_t* gd_fs_entry_from_xml(xmlDocPtr xml, xmlNodePtr node)
 					*/
 					else if(strcmp(value, "http://schemas.google.com/g/2005#resumable-edit-media") == 0)
 					{
-						// For resumeable writes?
-						// This may be the one we *really* want to use, rather than 'edit'
+						// Starts an upload session replacing the contents
+						xmlChar *href = xmlGetProp(c1, "href");
+						str_init_create(&entry->edit_media, href, 0);
+						xmlFree(href);
 					}
 					else if(strcmp(value, "http://schemas.google.com/docs/2007/thumbnail") == 0)
 					{
@@ -239,6 +425,14 @@ struct gd_fs_entry_t* gd_fs_entry_from_xml(xmlDocPtr xml, xmlNodePtr node)
 					xmlFree(value);
 				}
 				break;
+			case 'p':
+				if(strcmp(name, "published") == 0)
+				{
+					value = xmlNodeListGetString(xml, c1->children, 1);
+					entry->ctime = gd_parse_time((char*) value);
+					xmlFree(value);
+				}
+				break;
 			case 't': // 'title'
 				if(strcmp(name, "title") == 0)
 				{
@@ -249,6 +443,22 @@ struct gd_fs_entry_t* gd_fs_entry_from_xml(xmlDocPtr xml, xmlNodePtr node)
 					xmlFree(value);
 				}
 				break;
+			case 'u':
+				if(strcmp(name, "updated") == 0)
+				{
+					value = xmlNodeListGetString(xml, c1->children, 1);
+					entry->mtime = gd_parse_time((char*) value);
+					xmlFree(value);
+				}
+				break;
+			case 'r':
+				if(strcmp(name, "resourceId") == 0)
+				{
+					value = xmlNodeListGetString(xml, c1->children, 1);
+					str_init_create(&entry->resourceID, value, 0);
+					xmlFree(value);
+				}
+				break;
 			case 's':
 				if(strcmp(name, "size") == 0)
 				{
@@ -264,6 +474,143 @@ struct gd_fs_entry_t* gd_fs_entry_from_xml(xmlDocPtr xml, xmlNodePtr node)
 		}
 	}
 
+	entry->is_folder = strncmp(entry->resourceID.str ? entry->resourceID.str : "",
+			"folder:", 7) == 0;
+	gd_fs_entry_stat(entry);
+
+	return entry;
+}
+
+/** Parses an RFC 3339 timestamp as the server sends them.
+ *
+ *  @value const char* a time such as 2012-04-24T17:23:45.123Z
+ *
+ *  @returns the time, or 0 if value could not be parsed
+ */
+time_t gd_parse_time(const char* value)
+{
+	struct tm tm;
+
+	if(value == NULL)
+		return 0;
+	memset(&tm, 0, sizeof(struct tm));
+	// Fractions of a second are dropped, the server always sends UTC
+	if(strptime(value, "%Y-%m-%dT%H:%M:%S", &tm) == NULL)
+		return 0;
+	return timegm(&tm);
+}
+
+// The Drive mimeType prefix of Google documents, folders included. The rest
+// of the type is what the Documents List API uses as resourceID prefix.
+const char google_apps_type[] = "application/vnd.google-apps.";
+const char drive_files_uri[] = "https://www.googleapis.com/drive/v3/files/";
+const char docs_entry_uri[] = "https://docs.google.com/feeds/default/private/full/";
+const char docs_upload_uri[] =
+	"https://docs.google.com/feeds/upload/create-session/default/private/full/";
+
+/** Append a resourceID, escaped for a uri, to a string.
+ */
+static void json_concat_id(struct str_t* str, const struct str_t* resourceID)
+{
+	struct str_t *escaped = str_urlencode_str(resourceID);
+	if(escaped)
+		str_char_concat(str, escaped->str, escaped->len);
+	str_destroy(escaped);
+	free(escaped);
+}
+
+/** Creates a gd_fs_entry_t from one file of a Drive files.list reply.
+ *
+ *  Drive ids are the part of a resourceID after the ':', the rest of the
+ *  entry is filled in the way gd_fs_entry_from_xml() would, so the links
+ *  used for downloading, uploading and changing metadata are the same.
+ *
+ *  @file struct json_object* the file, with the fields asked for in the
+ *        listing's projection
+ *
+ *  @returns the new entry, or NULL if the file had no id or name
+ */
+struct gd_fs_entry_t* gd_fs_entry_from_json(struct json_object* file)
+{
+	struct json_object *value;
+
+	const char *id = json_object_get_string(json_object_object_get(file, "id"));
+	const char *name = json_object_get_string(json_object_object_get(file, "name"));
+	const char *type = json_object_get_string(json_object_object_get(file, "mimeType"));
+	if(id == NULL || name == NULL)
+		return NULL;
+
+	size_t length = strlen(name);
+	char *filename = filenameencode(name, &length);
+	if(filename == NULL)
+		return NULL;
+	struct gd_fs_entry_t *entry = gd_fs_entry_create(filename);
+	free(filename);
+	if(entry == NULL)
+		return NULL;
+
+	int google = type && strncmp(type, google_apps_type, sizeof(google_apps_type) - 1) == 0;
+	if(google)
+		str_init_create(&entry->resourceID, type + sizeof(google_apps_type) - 1, 0);
+	else
+		str_init_create(&entry->resourceID, "file", 0);
+	str_char_concat(&entry->resourceID, ":", 1);
+	str_char_concat(&entry->resourceID, id, strlen(id));
+	entry->is_folder = strncmp(entry->resourceID.str, "folder:", 7) == 0;
+
+	str_init_create(&entry->src, drive_files_uri, 0);
+	str_char_concat(&entry->src, id, strlen(id));
+	if(!google)
+		str_char_concat(&entry->src, "?alt=media", 10);
+	else if(strcmp(type + sizeof(google_apps_type) - 1, "document") == 0)
+		str_char_concat(&entry->src, "/export?mimeType=text/plain", 27);
+	else if(strcmp(type + sizeof(google_apps_type) - 1, "spreadsheet") == 0)
+		str_char_concat(&entry->src, "/export?mimeType=text/csv", 25);
+	else
+		str_char_concat(&entry->src, "/export?mimeType=application/pdf", 32);
+
+	str_init_create(&entry->edit, docs_entry_uri, 0);
+	json_concat_id(&entry->edit, &entry->resourceID);
+	str_init_create(&entry->feed, entry->edit.str, entry->edit.len);
+	str_char_concat(&entry->feed, "?v=3", 4);
+	if(!google)
+	{
+		str_init_create(&entry->edit_media, docs_upload_uri, 0);
+		json_concat_id(&entry->edit_media, &entry->resourceID);
+	}
+
+	value = json_object_object_get(file, "parents");
+	if(value && json_object_array_length(value))
+	{
+		const char *parent = json_object_get_string(json_object_array_get_idx(value, 0));
+		if(parent)
+		{
+			str_init_create(&entry->parent, "folder:", 0);
+			str_char_concat(&entry->parent, parent, strlen(parent));
+		}
+	}
+
+	value = json_object_object_get(file, "md5Checksum");
+	if(value)
+	{
+		entry->md5set = 1;
+		str_init_create(&entry->md5, json_object_get_string(value), 0);
+	}
+
+	value = json_object_object_get(file, "version");
+	if(value)
+		str_init_create(&entry->revision, json_object_get_string(value), 0);
+
+	value = json_object_object_get(file, "size");
+	if(value)
+		entry->size = strtoul(json_object_get_string(value), NULL, 10);
+
+	entry->mtime = gd_parse_time(json_object_get_string(
+				json_object_object_get(file, "modifiedTime")));
+	entry->ctime = gd_parse_time(json_object_get_string(
+				json_object_object_get(file, "createdTime")));
+	gd_fs_entry_stat(entry);
+
 	return entry;
 }
 
@@ -312,6 +659,34 @@ struct str_t* xml_get_md5sum(const struct str_t* xml)
 	return ret;
 }
 
+/** Creates a gd_fs_entry_t from XML containing only an <entry>.
+ *
+ *  This is what the server replies with when an entry is created or copied.
+ *
+ *  @xml struct str_t* the string containing the XML
+ *
+ *  @returns the new entry, or NULL if there was no entry in xml
+ */
+struct gd_fs_entry_t* xml_parse_entry(const struct str_t* xml)
+{
+	struct gd_fs_entry_t* entry = NULL;
+
+	if(xml->str == NULL)
+		return NULL;
+	const char* iter = strstr(xml->str, "<entry");
+	if(iter == NULL)
+		return NULL;
+
+	xmlDocPtr xmldoc = xmlParseMemory(iter, xml->len - (iter - xml->str));
+	if(xmldoc == NULL)
+		return NULL;
+	if(xmldoc->children != NULL)
+		entry = gd_fs_entry_from_xml(xmldoc, xmldoc->children);
+	xmlFreeDoc(xmldoc);
+
+	return entry;
+}
+
 /** Cleanup an entry.
  *
  *  @entry struct gd_fs_entry_t* the entry to uninitialize members for
@@ -323,70 +698,1010 @@ void gd_fs_entry_destroy(struct gd_fs_entry_t* entry)
 	str_destroy(&entry->lastModifiedBy);
 	str_destroy(&entry->lastModifiedBy_email);
 	str_destroy(&entry->filename);
+	str_destroy(&entry->resourceID);
 	str_destroy(&entry->src);
 	str_destroy(&entry->feed);
-	str_destroy(&entry->cache);
+	str_destroy(&entry->edit_media);
+	str_destroy(&entry->upload_session);
+	str_destroy(&entry->edit);
+	str_destroy(&entry->parent);
+	str_destroy(&entry->journal_key);
+	gd_content_put(entry->content);
+	if(entry->staging_fd >= 0)
+		close(entry->staging_fd);
+	free(entry->staging_filled);
 	str_destroy(&entry->md5);
+	str_destroy(&entry->revision);
+	pthread_cond_destroy(&entry->cond);
+	pthread_mutex_destroy(&entry->lock);
 }
 
-/** Searches hash table for a filename.
+/** Create a content version.
  *
- *  @key the name of the file to find
+ *  @data struct str_t*       the contents, taken over and left empty
+ *  @md5  const struct str_t* the checksum of data, or NULL if unknown
  *
- *  @returns the gd_fs_entry_t representing that file
+ *  @returns the new version holding one reference, or NULL on failure
  */
-struct gd_fs_entry_t* gd_fs_entry_find(const char* key)
+struct gd_content_t* gd_content_create(struct str_t* data, const struct str_t* md5)
 {
-	ENTRY keyentry;
-	keyentry.key = key;
-	keyentry.data = NULL;
-	ENTRY* entry = hsearch(keyentry, FIND);
-	if(entry == NULL)
+	struct gd_content_t *content;
+
+	content = (struct gd_content_t*) malloc(sizeof(struct gd_content_t));
+	if(content == NULL)
 		return NULL;
-	return (struct gd_fs_entry_t*) entry->data;
+	memset(content, 0, sizeof(struct gd_content_t));
+
+	str_swap(&content->data, data);
+	if(md5 && md5->len)
+		str_init_create(&content->md5, md5->str, md5->len);
+	content->refs = 1;
+
+	return content;
 }
 
-/** Creates the hash table for speeding up file finding.
+/** Take a reference to the current content version of an entry.
  *
- *  @size the size we want to make this hash table
- *  @head the first gd_fs_entry_t in the list of files
+ *  @entry struct gd_fs_entry_t* the entry to pin the contents of
  *
- *  @returns 0 on success, 1 on failure
+ *  @returns the version, or NULL if the entry has not been loaded
+ */
+struct gd_content_t* gd_content_get(struct gd_fs_entry_t* entry)
+{
+	struct gd_content_t *content;
+
+	// The lock only orders us against gd_content_publish() dropping the
+	// entry's reference, once we hold our own the version cannot go away.
+	pthread_mutex_lock(&entry->lock);
+	content = entry->content;
+	if(content)
+		__sync_add_and_fetch(&content->refs, 1);
+	pthread_mutex_unlock(&entry->lock);
+
+	return content;
+}
+
+/** Drop a reference to a content version, freeing it with the last one.
+ */
+void gd_content_put(struct gd_content_t* content)
+{
+	if(content == NULL)
+		return;
+	if(__sync_sub_and_fetch(&content->refs, 1))
+		return;
+
+	str_destroy(&content->data);
+	str_destroy(&content->md5);
+	free(content);
+}
+
+/** Make a content version the current one for an entry.
+ *
+ *  The entry's reference to the previous version is dropped, handles still
+ *  using it keep reading it undisturbed.
+ *
+ *  @entry   struct gd_fs_entry_t* the entry to update
+ *  @content struct gd_content_t*  the new version, its reference is taken over
+ */
+void gd_content_publish(struct gd_fs_entry_t* entry, struct gd_content_t* content)
+{
+	struct gd_content_t *old;
+
+	pthread_mutex_lock(&entry->lock);
+	old = entry->content;
+	entry->content = content;
+	pthread_mutex_unlock(&entry->lock);
+
+	gd_content_put(old);
+}
+
+/** Find or start the range flight covering a byte of an entry.
+ *
+ *  If a flight already covers start, a reference to it is taken. Otherwise a
+ *  new flight is created for [start, end), cut short where the next flight on
+ *  the wire begins so no byte is fetched twice. The caller must then fetch it
+ *  and call gd_flight_complete().
+ *
+ *  @entry  struct gd_fs_entry_t*      the entry being read
+ *  @start  off_t                      the first byte wanted
+ *  @end    off_t                      one past the last byte wanted
+ *  @flight struct gd_range_flight_t** set to the flight to read from
+ *
+ *  @returns 1 if the caller must fetch the flight, 0 if it is already on the
+ *           wire, -1 on failure
  */
-int create_hash_table(size_t size, const struct gd_fs_entry_t* head)
+int gd_flight_join(struct gd_fs_entry_t* entry, off_t start, off_t end,
+		struct gd_range_flight_t** flight)
 {
-	int ret = hcreate(size);
-	if(!ret)
+	struct gd_range_flight_t *iter;
+
+	pthread_mutex_lock(&entry->lock);
+	for(iter = entry->flights; iter != NULL; iter = iter->next)
 	{
-		fprintf(stderr, "hcreate failed\n");
-		return 1;
+		if(iter->start <= start && start < iter->start + (off_t) iter->length)
+		{
+			++iter->refs;
+			*flight = iter;
+			pthread_mutex_unlock(&entry->lock);
+			return 0;
+		}
+		if(start < iter->start && iter->start < end)
+			end = iter->start;
 	}
 
-	ENTRY entry;
-	struct gd_fs_entry_t *iter = head;
-	while(iter != NULL)
+	iter = (struct gd_range_flight_t*) malloc(sizeof(struct gd_range_flight_t));
+	if(iter == NULL)
 	{
-		entry.key = iter->filename.str;
-		entry.data = iter;
+		pthread_mutex_unlock(&entry->lock);
+		return -1;
+	}
+	memset(iter, 0, sizeof(struct gd_range_flight_t));
+	str_init(&iter->data);
+	iter->start = start;
+	iter->length = end - start;
+	iter->refs = 1;
+	iter->next = entry->flights;
+	entry->flights = iter;
+
+	*flight = iter;
+	pthread_mutex_unlock(&entry->lock);
+	return 1;
+}
+
+/** Publish the result of fetching a range flight and wake its readers.
+ *
+ *  The flight is taken off the wire list, readers that come later start a
+ *  new fetch.
+ *
+ *  @entry  struct gd_fs_entry_t*     the entry being read
+ *  @flight struct gd_range_flight_t* the flight that was fetched
+ *  @result int                       0 on success, otherwise a negative errno
+ */
+void gd_flight_complete(struct gd_fs_entry_t* entry,
+		struct gd_range_flight_t* flight, int result)
+{
+	struct gd_range_flight_t **iter;
 
-		ENTRY* entered = hsearch(entry, ENTER);
-		if(0 && !entered)
+	pthread_mutex_lock(&entry->lock);
+	for(iter = &entry->flights; *iter != NULL; iter = &(*iter)->next)
+	{
+		if(*iter == flight)
 		{
-			fprintf(stderr, "hsearch: %s\n", strerror(errno));
-			destroy_hash_table();
-			return 1;
+			*iter = flight->next;
+			break;
+		}
+	}
+	flight->next = NULL;
+	flight->result = result;
+	flight->done = 1;
+	pthread_cond_broadcast(&entry->cond);
+	pthread_mutex_unlock(&entry->lock);
+}
+
+/** Take another reference to a range flight already referenced by the caller.
+ */
+void gd_flight_get(struct gd_fs_entry_t* entry, struct gd_range_flight_t* flight)
+{
+	pthread_mutex_lock(&entry->lock);
+	++flight->refs;
+	pthread_mutex_unlock(&entry->lock);
+}
+
+/** Wait for a range flight to complete.
+ */
+void gd_flight_wait(struct gd_fs_entry_t* entry, struct gd_range_flight_t* flight)
+{
+	pthread_mutex_lock(&entry->lock);
+	while(!flight->done)
+		pthread_cond_wait(&entry->cond, &entry->lock);
+	pthread_mutex_unlock(&entry->lock);
+}
+
+/** Drop a reference to a range flight, freeing it with the last one.
+ */
+void gd_flight_release(struct gd_fs_entry_t* entry, struct gd_range_flight_t* flight)
+{
+	pthread_mutex_lock(&entry->lock);
+	size_t refs = --flight->refs;
+	pthread_mutex_unlock(&entry->lock);
+
+	if(!refs)
+	{
+		str_destroy(&flight->data);
+		free(flight);
+	}
+}
+
+/** Hashes a filename for the filename table, 64 bit FNV-1a.
+ */
+static uint64_t name_hash(const char* key)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for(; *key; ++key)
+	{
+		hash ^= (unsigned char) *key;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+/** Creates an empty Bloom filter for a filename table with this many buckets.
+ */
+static struct name_bloom_t* bloom_create(size_t buckets)
+{
+	size_t bits = buckets * bloom_bits_per_bucket;
+	struct name_bloom_t *bloom = (struct name_bloom_t*) calloc(1,
+			sizeof(struct name_bloom_t) + bits / 8);
+	if(bloom != NULL)
+		bloom->bits = bits;
+	return bloom;
+}
+
+/** Sets the bits of a filename hash in a Bloom filter.
+ *
+ *  Readers do not take table_lock, so bits are only ever set atomically.
+ */
+static void bloom_add(struct name_bloom_t* bloom, uint64_t hash)
+{
+	// Double hashing, the probes are h1 + i * h2
+	uint64_t h2 = (hash >> 32) | 1;
+	int iter;
+	for(iter = 0; iter < bloom_probes; ++iter, hash += h2)
+	{
+		size_t bit = hash & (bloom->bits - 1);
+		__sync_fetch_and_or(&bloom->words[bit / 64], (uint64_t) 1 << (bit % 64));
+	}
+}
+
+/** Checks if a filename hash may be in a Bloom filter.
+ *
+ *  @returns 0 if it certainly is not
+ */
+static int bloom_test(const struct name_bloom_t* bloom, uint64_t hash)
+{
+	uint64_t h2 = (hash >> 32) | 1;
+	int iter;
+	for(iter = 0; iter < bloom_probes; ++iter, hash += h2)
+	{
+		size_t bit = hash & (bloom->bits - 1);
+		if(!(bloom->words[bit / 64] & ((uint64_t) 1 << (bit % 64))))
+			return 0;
+	}
+	return 1;
+}
+
+/** Finds where a filename is in the filename table.
+ *
+ *  Must be called with table_lock held.
+ *
+ *  @returns the link pointing at the entry with that name, or at the NULL
+ *           ending its bucket if there is none
+ */
+static struct gd_fs_entry_t** name_slot(const char* key)
+{
+	struct gd_fs_entry_t **slot = &name_table[name_hash(key) & (name_buckets - 1)];
+	while(*slot != NULL && strcmp((*slot)->filename.str, key))
+		slot = &(*slot)->name_next;
+	return slot;
+}
+
+/** Doubles the filename table.
+ *
+ *  Must be called with table_lock held for writing. If there is no memory
+ *  the table stays as it is, just slower.
+ */
+static void name_grow()
+{
+	size_t buckets = name_buckets * 2;
+	struct gd_fs_entry_t **table =
+		(struct gd_fs_entry_t**) calloc(buckets, sizeof(struct gd_fs_entry_t*));
+	if(table == NULL)
+		return;
+
+	// Rebuilt from the names still in the table, which drops those removed
+	struct name_bloom_t *bloom = bloom_create(buckets);
+
+	size_t iter;
+	for(iter = 0; iter < name_buckets; ++iter)
+	{
+		struct gd_fs_entry_t *entry = name_table[iter];
+		while(entry != NULL)
+		{
+			struct gd_fs_entry_t *next = entry->name_next;
+			uint64_t hash = name_hash(entry->filename.str);
+			if(bloom)
+				bloom_add(bloom, hash);
+			struct gd_fs_entry_t **slot = &table[hash & (buckets - 1)];
+			entry->name_next = *slot;
+			*slot = entry;
+			entry = next;
 		}
+	}
 
-		iter = iter->next;
+	free(name_table);
+	name_table = table;
+	name_buckets = buckets;
+
+	// The old filter still covers every name, so keep it if this failed
+	if(bloom)
+	{
+		bloom->retired = name_bloom;
+		// Readers use it unlocked, it must be complete before it is published
+		__sync_synchronize();
+		name_bloom = bloom;
 	}
+}
 
-	return 0;
+/** Hashes the three bytes at name to a bucket of the trigram index.
+ */
+static size_t trigram_hash(const char* name)
+{
+	uint32_t trigram = ((uint32_t)(unsigned char) name[0] << 16)
+		| ((uint32_t)(unsigned char) name[1] << 8) | (unsigned char) name[2];
+	// Fibonacci hashing, the top 16 bits of the product
+	return (trigram * 2654435761U) >> 16;
 }
 
-/** Destroys the global hash table.
+/** Frees the trigram index.
+ *
+ *  Must be called with table_lock held for writing.
  */
-void destroy_hash_table()
+static void trigram_destroy()
 {
-	hdestroy();
+	size_t iter;
+
+	if(trigram_table == NULL)
+		return;
+	for(iter = 0; iter < trigram_buckets; ++iter)
+		free(trigram_table[iter].entries);
+	free(trigram_table);
+	trigram_table = NULL;
+}
+
+/** Adds the trigrams of an entry's filename to the trigram index.
+ *
+ *  Must be called with table_lock held for writing.
+ */
+static void trigram_add(struct gd_fs_entry_t* entry)
+{
+	const char *iter;
+
+	if(trigram_table == NULL || entry->filename.len < 3)
+		return;
+	for(iter = entry->filename.str; iter[1] && iter[2]; ++iter)
+	{
+		struct trigram_bucket_t *bucket = &trigram_table[trigram_hash(iter)];
+		// Nothing else is added meanwhile, so if an earlier trigram of this
+		// name hashed here the entry is last
+		if(bucket->count && bucket->entries[bucket->count - 1] == entry)
+			continue;
+		if(bucket->count == bucket->reserved)
+		{
+			size_t reserved = bucket->reserved ? bucket->reserved * 2 : 4;
+			struct gd_fs_entry_t **entries = (struct gd_fs_entry_t**)
+				realloc(bucket->entries, reserved * sizeof(struct gd_fs_entry_t*));
+			if(entries == NULL)
+			{
+				// An index missing names would miss results
+				fprintf(stderr, "trigram index: out of memory, dropped\n");
+				trigram_destroy();
+				return;
+			}
+			bucket->entries = entries;
+			bucket->reserved = reserved;
+		}
+		bucket->entries[bucket->count++] = entry;
+	}
+}
+
+/** Takes the trigrams of an entry's filename out of the trigram index.
+ *
+ *  Must be called with table_lock held for writing, before the filename
+ *  changes.
+ */
+static void trigram_remove(struct gd_fs_entry_t* entry)
+{
+	const char *iter;
+	size_t index;
+
+	if(trigram_table == NULL || entry->filename.len < 3)
+		return;
+	for(iter = entry->filename.str; iter[1] && iter[2]; ++iter)
+	{
+		struct trigram_bucket_t *bucket = &trigram_table[trigram_hash(iter)];
+		// Order within a bucket does not matter
+		for(index = 0; index < bucket->count; ++index)
+		{
+			if(bucket->entries[index] == entry)
+			{
+				bucket->entries[index] = bucket->entries[--bucket->count];
+				break;
+			}
+		}
+	}
+}
+
+/** Adds an entry to the filename table under its filename.
+ *
+ *  Must be called with table_lock held for writing.
+ *
+ *  @returns 0 on success, 1 if the name is taken
+ */
+static int name_insert(struct gd_fs_entry_t* entry)
+{
+	struct gd_fs_entry_t **slot = name_slot(entry->filename.str);
+	if(*slot != NULL)
+		return 1;
+	if(name_bloom)
+		bloom_add(name_bloom, name_hash(entry->filename.str));
+	entry->name_next = NULL;
+	*slot = entry;
+	entry->named = 1;
+	trigram_add(entry);
+
+	if(++name_count > name_buckets)
+		name_grow();
+	return 0;
+}
+
+/** Takes an entry out of the filename table.
+ *
+ *  Must be called with table_lock held for writing.
+ */
+static void remove_name(struct gd_fs_entry_t* entry)
+{
+	if(!entry->named)
+		return;
+	struct gd_fs_entry_t **slot = name_slot(entry->filename.str);
+	if(*slot == entry)
+	{
+		*slot = entry->name_next;
+		entry->name_next = NULL;
+		entry->named = 0;
+		--name_count;
+		trigram_remove(entry);
+	}
+}
+
+/** Searches the filename table for a filename.
+ *
+ *  @key the name of the file to find
+ *
+ *  @returns the gd_fs_entry_t representing that file, or NULL
+ */
+struct gd_fs_entry_t* gd_fs_entry_find(const char* key)
+{
+	// Most names looked up and not found never touch the table
+	const struct name_bloom_t *bloom = name_bloom;
+	if(bloom && !bloom_test(bloom, name_hash(key)))
+		return NULL;
+
+	pthread_rwlock_rdlock(&table_lock);
+	struct gd_fs_entry_t *entry = name_table ? *name_slot(key) : NULL;
+	pthread_rwlock_unlock(&table_lock);
+	return entry;
+}
+
+/** Collects a named entry if its filename has text in it.
+ *
+ *  @returns 0 on success, 1 on failure
+ */
+static int grep_match(struct gd_fs_entry_t* entry, const char* text,
+		struct gd_fs_entry_t*** results, size_t* count, size_t* reserved)
+{
+	if(!entry->named || entry->deleted || strstr(entry->filename.str, text) == NULL)
+		return 0;
+	if(*count == *reserved)
+	{
+		size_t grown = *reserved ? *reserved * 2 : 16;
+		struct gd_fs_entry_t **entries = (struct gd_fs_entry_t**)
+			realloc(*results, grown * sizeof(struct gd_fs_entry_t*));
+		if(entries == NULL)
+			return 1;
+		*results = entries;
+		*reserved = grown;
+	}
+	(*results)[(*count)++] = entry;
+	return 0;
+}
+
+/** Finds every entry in the filename table with text in its filename.
+ *
+ *  Text of three bytes or more is looked for only in the names sharing its
+ *  rarest trigram, shorter text in every name.
+ *
+ *  @text    the escaped text to look for
+ *  @results set to the entries found, for the caller to free
+ *  @count   set to how many were found
+ *
+ *  @returns 0 on success, 1 on failure
+ */
+int gd_fs_entry_grep(const char* text, struct gd_fs_entry_t*** results, size_t* count)
+{
+	struct trigram_bucket_t *rarest = NULL;
+	size_t reserved = 0;
+	size_t iter;
+	int ret = 0;
+
+	*results = NULL;
+	*count = 0;
+	pthread_rwlock_rdlock(&table_lock);
+	if(trigram_table && strlen(text) >= 3)
+	{
+		const char *trigram;
+		for(trigram = text; trigram[2]; ++trigram)
+		{
+			struct trigram_bucket_t *bucket = &trigram_table[trigram_hash(trigram)];
+			if(rarest == NULL || bucket->count < rarest->count)
+				rarest = bucket;
+		}
+		for(iter = 0; !ret && iter < rarest->count; ++iter)
+			ret = grep_match(rarest->entries[iter], text, results, count, &reserved);
+	}
+	else
+	{
+		for(iter = 0; !ret && iter < name_buckets; ++iter)
+		{
+			struct gd_fs_entry_t *entry;
+			for(entry = name_table[iter]; !ret && entry != NULL; entry = entry->name_next)
+				ret = grep_match(entry, text, results, count, &reserved);
+		}
+	}
+	pthread_rwlock_unlock(&table_lock);
+
+	if(ret)
+	{
+		free(*results);
+		*results = NULL;
+		*count = 0;
+	}
+	return ret;
+}
+
+static int compare_ino(const void *a, const void *b)
+{
+	uint64_t left = ((const struct gd_fs_entry_t*) a)->ino;
+	uint64_t right = ((const struct gd_fs_entry_t*) b)->ino;
+	return (left > right) - (left < right);
+}
+
+/** Searches the inode table for an inode number.
+ *
+ *  @ino the inode number of the entry to find
+ *
+ *  @returns the gd_fs_entry_t with that inode number, or NULL
+ */
+struct gd_fs_entry_t* gd_fs_entry_find_ino(uint64_t ino)
+{
+	struct gd_fs_entry_t key;
+	key.ino = ino;
+
+	pthread_rwlock_rdlock(&table_lock);
+	void *found = tfind(&key, &inode_table, compare_ino);
+	pthread_rwlock_unlock(&table_lock);
+	if(found == NULL)
+		return NULL;
+	return *(struct gd_fs_entry_t**) found;
+}
+
+/** Searches the inode table for an entry by resourceID.
+ *
+ *  Entries are numbered by the hash of their resourceID, so only the run of
+ *  inode numbers after that hash is searched. Entries created here are
+ *  numbered by filename and are not found until the tables are rebuilt.
+ *
+ *  @resourceID the resourceID of the entry to find
+ *  @within     only entries listed in these folder contents, or NULL for any
+ *
+ *  @returns the entry, one that is not deleted if there is one, or NULL
+ */
+struct gd_fs_entry_t* gd_fs_entry_find_id(const char* resourceID,
+		const struct gd_dir_t* within)
+{
+	struct gd_fs_entry_t key;
+	struct gd_fs_entry_t *deleted = NULL;
+	void *found;
+
+	memset(&key, 0, sizeof(struct gd_fs_entry_t));
+	key.resourceID.str = (char*) resourceID;
+	key.resourceID.len = strlen(resourceID);
+	key.ino = gd_fs_entry_ino(&key);
+
+	pthread_rwlock_rdlock(&table_lock);
+	while((found = tfind(&key, &inode_table, compare_ino)) != NULL)
+	{
+		struct gd_fs_entry_t *entry = *(struct gd_fs_entry_t**) found;
+		if(entry->resourceID.len && strcmp(entry->resourceID.str, resourceID) == 0
+				&& (within == NULL || entry->within == within))
+		{
+			if(!entry->deleted)
+			{
+				pthread_rwlock_unlock(&table_lock);
+				return entry;
+			}
+			if(deleted == NULL)
+				deleted = entry;
+		}
+		if(++key.ino <= GD_RESERVED_INO)
+			key.ino = GD_RESERVED_INO + 1;
+	}
+	pthread_rwlock_unlock(&table_lock);
+
+	return deleted;
+}
+
+/** Derives an inode number for an entry from its resourceID.
+ *
+ *  This is the 64 bit FNV-1a hash of the resourceID, so the same file gets the
+ *  same inode number on every mount. Entries without a resourceID fall back
+ *  to their filename. The numbers reserved for "no inode", the root and the
+ *  virtual folders are never returned.
+ *
+ *  @entry the entry to number
+ *
+ *  @returns the preferred inode number, which may collide with another entry's
+ */
+uint64_t gd_fs_entry_ino(const struct gd_fs_entry_t* entry)
+{
+	const struct str_t *key = entry->resourceID.len ? &entry->resourceID : &entry->filename;
+	uint64_t hash = 14695981039346656037ULL;
+	size_t count;
+
+	for(count = 0; count < key->len; ++count)
+	{
+		hash ^= (unsigned char) key->str[count];
+		hash *= 1099511628211ULL;
+	}
+
+	if(hash <= GD_RESERVED_INO)
+		hash += GD_RESERVED_INO + 1;
+	return hash;
+}
+
+/** Gives an entry an inode number and adds it to the inode table.
+ *
+ *  Must be called with table_lock held for writing.
+ *
+ *  @returns 0 on success, 1 on failure
+ */
+static int insert_ino(struct gd_fs_entry_t* entry)
+{
+	// Probe past the rare hash collision, the first entry keeps its number
+	entry->ino = gd_fs_entry_ino(entry);
+	while(tfind(entry, &inode_table, compare_ino) != NULL)
+		if(++entry->ino <= GD_RESERVED_INO)
+			entry->ino = GD_RESERVED_INO + 1;
+	if(tsearch(entry, &inode_table, compare_ino) == NULL)
+	{
+		fprintf(stderr, "tsearch: out of memory\n");
+		return 1;
+	}
+	return 0;
+}
+
+/** Adds an entry created locally to both tables.
+ *
+ *  @entry the entry to add, its filename must not be in use
+ *
+ *  @returns 0 on success, 1 if the name is taken or on failure
+ */
+int gd_fs_entry_insert(struct gd_fs_entry_t* entry)
+{
+	pthread_rwlock_wrlock(&table_lock);
+	if(*name_slot(entry->filename.str) != NULL || insert_ino(entry))
+	{
+		pthread_rwlock_unlock(&table_lock);
+		return 1;
+	}
+	name_insert(entry);
+	pthread_rwlock_unlock(&table_lock);
+
+	return 0;
+}
+
+/** Checks if an entry the tables hold is the same file as one just listed.
+ */
+static int same_file(const struct gd_fs_entry_t* held, const struct gd_fs_entry_t* listed)
+{
+	return held != NULL && held->resourceID.len
+		&& strcmp(held->resourceID.str, listed->resourceID.str) == 0;
+}
+
+/** Adds an entry from a listing to both tables.
+ *
+ *  The listing runs while the filesystem is in use, so the file may already
+ *  be there, found by a targeted lookup or uploaded from here. The first
+ *  entry listed under a name keeps it, later ones are only found by inode.
+ *
+ *  @entry the listed entry
+ *
+ *  @returns 0 if it was added, 1 if the file is already there, -1 on failure
+ */
+int gd_fs_entry_index(struct gd_fs_entry_t* entry)
+{
+	struct gd_fs_entry_t key;
+
+	pthread_rwlock_wrlock(&table_lock);
+	if(same_file(*name_slot(entry->filename.str), entry))
+	{
+		pthread_rwlock_unlock(&table_lock);
+		return 1;
+	}
+
+	// Entries with this resourceID sit on its inode number or past it
+	key.ino = gd_fs_entry_ino(entry);
+	void *found;
+	while((found = tfind(&key, &inode_table, compare_ino)) != NULL)
+	{
+		if(same_file(*(struct gd_fs_entry_t**) found, entry))
+		{
+			pthread_rwlock_unlock(&table_lock);
+			return 1;
+		}
+		if(++key.ino <= GD_RESERVED_INO)
+			key.ino = GD_RESERVED_INO + 1;
+	}
+
+	if(insert_ino(entry))
+	{
+		pthread_rwlock_unlock(&table_lock);
+		return -1;
+	}
+	name_insert(entry);
+	pthread_rwlock_unlock(&table_lock);
+
+	return 0;
+}
+
+/** Adds an entry from the listing of one folder to the tables.
+ *
+ *  Unlike gd_fs_entry_index() the same file may be added more than once, as
+ *  a file can be in more than one folder.
+ *
+ *  @entry the listed entry
+ *  @named nonzero to also add it to the filename table, if the name is free
+ *
+ *  @returns 0 on success, 1 on failure
+ */
+int gd_fs_entry_add(struct gd_fs_entry_t* entry, int named)
+{
+	pthread_rwlock_wrlock(&table_lock);
+	if(insert_ino(entry))
+	{
+		pthread_rwlock_unlock(&table_lock);
+		return 1;
+	}
+	if(named)
+		name_insert(entry);
+	pthread_rwlock_unlock(&table_lock);
+
+	return 0;
+}
+
+/** Takes an entry out of both tables so it can be freed.
+ *
+ *  Nothing may still refer to the entry, see gd_dir.c.
+ */
+void gd_fs_entry_drop(struct gd_fs_entry_t* entry)
+{
+	pthread_rwlock_wrlock(&table_lock);
+	remove_name(entry);
+	tdelete(entry, &inode_table, compare_ino);
+	pthread_rwlock_unlock(&table_lock);
+}
+
+/** Keep a name that was replaced alive until the tables are destroyed.
+ *
+ *  The filename table still points at it, and readers of the listing may be
+ *  using it. Must be called with table_lock held for writing.
+ */
+static void retire_name(char* name)
+{
+	struct retired_name_t *retired;
+
+	retired = (struct retired_name_t*) malloc(sizeof(struct retired_name_t));
+	if(retired == NULL)
+		return; // Leaked rather than freed while in use
+	retired->name = name;
+	retired->next = retired_names;
+	retired_names = retired;
+}
+
+/** Gives an entry a new name.
+ *
+ *  @entry    the entry to rename
+ *  @filename the new escaped name, which must not be in use
+ *
+ *  @returns 0 on success, 1 if the name is taken or on failure
+ */
+int gd_fs_entry_rename(struct gd_fs_entry_t* entry, const char* filename)
+{
+	struct str_t name;
+
+	if(str_init_create(&name, filename, 0))
+		return 1;
+
+	pthread_rwlock_wrlock(&table_lock);
+	if(*name_slot(name.str) != NULL)
+	{
+		pthread_rwlock_unlock(&table_lock);
+		str_destroy(&name);
+		return 1;
+	}
+
+	remove_name(entry);
+	retire_name(entry->filename.str);
+	entry->filename = name;
+	name_insert(entry);
+	pthread_rwlock_unlock(&table_lock);
+	// The names in the filename table are those of the root
+	gd_fs_entry_changed(NULL);
+
+	return 0;
+}
+
+/** Gives an entry that is not in the filename table a new name.
+ *
+ *  The caller makes sure the name is free wherever the entry is listed.
+ *
+ *  @entry    the entry to rename
+ *  @filename the new escaped name
+ *
+ *  @returns 0 on success, 1 on failure
+ */
+int gd_fs_entry_retitle(struct gd_fs_entry_t* entry, const char* filename)
+{
+	struct str_t name;
+
+	if(str_init_create(&name, filename, 0))
+		return 1;
+
+	pthread_rwlock_wrlock(&table_lock);
+	// Readers of the folder may still be using the old name
+	retire_name(entry->filename.str);
+	entry->filename = name;
+	pthread_rwlock_unlock(&table_lock);
+
+	return 0;
+}
+
+/** Gives an entry the resourceID the server returned for it.
+ *
+ *  Listings compare resourceIDs under table_lock, so they are only replaced
+ *  with it held.
+ *
+ *  @entry      the entry
+ *  @resourceID swapped with the entry's, the caller frees what it gets back
+ */
+void gd_fs_entry_swap_id(struct gd_fs_entry_t* entry, struct str_t* resourceID)
+{
+	pthread_rwlock_wrlock(&table_lock);
+	str_swap(&entry->resourceID, resourceID);
+	pthread_rwlock_unlock(&table_lock);
+}
+
+/** Note that the entries of a folder changed.
+ *
+ *  Called once an entry has been linked into or unlinked from a folder, its
+ *  deleted flag set or its name changed, so whoever compares generations
+ *  sees the change made. The folder is stamped with the next of a count
+ *  kept for all folders, so changes elsewhere leave its generation alone.
+ *
+ *  @folder the folder that changed, NULL for the root
+ */
+void gd_fs_entry_changed(struct gd_fs_entry_t* folder)
+{
+	unsigned long stamp = __sync_add_and_fetch(&listing_generation, 1);
+	__sync_lock_test_and_set(folder ? &folder->changed : &root_changed, stamp);
+}
+
+/** The generation of what a folder lists.
+ *
+ *  What was built from the folder's listing at one generation is current
+ *  while the generation is unchanged.
+ *
+ *  @ino the inode number of the folder
+ *
+ *  @returns the generation, 0 if the folder is not in memory
+ */
+unsigned long gd_fs_entry_generation(uint64_t ino)
+{
+	// No entry has a reserved inode number, the root's is one
+	if(ino <= GD_RESERVED_INO)
+		return __sync_add_and_fetch(&root_changed, 0);
+
+	struct gd_fs_entry_t *folder = gd_fs_entry_find_ino(ino);
+	return folder ? __sync_add_and_fetch(&folder->changed, 0) : 0;
+}
+
+/** Removes the name of an entry from the filename table.
+ *
+ *  The entry can still be found by inode number.
+ *
+ *  @returns nonzero if the entry had its name in the table
+ */
+int gd_fs_entry_remove(struct gd_fs_entry_t* entry)
+{
+	pthread_rwlock_wrlock(&table_lock);
+	int named = entry->named;
+	remove_name(entry);
+	pthread_rwlock_unlock(&table_lock);
+	return named;
+}
+
+/** Puts the name of an entry back in the filename table, after
+ *  gd_fs_entry_remove().
+ *
+ *  @returns 0 on success, 1 if another entry took the name meanwhile
+ */
+int gd_fs_entry_restore(struct gd_fs_entry_t* entry)
+{
+	pthread_rwlock_wrlock(&table_lock);
+	int ret = entry->named ? 0 : name_insert(entry);
+	pthread_rwlock_unlock(&table_lock);
+	return ret;
+}
+
+/** Creates the filename table, empty.
+ *
+ *  @size how many names to make room for at first, the table grows
+ *
+ *  @returns 0 on success, 1 on failure
+ */
+int create_hash_table(size_t size)
+{
+	size_t buckets = 16;
+	while(buckets < size)
+		buckets *= 2;
+
+	pthread_rwlock_wrlock(&table_lock);
+	name_table = (struct gd_fs_entry_t**) calloc(buckets, sizeof(struct gd_fs_entry_t*));
+	name_buckets = name_table ? buckets : 0;
+	name_count = 0;
+	// Lookups do without it if there is no memory for it
+	name_bloom = bloom_create(buckets);
+	trigram_table = (struct trigram_bucket_t*) calloc(trigram_buckets,
+			sizeof(struct trigram_bucket_t));
+	pthread_rwlock_unlock(&table_lock);
+
+	if(name_table == NULL)
+	{
+		fprintf(stderr, "create_hash_table: out of memory\n");
+		return 1;
+	}
+	return 0;
+}
+
+static void free_inode_node(void *node)
+{
+	// The entries themselves belong to the file list
+}
+
+/** Destroys the filename table and inode table.
+ */
+void destroy_hash_table()
+{
+	pthread_rwlock_wrlock(&table_lock);
+	free(name_table);
+	name_table = NULL;
+	name_buckets = 0;
+	name_count = 0;
+	while(name_bloom)
+	{
+		struct name_bloom_t *retired = name_bloom->retired;
+		free(name_bloom);
+		name_bloom = retired;
+	}
+	trigram_destroy();
+	tdestroy(inode_table, free_inode_node);
+	inode_table = NULL;
+	while(retired_names)
+	{
+		struct retired_name_t *next = retired_names->next;
+		free(retired_names->name);
+		free(retired_names);
+		retired_names = next;
+	}
+	pthread_rwlock_unlock(&table_lock);
 }
 
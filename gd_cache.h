@@ -21,8 +21,58 @@
 
 #include <libxml/tree.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
 #include "str.h"
 
+struct json_object;
+struct gd_dir_t;
+
+// Entries are never given inode numbers up to this. The root has 1,
+// FUSE_ROOT_ID, and the virtual folders of gd_virtual.h the ones after it.
+#define GD_RESERVED_INO 15
+
+extern const char drive_files_uri[];
+extern const char docs_entry_uri[];
+
+/** One version of the contents of an entry.
+ *
+ *  Versions are never modified once published. A refresh publishes a new
+ *  version, and the old one lives on until the last open handle using it is
+ *  released, so readers never need a lock and never see a torn buffer.
+ */
+struct gd_content_t {
+	struct str_t data;
+	// The md5Checksum the server reported for data, if there was one
+	struct str_t md5;
+
+	// The entry holds one reference while this is its current version, and
+	// each open handle holds one. Changed only with atomic operations.
+	unsigned long refs;
+};
+
+/** A byte range of an entry being fetched from the server.
+ *
+ *  Readers wanting bytes in [start, start + length) attach to it instead of
+ *  fetching them again, and are woken when it completes.
+ */
+struct gd_range_flight_t {
+	off_t start;
+	size_t length;
+
+	// The bytes received, valid once done is set
+	struct str_t data;
+	// 0 on success, otherwise a negative errno
+	int result;
+	int done;
+
+	// The fetching reader and every attached reader hold a reference
+	size_t refs;
+
+	struct gd_range_flight_t *next;
+};
 
 // Do we need to represent folders differently from files?
 // For the time being, ignore folders
@@ -37,38 +87,171 @@ struct gd_fs_entry_t {
 	struct str_t resourceID;
 	struct str_t src; // The url for downloading the file
 	struct str_t feed; // The url for getting the XML feed for this entry
+	struct str_t edit_media; // The url for starting an upload of new contents
+	struct str_t edit; // The url for changing the metadata of this entry
+	// The resourceID of the first folder this entry is in, empty if none
+	struct str_t parent;
+	// Folders are listed in the root like everything else, except in lazy
+	// mode, where they have their own contents
+	int is_folder;
+	// Set once the entry is unlinked. It stays in memory for the handles and
+	// kernel lookups still referring to it, until unmount or in lazy mode
+	// until its folder is evicted.
+	int deleted;
 
-	struct str_t cache;
-	int cached;
+	// The current version of the contents, NULL until first loaded
+	struct gd_content_t *content;
 
 	unsigned long size; // file size in bytes, 'gd:quotaBytesUsed' in XML
+	time_t mtime; // when the entry last changed, 'updated' in XML
+	time_t ctime; // when the entry was created, 'published' in XML
 	struct str_t md5; // 'docs:md5Checksum' in XML
 	int md5set; // indicates if the md5sum was available for this entry
+	// The server's version number of the entry, 'version' in JSON, empty if
+	// the listing did not have it or the entry changed here since
+	struct str_t revision;
+
+	// What getattr() replies with, but for the inode number and owner. Kept in
+	// step with size and times by gd_fs_entry_stat() so a reply is one copy.
+	struct stat attr;
+
+	// Inode number, stable across mounts since it is derived from resourceID
+	uint64_t ino;
+	// Kernel lookup count, changed only with atomic operations. The entry must
+	// not be freed while this is nonzero.
+	unsigned long nlookup;
+
+	// Protects content and the load and flight state below
+	pthread_mutex_t lock;
+	// Signalled when a load or a range flight completes
+	pthread_cond_t cond;
+	// Set while one thread runs gdi_load(), others wait for its result,
+	// which is -EINTR if the thread loading was interrupted
+	int loading;
+	int load_result;
+	unsigned long load_generation;
+	// Range fetches currently on the wire for this entry
+	struct gd_range_flight_t *flights;
+
+	// Local file holding the contents once the entry has been opened for
+	// writing, -1 until then. Reads and writes go here rather than to the
+	// server until it is closed again, once the server has caught up and
+	// nothing uses it, see gdw_unstage().
+	int staging_fd;
+	// Set while a thread creates the staging file, others wait for it
+	int staging_busy;
+	// Ranged entries are staged lazily. The server's bytes below
+	// staging_remote are copied into the staging file a staging_chunk at a
+	// time on first use, staging_filled has a byte per chunk set once it has
+	// been. One chunk is copied at a time, while staging_filling is set.
+	off_t staging_remote;
+	unsigned char *staging_filled;
+	int staging_filling;
+	// Handles open for writing, and reads of the staging file under way
+	unsigned long writers;
+	unsigned long staging_readers;
+	// Bumped by every change to the staging file. The server has the
+	// contents as of upload_generation, the entry is dirty while they differ.
+	unsigned long write_generation;
+	unsigned long upload_generation;
+	// 0, or the negative errno the last upload failed with
+	int upload_error;
+	// Set while the entry is in the upload queue, which it leaves when its
+	// upload starts, and the earliest time that upload may start
+	int upload_queued;
+	struct timespec upload_due;
+	struct gd_fs_entry_t *upload_next;
+	// Set while an uploader is sending the entry, it is not picked up again
+	// until that upload ends
+	int uploading;
+	// The session of an upload that failed part way, resumed by the next
+	// upload if the contents are still those of session_generation
+	struct str_t upload_session;
+	unsigned long session_generation;
 
-	// Add some data we can use in getattr()
+	// Metadata changes made locally that the server does not have yet, a mask
+	// of enum gdj_op_e. See gd_journal.c.
+	int journal_ops;
+	// The journal record of the newest of them, and the key they are recorded
+	// under, which stays the same once the entry is uploaded
+	unsigned long journal_seq;
+	struct str_t journal_key;
+	// Set while in the replay queue, and while a worker replays the entry
+	int journal_queued;
+	int journal_busy;
+	struct timespec journal_due;
+	struct gd_fs_entry_t *journal_next;
 
-	// Linked list
+	// The next entry in the same bucket of the filename table, and whether
+	// the entry is in that table at all. Entries listed under a name another
+	// entry already holds are only found by inode number.
+	struct gd_fs_entry_t *name_next;
+	int named;
+
+	// In lazy mode, the contents of the folder this entry is listed in and,
+	// for a folder, its own contents once listed. See gd_dir.c.
+	struct gd_dir_t *within;
+	struct gd_dir_t *dir;
+	// The listing of within that last had this entry, 0 if none has yet
+	unsigned long seen;
+	// For a folder, when what it lists last changed, see gd_fs_entry_changed()
+	unsigned long changed;
+
+	// Linked list, of every entry, or in lazy mode of the entries of within
 	struct gd_fs_entry_t *next;
 };
 
-// Since hsearch et al are likely not threadsafe we need to use a read write
-// lock to prevent corruption. The write lock should only be taken when we
-// need to add a new item.
-// What to do about removing a file? Just mark the entry as invalid? There is
-// no removal action for hsearch et al.
-// Does this also need a condition variable?
+// The filename and inode tables are guarded by a read write lock, lookups
+// share it and only adding, renaming and removing entries take it for
+// writing. The filename table grows as the listing fills it.
 struct gd_fs_lock_t {
 	pthread_rwlock_t *lock;
 };
 
 void gd_fs_entry_destroy(struct gd_fs_entry_t* entry);
 
+struct gd_fs_entry_t* gd_fs_entry_create(const char* filename);
+void gd_fs_entry_stat(struct gd_fs_entry_t* entry);
+void gd_fs_entry_modified(struct gd_fs_entry_t* entry, unsigned long size);
 struct gd_fs_entry_t* gd_fs_entry_from_xml(xmlDocPtr xml, xmlNodePtr node);
+struct gd_fs_entry_t* gd_fs_entry_from_json(struct json_object* file);
+int gd_fs_entry_insert(struct gd_fs_entry_t* entry);
+int gd_fs_entry_index(struct gd_fs_entry_t* entry);
+int gd_fs_entry_add(struct gd_fs_entry_t* entry, int named);
+void gd_fs_entry_drop(struct gd_fs_entry_t* entry);
+void gd_fs_entry_swap_id(struct gd_fs_entry_t* entry, struct str_t* resourceID);
+int gd_fs_entry_rename(struct gd_fs_entry_t* entry, const char* filename);
+int gd_fs_entry_retitle(struct gd_fs_entry_t* entry, const char* filename);
+int gd_fs_entry_remove(struct gd_fs_entry_t* entry);
+int gd_fs_entry_restore(struct gd_fs_entry_t* entry);
+void gd_fs_entry_changed(struct gd_fs_entry_t* folder);
+unsigned long gd_fs_entry_generation(uint64_t ino);
 struct gd_fs_entry_t* gd_fs_entry_find(const char* key);
+struct gd_fs_entry_t* gd_fs_entry_find_ino(uint64_t ino);
+int gd_fs_entry_grep(const char* text, struct gd_fs_entry_t*** results, size_t* count);
+struct gd_fs_entry_t* gd_fs_entry_find_id(const char* resourceID,
+		const struct gd_dir_t* within);
+uint64_t gd_fs_entry_ino(const struct gd_fs_entry_t* entry);
 
 struct str_t* xml_get_md5sum(const struct str_t* xml);
+struct gd_fs_entry_t* xml_parse_entry(const struct str_t* xml);
+char* filenamedecode(const char *filename, size_t length);
+time_t gd_parse_time(const char* value);
+
+struct gd_content_t* gd_content_create(struct str_t* data, const struct str_t* md5);
+struct gd_content_t* gd_content_get(struct gd_fs_entry_t* entry);
+void gd_content_put(struct gd_content_t* content);
+void gd_content_publish(struct gd_fs_entry_t* entry, struct gd_content_t* content);
+
+int gd_flight_join(struct gd_fs_entry_t* entry, off_t start, off_t end,
+		struct gd_range_flight_t** flight);
+void gd_flight_complete(struct gd_fs_entry_t* entry,
+		struct gd_range_flight_t* flight, int result);
+void gd_flight_get(struct gd_fs_entry_t* entry, struct gd_range_flight_t* flight);
+void gd_flight_wait(struct gd_fs_entry_t* entry, struct gd_range_flight_t* flight);
+void gd_flight_release(struct gd_fs_entry_t* entry, struct gd_range_flight_t* flight);
 
-int create_hash_table(size_t size, const struct gd_fs_entry_t* head);
+int create_hash_table(size_t size);
 void destroy_hash_table();
 
 #endif
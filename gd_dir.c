@@ -0,0 +1,690 @@
+/*
+	fuse-google-drive: a fuse filesystem wrapper for Google Drive
+	Copyright (C) 2012  James Cline
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2 as
+ 	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gd_cache.h"
+#include "gd_dir.h"
+#include "gd_interface.h"
+#include "gd_journal.h"
+#include "gd_negative.h"
+#include "gd_writeback.h"
+
+static struct gdd_state_t dirs;
+
+// A folder listing is used for this long before the folder is listed again
+const time_t dir_ttl_secs = 60;
+// The contents of a folder nothing has used for this long are freed
+const time_t dir_evict_secs = 600;
+// How often the sweeper looks for cold folders
+const time_t dir_sweep_secs = 60;
+
+
+void* gdd_sweeper(void* arg);
+static void gdd_free_dir(struct gd_dir_t* dir);
+
+/** The monotonic clock in seconds, what listing and use times are kept in.
+ */
+static time_t gdd_now()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
+}
+
+static void gdd_dir_init(struct gd_dir_t* dir, struct gd_fs_entry_t* folder)
+{
+	memset(dir, 0, sizeof(struct gd_dir_t));
+	pthread_mutex_init(&dir->lock, NULL);
+	pthread_cond_init(&dir->cond, NULL);
+	dir->folder = folder;
+}
+
+/** Start lazy mode.
+ *
+ *  Nothing is listed yet, the root is listed when it is first used.
+ *
+ *  @state struct gdi_state* the state for this mount
+ *
+ *  @returns 0 on success, 1 on failure
+ */
+int gdd_init(struct gdi_state* state)
+{
+	pthread_condattr_t attr;
+
+	memset(&dirs, 0, sizeof(struct gdd_state_t));
+	dirs.gdi = state;
+	gdd_dir_init(&dirs.root, NULL);
+	gdd_dir_init(&dirs.found, NULL);
+
+	pthread_mutex_init(&dirs.lock, NULL);
+	// Sweeps are timed on the monotonic clock
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&dirs.cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if(pthread_create(&dirs.sweeper, NULL, gdd_sweeper, NULL))
+	{
+		gdd_destroy();
+		return 1;
+	}
+	dirs.started = 1;
+
+	return 0;
+}
+
+/** Stop the sweeper and free every entry listed in lazy mode.
+ *
+ *  Must only be called once nothing uses the entries any more.
+ */
+void gdd_destroy()
+{
+	if(dirs.started)
+	{
+		pthread_mutex_lock(&dirs.lock);
+		dirs.stopping = 1;
+		pthread_cond_broadcast(&dirs.cond);
+		pthread_mutex_unlock(&dirs.lock);
+		pthread_join(dirs.sweeper, NULL);
+		dirs.started = 0;
+	}
+
+	gdd_free_dir(&dirs.root);
+	gdd_free_dir(&dirs.found);
+	pthread_cond_destroy(&dirs.cond);
+	pthread_mutex_destroy(&dirs.lock);
+}
+
+/** Free folder contents and everything in them.
+ */
+static void gdd_free_dir(struct gd_dir_t* dir)
+{
+	struct gd_fs_entry_t *entry = dir->children;
+	while(entry != NULL)
+	{
+		struct gd_fs_entry_t *next = entry->next;
+		if(entry->dir)
+		{
+			gdd_free_dir(entry->dir);
+			free(entry->dir);
+		}
+		gd_fs_entry_destroy(entry);
+		free(entry);
+		entry = next;
+	}
+	dir->children = NULL;
+	dir->tail = NULL;
+	pthread_cond_destroy(&dir->cond);
+	pthread_mutex_destroy(&dir->lock);
+}
+
+/** Get the contents of a folder, which need not have been listed yet.
+ *
+ *  @ino the inode number of the folder, FUSE_ROOT_ID for the root
+ *
+ *  @returns the contents, or NULL if ino is not a folder or on failure
+ */
+static struct gd_dir_t* gdd_dir(uint64_t ino)
+{
+	if(ino == FUSE_ROOT_ID)
+		return &dirs.root;
+
+	struct gd_fs_entry_t *folder = gd_fs_entry_find_ino(ino);
+	if(folder == NULL || !folder->is_folder)
+		return NULL;
+	if(folder->dir)
+		return folder->dir;
+
+	pthread_mutex_lock(&dirs.lock);
+	if(folder->dir == NULL)
+	{
+		struct gd_dir_t *dir = (struct gd_dir_t*) malloc(sizeof(struct gd_dir_t));
+		if(dir != NULL)
+		{
+			gdd_dir_init(dir, folder);
+			// Read without the lock, so it must be complete when published
+			__sync_synchronize();
+			folder->dir = dir;
+		}
+	}
+	pthread_mutex_unlock(&dirs.lock);
+
+	return folder->dir;
+}
+
+/** Check if an entry has to stay in memory.
+ *
+ *  It does while the kernel holds a lookup of it, and while it has changes
+ *  the server does not have yet.
+ */
+static int gdd_pinned(struct gd_fs_entry_t* entry)
+{
+	if(entry->nlookup || gdw_busy(entry) || gdj_busy(entry))
+		return 1;
+
+	pthread_mutex_lock(&entry->lock);
+	int dirty = entry->staging_fd >= 0 && entry->write_generation != entry->upload_generation;
+	pthread_mutex_unlock(&entry->lock);
+	return dirty;
+}
+
+/** Add a listing of a folder to what is known of its contents.
+ *
+ *  Entries already held are kept, as handles and lookups refer to them, and
+ *  the listed duplicates are dropped. Entries the listing no longer has were
+ *  removed on the server and are flagged deleted. An entry renamed on the
+ *  server is replaced by the listed one, unless it is pinned.
+ *
+ *  Must be called with dir->lock held.
+ *
+ *  @dir     struct gd_dir_t*      the folder contents
+ *  @entries struct gd_fs_entry_t* the listing, linked by next, taken over
+ */
+static void gdd_merge(struct gd_dir_t* dir, struct gd_fs_entry_t* entries)
+{
+	int root = dir == &dirs.root;
+	unsigned long generation = ++dir->generation;
+	struct gd_fs_entry_t *entry;
+	int changed = 0;
+	int created = 0;
+
+	// Entries created here are numbered by filename, so once on the server
+	// only a walk of the folder finds them by resourceID
+	for(entry = dir->children; entry != NULL && !root && !created; entry = entry->next)
+		created = !entry->seen && entry->resourceID.len;
+
+	while(entries != NULL)
+	{
+		entry = entries;
+		entries = entry->next;
+		entry->next = NULL;
+		if(!entry->resourceID.len)
+		{
+			gd_fs_entry_destroy(entry);
+			free(entry);
+			continue;
+		}
+
+		struct gd_fs_entry_t *held = gd_fs_entry_find_id(entry->resourceID.str, dir);
+		if(held == NULL && root)
+		{
+			// Entries created here are numbered by filename
+			held = gd_fs_entry_find(entry->filename.str);
+			if(held && (held->within != dir || !held->resourceID.len
+						|| strcmp(held->resourceID.str, entry->resourceID.str)))
+				held = NULL;
+		}
+		if(held == NULL && created)
+		{
+			struct gd_fs_entry_t *iter;
+			for(iter = dir->children; iter != NULL; iter = iter->next)
+				if(!iter->seen && iter->resourceID.len
+						&& strcmp(iter->resourceID.str, entry->resourceID.str) == 0)
+					break;
+			held = iter;
+		}
+		// Listed again after it was removed, unless that is still to be sent
+		if(held && held->deleted && !gdj_busy(held))
+			held = NULL;
+		if(held && !held->deleted && strcmp(held->filename.str, entry->filename.str)
+				&& !gdd_pinned(held))
+		{
+			held->deleted = 1;
+			if(root)
+				gd_fs_entry_remove(held);
+			held = NULL;
+			changed = 1;
+		}
+
+		if(held == NULL)
+		{
+			entry->within = dir;
+			entry->seen = generation;
+			if(!gd_fs_entry_add(entry, root))
+			{
+				// Readers walk the list unlocked, entry must be complete
+				// before it is linked
+				__sync_synchronize();
+				if(dir->tail)
+					dir->tail->next = entry;
+				else
+					dir->children = entry;
+				dir->tail = entry;
+				changed = 1;
+				gdn_added(root ? FUSE_ROOT_ID : dir->folder->ino,
+						entry->filename.str, 1);
+				continue;
+			}
+		}
+		else
+			held->seen = generation;
+
+		gd_fs_entry_destroy(entry);
+		free(entry);
+	}
+
+	// Entries created here have not been listed yet and are left alone
+	for(entry = dir->children; entry != NULL; entry = entry->next)
+	{
+		if(entry->seen && entry->seen != generation && !entry->deleted
+				&& !gdj_busy(entry))
+		{
+			entry->deleted = 1;
+			if(root)
+				gd_fs_entry_remove(entry);
+			changed = 1;
+		}
+	}
+
+	if(changed)
+		gd_fs_entry_changed(dir->folder);
+}
+
+/** List a folder unless its listing is fresh.
+ *
+ *  While one thread lists a folder others use the stale listing, or wait
+ *  for the new one if there is none.
+ *
+ *  @dir struct gd_dir_t* the folder contents
+ *
+ *  @returns 0 on success, -1 if there is no listing
+ */
+static int gdd_refresh(struct gd_dir_t* dir)
+{
+	struct gd_fs_entry_t *entries;
+	time_t now = gdd_now();
+	int ret;
+
+	pthread_mutex_lock(&dir->lock);
+	dir->used = now;
+	if(dir->listing)
+	{
+		while(dir->listing && !dir->expires)
+			pthread_cond_wait(&dir->cond, &dir->lock);
+		ret = dir->expires ? 0 : dir->result;
+		pthread_mutex_unlock(&dir->lock);
+		return ret;
+	}
+	if(dir->expires && now < dir->expires)
+	{
+		pthread_mutex_unlock(&dir->lock);
+		return 0;
+	}
+	dir->listing = 1;
+	pthread_mutex_unlock(&dir->lock);
+
+	ret = gdi_list_folder(dirs.gdi, dir->folder, &entries);
+
+	pthread_mutex_lock(&dir->lock);
+	if(!ret)
+	{
+		gdd_merge(dir, entries);
+		dir->expires = gdd_now() + dir_ttl_secs;
+	}
+	dir->result = ret;
+	dir->listing = 0;
+	pthread_cond_broadcast(&dir->cond);
+	// A stale listing is better than none
+	if(dir->expires)
+		ret = 0;
+	pthread_mutex_unlock(&dir->lock);
+
+	return ret;
+}
+
+/** Make sure a folder has been listed.
+ *
+ *  @ino the inode number of the folder, FUSE_ROOT_ID for the root
+ *
+ *  @returns 0 on success, -1 on failure
+ */
+int gdd_list(uint64_t ino)
+{
+	struct gd_dir_t *dir = gdd_dir(ino);
+	if(dir == NULL)
+		return -1;
+	return gdd_refresh(dir);
+}
+
+/** Find an entry in a folder, listing it first if needed.
+ *
+ *  @parent  the inode number of the folder, FUSE_ROOT_ID for the root
+ *  @name    the escaped filename
+ *  @missing if not NULL, set nonzero if the folder was listed and the name
+ *           is not in it, 0 if the folder could not be listed
+ *
+ *  @returns the entry, or NULL if there is no such entry
+ */
+struct gd_fs_entry_t* gdd_find(uint64_t parent, const char* name, int* missing)
+{
+	struct gd_fs_entry_t *entry;
+	struct gd_dir_t *dir = gdd_dir(parent);
+
+	if(missing)
+		*missing = 0;
+	if(dir == NULL || gdd_refresh(dir))
+		return NULL;
+	if(dir == &dirs.root)
+		entry = gd_fs_entry_find(name);
+	else
+	{
+		pthread_mutex_lock(&dir->lock);
+		for(entry = dir->children; entry != NULL; entry = entry->next)
+			if(!entry->deleted && strcmp(entry->filename.str, name) == 0)
+				break;
+		pthread_mutex_unlock(&dir->lock);
+	}
+
+	if(missing)
+		*missing = entry == NULL;
+	return entry;
+}
+
+/** Walk the entries of a folder, listing it first if needed.
+ *
+ *  Deleted entries are walked too, they keep their place.
+ *
+ *  @ino  the inode number of the folder, FUSE_ROOT_ID for the root
+ *  @prev the entry walked last, NULL to start
+ *
+ *  @returns the entry after prev, or NULL at the end
+ */
+struct gd_fs_entry_t* gdd_next(uint64_t ino, struct gd_fs_entry_t* prev)
+{
+	if(prev)
+		return prev->next;
+
+	struct gd_dir_t *dir = gdd_dir(ino);
+	if(dir == NULL || gdd_refresh(dir))
+		return NULL;
+	return dir->children;
+}
+
+/** Check if a folder other than the root has an entry by a name.
+ *
+ *  Must be called with dir->lock held.
+ */
+static int gdd_taken(struct gd_dir_t* dir, const char* name)
+{
+	struct gd_fs_entry_t *entry;
+
+	for(entry = dir->children; entry != NULL; entry = entry->next)
+		if(!entry->deleted && strcmp(entry->filename.str, name) == 0)
+			return 1;
+	return 0;
+}
+
+/** Add an entry created here to a folder.
+ *
+ *  @parent the inode number of the folder, FUSE_ROOT_ID for the root
+ *  @entry  the entry, its filename must not be in use in the folder
+ *
+ *  @returns 0 on success, 1 if the name is taken, parent is not a folder or
+ *           on failure
+ */
+int gdd_insert(uint64_t parent, struct gd_fs_entry_t* entry)
+{
+	struct gd_dir_t *dir = gdd_dir(parent);
+	int ret;
+
+	if(dir == NULL)
+		return 1;
+	pthread_mutex_lock(&dir->lock);
+	if(dir == &dirs.root)
+		ret = gd_fs_entry_insert(entry);
+	else
+		ret = gdd_taken(dir, entry->filename.str) || gd_fs_entry_add(entry, 0);
+	if(ret)
+	{
+		pthread_mutex_unlock(&dir->lock);
+		return 1;
+	}
+	entry->within = dir;
+	dir->used = gdd_now();
+	// Readers walk the list unlocked, entry must be complete before it is linked
+	__sync_synchronize();
+	if(dir->tail)
+		dir->tail->next = entry;
+	else
+		dir->children = entry;
+	dir->tail = entry;
+	pthread_mutex_unlock(&dir->lock);
+	gd_fs_entry_changed(dir->folder);
+
+	return 0;
+}
+
+/** Rename an entry within the folder it is in.
+ *
+ *  @entry    the entry to rename
+ *  @filename the new escaped name, which must not be in use in the folder
+ *
+ *  @returns 0 on success, 1 if the name is taken or on failure
+ */
+int gdd_rename(struct gd_fs_entry_t* entry, const char* filename)
+{
+	struct gd_dir_t *dir = entry->within;
+	int ret;
+
+	// The names in the root are those of the filename table
+	if(dir == NULL || dir == &dirs.root || dir == &dirs.found)
+		return gd_fs_entry_rename(entry, filename);
+
+	pthread_mutex_lock(&dir->lock);
+	ret = gdd_taken(dir, filename) || gd_fs_entry_retitle(entry, filename);
+	pthread_mutex_unlock(&dir->lock);
+	if(!ret)
+		gd_fs_entry_changed(dir->folder);
+	return ret;
+}
+
+/** Find the folder an entry is in.
+ *
+ *  The folder stays in memory for as long as the entry is pinned, see
+ *  gdd_pinned().
+ *
+ *  @entry the entry
+ *
+ *  @returns the folder, or NULL for the root or if the entry is in none
+ */
+struct gd_fs_entry_t* gdd_parent(const struct gd_fs_entry_t* entry)
+{
+	struct gd_dir_t *dir = entry->within;
+	return dir ? dir->folder : NULL;
+}
+
+/** Get the resourceID of the folder an entry is in, to create it there.
+ *
+ *  @entry the entry
+ *  @id    initialized to the resourceID, empty for the root
+ *
+ *  @returns 0 on success, -EAGAIN if the folder is not on the server yet
+ */
+int gdd_parent_id(const struct gd_fs_entry_t* entry, struct str_t* id)
+{
+	struct gd_fs_entry_t *folder = gdd_parent(entry);
+
+	str_init(id);
+	if(folder == NULL)
+		return 0;
+	pthread_mutex_lock(&folder->lock);
+	if(folder->resourceID.len)
+		str_char_concat(id, folder->resourceID.str, folder->resourceID.len);
+	pthread_mutex_unlock(&folder->lock);
+	return id->len ? 0 : -EAGAIN;
+}
+
+/** Keep an entry found by resourceID or by a search rather than in a folder.
+ *
+ *  It is in none of the folders listed so far, so it is kept apart from
+ *  them, and is never evicted.
+ *
+ *  @entry the entry, owned by this function
+ *
+ *  @returns the entry held for the file, which is entry unless one was held
+ *           already, or NULL on failure
+ */
+struct gd_fs_entry_t* gdd_adopt(struct gd_fs_entry_t* entry)
+{
+	struct gd_dir_t *dir = &dirs.found;
+	struct gd_fs_entry_t *held;
+
+	pthread_mutex_lock(&dir->lock);
+	held = gd_fs_entry_find_id(entry->resourceID.str, dir);
+	if(held == NULL && !gd_fs_entry_add(entry, 0))
+	{
+		entry->within = dir;
+		// Readers walk the list unlocked, entry must be complete before it
+		// is linked
+		__sync_synchronize();
+		if(dir->tail)
+			dir->tail->next = entry;
+		else
+			dir->children = entry;
+		dir->tail = entry;
+		held = entry;
+	}
+	pthread_mutex_unlock(&dir->lock);
+
+	if(held != entry)
+	{
+		gd_fs_entry_destroy(entry);
+		free(entry);
+	}
+	return held;
+}
+
+/** Check if a folder has nothing in it.
+ *
+ *  @folder the folder
+ *
+ *  @returns nonzero if it holds no entry that still exists, 0 if it does or
+ *           if it could not be listed
+ */
+int gdd_empty(struct gd_fs_entry_t* folder)
+{
+	struct gd_dir_t *dir = gdd_dir(folder->ino);
+	if(dir == NULL || gdd_refresh(dir))
+		return 0;
+
+	struct gd_fs_entry_t *entry;
+	pthread_mutex_lock(&dir->lock);
+	for(entry = dir->children; entry != NULL; entry = entry->next)
+		if(!entry->deleted)
+			break;
+	pthread_mutex_unlock(&dir->lock);
+
+	return entry == NULL;
+}
+
+/** Free an entry the sweeper evicted, with its folder contents if any.
+ *
+ *  Those contents must already be empty.
+ */
+static void gdd_free_entry(struct gd_fs_entry_t* entry)
+{
+	gd_fs_entry_drop(entry);
+	if(entry->dir)
+	{
+		gdd_free_dir(entry->dir);
+		free(entry->dir);
+	}
+	gd_fs_entry_destroy(entry);
+	free(entry);
+}
+
+/** Free the contents of the cold folders in and under dir.
+ *
+ *  A folder is cold once nothing has used it for dir_evict_secs. Its entries
+ *  are freed unless pinned, and a folder entry only once its own contents
+ *  are gone. Readers walk folder contents unlocked only while using them,
+ *  so a cold folder has none.
+ *
+ *  @dir the folder contents
+ *  @now the monotonic time in seconds
+ *
+ *  @returns nonzero if dir is cold and now empty
+ */
+static int gdd_evict(struct gd_dir_t* dir, time_t now)
+{
+	struct gd_fs_entry_t **link;
+	struct gd_fs_entry_t *entry;
+	struct gd_fs_entry_t *last = NULL;
+	int freed = 0;
+
+	pthread_mutex_lock(&dir->lock);
+	int cold = !dir->listing && now - dir->used >= dir_evict_secs;
+	link = &dir->children;
+	while((entry = *link) != NULL)
+	{
+		int empty = entry->dir ? gdd_evict(entry->dir, now) : 1;
+		if(cold && empty && !gdd_pinned(entry))
+		{
+			*link = entry->next;
+			// What was kept of the entry, see gde_resume(), is stale first
+			if(!freed)
+				gd_fs_entry_changed(dir->folder);
+			gdd_free_entry(entry);
+			freed = 1;
+			continue;
+		}
+		last = entry;
+		link = &entry->next;
+	}
+	dir->tail = last;
+	// What is left is listed again on next use
+	if(cold)
+		dir->expires = 0;
+	int empty = cold && dir->children == NULL;
+	pthread_mutex_unlock(&dir->lock);
+	// The entries after those freed moved up
+	if(freed)
+		gd_fs_entry_changed(dir->folder);
+
+	return empty;
+}
+
+/** The body of the sweeper thread, evicts cold folders every dir_sweep_secs.
+ */
+void* gdd_sweeper(void* arg)
+{
+	struct timespec due;
+
+	pthread_mutex_lock(&dirs.lock);
+	while(!dirs.stopping)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &due);
+		due.tv_sec += dir_sweep_secs;
+		pthread_cond_timedwait(&dirs.cond, &dirs.lock, &due);
+		if(dirs.stopping)
+			break;
+
+		pthread_mutex_unlock(&dirs.lock);
+		gdd_evict(&dirs.root, gdd_now());
+		pthread_mutex_lock(&dirs.lock);
+	}
+	pthread_mutex_unlock(&dirs.lock);
+
+	return NULL;
+}
@@ -0,0 +1,94 @@
+/*
+	fuse-google-drive: a fuse filesystem wrapper for Google Drive
+	Copyright (C) 2012  James Cline
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2 as
+ 	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef _GOOGLE_DRIVE_DIR_H
+#define _GOOGLE_DRIVE_DIR_H
+
+#include <pthread.h>
+#include <time.h>
+
+#include "gd_cache.h"
+#include "gd_interface.h"
+
+/** The contents of one folder in lazy mode.
+ *
+ *  Listed from the server the first time the folder is looked in, and again
+ *  once the listing is older than dir_ttl_secs. Once nothing has used the
+ *  folder for dir_evict_secs its entries are freed.
+ */
+struct gd_dir_t {
+	// Protects everything below
+	pthread_mutex_t lock;
+	// Signalled when a listing of the folder completes
+	pthread_cond_t cond;
+	// The folder these are the contents of, NULL for the root
+	struct gd_fs_entry_t *folder;
+	// The entries in the folder, linked by next. Readers walk the list
+	// without the lock, so it is only appended to while the folder is in use.
+	struct gd_fs_entry_t *children;
+	struct gd_fs_entry_t *tail;
+	// Set while a thread lists the folder, and the result of the last listing
+	int listing;
+	int result;
+	// Bumped by every listing, the entries it had get seen set to it
+	unsigned long generation;
+	// When the listing goes stale, 0 until listed, monotonic seconds
+	time_t expires;
+	// When the folder was last used, monotonic seconds
+	time_t used;
+};
+
+/** The state of lazy mode for this mount.
+ *
+ *  Nothing is listed at mount, each folder is listed when it is first used.
+ *  The root is the root folder on the server, and the names in it are kept
+ *  in the filename table so creating, renaming and removing entries there
+ *  works as in the full listing. Other folders are searched by walking their
+ *  contents, where entries are created, renamed and removed too. A sweeper thread frees the contents of
+ *  folders that have gone cold, so memory follows the working set.
+ */
+struct gdd_state_t {
+	struct gdi_state *gdi;
+	struct gd_dir_t root;
+	// Entries found by resourceID or by a search, in no folder listed yet
+	struct gd_dir_t found;
+
+	pthread_t sweeper;
+	int started;
+	// Protects stopping, and the dir of every folder until it is set
+	pthread_mutex_t lock;
+	// Signalled when the sweeper should stop
+	pthread_cond_t cond;
+	int stopping;
+};
+
+int gdd_init(struct gdi_state* state);
+void gdd_destroy();
+
+int gdd_list(uint64_t ino);
+struct gd_fs_entry_t* gdd_find(uint64_t parent, const char* name, int* missing);
+struct gd_fs_entry_t* gdd_next(uint64_t ino, struct gd_fs_entry_t* prev);
+int gdd_insert(uint64_t parent, struct gd_fs_entry_t* entry);
+int gdd_rename(struct gd_fs_entry_t* entry, const char* filename);
+struct gd_fs_entry_t* gdd_parent(const struct gd_fs_entry_t* entry);
+int gdd_parent_id(const struct gd_fs_entry_t* entry, struct str_t* id);
+struct gd_fs_entry_t* gdd_adopt(struct gd_fs_entry_t* entry);
+int gdd_empty(struct gd_fs_entry_t* folder);
+
+#endif
@@ -0,0 +1,357 @@
+/*
+	fuse-google-drive: a fuse filesystem wrapper for Google Drive
+	Copyright (C) 2012  James Cline
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2 as
+ 	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "gd_dirents.h"
+
+static struct gde_state_t dirents;
+
+// The first room made for the dirents of a folder, it doubles as they grow
+const size_t dirent_blob_bytes = 4096;
+const size_t dirent_blob_records = 128;
+
+
+/** Start the dirent cache, empty.
+ *
+ *  @returns 0 on success, 1 on failure
+ */
+int gde_init()
+{
+	memset(&dirents, 0, sizeof(struct gde_state_t));
+	if(pthread_mutex_init(&dirents.lock, NULL))
+		return 1;
+	return 0;
+}
+
+/** Drop every blob.
+ *
+ *  There are no replies being sent by now.
+ */
+void gde_destroy()
+{
+	size_t iter;
+	for(iter = 0; iter < GDE_DIRS; ++iter)
+		gde_put(dirents.dirs[iter].blob);
+	memset(dirents.dirs, 0, sizeof(dirents.dirs));
+	pthread_mutex_destroy(&dirents.lock);
+}
+
+/** Drop a reference to a blob, freeing it with the last one.
+ */
+void gde_put(struct gde_blob_t *blob)
+{
+	if(blob == NULL)
+		return;
+	if(__sync_sub_and_fetch(&blob->refs, 1))
+		return;
+
+	free(blob->data);
+	free(blob->records);
+	free(blob);
+}
+
+/** Find what is kept of a folder.
+ *
+ *  Must be called with dirents.lock held.
+ *
+ *  @ino    the inode number of the folder
+ *  @create if nonzero and the folder has nothing kept, the folder used least
+ *          recently is forgotten to make room for it
+ *
+ *  @returns what is kept of the folder, NULL if nothing is and create is 0
+ */
+static struct gde_dir_t* gde_dir(fuse_ino_t ino, int create)
+{
+	struct gde_dir_t *dir = NULL;
+	struct gde_dir_t *oldest = &dirents.dirs[0];
+	size_t iter;
+
+	for(iter = 0; iter < GDE_DIRS && dir == NULL; ++iter)
+	{
+		if(dirents.dirs[iter].ino == ino)
+			dir = &dirents.dirs[iter];
+		else if(dirents.dirs[iter].used < oldest->used)
+			oldest = &dirents.dirs[iter];
+	}
+
+	if(dir == NULL)
+	{
+		if(!create)
+			return NULL;
+		dir = oldest;
+		gde_put(dir->blob);
+		memset(dir, 0, sizeof(struct gde_dir_t));
+		dir->ino = ino;
+	}
+	dir->used = ++dirents.ticks;
+
+	return dir;
+}
+
+/** Add the dirent of one entry to the end of a blob being built.
+ *
+ *  @req      fuse_req_t          the request the blob is built for
+ *  @blob     struct gde_blob_t*  the blob
+ *  @reserved size_t*             the bytes allocated for data
+ *  @slots    size_t*             the records allocated
+ *  @name     const char*         the escaped filename
+ *  @ino      fuse_ino_t          the inode number of the entry
+ *  @mode     mode_t              S_IFDIR or S_IFREG
+ *  @position off_t               the position of the entry in the folder
+ *
+ *  @returns 0 on success, 1 on failure
+ */
+static int gde_append(fuse_req_t req, struct gde_blob_t *blob, size_t *reserved,
+		size_t *slots, const char *name, fuse_ino_t ino, mode_t mode,
+		off_t position)
+{
+	struct stat statbuf;
+	size_t length = fuse_add_direntry(req, NULL, 0, name, NULL, 0);
+
+	if(blob->length + length > *reserved)
+	{
+		size_t size = *reserved ? *reserved : dirent_blob_bytes;
+		while(blob->length + length > size)
+			size *= 2;
+		char *data = (char*) realloc(blob->data, size);
+		if(data == NULL)
+			return 1;
+		blob->data = data;
+		*reserved = size;
+	}
+	if(blob->count == *slots)
+	{
+		size_t count = *slots ? *slots * 2 : dirent_blob_records;
+		struct gde_record_t *records = (struct gde_record_t*)
+			realloc(blob->records, count * sizeof(struct gde_record_t));
+		if(records == NULL)
+			return 1;
+		blob->records = records;
+		*slots = count;
+	}
+
+	memset(&statbuf, 0, sizeof(struct stat));
+	statbuf.st_ino = ino;
+	statbuf.st_mode = mode;
+	fuse_add_direntry(req, blob->data + blob->length, length, name, &statbuf,
+			position + 1);
+
+	blob->records[blob->count].position = position;
+	blob->records[blob->count].at = blob->length;
+	++blob->count;
+	blob->length += length;
+	return 0;
+}
+
+/** Walk a folder into a new blob.
+ *
+ *  @generation gd_fs_entry_generation() of the folder from before the walk
+ *
+ *  @returns the blob holding one reference, or NULL on failure
+ */
+static struct gde_blob_t* gde_build(fuse_req_t req, struct gdi_state *state,
+		fuse_ino_t ino, unsigned long generation)
+{
+	struct gde_blob_t *blob;
+	struct gd_fs_entry_t *iter;
+	size_t reserved = 0;
+	size_t slots = 0;
+	off_t position = 2;
+
+	blob = (struct gde_blob_t*) malloc(sizeof(struct gde_blob_t));
+	if(blob == NULL)
+		return NULL;
+	memset(blob, 0, sizeof(struct gde_blob_t));
+	blob->generation = generation;
+	blob->refs = 1;
+
+	if(gde_append(req, blob, &reserved, &slots, ".", ino, S_IFDIR, 0)
+			|| gde_append(req, blob, &reserved, &slots, "..", FUSE_ROOT_ID,
+				S_IFDIR, 1))
+		goto build_fail;
+
+	// Deleted entries keep their position but are not listed
+	for(iter = gdi_next_child(state, ino, NULL); iter != NULL;
+			iter = gdi_next_child(state, ino, iter), ++position)
+	{
+		if(!iter->deleted && gde_append(req, blob, &reserved, &slots,
+					iter->filename.str, iter->ino,
+					iter->is_folder ? S_IFDIR : S_IFREG, position))
+			goto build_fail;
+	}
+
+	return blob;
+
+build_fail:
+	gde_put(blob);
+	return NULL;
+}
+
+/** Take a reference to the dirents of a folder.
+ *
+ *  The root is not cached until it has been listed in full, a walk of it
+ *  waits for just the entries it needs. If the listing failed part way the
+ *  root is never cached, it is walked every time.
+ *
+ *  @req     fuse_req_t        the readdir() request
+ *  @state   struct gdi_state* the state for this mount
+ *  @ino     fuse_ino_t        the inode number of the folder, which must be
+ *                             a folder and not a virtual one
+ *  @rebuild nonzero if a listing is starting, the folder is listed again if
+ *           stale and the blob rebuilt if the folder changed since it was
+ *           built. Otherwise the blob the listing started on is still used.
+ *
+ *  @returns the blob, or NULL if the folder has to be walked instead
+ */
+struct gde_blob_t* gde_get(fuse_req_t req, struct gdi_state *state,
+		fuse_ino_t ino, int rebuild)
+{
+	struct gde_blob_t *blob = NULL;
+	struct gde_blob_t *old = NULL;
+	struct gde_dir_t *dir;
+
+	if(ino == FUSE_ROOT_ID && (!state->listed || state->list_failed))
+		return NULL;
+	// In lazy mode this lists the folder again if it is due, as a walk would
+	if(rebuild)
+		gdi_next_child(state, ino, NULL);
+	unsigned long generation = gd_fs_entry_generation(ino);
+
+	pthread_mutex_lock(&dirents.lock);
+	dir = gde_dir(ino, 0);
+	if(dir && dir->blob && (!rebuild || dir->blob->generation == generation))
+	{
+		blob = dir->blob;
+		__sync_add_and_fetch(&blob->refs, 1);
+	}
+	pthread_mutex_unlock(&dirents.lock);
+	if(blob)
+		return blob;
+
+	// Built unlocked, in lazy mode the walk may have to list the folder
+	blob = gde_build(req, state, ino, generation);
+	if(blob == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&dirents.lock);
+	dir = gde_dir(ino, 1);
+	// Another reply may have built a newer one meanwhile
+	if(dir->blob == NULL || dir->blob->generation <= blob->generation)
+	{
+		old = dir->blob;
+		dir->blob = blob;
+		__sync_add_and_fetch(&blob->refs, 1);
+	}
+	pthread_mutex_unlock(&dirents.lock);
+	gde_put(old);
+
+	return blob;
+}
+
+/** Find the dirents of a readdir() reply.
+ *
+ *  @blob   the dirents of the folder
+ *  @offset the position of the first entry wanted
+ *  @size   the most bytes the reply may have
+ *  @data   set to where the reply starts
+ *
+ *  @returns the length of the reply, the most whole dirents fitting in size,
+ *           0 past the end
+ */
+size_t gde_slice(const struct gde_blob_t *blob, off_t offset, size_t size,
+		const char **data)
+{
+	size_t low = 0;
+	size_t high = blob->count;
+	size_t middle;
+
+	// The first dirent at or after offset
+	while(low < high)
+	{
+		middle = low + (high - low) / 2;
+		if(blob->records[middle].position < offset)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	*data = blob->data;
+	if(low == blob->count)
+		return 0;
+	size_t start = blob->records[low].at;
+	*data = blob->data + start;
+	if(blob->length - start <= size)
+		return blob->length - start;
+
+	// The first dirent after low not fitting, the reply ends where it starts
+	high = blob->count;
+	while(low < high)
+	{
+		middle = low + (high - low) / 2;
+		if(blob->records[middle].at - start <= size)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return blob->records[low - 1].at - start;
+}
+
+/** Find where the last walk of a folder stopped.
+ *
+ *  @ino      the inode number of the folder
+ *  @position the position the walk is to start from
+ *
+ *  @returns the entry at position, or NULL if the folder has to be walked
+ *           from its first entry
+ */
+struct gd_fs_entry_t* gde_resume(fuse_ino_t ino, off_t position)
+{
+	struct gd_fs_entry_t *entry = NULL;
+	unsigned long generation = gd_fs_entry_generation(ino);
+
+	pthread_mutex_lock(&dirents.lock);
+	struct gde_dir_t *dir = gde_dir(ino, 0);
+	if(dir && dir->entry && dir->position == position
+			&& dir->generation == generation)
+		entry = dir->entry;
+	pthread_mutex_unlock(&dirents.lock);
+
+	return entry;
+}
+
+/** Remember where a walk of a folder stopped, for gde_resume().
+ *
+ *  @ino        the inode number of the folder
+ *  @position   the position of entry
+ *  @entry      the entry the next walk starts from
+ *  @generation gd_fs_entry_generation() of the folder from before entry was walked to
+ */
+void gde_stopped(fuse_ino_t ino, off_t position, struct gd_fs_entry_t *entry,
+		unsigned long generation)
+{
+	pthread_mutex_lock(&dirents.lock);
+	struct gde_dir_t *dir = gde_dir(ino, 1);
+	dir->position = position;
+	dir->entry = entry;
+	dir->generation = generation;
+	pthread_mutex_unlock(&dirents.lock);
+}
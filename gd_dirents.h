@@ -0,0 +1,109 @@
+/*
+	fuse-google-drive: a fuse filesystem wrapper for Google Drive
+	Copyright (C) 2012  James Cline
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2 as
+ 	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef _GOOGLE_DRIVE_DIRENTS_H
+#define _GOOGLE_DRIVE_DIRENTS_H
+
+#define FUSE_USE_VERSION 34
+
+#include <fuse_lowlevel.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "gd_cache.h"
+#include "gd_interface.h"
+
+// Folders whose dirents are kept, the one used least recently makes room
+#define GDE_DIRS 32
+
+// Where one dirent of a blob starts, and the position in the folder of the
+// entry it is for
+struct gde_record_t {
+	off_t position;
+	size_t at;
+};
+
+/** The dirents of a folder, as readdir() replies them.
+ *
+ *  Every entry listed, "." and ".." first, in fuse_add_direntry() format and
+ *  back to back, each with the position after its own as the offset of the
+ *  next one. A reply is a run of them sent straight from here. Blobs are
+ *  never modified once built, a folder that changed gets a new one.
+ */
+struct gde_blob_t {
+	char *data;
+	size_t length;
+
+	// One per dirent, in order
+	struct gde_record_t *records;
+	size_t count;
+
+	// gd_fs_entry_generation() of the folder before it was walked
+	unsigned long generation;
+
+	// The cache holds one reference while the blob is its folder's, and
+	// each reply being sent holds one. Changed only with atomic operations.
+	unsigned long refs;
+};
+
+/** What is kept of one folder.
+ */
+struct gde_dir_t {
+	uint64_t ino;
+	struct gde_blob_t *blob;
+
+	// Where the last reply walking the folder stopped, the next one starts
+	// from entry if it asks for position and the generation is unchanged
+	off_t position;
+	struct gd_fs_entry_t *entry;
+	unsigned long generation;
+
+	// When it was last used, in ticks of the cache
+	unsigned long used;
+};
+
+/** The dirent cache for this mount.
+ *
+ *  Offsets given out by readdir() are positions in the folder, which stay
+ *  put as entries are added or deleted, so a blob built earlier still answers
+ *  a listing that started on it. Only a listing started from offset 0 builds
+ *  a new blob, and only if the folder changed since the last was built.
+ */
+struct gde_state_t {
+	struct gde_dir_t dirs[GDE_DIRS];
+	unsigned long ticks;
+	// Protects dirs and ticks, not the blobs, which are read without it
+	pthread_mutex_t lock;
+};
+
+int gde_init();
+void gde_destroy();
+
+struct gde_blob_t* gde_get(fuse_req_t req, struct gdi_state *state,
+		fuse_ino_t ino, int rebuild);
+void gde_put(struct gde_blob_t *blob);
+size_t gde_slice(const struct gde_blob_t *blob, off_t offset, size_t size,
+		const char **data);
+
+struct gd_fs_entry_t* gde_resume(fuse_ino_t ino, off_t position);
+void gde_stopped(fuse_ino_t ino, off_t position, struct gd_fs_entry_t *entry,
+		unsigned long generation);
+
+#endif
@@ -16,15 +16,24 @@
 	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 */
 
-#define FUSE_USE_VERSION 26
+#define FUSE_USE_VERSION 34
 #include <dirent.h>
 #include <errno.h>
-#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
 
 #include "gd_cache.h"
+#include "gd_dir.h"
+#include "gd_dirents.h"
 #include "gd_interface.h"
+#include "gd_journal.h"
+#include "gd_negative.h"
+#include "gd_virtual.h"
+#include "gd_writeback.h"
 #include "str.h"
 
 /**
@@ -38,76 +47,374 @@ struct gd_state {
 	struct gdi_state gdi_data;
 };
 
-/** Get file attributes.
+/** The options of this filesystem, given with -o.
+ *
+ *  lazy_listing: List folders as they are used rather than every file at
+ *  mount, see gd_dir.c.
+ */
+struct gd_options {
+	int lazy_listing;
+};
+
+static const struct fuse_opt gd_opts[] = {
+	{ "lazy_listing", offsetof(struct gd_options, lazy_listing), 1 },
+	FUSE_OPT_END
+};
+
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+#ifndef RENAME_EXCHANGE
+#define RENAME_EXCHANGE (1 << 1)
+#endif
+
+// How long the kernel may cache names and attributes we reply with
+const double entry_timeout = 10.0;
+const double attr_timeout = 10.0;
+// Largest read or write the kernel may send us in one request
+const unsigned max_request_size = 1024 * 1024;
+// Asynchronous requests (readahead, async direct I/O) the kernel may queue
+const unsigned max_background_requests = 64;
+
+/** Get the state for this mount from a request.
+ *
+ *  Also records req as the request this thread is handling, so requests to
+ *  the server made for it are cancelled if it is interrupted.
+ */
+struct gdi_state* gd_request_state(fuse_req_t req)
+{
+	gdi_set_request(req);
+	return &((struct gd_state*) fuse_req_userdata(req))->gdi_data;
+}
+
+/** Fill in the attributes of an entry, or of the root if entry is NULL.
  *
+ *  Entries keep their attributes ready, see gd_fs_entry_stat().
  */
-int gd_getattr (const char *path, struct stat *statbuf)
+void gd_fill_stat(fuse_req_t req, const struct gd_fs_entry_t *entry, struct stat *statbuf)
 {
-	struct fuse_context *fc = fuse_get_context();
+	const struct fuse_ctx *ctx = fuse_req_ctx(req);
 
-	if( strcmp("/", path) == 0)
+	if(entry == NULL)
 	{
+		memset(statbuf, 0, sizeof(struct stat));
+		statbuf->st_ino = FUSE_ROOT_ID;
 		statbuf->st_mode = S_IFDIR | 0700;
-		statbuf->st_nlink=2;
+		statbuf->st_nlink = 2;
 	}
 	else
 	{
-		memset(statbuf, 0, sizeof(struct stat));
-		const char *filename = gdi_strip_path(path);
-		struct gd_fs_entry_t * entry = gd_fs_entry_find(filename);
-		if(!entry)
-			return -ENOENT;
+		*statbuf = entry->attr;
+		statbuf->st_ino = entry->ino;
+	}
+	statbuf->st_uid = ctx->uid;
+	statbuf->st_gid = ctx->gid;
+}
+
+/** Fill in the reply to a lookup of an entry, taking a lookup reference.
+ */
+void gd_fill_entry_param(fuse_req_t req, struct gd_fs_entry_t *entry,
+		struct fuse_entry_param *param)
+{
+	memset(param, 0, sizeof(struct fuse_entry_param));
+	param->ino = entry->ino;
+	param->attr_timeout = attr_timeout;
+	param->entry_timeout = entry_timeout;
+	gd_fill_stat(req, entry, &param->attr);
+
+	__sync_add_and_fetch(&entry->nlookup, 1);
+}
+
+/** Fill in the reply to a lookup of a virtual folder, see gd_virtual.c.
+ *
+ *  They are never freed, so no lookup reference is taken.
+ */
+void gd_fill_virtual_param(fuse_req_t req, fuse_ino_t ino,
+		struct fuse_entry_param *param)
+{
+	memset(param, 0, sizeof(struct fuse_entry_param));
+	param->ino = ino;
+	param->attr_timeout = attr_timeout;
+	param->entry_timeout = entry_timeout;
+	gd_fill_stat(req, NULL, &param->attr);
+	param->attr.st_ino = ino;
+}
+
+/** Look up a directory entry by name and get its attributes.
+ *
+ *  Unless in lazy mode there is no hierarchy, every entry lives in the root.
+ *  Each successful lookup takes a reference the kernel gives back with
+ *  forget(). A name known not to exist is replied to with inode 0, which the
+ *  kernel caches as a negative entry until the name is added.
+ *
+ *  Names in /.by-id are resourceIDs, and are looked up without a listing.
+ *  Names in /.search are searched for on the server and names in /.find in
+ *  the filenames held, each is a folder of the files found.
+ */
+void gd_lookup (fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct fuse_entry_param param;
+	struct gd_fs_entry_t *entry;
+	int missing = 0;
+
+	struct gdi_state *state = gd_request_state(req);
+	fuse_ino_t virtual = gdv_find(parent, name);
+	if(virtual)
+	{
+		gd_fill_virtual_param(req, virtual, &param);
+		fuse_reply_entry(req, &param);
+		return;
+	}
 
+	if(parent == GDV_BY_ID_INO)
+		entry = gdi_find_id(state, name);
+	else if(parent == GDV_SEARCH_INO || parent == GDV_FIND_INO)
+		entry = gdv_search(parent, name);
+	else if(gdv_is_search(parent))
+		entry = gdv_search_find(parent, name);
+	else
+		entry = gdi_lookup(state, parent, name, &missing);
+	if(!entry)
+	{
+		if(!missing)
+		{
+			fuse_reply_err(req, ENOENT);
+			return;
+		}
+		memset(&param, 0, sizeof(struct fuse_entry_param));
+		param.entry_timeout = negative_timeout;
+		fuse_reply_entry(req, &param);
+		return;
+	}
+
+	gd_fill_entry_param(req, entry, &param);
+	if(fuse_reply_entry(req, &param))
+		__sync_sub_and_fetch(&entry->nlookup, 1);
+}
+
+/** Forget about an inode.
+ *
+ *  The kernel drops nlookup of the references taken by lookup().
+ */
+void gd_forget (fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+	struct gd_fs_entry_t *entry = gd_fs_entry_find_ino(ino);
+	if(entry)
+		__sync_sub_and_fetch(&entry->nlookup, nlookup);
+	fuse_reply_none(req);
+}
+
+/** Forget about many inodes at once.
+ *
+ */
+void gd_forget_multi (fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+	size_t iter;
+	for(iter = 0; iter < count; ++iter)
+	{
+		struct gd_fs_entry_t *entry = gd_fs_entry_find_ino(forgets[iter].ino);
 		if(entry)
-			statbuf->st_size = entry->size;
+			__sync_sub_and_fetch(&entry->nlookup, forgets[iter].nlookup);
+	}
+	fuse_reply_none(req);
+}
 
-		statbuf->st_mode = S_IFREG | 0600;
-		statbuf->st_nlink=1;
+/** Get file attributes.
+ *
+ */
+void gd_getattr (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fileinfo)
+{
+	struct stat statbuf;
+	struct gd_fs_entry_t *entry = NULL;
+
+	gd_request_state(req);
+	if(ino != FUSE_ROOT_ID && !gdv_is_folder(ino))
+	{
+		entry = gd_fs_entry_find_ino(ino);
+		if(!entry)
+		{
+			fuse_reply_err(req, ENOENT);
+			return;
+		}
 	}
-	statbuf->st_uid = fc->uid;
-	statbuf->st_gid = fc->gid;
 
-	return 0;
+	// Virtual folders look like the root
+	gd_fill_stat(req, entry, &statbuf);
+	statbuf.st_ino = ino;
+	fuse_reply_attr(req, &statbuf, attr_timeout);
 }
 
+/** Set file attributes.
+ *
+ *  Covers chmod, chown, truncate and utimens from the path based API.
+ *
+ *  chmod: Could this be used to share a document with others?
+ *  Perhaps o+r would make visible to all, o+rw would be editable by all?
+ *  I can't think of a way to do any sort of group level permissions sanely atm.
+ *
+ *  chown: Since this uses gid and uids, I cannot think of a way to easily use
+ *  this for Google Drive sharing purposes with specific users right now.
+ *  Perhaps some additional utility could be used to display a mapping of
+ *  uid/gids and Google Drive users you can share with?
+ *
+ *  Alternatively, these settings could be used for local access only, which
+ *  would let you make a file locally readable or modifiable by another system
+ *  user. This may violate the principle of least astonishment least.
+ */
+void gd_setattr (fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fileinfo)
+{
+	struct stat statbuf;
+	struct gd_fs_entry_t *entry = NULL;
+
+	gd_request_state(req);
+	if(ino != FUSE_ROOT_ID)
+	{
+		entry = gd_fs_entry_find_ino(ino);
+		if(!entry)
+		{
+			fuse_reply_err(req, ENOENT);
+			return;
+		}
+	}
+
+	// Only the size means anything to us yet. The rest is accepted and
+	// ignored, the write-back cache sets times on every write.
+	if(to_set & FUSE_SET_ATTR_SIZE)
+	{
+		if(entry == NULL)
+		{
+			fuse_reply_err(req, EISDIR);
+			return;
+		}
+		int ret = gdw_truncate(entry, attr->st_size);
+		if(ret)
+		{
+			fuse_reply_err(req, -ret);
+			return;
+		}
+	}
+
+	gd_fill_stat(req, entry, &statbuf);
+	fuse_reply_attr(req, &statbuf, attr_timeout);
+}
 /** Read the target of a symbolic link.
  *
  */
-int gd_readlink (const char *path, char *link, size_t size)
+void gd_readlink (fuse_req_t req, fuse_ino_t ino)
 {
-	return 0;
+	fuse_reply_err(req, ENOSYS);
 }
 
 /** Create a regular file.
  *
  */
-int gd_mknod (const char *path, mode_t mode, dev_t dev)
+void gd_mknod (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t dev)
 {
-	return 0;
+	fuse_reply_err(req, ENOSYS);
 }
 
 /** Create a directory.
  *
+ *  The folder is created on the server in the background, see gd_journal.c.
+ *  Like everything else it is listed in the root, except in lazy mode.
  */
-int gd_mkdir (const char *path, mode_t mode)
+void gd_mkdir (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
 {
-	return 0;
+	struct gdi_state *state = gd_request_state(req);
+	struct fuse_entry_param param;
+
+	if(parent != FUSE_ROOT_ID && !state->lazy_listing)
+	{
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	// The name may be on the server but not listed yet
+	if(gdv_find(parent, name) || gdi_lookup(state, parent, name, NULL))
+	{
+		fuse_reply_err(req, EEXIST);
+		return;
+	}
+
+	struct gd_fs_entry_t *entry = gdi_create(state, parent, name, 1);
+	if(!entry)
+	{
+		fuse_reply_err(req, gdi_lookup(state, parent, name, NULL) ? EEXIST : ENOMEM);
+		return;
+	}
+	if(gdj_mkdir(entry))
+	{
+		// Never recorded, so it must not be seen either
+		gd_fs_entry_remove(entry);
+		pthread_mutex_lock(&entry->lock);
+		entry->deleted = 1;
+		pthread_mutex_unlock(&entry->lock);
+		gd_fs_entry_changed(gdd_parent(entry));
+		fuse_reply_err(req, EIO);
+		return;
+	}
+
+	gd_fill_entry_param(req, entry, &param);
+	if(fuse_reply_entry(req, &param))
+		__sync_sub_and_fetch(&entry->nlookup, 1);
 }
 
 /** Remove a file.
  *
+ *  The name is gone at once, the file is moved to the trash on the server in
+ *  the background. Open handles keep working.
  */
-int gd_unlink (const char *path)
+void gd_unlink (fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-	return 0;
+	struct gdi_state *state = gd_request_state(req);
+
+	// Only the root has entries unless in lazy mode
+	struct gd_fs_entry_t *entry = gdi_lookup(state, parent, name, NULL);
+	if(!entry)
+	{
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	if(entry->is_folder)
+	{
+		fuse_reply_err(req, EISDIR);
+		return;
+	}
+
+	fuse_reply_err(req, -gdj_delete(entry));
 }
 
 /** Remove a directory.
  *
+ *  Only folders nothing is filed under can be removed.
  */
-int gd_rmdir (const char *path)
+void gd_rmdir (fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-	return 0;
+	struct gdi_state *state = gd_request_state(req);
+	if(gdv_find(parent, name))
+	{
+		fuse_reply_err(req, EBUSY);
+		return;
+	}
+
+	// Only the root has entries unless in lazy mode
+	struct gd_fs_entry_t *entry = gdi_lookup(state, parent, name, NULL);
+	if(!entry)
+	{
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	if(!entry->is_folder)
+	{
+		fuse_reply_err(req, ENOTDIR);
+		return;
+	}
+	if(!gdi_folder_empty(state, entry))
+	{
+		fuse_reply_err(req, ENOTEMPTY);
+		return;
+	}
+
+	fuse_reply_err(req, -gdj_delete(entry));
 }
 
 /** Create a symbolic link.
@@ -116,17 +423,74 @@ int gd_rmdir (const char *path)
  *  We could allow this for a specific session, but it would be lost
  *  after an unmount.
  */
-int gd_symlink (const char *path, const char *link)
+void gd_symlink (fuse_req_t req, const char *link, fuse_ino_t parent, const char *name)
 {
-	return 0;
+	fuse_reply_err(req, ENOSYS);
 }
 
 /** Rename a file.
  *
+ *  The rename is sent to the server in the background, see gd_journal.c. An
+ *  entry already under the new name is removed first, as rename(2) replaces
+ *  it. RENAME_EXCHANGE is not supported, nor is moving an entry to another
+ *  folder, which mv(1) does by copying instead.
  */
-int gd_rename (const char *path, const char *newpath)
+void gd_rename (fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname, unsigned int flags)
 {
-	return 0;
+	struct gdi_state *state = gd_request_state(req);
+	if(parent != newparent)
+	{
+		fuse_reply_err(req, state->lazy_listing ? EXDEV : ENOENT);
+		return;
+	}
+	if(flags & ~RENAME_NOREPLACE)
+	{
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+	if(gdv_find(parent, name) || gdv_find(newparent, newname))
+	{
+		fuse_reply_err(req, EBUSY);
+		return;
+	}
+
+	// Only the root has entries unless in lazy mode
+	struct gd_fs_entry_t *entry = gdi_lookup(state, parent, name, NULL);
+	if(!entry)
+	{
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	struct gd_fs_entry_t *target = gdi_lookup(state, newparent, newname, NULL);
+	if(target == entry)
+	{
+		fuse_reply_err(req, 0);
+		return;
+	}
+	if(target)
+	{
+		int err = 0;
+		if(flags & RENAME_NOREPLACE)
+			err = EEXIST;
+		else if(target->is_folder && !entry->is_folder)
+			err = EISDIR;
+		else if(!target->is_folder && entry->is_folder)
+			err = ENOTDIR;
+		else if(target->is_folder && !gdi_folder_empty(state, target))
+			err = ENOTEMPTY;
+		if(err)
+		{
+			fuse_reply_err(req, err);
+			return;
+		}
+	}
+
+	// A target is only deleted if the rename is made too
+	int ret = target ? gdj_replace(entry, target, newname) : gdj_rename(entry, newname);
+	if(!ret)
+		gdn_added(newparent, newname, 0);
+	fuse_reply_err(req, -ret);
 }
 
 /** Create a hard link to a file.
@@ -135,56 +499,54 @@ int gd_rename (const char *path, const char *newpath)
  *  We could allow this for a specific session, but it would be lost
  *  after an unmount.
  */
-int gd_link (const char *path, const char *newpath)
+void gd_link (fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname)
 {
-	return 0;
+	fuse_reply_err(req, ENOSYS);
 }
 
-/** Change the permission bits of a file.
+/** Open a handle on an entry and reply to an open() or create().
  *
- *  Could this be used to share a document with others?
- *  Perhaps o+r would make visible to all, o+rw would be editable by all?
- *  I can't think of a way to do any sort of group level permissions sanely atm.
+ *  The handle pins the version current right now, it keeps reading it even
+ *  if the entry is refreshed before it is released.
  *
- *  Alternatively, these permission settings could be used for local acces only,
- *  which would let you make a file locally readable or modifiable by another
- *  system user. This may violate the principle of least astonishment least.
+ *  @param struct fuse_entry_param* the reply to a create(), NULL for an open()
  */
-int gd_chmod (const char *path, mode_t mode)
+void gd_open_reply(fuse_req_t req, struct gdi_state *state,
+		struct gd_fs_entry_t *entry, struct fuse_file_info *fileinfo,
+		int writable, struct fuse_entry_param *param)
 {
-	return 0;
-}
-
-/** Change the owner and group of a file.
- *
- *  Since this uses gid and uids, I cannot think of a way to easily use this for
- *  Google Drive sharing purposes with specific users right now.
- *  Perhaps some additional utility could be used to display a mapping of
- *  uid/gids and Google Drive users you can share with?
- *
- *  Alternatively, these uid/gid settings could be used for local acces only,
- *  which would let you make a file locally readable or modifiable by another
- *  system user. This may violate the principle of least astonishment least.
- */
-int gd_chown (const char *path, uid_t uid, gid_t gid)
-{
-	return 0;
-}
+	struct gd_handle_t *handle = gdi_handle_open(state, entry);
+	if(!handle)
+	{
+		if(writable)
+			gdw_release(entry);
+		if(param)
+			__sync_sub_and_fetch(&entry->nlookup, 1);
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	handle->writable = writable;
+	fileinfo->fh = (uint64_t) (uintptr_t) handle;
 
-/** Change the size of a file.
- *
- */
-int gd_truncate (const char *path, off_t newsize)
-{
-	return 0;
+	int ret = param ? fuse_reply_create(req, param, fileinfo)
+		: fuse_reply_open(req, fileinfo);
+	if(ret)
+	{
+		if(writable)
+			gdw_release(entry);
+		if(param)
+			__sync_sub_and_fetch(&entry->nlookup, 1);
+		gdi_handle_release(handle);
+	}
 }
 
 /** File open operation.
  *
+ *  Opening for writing stages the file locally, see gdw_open().
  */
-int gd_open (const char *path, struct fuse_file_info * fileinfo)
+void gd_open (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * fileinfo)
 {
-	struct gdi_state *state = &((struct gd_state*)fuse_get_context()->private_data)->gdi_data;
+	struct gdi_state *state = gd_request_state(req);
 
 	int flags = fileinfo->flags;
 	/*
@@ -194,25 +556,8 @@ int gd_open (const char *path, struct fuse_file_info * fileinfo)
 		all?
 		Maybe something in the Access Control Lists allows this?
 	*/
-	if(flags & O_RDONLY)
-	{
-
-	}
 
-	// TODO: everything below here
-	// NOTE: O_RDWR won't work, just O_RDONLY
-	// people can share read only files with you
-	if(flags & O_WRONLY)
-	{
-
-	}
-
-	if(flags & O_RDWR)
-	{
-
-	}
-
-	// Don't need to check O_CREAT, O_EXCL, O_TRUNC
+	// Don't need to check O_CREAT, O_EXCL
 	// Do we need to check all these?
 	/* Comment these out for now to reduce user headacke
 	if(flags & O_APPEND);
@@ -229,302 +574,813 @@ int gd_open (const char *path, struct fuse_file_info * fileinfo)
 
 	// If we have access to this file, then load it. 
 	// TODO: Make gdi_load() nonblocking if appropriate
-	const char* filename = gdi_strip_path(path);
-	struct gd_fs_entry_t *entry = gd_fs_entry_find(filename);
-	int load = gdi_load(state, entry);
-	if(load)
-		return -1;
+	struct gd_fs_entry_t *entry = gd_fs_entry_find_ino(ino);
+	if(!entry)
+	{
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	if(entry->is_folder)
+	{
+		fuse_reply_err(req, EISDIR);
+		return;
+	}
+	int writable = (flags & O_ACCMODE) != O_RDONLY;
+	if(writable)
+	{
+		// Writers work on a local staging copy, which is uploaded once the
+		// last of them is released
+		int ret = gdw_open(entry, flags & O_TRUNC);
+		if(ret)
+		{
+			fuse_reply_err(req, -ret);
+			return;
+		}
+	}
+	else if(gdi_load(state, entry))
+	{
+		fuse_reply_err(req, gdi_interrupted() ? EINTR : EIO);
+		return;
+	}
 
-	return 0;
+	gd_open_reply(req, state, entry, fileinfo, writable, NULL);
 }
 
 /** Read data from an open file.
  *
+ *  Reads of a pinned version are replied to straight from its buffer.
  */
-int gd_read (const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fileinfo)
+void gd_read (fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fileinfo)
 {
-	struct gdi_state *state = &((struct gd_state*)fuse_get_context()->private_data)->gdi_data;
-	const char* filename = gdi_strip_path(path);
-	struct gd_fs_entry_t *entry = gd_fs_entry_find(filename);
-	if(!entry)
-		return 0;
+	struct gd_handle_t *handle = (struct gd_handle_t*) (uintptr_t) fileinfo->fh;
+	const char *chunk;
 	size_t length = size;
-	const char const* chunk = gdi_read(&length, entry, offset);
-	memcpy(buf, chunk, length);
-	return length;
+
+	if(gdi_handle_peek(handle, &chunk, &length, offset))
+	{
+		// The version is immutable while pinned, so the reply is sent from
+		// its buffer without copying it into one of our own. The buffer is
+		// heap memory, libfuse still copies it to the kernel.
+		struct fuse_bufvec bufvec = FUSE_BUFVEC_INIT(length);
+		bufvec.buf[0].mem = (void*) chunk;
+		fuse_reply_data(req, &bufvec, 0);
+		return;
+	}
+
+	gd_request_state(req);
+
+	char *buf = (char*) malloc(size);
+	if(buf == NULL)
+	{
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	int ret = gdi_handle_read(handle, buf, size, offset);
+	if(ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_buf(req, buf, ret);
+	free(buf);
 }
 
 /** Write data to an open file.
  *
+ *  Returns once the data is in the staging file, small writes are coalesced
+ *  there and reach the server as one upload.
  */
-int gd_write (const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fileinfo)
+void gd_write (fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t offset, struct fuse_file_info *fileinfo)
 {
-	return 0;
+	struct gd_handle_t *handle = (struct gd_handle_t*) (uintptr_t) fileinfo->fh;
+
+	gd_request_state(req);
+	if(!handle->writable)
+	{
+		fuse_reply_err(req, EBADF);
+		return;
+	}
+
+	int ret = gdw_write(handle->entry, buf, size, offset);
+	if(ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_write(req, ret);
 }
 
 /** Get file system statistics.
  *
  */
-int gd_statfs (const char *path, struct statvfs *statv)
+void gd_statfs (fuse_req_t req, fuse_ino_t ino)
 {
-	return 0;
+	fuse_reply_err(req, ENOSYS);
 }
 
 /** Possibly flush cached data.
  *
+ *  Called on every close(). Nothing is uploaded here, so closing a file is as
+ *  fast as closing a local one, the upload starts after release().
  */
-int gd_flush (const char *path, struct fuse_file_info *fileinfo)
+void gd_flush (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fileinfo)
 {
-	return 0;
+	fuse_reply_err(req, 0);
 }
 
 /** Release an open file.
  *
+ *  Releasing a handle that wrote queues the file for upload in the background.
  */
-int gd_release (const char *path, struct fuse_file_info *fileinfo)
+void gd_release (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fileinfo)
 {
-	return 0;
+	struct gd_handle_t *handle = (struct gd_handle_t*) (uintptr_t) fileinfo->fh;
+
+	if(handle->writable)
+		gdw_release(handle->entry);
+	gdi_handle_release(handle);
+	fileinfo->fh = 0;
+	fuse_reply_err(req, 0);
 }
 
 /** Synchronize file contents.
  *
+ *  Uploads the file now and waits for the server to have it.
  */
-int gd_fsync (const char *path, int datasync, struct fuse_file_info *fileinfo)
+void gd_fsync (fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fileinfo)
 {
-	return 0;
+	struct gd_handle_t *handle = (struct gd_handle_t*) (uintptr_t) fileinfo->fh;
+
+	gd_request_state(req);
+	fuse_reply_err(req, -gdw_sync(handle->entry));
 }
 
 /** Set extended attributes.
  *
  *  Does this mean anything for Google Drive?
  */
-int gd_setxattr (const char *path, const char *name, const char *value, size_t size, int flags)
+void gd_setxattr (fuse_req_t req, fuse_ino_t ino, const char *name, const char *value, size_t size, int flags)
 {
-	return 0;
+	fuse_reply_err(req, ENOSYS);
+}
+
+// The extended attributes of an entry, in the order listxattr() gives them.
+// They are answered from what the listing told us, without asking the server.
+static const char* const gd_xattr_names[] = {
+	"user.md5",
+	"user.id",
+	"user.revision",
+	"user.owner",
+};
+#define GD_XATTR_COUNT (sizeof(gd_xattr_names) / sizeof(gd_xattr_names[0]))
+
+/** Copy the value of one of the extended attributes of an entry.
+ *
+ *  @entry struct gd_fs_entry_t* the entry
+ *  @which size_t                the index of the name in gd_xattr_names
+ *  @value struct str_t*         set to the value, empty if there is none
+ *
+ *  @returns 0 on success, -ENOMEM on failure
+ */
+static int gd_xattr_value(struct gd_fs_entry_t *entry, size_t which, struct str_t *value)
+{
+	const struct str_t *field;
+	int ret = 0;
+
+	str_init(value);
+	// Uploads and copies swap these under the lock
+	pthread_mutex_lock(&entry->lock);
+	switch(which)
+	{
+		// Until the upload replaces it, the md5 is of the server's old bytes
+		case 0: field = (entry->md5set
+				&& entry->write_generation == entry->upload_generation)
+			? &entry->md5 : NULL; break;
+		case 1: field = &entry->resourceID; break;
+		case 2: field = &entry->revision; break;
+		default: field = &entry->author_email; break;
+	}
+	if(field && field->len && str_char_concat(value, field->str, field->len))
+		ret = -ENOMEM;
+	pthread_mutex_unlock(&entry->lock);
+
+	return ret;
+}
+
+/** Reply with a buffer to getxattr() or listxattr(), or with its size.
+ */
+static void gd_reply_xattr(fuse_req_t req, const char *buf, size_t len, size_t size)
+{
+	if(size == 0)
+		fuse_reply_xattr(req, len);
+	else if(size < len)
+		fuse_reply_err(req, ERANGE);
+	else
+		fuse_reply_buf(req, buf, len);
 }
 
 /** Get extended attributes.
  *
- *  Does this mean anything for Google Drive?
+ *  Entries have the server's md5 checksum, resourceID, version and owner as
+ *  user.md5, user.id, user.revision and user.owner, where known. An entry
+ *  with writes not uploaded yet has no user.md5.
  */
-int gd_getxattr (const char *path, const char *name, char *value, size_t size)
+void gd_getxattr (fuse_req_t req, fuse_ino_t ino, const char *name, size_t size)
 {
-	return 0;
+	struct gd_fs_entry_t *entry = NULL;
+	struct str_t value;
+	size_t which;
+
+	if(ino != FUSE_ROOT_ID && !gdv_is_folder(ino))
+		entry = gd_fs_entry_find_ino(ino);
+	for(which = 0; which < GD_XATTR_COUNT; ++which)
+		if(strcmp(name, gd_xattr_names[which]) == 0)
+			break;
+	if(entry == NULL || which == GD_XATTR_COUNT)
+	{
+		fuse_reply_err(req, (entry || ino == FUSE_ROOT_ID || gdv_is_folder(ino))
+				? ENODATA : ENOENT);
+		return;
+	}
+
+	int ret = gd_xattr_value(entry, which, &value);
+	if(ret)
+		fuse_reply_err(req, -ret);
+	else if(!value.len)
+		fuse_reply_err(req, ENODATA);
+	else
+		gd_reply_xattr(req, value.str, value.len, size);
+	str_destroy(&value);
 }
 
 /** List extended attributes.
  *
- *  Does this mean anything for Google Drive?
+ *  Only the attributes an entry has a value for are listed.
  */
-int gd_listxattr (const char *path, char *list, size_t size)
+void gd_listxattr (fuse_req_t req, fuse_ino_t ino, size_t size)
 {
-	return 0;
+	struct gd_fs_entry_t *entry = NULL;
+	struct str_t names;
+	struct str_t value;
+	size_t which;
+	int ret = 0;
+
+	if(ino != FUSE_ROOT_ID && !gdv_is_folder(ino))
+	{
+		entry = gd_fs_entry_find_ino(ino);
+		if(entry == NULL)
+		{
+			fuse_reply_err(req, ENOENT);
+			return;
+		}
+	}
+
+	str_init(&names);
+	for(which = 0; entry && !ret && which < GD_XATTR_COUNT; ++which)
+	{
+		ret = gd_xattr_value(entry, which, &value);
+		// Each name is followed by its NUL
+		if(!ret && value.len && str_char_concat(&names, gd_xattr_names[which],
+					strlen(gd_xattr_names[which]) + 1))
+			ret = -ENOMEM;
+		str_destroy(&value);
+	}
+
+	if(ret)
+		fuse_reply_err(req, -ret);
+	else
+		gd_reply_xattr(req, names.str, names.len, size);
+	str_destroy(&names);
 }
 
 /** Remove extended attributes.
  *
  *  Does this mean anything for Google Drive?
  */
-int gd_removexattr (const char *path, const char *name)
+void gd_removexattr (fuse_req_t req, fuse_ino_t ino, const char *name)
 {
-	return 0;
+	fuse_reply_err(req, ENOSYS);
 }
 
 /** Open a directory.
  *
  */
-int gd_opendir (const char *path, struct fuse_file_info *fileinfo)
+void gd_opendir (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fileinfo)
 {
-	return 0;
+	fuse_reply_err(req, ENOSYS);
 }
 
-/** Read directory.
+/** Add one directory entry to a readdir() reply buffer.
  *
+ *  @returns 0 if it fit, 1 if the buffer is full
  */
-int gd_readdir (const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fileinfo)
+int gd_add_direntry(fuse_req_t req, char *buf, size_t size, size_t *used,
+		const char *name, fuse_ino_t ino, mode_t mode, off_t next)
 {
-
-	filler(buf, ".", NULL, 0);
-	filler(buf, "..", NULL, 0);
-	struct gdi_state *state = &((struct gd_state*)fuse_get_context()->private_data)->gdi_data;
-
-	struct gd_fs_entry_t *iter = state->head;
-	while(iter != NULL)
-	{
-
-		if(filler(buf, iter->filename.str, NULL, 0))
-		{
-			fprintf(stderr, "readdir() filler()\n");
-			return -ENOMEM;
-		}
-		iter = iter->next;
-	}
-
+	struct stat statbuf;
+	memset(&statbuf, 0, sizeof(struct stat));
+	statbuf.st_ino = ino;
+	statbuf.st_mode = mode;
+
+	size_t length = fuse_add_direntry(req, buf + *used, size - *used, name, &statbuf, next);
+	if(length > size - *used)
+		return 1;
+	*used += length;
 	return 0;
 }
 
-/** Release directory.
+/** Add one directory entry with its attributes to a readdirplus() reply.
+ *
+ *  A lookup reference is taken only if the entry fit.
  *
+ *  @returns 0 if it fit, 1 if the buffer is full
  */
-int gd_releasedir (const char *path, struct fuse_file_info *fileinfo)
+int gd_add_direntry_plus(fuse_req_t req, char *buf, size_t size, size_t *used,
+		struct gd_fs_entry_t *entry, off_t next)
 {
+	struct fuse_entry_param param;
+	gd_fill_entry_param(req, entry, &param);
+
+	size_t length = fuse_add_direntry_plus(req, buf + *used, size - *used,
+			entry->filename.str, &param, next);
+	if(length > size - *used)
+	{
+		__sync_sub_and_fetch(&entry->nlookup, 1);
+		return 1;
+	}
+	*used += length;
 	return 0;
 }
 
-/** Synchronize directory contents.
+/** Add one entry of a folder to a readdir() or readdirplus() reply.
  *
+ *  @returns 0 if it fit, 1 if the buffer is full
  */
-int gd_fsyncdir (const char *path, int datasync, struct fuse_file_info *fileinfo)
+int gd_add_child(fuse_req_t req, char *buf, size_t size, size_t *used,
+		struct gd_fs_entry_t *entry, off_t next, int plus)
 {
-	return 0;
+	if(plus)
+		return gd_add_direntry_plus(req, buf, size, used, entry, next);
+	return gd_add_direntry(req, buf, size, used, entry->filename.str,
+			entry->ino, entry->is_folder ? S_IFDIR : S_IFREG, next);
 }
 
-/** Initialize filesystem
+/** Read directory, with or without attributes.
  *
+ *  The offset of an entry is its position in the listing, "." and ".." take
+ *  the first two. Each reply starts where the previous one stopped. Deleted
+ *  entries keep their position but are not listed.
+ *
+ *  Without plus the reply is cut from the dirents of the folder, built once
+ *  per change to the folder, see gd_dirents.h. With plus, or while the root
+ *  is still being listed, the folder is walked, from where the last reply
+ *  stopped if it was the one before this.
+ *
+ *  Folders other than the root only have "." and ".." unless in lazy mode.
+ *  The folder of a search has the files found, which are searched for again
+ *  when it is read from the start and the results are stale.
+ *
+ *  With plus set every entry returned counts as a lookup, so the kernel can
+ *  populate its dentry and attribute caches without a lookup() per name.
  */
-void *gd_init (struct fuse_conn_info *conn)
+void gd_readdir_common (fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, int plus)
 {
-	return ((struct gd_state *) fuse_get_context()->private_data);
+	struct gdi_state *state = gd_request_state(req);
+	struct gd_fs_entry_t **results = NULL;
+	size_t count = 0;
+	int search = 0;
+
+	int virtual = gdv_is_folder(ino);
+	if(ino != FUSE_ROOT_ID && !virtual && (search = gdv_is_search(ino)))
+	{
+		int ret = gdv_search_results(ino, offset == 0, &results, &count);
+		if(ret)
+		{
+			fuse_reply_err(req, -ret);
+			return;
+		}
+	}
+	else if(ino != FUSE_ROOT_ID && !virtual)
+	{
+		struct gd_fs_entry_t *folder = gd_fs_entry_find_ino(ino);
+		if(!folder || !folder->is_folder)
+		{
+			fuse_reply_err(req, folder ? ENOTDIR : ENOENT);
+			return;
+		}
+	}
+
+	if(!search && !virtual && !plus)
+	{
+		struct gde_blob_t *blob = gde_get(req, state, ino, offset == 0);
+		if(blob)
+		{
+			const char *data;
+			size_t length = gde_slice(blob, offset, size, &data);
+			fuse_reply_buf(req, data, length);
+			gde_put(blob);
+			return;
+		}
+	}
+
+	char *buf = (char*) malloc(size);
+	if(buf == NULL)
+	{
+		free(results);
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	size_t used = 0;
+	off_t index = offset;
+	int full = 0;
+
+	if(index == 0 && !(full = gd_add_direntry(req, buf, size, &used, ".",
+					ino, S_IFDIR, index + 1)))
+		++index;
+	if(index == 1 && !full && !(full = gd_add_direntry(req, buf, size, &used, "..",
+					FUSE_ROOT_ID, S_IFDIR, index + 1)))
+		++index;
+
+	off_t position = 2;
+	if(search)
+	{
+		for(; position - 2 < (off_t) count && !full; ++position)
+		{
+			if(position < index)
+				continue;
+			if(!results[position - 2]->deleted)
+				full = gd_add_child(req, buf, size, &used, results[position - 2],
+						index + 1, plus);
+			if(!full)
+				++index;
+		}
+		free(results);
+		fuse_reply_buf(req, buf, used);
+		free(buf);
+		return;
+	}
+
+	// Waits for the listing where it has not got to yet. The virtual folders
+	// are not listed, their names are only looked up.
+	unsigned long generation = gd_fs_entry_generation(ino);
+	struct gd_fs_entry_t *iter = NULL;
+	if(!virtual && index > position && (iter = gde_resume(ino, index)) != NULL)
+		position = index;
+	else if(!virtual)
+		iter = gdi_next_child(state, ino, NULL);
+	for(; iter != NULL && position < index; iter = gdi_next_child(state, ino, iter))
+		++position;
+	while(iter != NULL && !full)
+	{
+		if(!iter->deleted)
+			full = gd_add_child(req, buf, size, &used, iter, index + 1, plus);
+		if(!full)
+		{
+			++index;
+			iter = gdi_next_child(state, ino, iter);
+		}
+	}
+	if(iter != NULL)
+		gde_stopped(ino, index, iter, generation);
+
+	fuse_reply_buf(req, buf, used);
+	free(buf);
 }
 
-/** Clean up filesystem
+/** Read directory.
  *
- *  Automatically called by fuse on filesystem exit (unmount).
  */
-void gd_destroy (void *userdata)
+void gd_readdir (fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fileinfo)
 {
+	gd_readdir_common(req, ino, size, offset, 0);
 }
 
-/** Check file access permission.
+/** Read directory with attributes.
  *
  */
-int gd_access (const char *path, int mask)
+void gd_readdirplus (fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fileinfo)
 {
-	return 0;
+	gd_readdir_common(req, ino, size, offset, 1);
 }
 
-/** Create and open a file.
+/** Release directory.
  *
  */
-int gd_create (const char *path, mode_t mode, struct fuse_file_info *fileinfo)
+void gd_releasedir (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fileinfo)
 {
-	return 0;
+	fuse_reply_err(req, 0);
 }
 
-/** Change the size of an open file.
+/** Synchronize directory contents.
  *
  */
-int gd_ftruncate (const char *path, off_t offset, struct fuse_file_info *fileinfo)
+void gd_fsyncdir (fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fileinfo)
 {
-	return 0;
+	fuse_reply_err(req, ENOSYS);
 }
 
-/** Get attributes from an open file.
+/** Initialize filesystem
  *
+ *  Negotiate the kernel features that matter for large sequential I/O and
+ *  big directories, each only if the kernel offers it. With the write-back
+ *  cache the kernel gathers small writes into large ones before sending them.
  */
-int gd_fgetattr (const char *path, struct stat *statbuf, struct fuse_file_info *fileinfo)
+void gd_init (void *userdata, struct fuse_conn_info *conn)
 {
-	return 0;
+	unsigned wanted = FUSE_CAP_ASYNC_READ | FUSE_CAP_ASYNC_DIO |
+		FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_READ |
+		FUSE_CAP_READDIRPLUS | FUSE_CAP_READDIRPLUS_AUTO |
+		FUSE_CAP_PARALLEL_DIROPS | FUSE_CAP_ATOMIC_O_TRUNC |
+		FUSE_CAP_WRITEBACK_CACHE;
+	conn->want |= conn->capable & wanted;
+
+	// Let the kernel send as much per request as it is able to
+	conn->max_write = max_request_size;
+	conn->max_readahead = max_request_size;
+	conn->max_background = max_background_requests;
+	conn->congestion_threshold = max_background_requests * 3 / 4;
 }
 
-/** Perform POSIX file locking operation.
+/** Clean up filesystem
  *
- *  Does this make any sense for Google Drive?
+ *  Automatically called by fuse on filesystem exit (unmount).
  */
-int gd_lock (const char *path, struct fuse_file_info *fileinfo, int cmd, struct flock *lock)
+void gd_destroy (void *userdata)
 {
-	return 0;
 }
 
-/** Change the access and modification times of a file with nanosecond
- *  resoluton.
+/** Check file access permission.
  *
- *  Does this make any sense for Google Drive?
  */
-int gd_utimens (const char *path, const struct timespec tv[2])
+void gd_access (fuse_req_t req, fuse_ino_t ino, int mask)
 {
-	return 0;
+	fuse_reply_err(req, ENOSYS);
 }
 
-/** Ioctl
+/** Copy a range of data from one open file to another.
  *
- *  Does this make any sense for Google Drive?
+ *  Whole-file copies to a file that does not exist on the server yet are done
+ *  with Drive's server side copy, no data passes through us. Anything else is
+ *  refused so the caller falls back to reading and writing, and so are
+ *  sources with writes the server may not have and destinations that another
+ *  handle writes to or that are being uploaded.
  */
-int gd_ioctl (const char *path, int cmd, void *arg, struct fuse_file_info *fileinfo, unsigned int flags, void *data)
+void gd_copy_file_range (fuse_req_t req, fuse_ino_t ino_in, off_t off_in, struct fuse_file_info *fi_in, fuse_ino_t ino_out, off_t off_out, struct fuse_file_info *fi_out, size_t len, int flags)
 {
-	return 0;
+	struct gdi_state *state = gd_request_state(req);
+	struct gd_handle_t *in = (struct gd_handle_t*) (uintptr_t) fi_in->fh;
+	struct gd_handle_t *out = (struct gd_handle_t*) (uintptr_t) fi_out->fh;
+
+	// Only the server knows the bytes of a copy of a Google document, which
+	// may differ from the size reported for the original
+	if(off_in != 0 || off_out != 0 || len < in->entry->size || !in->entry->md5set
+			|| out->entry->resourceID.len || out->entry->size
+			|| gdw_pending(in->entry) || gdw_writers(out->entry) > 1
+			|| gdw_busy(out->entry))
+	{
+		fuse_reply_err(req, EOPNOTSUPP);
+		return;
+	}
+
+	int ret = gdi_copy(state, in->entry, out->entry);
+	if(ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_write(req, out->entry->size);
 }
 
-/** Poll for IO readiness events.
+/** Create and open a file.
  *
+ *  The file exists only locally until its first upload, which happens once
+ *  it is released or synced.
  */
-int gd_poll (const char *path, struct fuse_file_info *fileinfo, struct fuse_pollhandle *ph, unsigned *reventsp)
+void gd_create (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fileinfo)
 {
-	return 0;
+	struct gdi_state *state = gd_request_state(req);
+	struct fuse_entry_param param;
+
+	if(parent != FUSE_ROOT_ID && !state->lazy_listing)
+	{
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	// The name may be on the server but not listed yet
+	if(gdv_find(parent, name) || gdi_lookup(state, parent, name, NULL))
+	{
+		fuse_reply_err(req, EEXIST);
+		return;
+	}
+
+	struct gd_fs_entry_t *entry = gdi_create(state, parent, name, 0);
+	if(!entry)
+	{
+		fuse_reply_err(req, gdi_lookup(state, parent, name, NULL) ? EEXIST : ENOMEM);
+		return;
+	}
+
+	int ret = gdw_open(entry, 1);
+	if(ret)
+	{
+		fuse_reply_err(req, -ret);
+		return;
+	}
+
+	gd_fill_entry_param(req, entry, &param);
+	gd_open_reply(req, state, entry, fileinfo, 1, &param);
 }
 
 
+/** Wrap an operation so the request it handles is recorded for as long as it
+ *  runs, and forgotten once it returns, by when it has been replied to. An
+ *  operation reaching the server without gd_request_state(), or a later one
+ *  on the same thread, then never polls a request that was freed.
+ */
+#define GD_OP(op, params, args) \
+	static void op##_op params \
+	{ \
+		gdi_set_request(req); \
+		op args; \
+		gdi_set_request(NULL); \
+	}
+
+GD_OP(gd_lookup, (fuse_req_t req, fuse_ino_t parent, const char *name),
+		(req, parent, name))
+GD_OP(gd_forget, (fuse_req_t req, fuse_ino_t ino, unsigned long nlookup),
+		(req, ino, nlookup))
+GD_OP(gd_forget_multi, (fuse_req_t req, size_t count,
+		struct fuse_forget_data *forgets),
+		(req, count, forgets))
+GD_OP(gd_getattr, (fuse_req_t req, fuse_ino_t ino,
+		struct fuse_file_info *fileinfo),
+		(req, ino, fileinfo))
+GD_OP(gd_setattr, (fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+		int to_set, struct fuse_file_info *fileinfo),
+		(req, ino, attr, to_set, fileinfo))
+GD_OP(gd_mkdir, (fuse_req_t req, fuse_ino_t parent, const char *name,
+		mode_t mode),
+		(req, parent, name, mode))
+GD_OP(gd_unlink, (fuse_req_t req, fuse_ino_t parent, const char *name),
+		(req, parent, name))
+GD_OP(gd_rmdir, (fuse_req_t req, fuse_ino_t parent, const char *name),
+		(req, parent, name))
+GD_OP(gd_rename, (fuse_req_t req, fuse_ino_t parent, const char *name,
+		fuse_ino_t newparent, const char *newname, unsigned int flags),
+		(req, parent, name, newparent, newname, flags))
+GD_OP(gd_open, (fuse_req_t req, fuse_ino_t ino,
+		struct fuse_file_info *fileinfo),
+		(req, ino, fileinfo))
+GD_OP(gd_read, (fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+		struct fuse_file_info *fileinfo),
+		(req, ino, size, offset, fileinfo))
+GD_OP(gd_write, (fuse_req_t req, fuse_ino_t ino, const char *buf,
+		size_t size, off_t offset, struct fuse_file_info *fileinfo),
+		(req, ino, buf, size, offset, fileinfo))
+GD_OP(gd_flush, (fuse_req_t req, fuse_ino_t ino,
+		struct fuse_file_info *fileinfo),
+		(req, ino, fileinfo))
+GD_OP(gd_release, (fuse_req_t req, fuse_ino_t ino,
+		struct fuse_file_info *fileinfo),
+		(req, ino, fileinfo))
+GD_OP(gd_fsync, (fuse_req_t req, fuse_ino_t ino, int datasync,
+		struct fuse_file_info *fileinfo),
+		(req, ino, datasync, fileinfo))
+GD_OP(gd_readdir, (fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+		struct fuse_file_info *fileinfo),
+		(req, ino, size, offset, fileinfo))
+GD_OP(gd_readdirplus, (fuse_req_t req, fuse_ino_t ino, size_t size,
+		off_t offset, struct fuse_file_info *fileinfo),
+		(req, ino, size, offset, fileinfo))
+GD_OP(gd_releasedir, (fuse_req_t req, fuse_ino_t ino,
+		struct fuse_file_info *fileinfo),
+		(req, ino, fileinfo))
+GD_OP(gd_getxattr, (fuse_req_t req, fuse_ino_t ino, const char *name,
+		size_t size),
+		(req, ino, name, size))
+GD_OP(gd_listxattr, (fuse_req_t req, fuse_ino_t ino, size_t size),
+		(req, ino, size))
+GD_OP(gd_create, (fuse_req_t req, fuse_ino_t parent, const char *name,
+		mode_t mode, struct fuse_file_info *fileinfo),
+		(req, parent, name, mode, fileinfo))
+GD_OP(gd_copy_file_range, (fuse_req_t req, fuse_ino_t ino_in, off_t off_in,
+		struct fuse_file_info *fi_in, fuse_ino_t ino_out, off_t off_out,
+		struct fuse_file_info *fi_out, size_t len, int flags),
+		(req, ino_in, off_in, fi_in, ino_out, off_out, fi_out, len, flags))
+
 // Only uncomment these assignments once an operation's function has been
 // fleshed out.
-struct fuse_operations gd_oper = {
-	.getattr     = gd_getattr,
+struct fuse_lowlevel_ops gd_oper = {
+	.init        = gd_init,
+	//.destroy     = gd_destroy,
+	.lookup      = gd_lookup_op,
+	.forget      = gd_forget_op,
+	.forget_multi = gd_forget_multi_op,
+	.getattr     = gd_getattr_op,
+	.setattr     = gd_setattr_op,
 	//.readlink    = gd_readlink,
-	// getdir() deprecated, use readdir()
-	.getdir        = NULL,
 	//.mknod       = gd_mknod,
-	//.mkdir       = gd_mkdir,
-	//.unlink      = gd_unlink,
-	//.rmdir       = gd_rmdir,
+	.mkdir       = gd_mkdir_op,
+	.unlink      = gd_unlink_op,
+	.rmdir       = gd_rmdir_op,
 	//.symlink     = gd_symlink,
-	//.rename      = gd_rename,
+	.rename      = gd_rename_op,
 	//.link        = gd_link,
-	//.chmod       = gd_chmod,
-	//.chown       = gd_chown,
-	//.truncate    = gd_truncate,
-	// utime() deprecated, use utimens
-	.utime         = NULL,
-	.open        = gd_open,
-	.read        = gd_read,
-	//.write       = gd_write,
+	.open        = gd_open_op,
+	.read        = gd_read_op,
+	.write       = gd_write_op,
+	.flush       = gd_flush_op,
+	.release     = gd_release_op,
+	.fsync       = gd_fsync_op,
+	//.opendir     = gd_opendir,
+	.readdir     = gd_readdir_op,
+	.readdirplus = gd_readdirplus_op,
+	.releasedir  = gd_releasedir_op,
+	//.fsyncdir    = gd_fsyncdir,
 	//.statfs      = gd_statfs,
-	//.flush       = gd_flush,
-	.release     = gd_release,
-	//.fsync       = gd_fsync,
 	//.setxattr    = gd_setxattr,
-	//.getxattr    = gd_getxattr,
-	//.listxattr   = gd_listxattr,
+	.getxattr    = gd_getxattr_op,
+	.listxattr   = gd_listxattr_op,
 	//.removexattr = gd_removexattr,
-	//.opendir     = gd_opendir,
-	.readdir     = gd_readdir,
-	//.releasedir  = gd_releasedir,
-	//.fsyncdir    = gd_fsyncdir,
-	.init        = gd_init,
-	//.destroy     = gd_destroy,
 	//.access      = gd_access,
-	//.create      = gd_create,
-	//.ftruncate   = gd_ftruncate,
-	//.getattr     = gd_fgetattr,
-	//.lock        = gd_lock,
-	//.utimens     = gd_utimens,
-	//.ioctl       = gd_ioctl,
-	//.poll        = gd_poll,
+	.create      = gd_create_op,
+	.copy_file_range = gd_copy_file_range_op,
 };
 
 int main(int argc, char* argv[])
 {
-	int fuse_stat;
+	int fuse_stat = 1;
 	struct gd_state gd_data;
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse_cmdline_opts opts;
+	struct gd_options options = { 0 };
+	struct fuse_loop_config config;
+	struct fuse_session *session;
+
+	if(fuse_parse_cmdline(&args, &opts) != 0)
+		return 1;
+	if(fuse_opt_parse(&args, &options, gd_opts, NULL) != 0)
+		goto out_args;
+	if(opts.show_help)
+	{
+		printf("Usage: %s [options] mountpoint\n\n", argv[0]);
+		printf("    -o lazy_listing        list folders as they are used, not all at mount\n");
+		fuse_cmdline_help();
+		fuse_lowlevel_help();
+		fuse_stat = 0;
+		goto out_args;
+	}
+	if(opts.show_version)
+	{
+		fuse_lowlevel_version();
+		fuse_stat = 0;
+		goto out_args;
+	}
+	if(opts.mountpoint == NULL)
+	{
+		fprintf(stderr, "Usage: %s [options] mountpoint\n", argv[0]);
+		goto out_args;
+	}
+	gd_data.root = opts.mountpoint;
+	gd_data.gdi_data.lazy_listing = options.lazy_listing;
 
-	int ret = gdi_init(&gd_data.gdi_data);
-	if(ret != 0)
-		return ret;
+	if(gdi_init(&gd_data.gdi_data) != 0)
+		goto out_args;
 
 	// Start fuse
-	fuse_stat = fuse_main(argc, argv, &gd_oper, &gd_data);
+	session = fuse_session_new(&args, &gd_oper, sizeof(gd_oper), &gd_data);
+	if(session != NULL)
+	{
+		if(fuse_set_signal_handlers(session) == 0)
+		{
+			if(fuse_session_mount(session, opts.mountpoint) == 0)
+			{
+				gdn_set_session(session);
+				fuse_daemonize(opts.foreground);
+				// Threads do not survive daemonizing, so they start only now
+				if(gdi_start(&gd_data.gdi_data))
+					fuse_stat = 1;
+				else if(opts.singlethread)
+					fuse_stat = fuse_session_loop(session);
+				else
+				{
+					// -o clone_fd gives each worker thread its own /dev/fuse
+					// descriptor, so they stop contending on one queue
+					config.clone_fd = opts.clone_fd;
+					config.max_idle_threads = opts.max_idle_threads;
+					fuse_stat = fuse_session_loop_mt(session, &config);
+				}
+				gdn_set_session(NULL);
+				fuse_session_unmount(session);
+			}
+			fuse_remove_signal_handlers(session);
+		}
+		fuse_session_destroy(session);
+	}
 	/*  When we get here, fuse has finished.
 	 *  Do any necessary cleanups.
 	 */
 	gdi_destroy(&gd_data.gdi_data);
 
+out_args:
+	free(opts.mountpoint);
+	fuse_opt_free_args(&args);
+
 	return fuse_stat;
 }
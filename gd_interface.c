@@ -26,50 +26,84 @@
 #include <stdio.h>
 #include <sys/stat.h> // mkdir
 #include <unistd.h>
+#include <libxml/entities.h>
 #include <libxml/tree.h>
 
 #include "gd_interface.h"
+#include "gd_auth.h"
+#include "gd_batch.h"
 #include "gd_cache.h"
+#include "gd_dir.h"
+#include "gd_dirents.h"
+#include "gd_journal.h"
+#include "gd_negative.h"
+#include "gd_virtual.h"
+#include "gd_writeback.h"
 #include "stack.h"
 #include "functional_stack.h"
 #include "str.h"
 #include "curl_interface.h"
-
-const char auth_uri[] = "https://accounts.google.com/o/oauth2/auth";
-const char token_uri[] = "https://accounts.google.com/o/oauth2/token";
-//const char drive_scope[] = "https://www.googleapis.com/auth/drive.file";
-const char email_scope[] = "https://www.googleapis.com/auth/userinfo.email";
-const char docs_scope[] = "https://docs.google.com/feeds/";
-const char docsguc_scope[] = "https://docs.googleusercontent.com/";
-const char spreadsheets_scope[] = "https://spreadsheets.google.com/feeds/";
-const char profile_scope[] = "https://www.googleapis.com/auth/userinfo.profile";
-
-
-int create_oauth_header(struct gdi_state* state)
+#include "request_scheduler.h"
+
+const char feed_uri[] = "https://docs.google.com/feeds/default/private/full?v=3";
+const char list_uri[] = "https://docs.google.com/feeds/default/private/full?v=3&showfolders=true&max-results=1000";
+// Asks only for the fields gd_fs_entry_from_json() uses, followed by a query
+const char drive_list_uri[] = "https://www.googleapis.com/drive/v3/files"
+	"?pageSize=1000&fields=nextPageToken%2Cfiles(id%2Cname"
+	"%2CmimeType%2Cparents%2Csize%2Cmd5Checksum%2CmodifiedTime%2CcreatedTime%2Cversion)&q=";
+const char drive_list_query[] = "trashed%3Dfalse";
+// Asks for one file by id, with the same fields and whether it is trashed
+const char drive_file_fields[] = "?fields=id%2Cname%2CmimeType%2Cparents"
+	"%2Csize%2Cmd5Checksum%2CmodifiedTime%2CcreatedTime%2Cversion%2Ctrashed";
+// The contents feed of a folder is this, the resourceID and the query
+const char folder_list_uri[] = "https://docs.google.com/feeds/default/private/full/";
+const char folder_list_query[] = "/contents?v=3&showfolders=true&max-results=1000";
+const char entry_id_prefix[] = "https://docs.google.com/feeds/id/";
+
+// Requests allowed on the wire at once, across every priority class
+const size_t max_inflight_requests = 8;
+// Per class, the requests allowed on the wire at once and the bytes/second
+// each transfer may receive, 0 for no cap. Speculative and background work
+// is held to a share of the connections, background metadata to a share of
+// the link.
+const size_t class_max_inflight[PRIORITY_COUNT] = { 8, 8, 4, 2, 2 };
+const curl_off_t class_max_recv_speed[PRIORITY_COUNT] = { 0, 0, 0, 0, 1024 * 1024 };
+// Time allowed for a metadata request
+const long metadata_deadline_ms = 30000;
+// Downloads get metadata_deadline_ms plus the time the body would take at
+// this many bytes/second
+const long download_min_rate = 64 * 1024;
+// Sequential readers of ranged entries have this much fetched ahead of them
+// at first, doubling with each sequential read up to readahead_max
+const size_t readahead_min = 256 * 1024;
+const size_t readahead_max = 16 * 1024 * 1024;
+// Files larger than this are not downloaded on open(), read() fetches just
+// the ranges asked for instead
+const unsigned long full_download_max = 16 * 1024 * 1024;
+// Pages of results a search keeps, of up to 1000 files each
+const size_t search_max_pages = 2;
+// Race a duplicate against range reads that are slow to start
+const int hedge_range_reads = 1;
+// List with the Drive JSON API rather than the Documents List Atom feed, the
+// reply is a fraction of the size
+const int json_listing = 1;
+
+// The FUSE request the calling thread is handling, if any
+static __thread fuse_req_t current_req = NULL;
+// Set by gdi_destroy() to abandon a listing still running
+static volatile int listing_stopped = 0;
+
+static int gdi_start_listing(struct gdi_state *state);
+static void gdi_stop_background(struct gdi_state *state);
+
+/** Polled by listing requests, aborts them once the listing is abandoned.
+ */
+static int gdi_listing_cancelled(void)
 {
-	union func_u func;
-	int ret = 0;
-	struct str_t oauth;
-	struct str_t oauth_header;
-
-	str_init(&oauth_header);
-	str_init_create(&oauth, "Authorization: OAuth ", 0);
-
-	const struct str_t const* concat[2] = {&oauth, &state->access_token};
-
-	str_init(&state->oauth_header);
-	func.func3 = str_destroy;
-	fstack_push(state->stack, &state->oauth_header, &func, 3);
-
-	ret = str_concat(&state->oauth_header, 2, concat);
-	if(ret)
-		fstack_pop(state->stack);
-
-	str_destroy(&oauth);
-	str_destroy(&oauth_header);
-	return ret;
+	return listing_stopped;
 }
 
+
 int gdi_get_credentials()
 {
 	return 0;
@@ -135,56 +169,6 @@ char* load_file(const char* path, const char* name)
 	return result;
 }
 
-/** Callback for libcurl for parsing json auth tokens.
- *
- */
-int curl_post_callback(struct gdi_state *state, struct request_t *request)
-{
-	struct json_object *json = json_tokener_parse(request->response.body.str);
-	union func_u func;
-
-	struct json_object *tmp = json_object_object_get(json, "error");
-	if(tmp != NULL)
-	{
-		fprintf(stderr, "Error: %s\n", json_object_get_string(tmp));
-		state->callback_error = 1;
-		return 1;
-	}
-
-	tmp = json_object_object_get(json, "access_token");
-	const char* val = json_object_get_string(tmp);
-
-	str_init_create(&state->access_token, val, 0);
-	func.func1 = str_destroy;
-	fstack_push(state->stack, &state->access_token, &func, 1);
-
-	tmp = json_object_object_get(json, "token_type");
-	val = json_object_get_string(tmp);
-
-	str_init_create(&state->token_type, val, 0);
-	func.func1 = str_destroy;
-	fstack_push(state->stack, &state->token_type, &func, 1);
-
-	tmp = json_object_object_get(json, "refresh_token");
-	val = json_object_get_string(tmp);
-
-	str_init_create(&state->refresh_token, val, 0);
-	func.func1 = free;
-	fstack_push(state->stack, &state->refresh_token, &func, 1);
-
-	tmp = json_object_object_get(json, "id_token");
-	val = json_object_get_string(tmp);
-
-	str_init_create(&state->id_token, val, 0);
-	func.func1 = free;
-	fstack_push(state->stack, &state->id_token, &func, 1);
-
-	tmp = json_object_object_get(json, "expires_in");
-	state->token_expiration = json_object_get_int(tmp);
-
-	return 0;
-}
-
 void print_api_info(const char* path)
 {
 	printf("If you are seeing this then fuse-google-drive was unable to ");
@@ -294,6 +278,15 @@ int gdi_init(struct gdi_state* state)
 	state->tail = NULL;
 	state->callback_error = 0;
 	state->num_files = 0;
+	state->background = 0;
+	pthread_mutex_init(&state->background_lock, NULL);
+	pthread_cond_init(&state->background_done, NULL);
+	pthread_mutex_init(&state->list_lock, NULL);
+	pthread_cond_init(&state->list_grown, NULL);
+	state->listed = 0;
+	state->list_failed = 0;
+	state->started = 0;
+	listing_stopped = 0;
 
 	char *xdg_conf = getenv("XDG_CONFIG_HOME");
 	char *pname = "/fuse-google-drive/";
@@ -307,8 +300,10 @@ int gdi_init(struct gdi_state* state)
 			 	strlen(pname) + 1));
 	if(full_path == NULL)
 		goto init_fail;
+	// Kept until unmount for gdi_start()
+	state->config_path = full_path;
 	func.func1 = free;
-	fstack_push(gstack, full_path, &func, 1);
+	fstack_push(estack, full_path, &func, 1);
 
 	memcpy(full_path, xdg_conf, strlen(xdg_conf) + 1);
 	memcpy(full_path + strlen(xdg_conf), pname, strlen(pname) + 1);
@@ -338,161 +333,40 @@ int gdi_init(struct gdi_state* state)
 	func.func2 = curl_global_cleanup;
 	fstack_push(estack, NULL, &func, 2);
 
+	if(rs_init(max_inflight_requests))
+		goto init_fail;
+	func.func2 = rs_destroy;
+	fstack_push(estack, NULL, &func, 2);
+	size_t priority;
+	for(priority = 0; priority < PRIORITY_COUNT; ++priority)
+		rs_set_class_limits(priority, class_max_inflight[priority],
+				class_max_recv_speed[priority]);
+	rs_set_hedging(hedge_range_reads);
+
 	state->curlmulti = curl_multi_init();
 	if(state->curlmulti == NULL)
 		goto init_fail;
 	func.func3 = curl_multi_cleanup;
 	fstack_push(estack, state->curlmulti, &func, 3);
 
-	/* Authenticate the application */
-	struct str_t complete_authuri;
-	func.func1 = str_destroy;
-	fstack_push(gstack, &complete_authuri, &func, 1);
-
-	struct str_t plus;
-	struct str_t amp;
-	struct str_t que;
-
-	struct str_t response_type_code;
-	struct str_t code_param;
-	struct str_t redirect_param;
-	struct str_t scope_param;
-	struct str_t client_id_param;
-	struct str_t client_secret_param;
-	struct str_t grant_type_param;
-
-	struct str_t *email_scope_str = str_urlencode_char(email_scope, 0);
-	struct str_t *profile_scope_str = str_urlencode_char(profile_scope, 0);
-	struct str_t *docs_scope_str = str_urlencode_char(docs_scope, 0);
-	struct str_t *docsguc_scope_str = str_urlencode_char(docsguc_scope, 0);
-	struct str_t *spreadsheets_scope_str = str_urlencode_char(spreadsheets_scope, 0);
-
-	struct str_t *redirecturi_str = str_urlencode_char(state->redirecturi, 0);
-	struct str_t *clientid_str = str_urlencode_char(state->clientid, 0);
-	struct str_t *clientsecret_str = str_urlencode_char(state->clientsecrets, 0);
-
-
-	str_init_create(&plus, "+", 0);
-	str_init_create(&amp, "&", 0);
-	str_init_create(&que, "?", 0);
-
-	str_init_create(&response_type_code, "response_type=code", 0);
-	str_init_create(&code_param, "code=", 0);
-	str_init_create(&redirect_param, "redirect_uri=", 0);
-	str_init_create(&scope_param, "scope=", 0);
-	str_init_create(&client_id_param, "client_id=", 0);
-	str_init_create(&client_secret_param, "client_secret=", 0);
-	str_init_create(&grant_type_param, "grant_type=authorization%5Fcode", 0);
-
-	{ // So we can reuse variable name again
-		const struct str_t const* uri_parts[] =
-		{
-			&que,
-			&response_type_code,
-			&amp,
-			&scope_param,
-			email_scope_str,
-			&plus,
-			profile_scope_str,
-			&plus,
-			docs_scope_str,
-			&plus,
-			docsguc_scope_str,
-			&plus,
-			spreadsheets_scope_str,
-			&amp,
-			&redirect_param,
-			redirecturi_str,
-			&amp,
-			&client_id_param,
-			clientid_str
-		};
-		str_init_create(&complete_authuri, auth_uri, 0);
-		str_concat(&complete_authuri, sizeof(uri_parts)/sizeof(const struct str_t const*), uri_parts);
-	}
-
-	printf("Please open this in a web browser and authorize fuse-google-drive:\n%s\n", complete_authuri.str);
-
-	printf("\n\nOnce you authenticate, Google should give you a code, please paste it here:\n");
-
-	// Read in the code from Google
-	size_t length = 45;
-	size_t i = 0;
-	size_t done = 0;
-	state->code = (char *) malloc(sizeof(char)*(length+1));
-	if(state->code == NULL)
+	// Stopped after everything that sends requests, gdi_destroy() pops it last
+	if(gda_init(state, full_path))
 		goto init_fail;
-	func.func1 = free;
-	fstack_push(estack, state->code, &func, 1);
-
-	char *code = state->code;
-	while(i < length && !done)
-	{
-		char c = getc(stdin);
-		switch(c)
-		{
-			case ' ':
-				break;
-			case '\t':
-				break;
-			case '\n':
-				done = 1;
-				break;
-			default:
-				code[i] = c;
-				++i;
-				break;
-		}
-	}
-
-	code[i] = 0; // Null terminate code
+	func.func2 = gda_destroy;
+	fstack_push(estack, NULL, &func, 2);
 
-	if(i < 5)
-	{
-		printf("You did not enter a correct authentication code.\n");
+	if(gdn_init())
 		goto init_fail;
-	}
+	func.func2 = gdn_destroy;
+	fstack_push(estack, NULL, &func, 2);
 
-	// Prepare and make the request to exchange the code for an access token
-	str_clear(&complete_authuri);
+	if(gde_init())
+		goto init_fail;
+	func.func2 = gde_destroy;
+	fstack_push(estack, NULL, &func, 2);
 
-	struct str_t *code_str = str_urlencode_char(code, 0);
-	{
-		const struct str_t const* uri_parts[] =
-		{
-			&code_param,
-			code_str,
-			&amp,
-			&client_id_param,
-			clientid_str,
-			&amp,
-			&client_secret_param,
-			clientsecret_str,
-			&amp,
-			&redirect_param,
-			redirecturi_str,
-			&amp,
-			&grant_type_param
-		};
-		str_init(&complete_authuri);
-		if(str_concat(&complete_authuri, sizeof(uri_parts)/sizeof(const struct str_t const*), uri_parts))
-			goto init_fail;
-		printf("%s\n", complete_authuri.str);
-
-		struct str_t token_uri_str;
-		str_init_create(&token_uri_str, token_uri, 0);
-
-		struct request_t request;
-		ci_init(&request, &token_uri_str, 0, NULL, complete_authuri.str, POST);
-		ci_request(&request);
-		if(curl_post_callback(state, &request))
-			goto init_fail;
-		ci_destroy(&request);
-	}
-
-	create_oauth_header(state);
-	gdi_get_file_list(state);
-	if(create_hash_table(state->num_files*4, state->head))
+	// Grows as the listing fills it
+	if(create_hash_table(1024))
 	{
 		printf("create_hash failed\n");
 		goto init_fail;
@@ -500,6 +374,10 @@ int gdi_init(struct gdi_state* state)
 	func.func2 = destroy_hash_table;
 	fstack_push(estack, NULL, &func, 2);
 
+	if(gdv_init(state))
+		goto init_fail;
+	func.func2 = gdv_destroy;
+	fstack_push(estack, NULL, &func, 2);
 
 	goto init_success;
 
@@ -522,11 +400,95 @@ init_success:
 	return 0;
 }
 
+/** Start the background threads of this mount.
+ *
+ *  Apart from gdi_init() because threads do not survive fuse_daemonize(),
+ *  which has to come after gdi_init() asked the user to authorize us. Must
+ *  be called once, after daemonizing and before the session is served.
+ *
+ *  @state struct gdi_state* the state for this mount, from gdi_init()
+ *
+ *  @returns 0 on success, 1 on failure, gdi_destroy() cleans up either way
+ */
+int gdi_start(struct gdi_state* state)
+{
+	union func_u func;
+	const char *full_path = state->config_path;
+
+	if(gda_start())
+	{
+		printf("gda_start failed\n");
+		return 1;
+	}
+	if(gdn_start())
+	{
+		printf("gdn_start failed\n");
+		return 1;
+	}
+
+	if(state->lazy_listing)
+	{
+		// There is no listing to wait for
+		state->listed = 1;
+		if(gdd_init(state))
+		{
+			printf("gdd_init failed\n");
+			return 1;
+		}
+		func.func2 = gdd_destroy;
+		fstack_push(state->stack, NULL, &func, 2);
+	}
+	// The filesystem is served while this runs
+	else if(gdi_start_listing(state))
+	{
+		printf("gdi_start_listing failed\n");
+		return 1;
+	}
+
+	if(gdb_init(state))
+	{
+		printf("gdb_init failed\n");
+		return 1;
+	}
+	state->started = 1;
+
+	// Stopped by gdi_destroy() before the entries it uploads are freed
+	if(gdw_init(state, full_path))
+	{
+		printf("gdw_init failed\n");
+		return 1;
+	}
+	state->started = 2;
+
+	// Replays what the last mount left in the journal, so after writeback
+	if(gdj_init(state, full_path))
+	{
+		printf("gdj_init failed\n");
+		return 1;
+	}
+	state->started = 3;
+
+	return 0;
+}
+
 void gdi_destroy(struct gdi_state* state)
 {
 	printf("Cleaning up...\n");
 	fflush(stdout);
 
+	// Uploads whatever is still queued
+	if(state->started >= 2)
+		gdw_destroy();
+	// Sends whatever metadata changes are still queued, some of them wait for
+	// those uploads
+	if(state->started >= 3)
+		gdj_destroy();
+	if(state->started >= 1)
+		gdb_destroy();
+
+	// Background work may still be using entries, the listing among it
+	gdi_stop_background(state);
+
 	struct gd_fs_entry_t *iter = state->head;
 	struct gd_fs_entry_t *tmp = iter;
 	while(iter != NULL)
@@ -563,26 +525,92 @@ size_t remove_newlines(char *str, size_t length)
 	return move_iter+1;
 }
 
+/** Where the entries of a listing go.
+ */
+struct gdi_listing_t {
+	struct gdi_state *state;
+	// If set the entries are chained here, linked by next, rather than added
+	// to this mount
+	struct gd_fs_entry_t **tail;
+};
+
+/** Append an entry to the list of entries this mount frees at unmount.
+ *
+ *  @state struct gdi_state*     the state for this mount
+ *  @entry struct gd_fs_entry_t* the entry, already in the tables
+ */
+static void gdi_append(struct gdi_state *state, struct gd_fs_entry_t *entry)
+{
+	pthread_mutex_lock(&state->list_lock);
+	// Readers walk the list unlocked, entry must be complete before it is linked
+	__sync_synchronize();
+	if(state->tail)
+		state->tail->next = entry;
+	else
+		state->head = entry;
+	state->tail = entry;
+	++state->num_files;
+	pthread_mutex_unlock(&state->list_lock);
+	// Only the root is listed in full
+	gd_fs_entry_changed(NULL);
+}
+
+/** Adds a listed entry to this mount.
+ *
+ *  The entry is dropped if the index already holds the file, the listing
+ *  runs while the filesystem is in use and may find files a lookup already
+ *  queried or that were created here.
+ *
+ *  @listing struct gdi_listing_t*  where the entry goes
+ *  @entry   struct gd_fs_entry_t* the entry, owned by this function
+ *
+ *  @returns 1 if the entry was added, 0 if it was dropped
+ */
+static int gdi_add_entry(struct gdi_listing_t *listing, struct gd_fs_entry_t *entry)
+{
+	struct gdi_state *state = listing->state;
+
+	if(listing->tail)
+	{
+		*listing->tail = entry;
+		listing->tail = &entry->next;
+		return 1;
+	}
+
+	if(gd_fs_entry_index(entry))
+	{
+		gd_fs_entry_destroy(entry);
+		free(entry);
+		return 0;
+	}
+
+	gdi_append(state, entry);
+	// The kernel may hold a negative entry from before the listing got here
+	gdn_added(FUSE_ROOT_ID, entry->filename.str, 1);
+
+	return 1;
+}
+
 /** Build linked list of files.
  *
  *  Calls the XML parsing code to get gd_fs_entry_ts for creating a list of files.
  *
- *  @xml   a string containing the xml to parse, this is what we get from curl
- *  @len   the length of xml
- *  @state the variable we store this mount's state in
+ *  @xml     a string containing the xml to parse, this is what we get from curl
+ *  @listing where the entries go
  *
  *  @returns the link to the  next page of the directory listing, as found in xml
  */
-struct str_t* xml_parse_file_list(struct str_t* xml, struct gdi_state *state)
+struct str_t* xml_parse_file_list(struct str_t* xml, struct gdi_listing_t *listing)
 {
+	if(xml->str == NULL)
+		return NULL;
 	char* iter = strstr(xml->str, "<feed");
+	if(iter == NULL)
+		return NULL;
 	xmlDocPtr xmldoc = xmlParseMemory(iter, xml->len - (iter - xml->str));
 
 	xmlNodePtr node;
 
-	size_t count = 0;
-	struct gd_fs_entry_t *tmp = state->tail;
-
 	struct str_t* next = NULL;
 
 	if(xmldoc == NULL || xmldoc->children == NULL || xmldoc->children->children == NULL)
@@ -591,19 +619,9 @@ struct str_t* xml_parse_file_list(struct str_t* xml, struct gdi_state *state)
 	{
 		if(strcmp(node->name, "entry") == 0)
 		{
-			if(!tmp)
-			{
-				tmp = gd_fs_entry_from_xml(xmldoc, node);
-				state->head = tmp;
-				state->tail = tmp;
-			}
-			else
-			{
-				tmp->next = gd_fs_entry_from_xml(xmldoc, node);
-				tmp = tmp->next;
-				state->tail = tmp;
-			}
-			++count;
+			struct gd_fs_entry_t *entry = gd_fs_entry_from_xml(xmldoc, node);
+			if(entry != NULL)
+				gdi_add_entry(listing, entry);
 		}
 		if(strcmp(node->name, "link") == 0)
 		{
@@ -621,125 +639,1556 @@ struct str_t* xml_parse_file_list(struct str_t* xml, struct gdi_state *state)
 		}
 	}
 	xmlFreeDoc(xmldoc);
-	state->num_files += count;
 	return next;
 }
 
-/** Gets a listing of all the files for this mount.
+/** Parses one page of a Drive files.list reply into entries for this mount.
  *
- *  Calls curl repeatedly to get each page of xml from the directory-listing
- *  Google API. Then parses those pages into a list of gd_fs_entry_ts, stored
- *  in state.
- *
- *  @state the state for this mount
+ *  @json    struct str_t*         the reply
+ *  @listing struct gdi_listing_t* where the entries go
  *
- *  @returns void
+ *  @returns the token of the next page, or NULL if this was the last
  */
-void gdi_get_file_list(struct gdi_state *state)
+struct str_t* json_parse_file_list(struct str_t* json, struct gdi_listing_t *listing)
 {
-	struct str_t resp;
-	resp.len = 0;
-	resp.str = NULL;
-
-	struct str_t uri;
-	str_init_create(&uri, "https://docs.google.com/feeds/default/private/full?v=3&showfolders=true&max-results=1000", 0);
-
 	struct str_t* next = NULL;
+	size_t iter;
 
-	struct request_t request;
-	ci_init(&request, &uri, 1, &state->oauth_header, NULL, GET);
-	do
-	{
-
-		ci_request(&request);
+	if(json->str == NULL)
+		return NULL;
+	struct json_object *list = json_tokener_parse(json->str);
+	if(list == NULL)
+		return NULL;
 
-		str_destroy(next);
-		free(next);
-		next = xml_parse_file_list(&request.response.body, state);
-		if(next)
-			ci_set_uri(&request, next);
+	struct json_object *files = json_object_object_get(list, "files");
+	size_t length = files ? json_object_array_length(files) : 0;
+	for(iter = 0; iter < length; ++iter)
+	{
+		struct gd_fs_entry_t *entry =
+			gd_fs_entry_from_json(json_object_array_get_idx(files, iter));
+		if(entry != NULL)
+			gdi_add_entry(listing, entry);
+	}
 
-		ci_clear_response(&request);
-	} while(next);
+	const char *token = json_object_get_string(json_object_object_get(list, "nextPageToken"));
+	if(token)
+		next = str_urlencode_char(token, 0);
 
-	ci_destroy(&request);
-	str_destroy(&uri);
+	json_object_put(list);
+	return next;
 }
 
-const char* gdi_strip_path(const char* path)
+/** Appends a string literal for a files.list query, quoted and with quotes
+ *  and backslashes escaped with a backslash.
+ */
+static void gdi_query_literal(struct str_t* query, const char* value)
 {
-	char *filename = strrchr(path, '/');
-	++filename;
-	return filename;
+	const char *iter;
+
+	str_char_concat(query, "'", 1);
+	for(iter = value; *iter; ++iter)
+	{
+		if(*iter == '\'' || *iter == '\\')
+			str_char_concat(query, "\\", 1);
+		str_char_concat(query, iter, 1);
+	}
+	str_char_concat(query, "'", 1);
 }
 
-int gdi_check_update(struct gdi_state* state, struct gd_fs_entry_t* entry)
+/** Builds the uri of a listing, from the Drive API if json_listing is set and
+ *  the Documents List API otherwise.
+ *
+ *  @uri    struct str_t* set to the uri
+ *  @title  const char*   the escaped filename to list, or NULL
+ *  @folder const char*   the resourceID of the folder to list the contents of,
+ *          "folder:root" for the root, or NULL
+ *  @text   const char*   the escaped text to search names and contents for,
+ *          or NULL
+ *
+ *  With none of title, folder or text every file is listed.
+ *
+ *  @returns 0 on success, 1 on failure
+ */
+static int gdi_list_uri(struct str_t* uri, const char* title, const char* folder,
+		const char* text)
 {
-	int ret = 0;
+	struct str_t *encoded = NULL;
+	struct str_t query;
 
-	if(entry->md5set)
+	str_init(&query);
+	if(title != NULL || text != NULL)
 	{
-		struct request_t request;
-		ci_init(&request, &entry->feed, 1, &state->oauth_header, NULL, GET);
-		ci_request(&request);
+		const char *escaped = title ? title : text;
+		char *decoded = filenamedecode(escaped, strlen(escaped));
+		if(decoded == NULL)
+			return 1;
 
-		struct str_t* md5 = xml_get_md5sum(&request.response.body);
-		if(md5 == NULL)
-			ret = -1;
-		if(!ret && strcmp(md5->str, entry->md5.str))
-			ret = 1;
+		if(json_listing)
+		{
+			if(title)
+				str_char_concat(&query, "name = ", 7);
+			else
+				str_char_concat(&query, "fullText contains ", 18);
+			gdi_query_literal(&query, decoded);
+			str_char_concat(&query, " and trashed = false", 20);
+		}
+		else
+			str_char_concat(&query, decoded, strlen(decoded));
+		free(decoded);
+	}
+	else if(folder != NULL)
+	{
+		if(json_listing)
+		{
+			// The Drive API knows the folder by the id after the type
+			const char *id = strchr(folder, ':');
+			gdi_query_literal(&query, id ? id + 1 : folder);
+			str_char_concat(&query, " in parents and trashed = false", 31);
+		}
+		else
+			str_char_concat(&query, folder, strlen(folder));
+	}
 
-		ci_destroy(&request);
+	if(query.len)
+	{
+		encoded = str_urlencode_str(&query);
+		str_destroy(&query);
+		if(encoded == NULL)
+			return 1;
 	}
 
-	return ret;
+	if(json_listing)
+	{
+		str_init_create(uri, drive_list_uri, 0);
+		if(encoded)
+			str_char_concat(uri, encoded->str, encoded->len);
+		else
+			str_char_concat(uri, drive_list_query, sizeof(drive_list_query) - 1);
+	}
+	else if(title != NULL)
+	{
+		str_init_create(uri, list_uri, 0);
+		str_char_concat(uri, "&title-exact=true&title=", 24);
+		str_char_concat(uri, encoded->str, encoded->len);
+	}
+	else if(text != NULL)
+	{
+		str_init_create(uri, list_uri, 0);
+		str_char_concat(uri, "&q=", 3);
+		str_char_concat(uri, encoded->str, encoded->len);
+	}
+	else if(folder != NULL)
+	{
+		// The contents feed of the folder
+		str_init_create(uri, folder_list_uri, 0);
+		str_char_concat(uri, encoded->str, encoded->len);
+		str_char_concat(uri, folder_list_query, sizeof(folder_list_query) - 1);
+	}
+	else
+		str_init_create(uri, list_uri, 0);
+
+	str_destroy(encoded);
+	free(encoded);
+	return 0;
 }
 
-int gdi_load(struct gdi_state* state, struct gd_fs_entry_t* entry)
+/** Gets one page of a listing and adds the files on it to this mount.
+ *
+ *  @listing  struct gdi_listing_t*   where the entries go
+ *  @uri      struct str_t*           the page to get
+ *  @priority enum request_priority_e the scheduler class of the request
+ *  @next     struct str_t*           set to the uri of the next page, left
+ *            alone if this was the last
+ *
+ *  @returns 0 if this was the last page, 1 if there is a next, -1 on failure
+ */
+static int gdi_list_page(struct gdi_listing_t *listing, struct str_t *uri,
+		enum request_priority_e priority, struct str_t *next)
 {
-	int ret = 0;
-	if(entry->cached)
-	{
-		int updated = gdi_check_update(state, entry);
-		struct request_t request;
-		switch(updated)
-		{
-			case -1:
-				ret = 1;
-				break;
-			case 0:
-				ret = 0;
-				break;
-			case 1:
-				ci_init(&request, &entry->src, 1, &state->oauth_header, NULL, GET);
-				ci_request(&request);
+	struct gdi_state *state = listing->state;
+	struct request_t request;
+	struct str_t* token = NULL;
+	int ret = -1;
 
-				str_swap(&request.response.body, &entry->cache);
+	gdi_request_init(state, &request, uri, priority, metadata_deadline_ms);
+	// Listings are large and compress well
+	ci_set_compressed(&request);
+	if(current_req == NULL)
+		ci_set_cancel(&request, gdi_listing_cancelled);
 
-				ci_destroy(&request);
-				break;
-		}
+	if(gdi_request_ok(&request, ci_request(&request)))
+	{
+		ret = 0;
+		if(json_listing)
+			token = json_parse_file_list(&request.response.body, listing);
+		else
+			token = xml_parse_file_list(&request.response.body, listing);
+	}
+	ci_destroy(&request);
+
+	if(token == NULL)
+		return ret;
+	if(json_listing)
+	{
+		// The next page is asked for by token, with the same query
+		const char *page = strstr(uri->str, "&pageToken=");
+		str_init_create(next, uri->str, page ? page - uri->str : uri->len);
+		str_char_concat(next, "&pageToken=", 11);
+		str_char_concat(next, token->str, token->len);
 	}
 	else
+		str_init_create(next, token->str, token->len);
+	str_destroy(token);
+	free(token);
+	return 1;
+}
+
+/** Gets a listing of all the files for this mount.
+ *
+ *  Calls curl repeatedly to get each page of the directory listing, and parses
+ *  those pages into a list of gd_fs_entry_ts, stored in state. Waiters on
+ *  list_grown are woken after each page.
+ *
+ *  @state the state for this mount
+ *
+ *  @returns 0 if every file was listed, -1 if not
+ */
+int gdi_get_file_list(struct gdi_state *state)
+{
+	struct gdi_listing_t listing = { state, NULL };
+	struct str_t uri;
+	struct str_t next;
+	int ret;
+
+	if(gdi_list_uri(&uri, NULL, NULL, NULL))
+		return -1;
+	do
 	{
-		struct request_t request;
-		ci_init(&request, &entry->src, 1, &state->oauth_header, NULL, GET);
-		ci_request(&request);
+		ret = gdi_list_page(&listing, &uri, PRIORITY_OPEN, &next);
+		str_destroy(&uri);
+		if(ret > 0)
+			uri = next;
+
+		pthread_mutex_lock(&state->list_lock);
+		pthread_cond_broadcast(&state->list_grown);
+		pthread_mutex_unlock(&state->list_lock);
+	} while(ret > 0 && !listing_stopped);
+
+	if(ret > 0)
+		str_destroy(&uri);
+	if(ret < 0 && !listing_stopped)
+		printf("Listing failed, %lu files found\n", (unsigned long) state->num_files);
+	return (ret == 0) ? 0 : -1;
+}
 
-		str_swap(&request.response.body, &entry->cache);
+/** Lists the contents of one folder, for lazy mode.
+ *
+ *  @state   struct gdi_state*           the state for this mount
+ *  @folder  const struct gd_fs_entry_t* the folder, NULL for the root
+ *  @entries struct gd_fs_entry_t**      set to the entries found, linked by
+ *           next and not yet added to this mount
+ *
+ *  @returns 0 on success, -1 on failure
+ */
+int gdi_list_folder(struct gdi_state *state, const struct gd_fs_entry_t *folder,
+		struct gd_fs_entry_t **entries)
+{
+	struct gdi_listing_t listing = { state, entries };
+	struct str_t uri;
+	struct str_t next;
+	int ret;
+
+	*entries = NULL;
+	// Nothing can be in a folder the server has not seen yet
+	if(folder && !folder->resourceID.len)
+		return 0;
+	if(gdi_list_uri(&uri, NULL, folder ? folder->resourceID.str : "folder:root", NULL))
+		return -1;
+	do
+	{
+		ret = gdi_list_page(&listing, &uri, PRIORITY_OPEN, &next);
+		str_destroy(&uri);
+		if(ret > 0)
+			uri = next;
+	} while(ret > 0);
 
-		ci_destroy(&request);
-		entry->cached = 1;
+	if(ret < 0)
+	{
+		while(*entries)
+		{
+			struct gd_fs_entry_t *entry = *entries;
+			*entries = entry->next;
+			gd_fs_entry_destroy(entry);
+			free(entry);
+		}
+		return -1;
 	}
+	return 0;
+}
 
-	return ret;
+/** Searches the names and contents of files on the server.
+ *
+ *  Only the first search_max_pages pages of results are kept.
+ *
+ *  @state   struct gdi_state*      the state for this mount
+ *  @text    const char*            the escaped text to search for
+ *  @entries struct gd_fs_entry_t** set to the entries found, linked by next
+ *           and not yet added to this mount
+ *
+ *  @returns 0 on success, -1 on failure
+ */
+int gdi_search(struct gdi_state *state, const char *text,
+		struct gd_fs_entry_t **entries)
+{
+	struct gdi_listing_t listing = { state, entries };
+	struct str_t uri;
+	struct str_t next;
+	size_t pages = 0;
+	int ret;
+
+	*entries = NULL;
+	if(gdi_list_uri(&uri, NULL, NULL, text))
+		return -1;
+	do
+	{
+		ret = gdi_list_page(&listing, &uri, PRIORITY_INTERACTIVE, &next);
+		str_destroy(&uri);
+		if(ret > 0)
+			uri = next;
+	} while(ret > 0 && ++pages < search_max_pages);
+
+	if(ret > 0)
+		str_destroy(&uri);
+	if(ret < 0)
+	{
+		while(*entries)
+		{
+			struct gd_fs_entry_t *entry = *entries;
+			*entries = entry->next;
+			gd_fs_entry_destroy(entry);
+			free(entry);
+		}
+		return -1;
+	}
+	return 0;
 }
 
-const char* gdi_read(size_t *size, struct gd_fs_entry_t* entry, off_t offset)
+/** Lists every file, the body of the listing thread.
+ *
+ *  @arg struct gdi_state* the state for this mount
+ */
+static void* gdi_lister(void *arg)
 {
-	size_t remaining = (entry->cache.len < offset) ? 0 : entry->cache.len - offset;
-	*size = (remaining < *size) ? remaining : *size;
-	if(*size == 0)
+	struct gdi_state *state = (struct gdi_state*) arg;
+
+	int failed = gdi_get_file_list(state);
+
+	// Waiters give up on the rest of the listing if it failed part way, but
+	// what it did not get to is not taken to be missing
+	pthread_mutex_lock(&state->list_lock);
+	state->list_failed = failed;
+	state->listed = 1;
+	pthread_cond_broadcast(&state->list_grown);
+	pthread_mutex_unlock(&state->list_lock);
+
+	pthread_mutex_lock(&state->background_lock);
+	if(!--state->background)
+		pthread_cond_broadcast(&state->background_done);
+	pthread_mutex_unlock(&state->background_lock);
+
+	return NULL;
+}
+
+/** Start listing every file in the background.
+ *
+ *  @state struct gdi_state* the state for this mount
+ *
+ *  @returns 0 on success, 1 on failure
+ */
+static int gdi_start_listing(struct gdi_state *state)
+{
+	pthread_t thread;
+	pthread_attr_t attr;
+	int ret = 0;
+
+	pthread_mutex_lock(&state->background_lock);
+	++state->background;
+	pthread_mutex_unlock(&state->background_lock);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if(pthread_create(&thread, &attr, gdi_lister, state))
+	{
+		pthread_mutex_lock(&state->background_lock);
+		--state->background;
+		pthread_mutex_unlock(&state->background_lock);
+		ret = 1;
+	}
+	pthread_attr_destroy(&attr);
+
+	return ret;
+}
+
+/** Abandon the listing and wait for every background thread to finish.
+ *
+ *  @state struct gdi_state* the state for this mount
+ */
+static void gdi_stop_background(struct gdi_state *state)
+{
+	listing_stopped = 1;
+
+	pthread_mutex_lock(&state->background_lock);
+	while(state->background)
+		pthread_cond_wait(&state->background_done, &state->background_lock);
+	pthread_mutex_unlock(&state->background_lock);
+}
+
+/** Wait for the listing to finish, in lazy mode for the root to be listed.
+ *
+ *  @state struct gdi_state* the state for this mount
+ */
+void gdi_wait_listed(struct gdi_state *state)
+{
+	if(state->lazy_listing)
+	{
+		gdd_list(FUSE_ROOT_ID);
+		return;
+	}
+
+	pthread_mutex_lock(&state->list_lock);
+	while(!state->listed)
+		pthread_cond_wait(&state->list_grown, &state->list_lock);
+	pthread_mutex_unlock(&state->list_lock);
+}
+
+/** Walk the list of entries, waiting for the listing where it has not got
+ *  to yet.
+ *
+ *  @state struct gdi_state*     the state for this mount
+ *  @prev  struct gd_fs_entry_t* the entry walked last, NULL to start
+ *
+ *  @returns the entry after prev, or NULL at the end of the full listing
+ */
+struct gd_fs_entry_t* gdi_next_listed(struct gdi_state *state, struct gd_fs_entry_t *prev)
+{
+	struct gd_fs_entry_t *next = prev ? prev->next : state->head;
+	if(next != NULL || state->listed)
+		return next;
+
+	pthread_mutex_lock(&state->list_lock);
+	while((next = prev ? prev->next : state->head) == NULL && !state->listed)
+		pthread_cond_wait(&state->list_grown, &state->list_lock);
+	pthread_mutex_unlock(&state->list_lock);
+	return next;
+}
+
+/** Find an entry in the root of the full listing.
+ *
+ *  @state struct gdi_state* the state for this mount
+ *  @name  const char*       the escaped filename
+ *  @known int*              set nonzero if a miss is certain
+ *
+ *  @returns the entry, or NULL if there is no such file
+ */
+static struct gd_fs_entry_t* gdi_find_listed(struct gdi_state *state,
+		const char *name, int *known)
+{
+	struct gd_fs_entry_t *entry = gd_fs_entry_find(name);
+	*known = state->listed && !state->list_failed;
+	if(entry != NULL || *known)
+		return entry;
+
+	struct str_t uri;
+	struct str_t next;
+	int ret = -1;
+	struct gdi_listing_t listing = { state, NULL };
+	if(!gdi_list_uri(&uri, name, NULL, NULL))
+	{
+		ret = gdi_list_page(&listing, &uri, PRIORITY_INTERACTIVE, &next);
+		str_destroy(&uri);
+		// One name is never more than a page
+		if(ret > 0)
+			str_destroy(&next);
+	}
+	if(ret < 0 && !gdi_interrupted())
+		gdi_wait_listed(state);
+
+	// The query asked for every file with this name
+	*known = ret >= 0 || (state->listed && !state->list_failed);
+	return gd_fs_entry_find(name);
+}
+
+/** Find an entry by filename, even if the listing has not got to it yet.
+ *
+ *  Names the listing has not reached are asked for by name, so a lookup
+ *  waits for one small query rather than for the listing. If that query
+ *  fails the lookup waits for the listing instead. In lazy mode this lists
+ *  the root if it has not been. Names found missing are remembered by
+ *  gd_negative.c so the next lookup does not ask again.
+ *
+ *  @state struct gdi_state* the state for this mount
+ *  @name  const char*       the escaped filename
+ *
+ *  @returns the entry, or NULL if there is no such file
+ */
+struct gd_fs_entry_t* gdi_find(struct gdi_state *state, const char *name)
+{
+	return gdi_lookup(state, FUSE_ROOT_ID, name, NULL);
+}
+
+/** Find an entry by filename in a folder.
+ *
+ *  Only the root has entries unless in lazy mode.
+ *
+ *  @state   struct gdi_state* the state for this mount
+ *  @parent  fuse_ino_t        the inode number of the folder
+ *  @name    const char*       the escaped filename
+ *  @missing int*              if not NULL, set nonzero if the name is known
+ *                             not to exist, 0 if it may
+ *
+ *  @returns the entry, or NULL if there is no such entry
+ */
+struct gd_fs_entry_t* gdi_lookup(struct gdi_state *state, fuse_ino_t parent,
+		const char *name, int *missing)
+{
+	struct gd_fs_entry_t *entry;
+	int known = 0;
+
+	if(missing)
+		*missing = 0;
+	if(!state->lazy_listing && parent != FUSE_ROOT_ID)
+		return NULL;
+	if(gdn_missing(parent, name))
+	{
+		if(missing)
+			*missing = 1;
+		return NULL;
+	}
+
+	if(state->lazy_listing)
+		entry = gdd_find(parent, name, &known);
+	else
+		entry = gdi_find_listed(state, name, &known);
+
+	if(entry == NULL && known)
+	{
+		gdn_miss(parent, name);
+		if(missing)
+			*missing = 1;
+	}
+	return entry;
+}
+
+/** Get the metadata of one file from the server by resourceID.
+ *
+ *  @state      struct gdi_state* the state for this mount
+ *  @resourceID const char*       the resourceID
+ *
+ *  @returns a new entry, not in the tables yet, or NULL if there is no such
+ *           file or on failure
+ */
+static struct gd_fs_entry_t* gdi_fetch_id(struct gdi_state *state, const char *resourceID)
+{
+	struct gd_fs_entry_t *entry = NULL;
+	struct request_t request;
+	struct str_t uri;
+	struct str_t id;
+
+	// The Drive API knows the file by the id after the type
+	const char *type = strchr(resourceID, ':');
+	if(type == NULL || type[1] == 0)
+		return NULL;
+	str_init_create(&id, json_listing ? type + 1 : resourceID, 0);
+	struct str_t *escaped = str_urlencode_str(&id);
+	str_destroy(&id);
+	if(escaped == NULL)
+		return NULL;
+
+	if(json_listing)
+	{
+		str_init_create(&uri, drive_files_uri, 0);
+		str_char_concat(&uri, escaped->str, escaped->len);
+		str_char_concat(&uri, drive_file_fields, sizeof(drive_file_fields) - 1);
+	}
+	else
+	{
+		str_init_create(&uri, docs_entry_uri, 0);
+		str_char_concat(&uri, escaped->str, escaped->len);
+		str_char_concat(&uri, "?v=3", 4);
+	}
+	str_destroy(escaped);
+	free(escaped);
+
+	gdi_request_init(state, &request, &uri, PRIORITY_INTERACTIVE, metadata_deadline_ms);
+	if(gdi_request_ok(&request, ci_request(&request)))
+	{
+		if(!json_listing)
+			entry = xml_parse_entry(&request.response.body);
+		else if(request.response.body.str)
+		{
+			struct json_object *file = json_tokener_parse(request.response.body.str);
+			// Listings leave out the trash, so does this
+			if(file && !json_object_get_boolean(json_object_object_get(file, "trashed")))
+				entry = gd_fs_entry_from_json(file);
+			if(file)
+				json_object_put(file);
+		}
+	}
+	ci_destroy(&request);
+	str_destroy(&uri);
+
+	return entry;
+}
+
+/** Find an entry by resourceID, without listing anything.
+ *
+ *  An entry no listing has had yet is asked for by itself, see gdi_adopt().
+ *
+ *  @state      struct gdi_state* the state for this mount
+ *  @resourceID const char*       the resourceID, such as file:0B1a2b3c
+ *
+ *  @returns the entry, or NULL if there is no such file
+ */
+struct gd_fs_entry_t* gdi_find_id(struct gdi_state *state, const char *resourceID)
+{
+	struct gd_fs_entry_t *entry = gd_fs_entry_find_id(resourceID, NULL);
+	if(entry != NULL)
+		return entry->deleted ? NULL : entry;
+
+	// The type the server gives may not be the one asked for
+	entry = gdi_fetch_id(state, resourceID);
+	return entry ? gdi_adopt(state, entry) : NULL;
+}
+
+/** Add an entry found other than by listing a folder to this mount.
+ *
+ *  In the full listing it joins the root like any other. In lazy mode it is
+ *  in no folder until the one it is in is listed, only its inode number
+ *  finds it, see gdd_adopt().
+ *
+ *  @state struct gdi_state*     the state for this mount
+ *  @entry struct gd_fs_entry_t* the entry, owned by this function
+ *
+ *  @returns the entry held for the file, which is not always entry, or NULL
+ *           if it was removed here or on failure
+ */
+struct gd_fs_entry_t* gdi_adopt(struct gdi_state *state, struct gd_fs_entry_t *entry)
+{
+	// Only the resourceID tells if the file is held already
+	if(!entry->resourceID.len)
+	{
+		gd_fs_entry_destroy(entry);
+		free(entry);
+		return NULL;
+	}
+	if(state->lazy_listing)
+	{
+		entry = gdd_adopt(entry);
+		return (entry && !entry->deleted) ? entry : NULL;
+	}
+
+	// A file already held is dropped rather than added
+	struct str_t found;
+	struct gdi_listing_t listing = { state, NULL };
+	str_init_create(&found, entry->resourceID.str, entry->resourceID.len);
+	gdi_add_entry(&listing, entry);
+
+	entry = gd_fs_entry_find_id(found.str, NULL);
+	str_destroy(&found);
+	return (entry && !entry->deleted) ? entry : NULL;
+}
+
+/** Walk the entries of a folder.
+ *
+ *  Only the root has entries unless in lazy mode. Deleted entries are walked
+ *  too, they keep their place.
+ *
+ *  @state struct gdi_state*     the state for this mount
+ *  @ino   fuse_ino_t            the inode number of the folder
+ *  @prev  struct gd_fs_entry_t* the entry walked last, NULL to start
+ *
+ *  @returns the entry after prev, or NULL at the end
+ */
+struct gd_fs_entry_t* gdi_next_child(struct gdi_state *state, fuse_ino_t ino,
+		struct gd_fs_entry_t *prev)
+{
+	if(state->lazy_listing)
+		return gdd_next(ino, prev);
+	return (ino == FUSE_ROOT_ID) ? gdi_next_listed(state, prev) : NULL;
+}
+
+const char* gdi_strip_path(const char* path)
+{
+	char *filename = strrchr(path, '/');
+	++filename;
+	return filename;
+}
+
+/** Record the FUSE request the calling thread is handling.
+ *
+ *  Requests to the server made by this thread are then cancelled if that
+ *  FUSE request is interrupted.
+ *
+ *  @req fuse_req_t the request, or NULL once it has been replied to, see
+ *       GD_OP() in gd_fuse_operations.c
+ */
+void gdi_set_request(fuse_req_t req)
+{
+	current_req = req;
+}
+
+/** Check if the FUSE request the calling thread is handling was interrupted.
+ */
+int gdi_interrupted(void)
+{
+	return current_req ? fuse_req_interrupted(current_req) : 0;
+}
+
+/** Prepare a GET request made on behalf of a FUSE operation.
+ *
+ *  The request is authorized for this mount, queued in the given scheduler
+ *  class, limited to deadline_ms and aborted if the calling operation is
+ *  interrupted.
+ *
+ *  @state       struct gdi_state*       the state for this mount
+ *  @request     struct request_t*       the request to initialize
+ *  @uri         struct str_t*           the uri to get
+ *  @priority    enum request_priority_e the scheduler class for this request
+ *  @deadline_ms long                    the time budget, 0 for no limit
+ */
+void gdi_request_init(struct gdi_state* state, struct request_t* request,
+		struct str_t* uri, enum request_priority_e priority, long deadline_ms)
+{
+	ci_init(request, uri, 1, state->oauth_header, NULL, GET);
+	ci_set_priority(request, priority);
+	ci_set_deadline(request, deadline_ms);
+	ci_set_cancel(request, gdi_interrupted);
+}
+
+/** Check if a request completed with a successful response.
+ */
+int gdi_request_ok(const struct request_t* request, int curl_ret)
+{
+	return curl_ret == CURLE_OK && request->status >= 200 && request->status < 300;
+}
+
+/** Ask the server if an entry changed since a content version was fetched.
+ *
+ *  If it did, the entry's md5 is updated to the server's. The question goes
+ *  out in a batch with those of other threads, see gd_batch.c.
+ *
+ *  @state   struct gdi_state*     the state for this mount
+ *  @entry   struct gd_fs_entry_t* the entry to check
+ *  @current struct gd_content_t*  the version we have
+ *
+ *  @returns 1 if it changed, 0 if not, -1 if we could not tell
+ */
+int gdi_check_update(struct gdi_state* state, struct gd_fs_entry_t* entry,
+		const struct gd_content_t* current)
+{
+	int ret = 0;
+
+	if(entry->md5set)
+	{
+		struct str_t md5;
+		str_init(&md5);
+		if(gdb_query_md5(entry, &md5) || !md5.len)
+			ret = -1;
+		if(!ret && (!current->md5.len || strcmp(md5.str, current->md5.str)))
+		{
+			pthread_mutex_lock(&entry->lock);
+			str_swap(&md5, &entry->md5);
+			pthread_mutex_unlock(&entry->lock);
+			ret = 1;
+		}
+		str_destroy(&md5);
+	}
+
+	return ret;
+}
+
+/** Download the contents of an entry and publish them as a new version.
+ *
+ *  @state struct gdi_state*     the state for this mount
+ *  @entry struct gd_fs_entry_t* the entry to download
+ *
+ *  @returns 0 on success, 1 on failure, the current version is left in place
+ *           on failure
+ */
+int gdi_download(struct gdi_state* state, struct gd_fs_entry_t* entry)
+{
+	int ret = 0;
+	struct request_t request;
+	long deadline = metadata_deadline_ms + entry->size / download_min_rate * 1000;
+
+	gdi_request_init(state, &request, &entry->src, PRIORITY_OPEN, deadline);
+	if(gdi_request_ok(&request, ci_request(&request)))
+	{
+		pthread_mutex_lock(&entry->lock);
+		struct gd_content_t *content =
+			gd_content_create(&request.response.body, &entry->md5);
+		pthread_mutex_unlock(&entry->lock);
+
+		if(content)
+			gd_content_publish(entry, content);
+		else
+			ret = 1;
+	}
+	else
+		ret = 1;
+
+	ci_destroy(&request);
+	return ret;
+}
+
+/** Check if an entry is read in ranges rather than downloaded on open().
+ *
+ *  Only files with a checksum have a byte stream we can ask ranges of, Google
+ *  documents are exported whole.
+ */
+int gdi_is_ranged(const struct gd_fs_entry_t* entry)
+{
+	return entry->md5set && entry->size > full_download_max;
+}
+
+/** Make sure the current content version of an entry is present and current.
+ *
+ *  Only one thread loads an entry at a time. Threads that call this while a
+ *  load is running wait for it and share its result rather than making the
+ *  same requests again. If the thread loading is interrupted, one of them
+ *  loads the entry instead of failing with it.
+ *
+ *  @state struct gdi_state*     the state for this mount
+ *  @entry struct gd_fs_entry_t* the entry to load
+ *
+ *  @returns 0 on success, 1 on failure
+ */
+int gdi_load(struct gdi_state* state, struct gd_fs_entry_t* entry)
+{
+	int ret = 0;
+	// Staged entries are read from their staging file
+	if(gdi_is_ranged(entry) || gdw_is_staged(entry))
+		return 0;
+
+	pthread_mutex_lock(&entry->lock);
+	while(entry->loading)
+	{
+		unsigned long generation = entry->load_generation;
+		while(entry->loading && generation == entry->load_generation)
+			pthread_cond_wait(&entry->cond, &entry->lock);
+		// A load given up because its reader was interrupted is made again,
+		// by the first waiter to get here
+		if(entry->load_result >= 0 || gdi_interrupted())
+		{
+			ret = entry->load_result != 0;
+			pthread_mutex_unlock(&entry->lock);
+			return ret;
+		}
+	}
+	entry->loading = 1;
+	pthread_mutex_unlock(&entry->lock);
+
+	struct gd_content_t *current = gd_content_get(entry);
+	if(current)
+	{
+		int updated = gdi_check_update(state, entry, current);
+		switch(updated)
+		{
+			case -1:
+				ret = 1;
+				break;
+			case 0:
+				ret = 0;
+				break;
+			case 1:
+				ret = gdi_download(state, entry);
+				break;
+		}
+	}
+	else
+		ret = gdi_download(state, entry);
+	gd_content_put(current);
+
+	pthread_mutex_lock(&entry->lock);
+	entry->loading = 0;
+	entry->load_result = (ret && gdi_interrupted()) ? -EINTR : ret;
+	++entry->load_generation;
+	pthread_cond_broadcast(&entry->cond);
+	pthread_mutex_unlock(&entry->lock);
+
+	return ret;
+}
+
+// What gdi_hedge_init() needs to duplicate a range request
+struct gdi_hedge_arg_t {
+	struct gdi_state *state;
+	struct gd_fs_entry_t *entry;
+	enum request_priority_e priority;
+	long deadline;
+	off_t offset;
+	size_t size;
+};
+
+/** Build the duplicate of a range request, for ci_request_hedged().
+ *
+ *  @hedge struct request_t*         the request to initialize
+ *  @arg   struct gdi_hedge_arg_t*   what the range request was made of
+ *
+ *  @returns 0 on success, 1 on failure
+ */
+static int gdi_hedge_init(struct request_t* hedge, void* arg)
+{
+	struct gdi_hedge_arg_t *range = (struct gdi_hedge_arg_t*) arg;
+
+	gdi_request_init(range->state, hedge, &range->entry->src, range->priority,
+			range->deadline);
+	if(ci_set_range(hedge, range->offset, range->size) != CURLE_OK)
+	{
+		ci_destroy(hedge);
+		return 1;
+	}
+	return 0;
+}
+
+/** Fetch part of an entry from the server.
+ *
+ *  Interactive range requests are hedged if they are slow to produce their
+ *  first byte.
+ *
+ *  @state    struct gdi_state*       the state for this mount
+ *  @entry    struct gd_fs_entry_t*   the entry to read from
+ *  @data     struct str_t*           receives the bytes, may be short at the end
+ *  @size     size_t                  the number of bytes wanted
+ *  @offset   off_t                   where in the entry to start reading
+ *  @priority enum request_priority_e the scheduler class for the request
+ *
+ *  @returns 0 on success, or a negative errno
+ */
+int gdi_fetch_range(struct gdi_state* state, struct gd_fs_entry_t* entry,
+		struct str_t* data, size_t size, off_t offset,
+		enum request_priority_e priority)
+{
+	int ret;
+	struct request_t request;
+	// Readahead runs on a thread of its own, with no FUSE request to poll
+	int background = priority == PRIORITY_READAHEAD;
+
+	long deadline = metadata_deadline_ms + size / download_min_rate * 1000;
+	gdi_request_init(state, &request, &entry->src, priority, deadline);
+	ci_set_range(&request, offset, size);
+	if(background)
+		ci_set_cancel(&request, NULL);
+
+	// The duplicate is only built if the request is slow to start
+	struct gdi_hedge_arg_t hedge = { state, entry, priority, deadline, offset, size };
+	if(priority == PRIORITY_INTERACTIVE)
+		ret = ci_request_hedged(&request, gdi_hedge_init, &hedge);
+	else
+		ret = ci_request(&request);
+	if(gdi_request_ok(&request, ret))
+	{
+		const struct str_t *body = &request.response.body;
+		size_t skip = 0;
+		// A 200 means the server ignored the range and sent the whole file
+		if(request.status == 200)
+			skip = (body->len < offset) ? body->len : offset;
+		size_t length = (body->len - skip < size) ? body->len - skip : size;
+		ret = str_char_concat(data, body->str + skip, length) ? -ENOMEM : 0;
+	}
+	else
+		ret = gdi_interrupted() ? -EINTR : -EIO;
+
+	ci_destroy(&request);
+	return ret;
+}
+
+/** Read part of an entry straight from the server.
+ *
+ *  Bytes another reader is already fetching are not requested again, this
+ *  read attaches to that fetch and only requests the gaps between fetches.
+ *  A fetch given up because the reader making it was interrupted is made
+ *  again by this one.
+ *
+ *  @state  struct gdi_state*     the state for this mount
+ *  @entry  struct gd_fs_entry_t* the entry to read from
+ *  @buf    char*                 where to put the data
+ *  @size   size_t                the number of bytes wanted
+ *  @offset off_t                 where in the entry to start reading
+ *
+ *  @returns the number of bytes read, or a negative errno
+ */
+int gdi_read_range(struct gdi_state* state, struct gd_fs_entry_t* entry,
+		char* buf, size_t size, off_t offset)
+{
+	off_t pos = offset;
+	off_t end;
+
+	if(offset >= entry->size)
+		return 0;
+	if(offset + size > entry->size)
+		size = entry->size - offset;
+	end = offset + size;
+
+	while(pos < end)
+	{
+		struct gd_range_flight_t *flight;
+		int ret = gd_flight_join(entry, pos, end, &flight);
+		if(ret < 0)
+			return -ENOMEM;
+
+		if(ret)
+			gd_flight_complete(entry, flight, gdi_fetch_range(state, entry,
+						&flight->data, flight->length, flight->start,
+						PRIORITY_INTERACTIVE));
+		else
+			gd_flight_wait(entry, flight);
+
+		ret = flight->result;
+		// The reader fetching it was interrupted, this one was not, so it
+		// fetches the range itself
+		if(ret == -EINTR && !gdi_interrupted())
+		{
+			gd_flight_release(entry, flight);
+			continue;
+		}
+		if(!ret)
+		{
+			size_t skip = pos - flight->start;
+			size_t wanted = end - pos;
+			size_t length = (flight->data.len > skip) ? flight->data.len - skip : 0;
+			if(length > wanted)
+				length = wanted;
+			memcpy(buf + (pos - offset), flight->data.str + skip, length);
+			pos += length;
+			// The flight came back short, there is nothing past it
+			if(flight->data.len < flight->length && skip + length == flight->data.len)
+				end = pos;
+		}
+		gd_flight_release(entry, flight);
+
+		if(ret)
+			return (pos > offset) ? pos - offset : ret;
+	}
+
+	return pos - offset;
+}
+
+/** Find the bytes of a content version to satisfy a read.
+ *
+ *  No locks are taken, the version is immutable and pinned by the caller.
+ *
+ *  @size    size_t*             the number of bytes wanted, set to the number
+ *                               of bytes available
+ *  @content struct gd_content_t* the version to read from
+ *  @offset  off_t               where to start reading
+ *
+ *  @returns a pointer to the bytes, or NULL if there are none
+ */
+const char* gdi_read(size_t *size, const struct gd_content_t* content, off_t offset)
+{
+	const struct str_t *data = &content->data;
+	size_t remaining = (data->len < offset) ? 0 : data->len - offset;
+	*size = (remaining < *size) ? remaining : *size;
+	if(*size == 0)
+		return NULL;
+	return data->str + offset;
+}
+
+/** Open a handle on an entry.
+ *
+ *  The handle carries everything a read needs, so reads do no lookups. The
+ *  current content version is pinned for the life of the handle.
+ *
+ *  @state struct gdi_state*     the state for this mount
+ *  @entry struct gd_fs_entry_t* the loaded entry to open
+ *
+ *  @returns the new handle, or NULL on failure
+ */
+struct gd_handle_t* gdi_handle_open(struct gdi_state* state, struct gd_fs_entry_t* entry)
+{
+	struct gd_handle_t *handle;
+
+	handle = (struct gd_handle_t*) malloc(sizeof(struct gd_handle_t));
+	if(handle == NULL)
+		return NULL;
+	memset(handle, 0, sizeof(struct gd_handle_t));
+
+	if(pthread_mutex_init(&handle->lock, NULL))
+	{
+		free(handle);
+		return NULL;
+	}
+
+	handle->state = state;
+	handle->entry = entry;
+	// Ranged entries have no content version
+	handle->content = gd_content_get(entry);
+	handle->window = readahead_min;
+
+	return handle;
+}
+
+/** Close a handle, dropping its pinned version and readahead.
+ */
+void gdi_handle_release(struct gd_handle_t* handle)
+{
+	if(handle == NULL)
+		return;
+
+	gd_content_put(handle->content);
+	if(handle->ahead)
+		gd_flight_release(handle->entry, handle->ahead);
+	pthread_mutex_destroy(&handle->lock);
+	free(handle);
+}
+
+struct gdi_readahead_t {
+	struct gdi_state *state;
+	struct gd_fs_entry_t *entry;
+	struct gd_range_flight_t *flight;
+};
+
+/** Fetch a readahead flight in the background.
+ *
+ *  @arg struct gdi_readahead_t* what to fetch, freed here
+ */
+void* gdi_readahead_thread(void* arg)
+{
+	struct gdi_readahead_t *ahead = (struct gdi_readahead_t*) arg;
+	struct gdi_state *state = ahead->state;
+	struct gd_range_flight_t *flight = ahead->flight;
+
+	gd_flight_complete(ahead->entry, flight, gdi_fetch_range(state,
+				ahead->entry, &flight->data, flight->length, flight->start,
+				PRIORITY_READAHEAD));
+	gd_flight_release(ahead->entry, flight);
+	free(ahead);
+
+	pthread_mutex_lock(&state->background_lock);
+	if(!--state->background)
+		pthread_cond_broadcast(&state->background_done);
+	pthread_mutex_unlock(&state->background_lock);
+
+	return NULL;
+}
+
+/** Start fetching ahead of a sequential reader.
+ *
+ *  Must be called with handle->lock held. The handle's previous readahead, if
+ *  any, is replaced.
+ *
+ *  @handle struct gd_handle_t* the handle to read ahead for
+ *  @start  off_t               the first byte to fetch
+ */
+void gdi_readahead(struct gd_handle_t* handle, off_t start)
+{
+	struct gd_fs_entry_t *entry = handle->entry;
+	struct gd_range_flight_t *flight;
+	off_t end = start + handle->window;
+	pthread_t thread;
+	pthread_attr_t attr;
+
+	if(start >= entry->size)
+		return;
+	if(end > entry->size)
+		end = entry->size;
+
+	int owner = gd_flight_join(entry, start, end, &flight);
+	if(owner < 0)
+		return;
+
+	if(owner)
+	{
+		struct gdi_readahead_t *ahead;
+		ahead = (struct gdi_readahead_t*) malloc(sizeof(struct gdi_readahead_t));
+		if(ahead == NULL)
+		{
+			gd_flight_complete(entry, flight, -ENOMEM);
+			gd_flight_release(entry, flight);
+			return;
+		}
+		ahead->state = handle->state;
+		ahead->entry = entry;
+		ahead->flight = flight;
+
+		// One reference for the thread, one for the handle
+		gd_flight_get(entry, flight);
+
+		pthread_mutex_lock(&handle->state->background_lock);
+		++handle->state->background;
+		pthread_mutex_unlock(&handle->state->background_lock);
+
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		if(pthread_create(&thread, &attr, gdi_readahead_thread, ahead))
+		{
+			// Nobody will fetch it, fail it so readers fetch it themselves
+			free(ahead);
+			gd_flight_complete(entry, flight, -EAGAIN);
+			gd_flight_release(entry, flight);
+			pthread_mutex_lock(&handle->state->background_lock);
+			--handle->state->background;
+			pthread_mutex_unlock(&handle->state->background_lock);
+		}
+		pthread_attr_destroy(&attr);
+	}
+
+	if(handle->ahead)
+		gd_flight_release(entry, handle->ahead);
+	handle->ahead = flight;
+}
+
+/** Find the bytes for a read of a pinned version without copying them.
+ *
+ *  @handle struct gd_handle_t* the handle to read from
+ *  @data   const char**        set to the bytes, NULL if there are none
+ *  @size   size_t*             the number of bytes wanted, set to the number
+ *                              of bytes available
+ *  @offset off_t               where to start reading
+ *
+ *  @returns 1 if data and size were set, 0 if the handle has no pinned version
+ *           and the read must go through gdi_handle_read()
+ */
+int gdi_handle_peek(struct gd_handle_t* handle, const char** data, size_t* size, off_t offset)
+{
+	if(!handle->content)
+		return 0;
+
+	*data = gdi_read(size, handle->content, offset);
+	__sync_add_and_fetch(&handle->stats.reads, 1);
+	__sync_add_and_fetch(&handle->stats.bytes, *size);
+	return 1;
+}
+
+/** Read from an open handle.
+ *
+ *  Reads of a pinned version are served straight from memory, staged entries
+ *  from their staging file. Ranged entries are served from the handle's readahead where possible, and sequential
+ *  readers get a growing window fetched ahead of them in the background.
+ *
+ *  @handle struct gd_handle_t* the handle to read from
+ *  @buf    char*               where to put the data
+ *  @size   size_t              the number of bytes wanted
+ *  @offset off_t               where to start reading
+ *
+ *  @returns the number of bytes read, or a negative errno
+ */
+int gdi_handle_read(struct gd_handle_t* handle, char* buf, size_t size, off_t offset)
+{
+	struct gd_fs_entry_t *entry = handle->entry;
+	struct gd_range_flight_t *ahead = NULL;
+	size_t copied = 0;
+	int ret;
+
+	const char *chunk;
+	size_t length = size;
+	if(gdi_handle_peek(handle, &chunk, &length, offset))
+	{
+		memcpy(buf, chunk, length);
+		return length;
+	}
+
+	__sync_add_and_fetch(&handle->stats.reads, 1);
+
+	if(gdw_is_staged(entry))
+	{
+		ret = gdw_read(entry, buf, size, offset);
+		if(ret > 0)
+			__sync_add_and_fetch(&handle->stats.bytes, ret);
+		// Otherwise it was uploaded and closed, the server has the contents
+		if(ret != -ESTALE)
+			return ret;
+	}
+
+	pthread_mutex_lock(&handle->lock);
+	if(handle->ahead && handle->ahead->start <= offset
+			&& offset < handle->ahead->start + (off_t) handle->ahead->length)
+	{
+		ahead = handle->ahead;
+		gd_flight_get(entry, ahead);
+	}
+	pthread_mutex_unlock(&handle->lock);
+
+	if(ahead)
+	{
+		gd_flight_wait(entry, ahead);
+		if(!ahead->result)
+		{
+			size_t skip = offset - ahead->start;
+			copied = (ahead->data.len > skip) ? ahead->data.len - skip : 0;
+			if(copied > size)
+				copied = size;
+			memcpy(buf, ahead->data.str + skip, copied);
+			__sync_add_and_fetch(&handle->stats.readahead_hits, 1);
+		}
+		gd_flight_release(entry, ahead);
+	}
+
+	ret = 0;
+	if(copied < size && offset + copied < entry->size)
+		ret = gdi_read_range(handle->state, entry, buf + copied,
+				size - copied, offset + copied);
+	if(ret < 0 && !copied)
+		return ret;
+	if(ret > 0)
+		copied += ret;
+
+	pthread_mutex_lock(&handle->lock);
+	if(offset == handle->next_offset)
+	{
+		off_t end = offset + copied;
+		off_t ahead_end = handle->ahead ?
+			handle->ahead->start + (off_t) handle->ahead->length : 0;
+
+		// Keep at least half a window between the reader and the end of the
+		// data already fetched ahead
+		if(!handle->ahead || ahead_end - end < (off_t) handle->window / 2)
+		{
+			if(handle->window < readahead_max)
+				handle->window *= 2;
+			gdi_readahead(handle, ahead_end > end ? ahead_end : end);
+		}
+	}
+	else
+		handle->window = readahead_min;
+	handle->next_offset = offset + copied;
+	pthread_mutex_unlock(&handle->lock);
+
+	__sync_add_and_fetch(&handle->stats.bytes, copied);
+	return copied;
+}
+
+/** Prepare a request that sends an Atom document on behalf of a FUSE operation.
+ *
+ *  Like gdi_request_init(), but POSTs body, which must stay valid until the
+ *  request is destroyed.
+ *
+ *  @state       struct gdi_state*       the state for this mount
+ *  @request     struct request_t*       the request to initialize
+ *  @uri         struct str_t*           the uri to post to
+ *  @body        const char*             the Atom document to send
+ *  @priority    enum request_priority_e the scheduler class for this request
+ *  @deadline_ms long                    the time budget, 0 for no limit
+ */
+void gdi_post_init(struct gdi_state* state, struct request_t* request,
+		struct str_t* uri, const char* body, enum request_priority_e priority,
+		long deadline_ms)
+{
+	struct str_t headers[3];
+
+	headers[0] = *state->oauth_header;
+	str_init_create(&headers[1], "GData-Version: 3.0", 0);
+	str_init_create(&headers[2], "Content-Type: application/atom+xml", 0);
+
+	ci_init(request, uri, 3, headers, body, POST);
+	ci_set_priority(request, priority);
+	ci_set_deadline(request, deadline_ms);
+	ci_set_cancel(request, gdi_interrupted);
+
+	str_destroy(&headers[1]);
+	str_destroy(&headers[2]);
+}
+
+/** Append an Atom title element naming an entry to a request body.
+ *
+ *  @body     struct str_t*       the body to append to
+ *  @filename const struct str_t* the escaped filename of the entry
+ *
+ *  @returns 0 on success, 1 if out of memory
+ */
+int gdi_atom_title(struct str_t* body, const struct str_t* filename)
+{
+	char *title = filenamedecode(filename->str, filename->len);
+	if(title == NULL)
+		return 1;
+	xmlChar *escaped = xmlEncodeSpecialChars(NULL, (xmlChar*) title);
+	free(title);
+	if(escaped == NULL)
+		return 1;
+
+	str_char_concat(body, "<title>", 7);
+	str_char_concat(body, (char*) escaped, xmlStrlen(escaped));
+	str_char_concat(body, "</title>", 8);
+	xmlFree(escaped);
+	return 0;
+}
+
+/** Copy an entry on the server, giving the copy the name of another entry.
+ *
+ *  No content goes over the wire. dst, which must not exist on the server yet,
+ *  takes on the metadata of the new copy, and shares src's content version if
+ *  src has one loaded since the bytes are identical.
+ *
+ *  @state struct gdi_state*     the state for this mount
+ *  @src   struct gd_fs_entry_t* the entry to copy
+ *  @dst   struct gd_fs_entry_t* the local entry that becomes the copy
+ *
+ *  @returns 0 on success, or a negative errno
+ */
+int gdi_copy(struct gdi_state* state, struct gd_fs_entry_t* src, struct gd_fs_entry_t* dst)
+{
+	int ret = 0;
+	struct request_t request;
+	struct str_t body;
+	struct str_t uri;
+
+	str_init_create(&body, "<?xml version='1.0' encoding='UTF-8'?>"
+			"<entry xmlns=\"http://www.w3.org/2005/Atom\"><id>", 0);
+	str_char_concat(&body, entry_id_prefix, sizeof(entry_id_prefix) - 1);
+	str_char_concat(&body, src->resourceID.str, src->resourceID.len);
+	str_char_concat(&body, "</id>", 5);
+	if(gdi_atom_title(&body, &dst->filename))
+	{
+		str_destroy(&body);
+		return -ENOMEM;
+	}
+	str_char_concat(&body, "</entry>", 8);
+
+	str_init_create(&uri, feed_uri, 0);
+	gdi_post_init(state, &request, &uri, body.str, PRIORITY_OPEN, metadata_deadline_ms);
+
+	if(gdi_request_ok(&request, ci_request(&request)))
+	{
+		struct gd_fs_entry_t *copy = xml_parse_entry(&request.response.body);
+		if(copy)
+		{
+			// Keep dst's name and inode, take everything that identifies the
+			// server side file from the copy
+			pthread_mutex_lock(&dst->lock);
+			gd_fs_entry_swap_id(dst, &copy->resourceID);
+			str_swap(&dst->src, &copy->src);
+			str_swap(&dst->feed, &copy->feed);
+			str_swap(&dst->edit_media, &copy->edit_media);
+			str_swap(&dst->edit, &copy->edit);
+			str_swap(&dst->parent, &copy->parent);
+			str_swap(&dst->md5, &copy->md5);
+			str_swap(&dst->revision, &copy->revision);
+			dst->md5set = copy->md5set;
+			dst->size = copy->size;
+			dst->mtime = copy->mtime;
+			dst->ctime = copy->ctime;
+			gd_fs_entry_stat(dst);
+			pthread_mutex_unlock(&dst->lock);
+
+			// Anything staged for dst is superseded by the copy
+			gdw_discard(dst);
+			struct gd_content_t *content = gd_content_get(src);
+			if(content)
+				gd_content_publish(dst, content);
+
+			gd_fs_entry_destroy(copy);
+			free(copy);
+		}
+		else
+			ret = -EIO;
+	}
+	else
+		ret = gdi_interrupted() ? -EINTR : -EIO;
+
+	ci_destroy(&request);
+	str_destroy(&uri);
+	str_destroy(&body);
+	return ret;
+}
+
+/** Create an entry for a new file or folder, which exists only locally until
+ *  uploaded.
+ *
+ *  The entry is added to the listing and the lookup tables. Only the root
+ *  has entries unless in lazy mode.
+ *
+ *  @state  struct gdi_state* the state for this mount
+ *  @parent fuse_ino_t        the inode number of the folder to create it in
+ *  @name   const char*       the escaped name of the file
+ *  @folder int               nonzero to create a folder
+ *
+ *  @returns the new entry, or NULL if the name is taken or on failure
+ */
+struct gd_fs_entry_t* gdi_create(struct gdi_state* state, fuse_ino_t parent,
+		const char* name, int folder)
+{
+	if(!state->lazy_listing && parent != FUSE_ROOT_ID)
+		return NULL;
+
+	struct gd_fs_entry_t *entry = gd_fs_entry_create(name);
+	if(entry == NULL)
+		return NULL;
+	entry->is_folder = folder;
+	gd_fs_entry_stat(entry);
+
+	if(state->lazy_listing)
+	{
+		if(gdd_insert(parent, entry))
+		{
+			gd_fs_entry_destroy(entry);
+			free(entry);
+			return NULL;
+		}
+		gdn_added(parent, name, 0);
+		return entry;
+	}
+
+	pthread_mutex_lock(&state->list_lock);
+	if(gd_fs_entry_insert(entry))
+	{
+		pthread_mutex_unlock(&state->list_lock);
+		gd_fs_entry_destroy(entry);
+		free(entry);
 		return NULL;
-	return entry->cache.str + offset;
+	}
+
+	// Readers walk the list unlocked, entry must be complete before it is linked
+	__sync_synchronize();
+	if(state->tail)
+		state->tail->next = entry;
+	else
+		state->head = entry;
+	state->tail = entry;
+	++state->num_files;
+	pthread_mutex_unlock(&state->list_lock);
+	gd_fs_entry_changed(NULL);
+	gdn_added(FUSE_ROOT_ID, name, 0);
+
+	return entry;
+}
+
+/** Rename an entry within the folder it is in.
+ *
+ *  @state    struct gdi_state*     the state for this mount
+ *  @entry    struct gd_fs_entry_t* the entry to rename
+ *  @filename const char*           the new escaped name
+ *
+ *  @returns 0 on success, 1 if the name is taken or on failure
+ */
+int gdi_rename(struct gdi_state* state, struct gd_fs_entry_t* entry,
+		const char* filename)
+{
+	if(state->lazy_listing)
+		return gdd_rename(entry, filename);
+	return gd_fs_entry_rename(entry, filename);
+}
+
+/** Check if a folder has nothing in it.
+ *
+ *  @state  struct gdi_state*     the state for this mount
+ *  @folder struct gd_fs_entry_t* the folder to check
+ *
+ *  @returns nonzero if no entry that still exists has folder as its parent
+ */
+int gdi_folder_empty(struct gdi_state* state, struct gd_fs_entry_t* folder)
+{
+	struct gd_fs_entry_t *iter;
+
+	// Only in lazy mode is anything created in a folder here
+	if(state->lazy_listing)
+		return gdd_empty(folder);
+	// A folder the server has not seen yet cannot have been used as a parent
+	if(!folder->resourceID.len)
+		return 1;
+	gdi_wait_listed(state);
+	for(iter = state->head; iter != NULL; iter = iter->next)
+		if(!iter->deleted && iter->parent.len
+				&& strcmp(iter->parent.str, folder->resourceID.str) == 0)
+			return 0;
+	return 1;
 }
@@ -19,14 +19,17 @@
 #ifndef _GOOGLE_DRIVE_INTERFACE_H
 #define _GOOGLE_DRIVE_INTERFACE_H
 
-#define FUSE_USE_VERSION 26
+#define FUSE_USE_VERSION 34
 
 #include <curl/curl.h>
 #include <curl/multi.h>
-#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <pthread.h>
 #include <stdlib.h>
 
+#include "curl_interface.h"
 #include "gd_cache.h"
+#include "request_scheduler.h"
 #include "stack.h"
 #include "str.h"
 
@@ -49,25 +52,123 @@ struct gdi_state {
 	struct gd_fs_entry_t *head;
 	struct gd_fs_entry_t *tail;
 	size_t num_files;
+	// Serializes appending entries, readers walk the list without it
+	pthread_mutex_t list_lock;
+	// The listing runs in the background after mount, list_grown is signalled
+	// with list_lock whenever it adds a page, and once more when listed is set
+	pthread_cond_t list_grown;
+	int listed;
+	// List each folder when it is first used instead of every file at mount,
+	// and free the contents of folders that go unused, see gd_dir.c. For
+	// accounts too large to hold in memory. Set by -o lazy_listing.
+	int lazy_listing;
+	// Set with listed if the listing failed part way, names it did not get to
+	// are then still asked for one by one
+	int list_failed;
 
 	struct stack_t *stack;
+	// The configuration directory, with a trailing '/'
+	char *config_path;
+	// How far gdi_start() got: 1 once the batch senders run, 2 the uploaders,
+	// 3 the journal workers
+	int started;
 
 	int callback_error;
 
-	struct str_t oauth_header;
+	// The Authorization header for requests. Replaced whole when the access
+	// token is renewed, see gd_auth.c, so read the pointer once per request.
+	struct str_t *oauth_header;
+
+	// Background threads still running, gdi_destroy() waits for them
+	size_t background;
+	pthread_mutex_t background_lock;
+	pthread_cond_t background_done;
+};
+
+struct gd_handle_stats_t {
+	unsigned long reads;
+	unsigned long bytes;
+	unsigned long readahead_hits;
+};
+
+/** The state of one open file, stored in fuse_file_info->fh.
+ */
+struct gd_handle_t {
+	struct gdi_state *state;
+	struct gd_fs_entry_t *entry;
+	// The version pinned at open, NULL for ranged and staged entries
+	struct gd_content_t *content;
+	// Set if the handle was opened for writing with gdw_open()
+	int writable;
+
+	// Protects the readahead state below
+	pthread_mutex_t lock;
+	// Where the next read starts if the reader is sequential
+	off_t next_offset;
+	// How much to fetch ahead of a sequential reader
+	size_t window;
+	// The range fetched ahead of the reader, we hold a reference to it
+	struct gd_range_flight_t *ahead;
+
+	// Updated with atomic operations
+	struct gd_handle_stats_t stats;
 };
 
 char* urlencode (const char *url, size_t* length);
 
 int gdi_get_credentials();
+char* load_file(const char* path, const char* name);
 
 int gdi_init(struct gdi_state *state);
+int gdi_start(struct gdi_state *state);
 void gdi_destroy(struct gdi_state *state);
 
 /* Interface for various operations */
-void gdi_get_file_list(struct gdi_state *state);
+int gdi_get_file_list(struct gdi_state *state);
+void gdi_wait_listed(struct gdi_state *state);
+struct gd_fs_entry_t* gdi_next_listed(struct gdi_state *state, struct gd_fs_entry_t *prev);
+struct gd_fs_entry_t* gdi_find(struct gdi_state *state, const char *name);
+struct gd_fs_entry_t* gdi_lookup(struct gdi_state *state, fuse_ino_t parent,
+		const char *name, int *missing);
+struct gd_fs_entry_t* gdi_find_id(struct gdi_state *state, const char *resourceID);
+struct gd_fs_entry_t* gdi_adopt(struct gdi_state *state, struct gd_fs_entry_t *entry);
+struct gd_fs_entry_t* gdi_next_child(struct gdi_state *state, fuse_ino_t ino,
+		struct gd_fs_entry_t *prev);
+int gdi_search(struct gdi_state *state, const char *text,
+		struct gd_fs_entry_t **entries);
+int gdi_list_folder(struct gdi_state *state, const struct gd_fs_entry_t *folder,
+		struct gd_fs_entry_t **entries);
 const char* gdi_strip_path(const char* path);
+void gdi_set_request(fuse_req_t req);
+int gdi_interrupted(void);
+void gdi_request_init(struct gdi_state* state, struct request_t* request,
+		struct str_t* uri, enum request_priority_e priority, long deadline_ms);
+int gdi_request_ok(const struct request_t* request, int curl_ret);
+void gdi_post_init(struct gdi_state* state, struct request_t* request,
+		struct str_t* uri, const char* body, enum request_priority_e priority,
+		long deadline_ms);
+int gdi_download(struct gdi_state* state, struct gd_fs_entry_t* entry);
+int gdi_is_ranged(const struct gd_fs_entry_t* entry);
 int gdi_load(struct gdi_state* state, struct gd_fs_entry_t* entry);
-const char* gdi_read(size_t *size, struct gd_fs_entry_t* entry, off_t offset);
+int gdi_fetch_range(struct gdi_state* state, struct gd_fs_entry_t* entry,
+		struct str_t* data, size_t size, off_t offset,
+		enum request_priority_e priority);
+int gdi_read_range(struct gdi_state* state, struct gd_fs_entry_t* entry,
+		char* buf, size_t size, off_t offset);
+const char* gdi_read(size_t *size, const struct gd_content_t* content, off_t offset);
+
+struct gd_handle_t* gdi_handle_open(struct gdi_state* state, struct gd_fs_entry_t* entry);
+void gdi_handle_release(struct gd_handle_t* handle);
+void gdi_readahead(struct gd_handle_t* handle, off_t start);
+
+int gdi_atom_title(struct str_t* body, const struct str_t* filename);
+int gdi_copy(struct gdi_state* state, struct gd_fs_entry_t* src, struct gd_fs_entry_t* dst);
+struct gd_fs_entry_t* gdi_create(struct gdi_state* state, fuse_ino_t parent,
+		const char* name, int folder);
+int gdi_rename(struct gdi_state* state, struct gd_fs_entry_t* entry,
+		const char* filename);
+int gdi_folder_empty(struct gdi_state* state, struct gd_fs_entry_t* folder);
+int gdi_handle_peek(struct gd_handle_t* handle, const char** data, size_t* size, off_t offset);
+int gdi_handle_read(struct gd_handle_t* handle, char* buf, size_t size, off_t offset);
 
 #endif
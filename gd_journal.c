@@ -0,0 +1,1104 @@
+/*
+	fuse-google-drive: a fuse filesystem wrapper for Google Drive
+	Copyright (C) 2012  James Cline
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2 as
+ 	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "curl_interface.h"
+#include "gd_cache.h"
+#include "gd_dir.h"
+#include "gd_interface.h"
+#include "gd_journal.h"
+#include "gd_writeback.h"
+#include "request_scheduler.h"
+#include "str.h"
+
+static struct gdj_state_t journal;
+
+const char folder_feed_uri[] = "https://docs.google.com/feeds/default/private/full";
+
+// Time allowed for replaying one change
+const long replay_deadline_ms = 30000;
+// A change waiting for something else, such as the first upload of a file,
+// is looked at again after this long
+const long replay_defer_ms = 1000;
+// A change the server refused or that could not be sent is tried again after
+// this long. Whatever is left at unmount is replayed at the next mount.
+const long replay_retry_ms = 30000;
+
+void* gdj_worker(void* arg);
+static int gdj_recover(const char* name);
+
+/** Start the journal.
+ *
+ *  Replays anything an earlier mount left in the journal file under path onto
+ *  the index, then starts the workers that send it on. If there is anything
+ *  to replay this waits for the listing to finish.
+ *
+ *  @state struct gdi_state* the state for this mount
+ *  @path  const char*       the configuration directory, with a trailing '/'
+ *
+ *  @returns 0 on success, 1 on failure
+ */
+int gdj_init(struct gdi_state* state, const char* path)
+{
+	const char file[] = "journal";
+	pthread_condattr_t attr;
+
+	memset(&journal, 0, sizeof(struct gdj_state_t));
+	journal.gdi = state;
+
+	char *name = (char*) malloc(strlen(path) + sizeof(file));
+	if(name == NULL)
+		return 1;
+	memcpy(name, path, strlen(path));
+	memcpy(name + strlen(path), file, sizeof(file));
+
+	journal.fd = open(name, O_RDWR | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR);
+	if(journal.fd < 0)
+	{
+		printf("open(\"%s\"): %s\n", name, strerror(errno));
+		free(name);
+		return 1;
+	}
+
+	pthread_mutex_init(&journal.lock, NULL);
+	// Replay due times are monotonic
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&journal.cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	// Records name files by resourceID, so they are matched against the whole
+	// listing. Only a mount that did not finish replaying waits for it here.
+	struct stat info;
+	if(fstat(journal.fd, &info) == 0 && info.st_size > 0)
+		gdi_wait_listed(state);
+	if(gdj_recover(name))
+		printf("Could not replay %s, changes made during the last mount may be lost\n", name);
+	free(name);
+
+	for(; journal.started < GDJ_WORKERS; ++journal.started)
+		if(pthread_create(&journal.workers[journal.started], NULL, gdj_worker, NULL))
+			break;
+
+	if(!journal.started)
+	{
+		pthread_cond_destroy(&journal.cond);
+		pthread_mutex_destroy(&journal.lock);
+		close(journal.fd);
+		return 1;
+	}
+
+	return 0;
+}
+
+/** Stop the journal.
+ *
+ *  Every entry still queued is replayed first. Changes that fail now stay in
+ *  the journal file for the next mount.
+ */
+void gdj_destroy()
+{
+	pthread_mutex_lock(&journal.lock);
+	journal.stopping = 1;
+	pthread_cond_broadcast(&journal.cond);
+	pthread_mutex_unlock(&journal.lock);
+
+	size_t iter;
+	for(iter = 0; iter < journal.started; ++iter)
+		pthread_join(journal.workers[iter], NULL);
+
+	pthread_cond_destroy(&journal.cond);
+	pthread_mutex_destroy(&journal.lock);
+	close(journal.fd);
+}
+
+/** Append one field of a record to a line.
+ *
+ *  '%', '-', spaces and control characters are escaped as %XX, and a field
+ *  that is NULL is written as "-". filenamedecode() reverses this.
+ */
+static void gdj_concat_field(struct str_t* line, const char* field)
+{
+	str_char_concat(line, " ", 1);
+	if(field == NULL)
+	{
+		str_char_concat(line, "-", 1);
+		return;
+	}
+	for(; *field; ++field)
+	{
+		if(*field == '%' || *field == '-' || (unsigned char) *field <= ' ')
+		{
+			char hex[4];
+			snprintf(hex, sizeof(hex), "%%%02X", (unsigned char) *field);
+			str_char_concat(line, hex, 3);
+		}
+		else
+			str_char_concat(line, field, 1);
+	}
+}
+
+/** Append a record to the journal file and make it durable.
+ *
+ *  Records are lines of "<seq> <op> <key> <name>", where op is one of M, R
+ *  and D for the changes and C for "every earlier record under key is done".
+ *  The name is escaped by gdj_concat_field(). M records of folders created
+ *  in a folder other than the root end in the key of that folder, and the C
+ *  record of a created folder has its new resourceID as name, so later
+ *  records can still find it by the key it had before. Must be called with
+ *  journal.lock held.
+ *
+ *  A record that could not be written in full or made durable is cut off
+ *  again, so the file never ends in half a line.
+ *
+ *  @op     char                the kind of record
+ *  @key    const struct str_t* the key of the entry
+ *  @name   const char*         the name, or NULL for none
+ *  @parent const char*         the key of the folder, or NULL for the root
+ *
+ *  @returns the sequence number of the record, 0 on failure
+ */
+static unsigned long gdj_append(char op, const struct str_t* key, const char* name,
+		const char* parent)
+{
+	struct str_t line;
+	char head[64];
+	unsigned long seq = ++journal.seq;
+
+	snprintf(head, sizeof(head), "%lu %c ", seq, op);
+	str_init_create(&line, head, 0);
+	str_char_concat(&line, key->str, key->len);
+	gdj_concat_field(&line, name);
+	if(parent)
+		gdj_concat_field(&line, parent);
+	str_char_concat(&line, "\n", 1);
+
+	struct stat info;
+	size_t done = 0;
+	int failed = fstat(journal.fd, &info) != 0;
+	while(!failed && done < line.len)
+	{
+		ssize_t count = write(journal.fd, line.str + done, line.len - done);
+		if(count < 0 && errno == EINTR)
+			continue;
+		if(count <= 0)
+			failed = 1;
+		else
+			done += count;
+	}
+	if(!failed && fdatasync(journal.fd))
+		failed = 1;
+	if(failed)
+	{
+		fprintf(stderr, "journal write: %s\n", strerror(errno ? errno : EIO));
+		if(done && ftruncate(journal.fd, info.st_size))
+			fprintf(stderr, "journal truncate: %s\n", strerror(errno));
+	}
+
+	str_destroy(&line);
+	return failed ? 0 : seq;
+}
+
+/** Queue an entry for replay.
+ *
+ *  Nothing is queued once the workers are stopping, changes that come back
+ *  then stay in the journal file for the next mount.
+ *
+ *  @entry    struct gd_fs_entry_t* the entry with changes to replay
+ *  @delay_ms long                  how long to wait before replaying
+ */
+static void gdj_queue(struct gd_fs_entry_t* entry, long delay_ms)
+{
+	struct timespec due;
+	clock_gettime(CLOCK_MONOTONIC, &due);
+	due.tv_sec += delay_ms / 1000;
+	due.tv_nsec += (delay_ms % 1000) * 1000000;
+	if(due.tv_nsec >= 1000000000)
+	{
+		++due.tv_sec;
+		due.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&journal.lock);
+	if(!entry->journal_queued && !journal.stopping)
+	{
+		entry->journal_queued = 1;
+		entry->journal_due = due;
+		entry->journal_next = NULL;
+		if(journal.tail)
+			journal.tail->journal_next = entry;
+		else
+			journal.head = entry;
+		journal.tail = entry;
+	}
+	pthread_cond_broadcast(&journal.cond);
+	pthread_mutex_unlock(&journal.lock);
+}
+
+/** Give an entry the key its journal records are filed under.
+ *
+ *  Entries on the server use their resourceID, others a name unique to this
+ *  mount. Must be called with entry->lock held.
+ */
+static void gdj_key(struct gd_fs_entry_t* entry)
+{
+	char local[64];
+
+	if(entry->journal_key.len)
+		return;
+	if(entry->resourceID.len)
+		str_init_create(&entry->journal_key, entry->resourceID.str, entry->resourceID.len);
+	else
+	{
+		snprintf(local, sizeof(local), "local:%llu", (unsigned long long) entry->ino);
+		str_init_create(&entry->journal_key, local, 0);
+	}
+}
+
+/** Get the key the folder an entry is in goes by in the journal.
+ *
+ *  The same as gdj_key() would give the folder. Must be called with no entry
+ *  locked.
+ *
+ *  @entry struct gd_fs_entry_t* the entry
+ *  @key   struct str_t*         initialized to the key, empty for the root
+ */
+static void gdj_parent_key(struct gd_fs_entry_t* entry, struct str_t* key)
+{
+	char local[64];
+	struct gd_fs_entry_t *folder = gdd_parent(entry);
+
+	str_init(key);
+	if(folder == NULL)
+		return;
+	pthread_mutex_lock(&folder->lock);
+	if(folder->resourceID.len)
+		str_char_concat(key, folder->resourceID.str, folder->resourceID.len);
+	else
+	{
+		snprintf(local, sizeof(local), "local:%llu", (unsigned long long) folder->ino);
+		str_char_concat(key, local, strlen(local));
+	}
+	pthread_mutex_unlock(&folder->lock);
+}
+
+/** Record the outstanding changes of an entry afresh.
+ *
+ *  Must be called with entry->lock and journal.lock held.
+ *
+ *  @entry  struct gd_fs_entry_t* the entry
+ *  @parent const struct str_t*   from gdj_parent_key(), only needed if the
+ *          creation of a folder is outstanding
+ */
+static void gdj_rerecord(struct gd_fs_entry_t* entry, const struct str_t* parent)
+{
+	gdj_key(entry);
+	if(entry->journal_ops & GDJ_MKDIR)
+		entry->journal_seq = gdj_append('M', &entry->journal_key, entry->filename.str,
+				(parent && parent->len) ? parent->str : NULL);
+	if(entry->journal_ops & GDJ_RENAME)
+		entry->journal_seq = gdj_append('R', &entry->journal_key, entry->filename.str, NULL);
+	if(entry->journal_ops & GDJ_DELETE)
+		entry->journal_seq = gdj_append('D', &entry->journal_key, NULL, NULL);
+}
+
+/** Record a change to an entry in the journal, without queueing it.
+ *
+ *  If the record cannot be made durable the entry's outstanding changes are
+ *  left as they were.
+ *
+ *  @entry struct gd_fs_entry_t* the changed entry
+ *  @op    enum gdj_op_e         the change
+ *
+ *  @returns nonzero if there is something to replay, 0 if not, or -EIO
+ */
+static int gdj_log(struct gd_fs_entry_t* entry, enum gdj_op_e op)
+{
+	const char codes[] = { 0, 'M', 'R', 0, 'D' };
+	struct str_t parent;
+
+	if(op == GDJ_MKDIR)
+		gdj_parent_key(entry, &parent);
+	else
+		str_init(&parent);
+
+	pthread_mutex_lock(&entry->lock);
+	gdj_key(entry);
+	pthread_mutex_lock(&journal.lock);
+	int ops = entry->journal_ops;
+	if(op == GDJ_DELETE)
+	{
+		// A folder that never reached the server needs nothing sent at all,
+		// unless a worker is creating it right now
+		if((ops & GDJ_MKDIR) && !entry->resourceID.len && !entry->journal_busy)
+			ops = 0;
+		else
+			ops = GDJ_DELETE;
+	}
+	else
+		ops |= op;
+
+	unsigned long seq = gdj_append(ops ? codes[op] : 'C', &entry->journal_key,
+			(op == GDJ_DELETE) ? NULL : entry->filename.str,
+			(ops && parent.len) ? parent.str : NULL);
+	if(seq)
+	{
+		entry->journal_ops = ops;
+		entry->journal_seq = seq;
+	}
+	pthread_mutex_unlock(&journal.lock);
+	if(seq && !ops)
+		str_destroy(&entry->journal_key);
+	pthread_mutex_unlock(&entry->lock);
+	str_destroy(&parent);
+
+	if(!seq)
+		return -EIO;
+	return ops != 0;
+}
+
+/** Record a change to an entry and queue it for replay.
+ *
+ *  The change must already be made to the local index.
+ *
+ *  @entry struct gd_fs_entry_t* the changed entry
+ *  @op    enum gdj_op_e         the change
+ *
+ *  @returns 0 on success, -EIO if the change could not be recorded
+ */
+static int gdj_record(struct gd_fs_entry_t* entry, enum gdj_op_e op)
+{
+	int ret = gdj_log(entry, op);
+	if(ret < 0)
+		return ret;
+	if(ret)
+		gdj_queue(entry, 0);
+	return 0;
+}
+
+/** Record the creation of a folder made with gdi_create().
+ *
+ *  @returns 0 on success, -EIO if it could not be recorded
+ */
+int gdj_mkdir(struct gd_fs_entry_t* entry)
+{
+	return gdj_record(entry, GDJ_MKDIR);
+}
+
+/** Rename an entry.
+ *
+ *  @entry    struct gd_fs_entry_t* the entry to rename
+ *  @filename const char*           the new escaped name, which must be free
+ *                                  in the folder the entry is in
+ *
+ *  @returns 0 on success, or a negative errno
+ */
+int gdj_rename(struct gd_fs_entry_t* entry, const char* filename)
+{
+	struct str_t old;
+
+	if(str_init_create(&old, entry->filename.str, entry->filename.len))
+		return -ENOMEM;
+	if(gdi_rename(journal.gdi, entry, filename))
+	{
+		str_destroy(&old);
+		return -EEXIST;
+	}
+
+	int ret = gdj_record(entry, GDJ_RENAME);
+	// Not recorded, so not made either
+	if(ret)
+		gdi_rename(journal.gdi, entry, old.str);
+	str_destroy(&old);
+	return ret;
+}
+
+/** Check if an entry has changes the server does not have yet.
+ */
+int gdj_busy(struct gd_fs_entry_t* entry)
+{
+	pthread_mutex_lock(&entry->lock);
+	pthread_mutex_lock(&journal.lock);
+	int busy = entry->journal_ops || entry->journal_queued || entry->journal_busy;
+	pthread_mutex_unlock(&journal.lock);
+	pthread_mutex_unlock(&entry->lock);
+	return busy;
+}
+
+/** Delete an entry.
+ *
+ *  Its name is freed at once, the entry itself lives on for open handles.
+ *  On the server it is moved to the trash. The deletion is recorded before
+ *  it is made, and not made if it cannot be recorded.
+ *
+ *  @returns 0 on success, -EIO if it could not be recorded
+ */
+int gdj_delete(struct gd_fs_entry_t* entry)
+{
+	int ret = gdj_log(entry, GDJ_DELETE);
+	if(ret < 0)
+		return ret;
+
+	gd_fs_entry_remove(entry);
+	pthread_mutex_lock(&entry->lock);
+	entry->deleted = 1;
+	pthread_mutex_unlock(&entry->lock);
+	gd_fs_entry_changed(gdd_parent(entry));
+
+	if(ret)
+		gdj_queue(entry, 0);
+	return 0;
+}
+
+/** Take back the deletion of an entry that gdj_log() recorded, the entry
+ *  was then not deleted after all.
+ *
+ *  The entry is listed again, under its name if it had one in the filename
+ *  table, and the changes it had outstanding before are recorded afresh.
+ *
+ *  @entry struct gd_fs_entry_t* the entry
+ *  @ops   int                   its journal_ops before the deletion
+ *  @named int                   what gd_fs_entry_remove() returned for it
+ */
+static void gdj_undelete(struct gd_fs_entry_t* entry, int ops, int named)
+{
+	struct str_t parent;
+
+	gdj_parent_key(entry, &parent);
+	pthread_mutex_lock(&entry->lock);
+	entry->deleted = 0;
+	gdj_key(entry);
+	pthread_mutex_lock(&journal.lock);
+	entry->journal_ops = ops;
+	entry->journal_seq = gdj_append('C', &entry->journal_key, NULL, NULL);
+	if(!entry->journal_seq)
+		fprintf(stderr, "Could not record that %s was kept\n", entry->filename.str);
+	if(ops)
+		gdj_rerecord(entry, &parent);
+	pthread_mutex_unlock(&journal.lock);
+	if(!ops)
+		str_destroy(&entry->journal_key);
+	pthread_mutex_unlock(&entry->lock);
+	str_destroy(&parent);
+
+	if(named && gd_fs_entry_restore(entry))
+		fprintf(stderr, "%s was taken meanwhile\n", entry->filename.str);
+	gd_fs_entry_changed(gdd_parent(entry));
+}
+
+/** Rename an entry over another one in the same folder, which is deleted.
+ *
+ *  The deletion is recorded and made first, to free the name. If the rename
+ *  then fails the target is put back as it was, so it is never lost to a
+ *  rename that did not happen.
+ *
+ *  @entry    struct gd_fs_entry_t* the entry to rename
+ *  @target   struct gd_fs_entry_t* the entry that has the new name
+ *  @filename const char*           the new escaped name
+ *
+ *  @returns 0 on success, or a negative errno
+ */
+int gdj_replace(struct gd_fs_entry_t* entry, struct gd_fs_entry_t* target,
+		const char* filename)
+{
+	pthread_mutex_lock(&target->lock);
+	pthread_mutex_lock(&journal.lock);
+	int ops = target->journal_ops;
+	pthread_mutex_unlock(&journal.lock);
+	pthread_mutex_unlock(&target->lock);
+
+	int queue = gdj_log(target, GDJ_DELETE);
+	if(queue < 0)
+		return queue;
+
+	int named = gd_fs_entry_remove(target);
+	pthread_mutex_lock(&target->lock);
+	target->deleted = 1;
+	pthread_mutex_unlock(&target->lock);
+	gd_fs_entry_changed(gdd_parent(target));
+
+	int ret = gdj_rename(entry, filename);
+	if(ret)
+	{
+		gdj_undelete(target, ops, named);
+		return ret;
+	}
+
+	if(queue)
+		gdj_queue(target, 0);
+	return 0;
+}
+
+/** Prepare a request replaying a change.
+ *
+ *  @request struct request_t*   the request to initialize
+ *  @uri     struct str_t*       the uri to send to
+ *  @body    const char*         the Atom document to send, or NULL
+ *  @type    enum request_type_e POST, PUT or DELETE
+ */
+static void gdj_request_init(struct request_t* request, struct str_t* uri,
+		const char* body, enum request_type_e type)
+{
+	struct str_t headers[4];
+	size_t count = 3;
+
+	headers[0] = *journal.gdi->oauth_header;
+	str_init_create(&headers[1], "GData-Version: 3.0", 0);
+	str_init_create(&headers[2], "Content-Type: application/atom+xml", 0);
+	// Last writer wins, we do not track etags
+	if(type != POST)
+		str_init_create(&headers[count++], "If-Match: *", 0);
+
+	ci_init(request, uri, count, headers, body, type);
+	ci_set_priority(request, PRIORITY_SYNC);
+	ci_set_deadline(request, replay_deadline_ms);
+
+	while(--count)
+		str_destroy(&headers[count]);
+}
+
+/** Send a change to the server.
+ *
+ *  @entry struct gd_fs_entry_t* the entry the change is for
+ *  @op    enum gdj_op_e         the change
+ *
+ *  @returns 0 on success, -EAGAIN if the folder a new folder is in is not on
+ *           the server yet, or a negative errno
+ */
+static int gdj_send(struct gd_fs_entry_t* entry, enum gdj_op_e op)
+{
+	int ret = 0;
+	struct request_t request;
+	struct str_t body;
+	struct str_t uri;
+	const char head[] = "<?xml version='1.0' encoding='UTF-8'?>"
+		"<entry xmlns=\"http://www.w3.org/2005/Atom\">";
+	const char folder[] = "<category scheme=\"http://schemas.google.com/g/2005#kind\""
+		" term=\"http://schemas.google.com/docs/2007#folder\"/>";
+
+	// Entries the server does not let us edit have no edit link
+	if(op != GDJ_MKDIR && !entry->edit.len)
+		return -EACCES;
+
+	// Folders are created in the contents feed of the folder they are in,
+	// which must have been created first
+	struct str_t *parent = NULL;
+	if(op == GDJ_MKDIR)
+	{
+		struct str_t id;
+		ret = gdd_parent_id(entry, &id);
+		if(!ret && id.len && (parent = str_urlencode_str(&id)) == NULL)
+			ret = -ENOMEM;
+		str_destroy(&id);
+		if(ret)
+			return ret;
+	}
+
+	str_init(&body);
+	str_init(&uri);
+	if(op != GDJ_DELETE)
+	{
+		str_char_concat(&body, head, sizeof(head) - 1);
+		if(op == GDJ_MKDIR)
+			str_char_concat(&body, folder, sizeof(folder) - 1);
+		if(gdi_atom_title(&body, &entry->filename))
+		{
+			str_destroy(&body);
+			str_destroy(parent);
+			free(parent);
+			return -ENOMEM;
+		}
+		str_char_concat(&body, "</entry>", 8);
+	}
+
+	switch(op)
+	{
+		case GDJ_MKDIR:
+			str_init_create(&uri, folder_feed_uri, 0);
+			if(parent)
+			{
+				str_char_concat(&uri, "/", 1);
+				str_char_concat(&uri, parent->str, parent->len);
+				str_char_concat(&uri, "/contents", 9);
+				str_destroy(parent);
+				free(parent);
+			}
+			gdj_request_init(&request, &uri, body.str, POST);
+			break;
+		case GDJ_RENAME:
+			str_init_create(&uri, entry->edit.str, entry->edit.len);
+			gdj_request_init(&request, &uri, body.str, PUT);
+			break;
+		case GDJ_DELETE:
+			str_init_create(&uri, entry->edit.str, entry->edit.len);
+			gdj_request_init(&request, &uri, NULL, DELETE);
+			break;
+	}
+
+	ret = ci_request(&request);
+	if(op == GDJ_DELETE && ret == CURLE_OK
+			&& (request.status == 404 || request.status == 410))
+		; // Already gone
+	else if(!gdi_request_ok(&request, ret))
+		ret = -EIO;
+	else if(op == GDJ_MKDIR)
+	{
+		struct gd_fs_entry_t *created = xml_parse_entry(&request.response.body);
+		if(created)
+		{
+			pthread_mutex_lock(&entry->lock);
+			gd_fs_entry_swap_id(entry, &created->resourceID);
+			str_swap(&entry->feed, &created->feed);
+			str_swap(&entry->edit, &created->edit);
+			pthread_mutex_unlock(&entry->lock);
+			gd_fs_entry_destroy(created);
+			free(created);
+		}
+		else
+			ret = -EIO;
+	}
+	ret = (ret < 0) ? ret : 0;
+
+	ci_destroy(&request);
+	str_destroy(&uri);
+	str_destroy(&body);
+	return ret;
+}
+
+/** Replay the outstanding changes of an entry.
+ *
+ *  Only the coalesced result is sent: one delete, or a folder creation under
+ *  the current name, or one rename to the current name. Files not uploaded
+ *  yet need nothing at all, their first upload uses their current name.
+ *
+ *  @entry struct gd_fs_entry_t* the entry to replay
+ */
+static void gdj_replay(struct gd_fs_entry_t* entry)
+{
+	int ret = 0;
+	int defer = 0;
+
+	pthread_mutex_lock(&entry->lock);
+	int ops = entry->journal_ops;
+	unsigned long seq = entry->journal_seq;
+	int on_server = entry->resourceID.len != 0;
+	pthread_mutex_unlock(&entry->lock);
+
+	if(!ops)
+		;
+	else if(!on_server && !(ops & GDJ_MKDIR))
+	{
+		// Wait for an upload on the way, it may give the entry a resourceID
+		defer = gdw_busy(entry);
+		pthread_mutex_lock(&entry->lock);
+		defer = defer || entry->resourceID.len;
+		pthread_mutex_unlock(&entry->lock);
+	}
+	else if(ops & GDJ_DELETE)
+		ret = on_server ? gdj_send(entry, GDJ_DELETE) : 0;
+	else if(ops & GDJ_MKDIR)
+		ret = gdj_send(entry, GDJ_MKDIR);
+	else if(ops & GDJ_RENAME)
+		ret = gdj_send(entry, GDJ_RENAME);
+
+	if(ret == -EAGAIN)
+	{
+		defer = 1;
+		ret = 0;
+	}
+	if(ret == -EACCES)
+	{
+		// Retrying will not help, the change stays local
+		fprintf(stderr, "Not allowed to change %s on the server\n", entry->filename.str);
+		ret = 0;
+	}
+
+	pthread_mutex_lock(&entry->lock);
+	if(!ret && !defer && ops)
+	{
+		// Changes recorded meanwhile are still to be sent, apart from the
+		// creation of a folder which now exists
+		if(entry->journal_seq == seq)
+			entry->journal_ops = 0;
+		else
+			entry->journal_ops &= ~(ops & GDJ_MKDIR);
+
+		pthread_mutex_lock(&journal.lock);
+		entry->journal_seq = gdj_append('C', &entry->journal_key,
+				(ops & GDJ_MKDIR) ? entry->resourceID.str : NULL, NULL);
+		str_destroy(&entry->journal_key);
+		// What is left is recorded again, under the resourceID a new folder
+		// just got, so a later mount does not create it a second time
+		if(entry->journal_ops)
+			gdj_rerecord(entry, NULL);
+		pthread_mutex_unlock(&journal.lock);
+	}
+	int left = entry->journal_ops;
+	pthread_mutex_unlock(&entry->lock);
+
+	if(ret)
+		fprintf(stderr, "Could not update %s on the server\n", entry->filename.str);
+	if(left)
+		gdj_queue(entry, ret ? replay_retry_ms : (defer ? replay_defer_ms : 0));
+}
+
+/** Take the entry due soonest off the replay queue.
+ *
+ *  Entries another worker is replaying are passed over. Must be called with
+ *  journal.lock held.
+ *
+ *  @now struct timespec* the current time
+ *
+ *  @returns the entry if one is due. Otherwise NULL, with now set to when the
+ *           next one is due, or zeroed if there is none.
+ */
+static struct gd_fs_entry_t* gdj_next(struct timespec* now)
+{
+	struct gd_fs_entry_t **iter;
+	struct gd_fs_entry_t **soonest = NULL;
+	struct gd_fs_entry_t *prev = NULL;
+	struct gd_fs_entry_t *before = NULL;
+
+	for(iter = &journal.head; *iter != NULL; iter = &(*iter)->journal_next)
+	{
+		if(!(*iter)->journal_busy)
+		{
+			const struct timespec *due = &(*iter)->journal_due;
+			const struct timespec *best = soonest ? &(*soonest)->journal_due : NULL;
+			if(best == NULL || due->tv_sec < best->tv_sec || (due->tv_sec == best->tv_sec
+						&& due->tv_nsec < best->tv_nsec))
+			{
+				soonest = iter;
+				before = prev;
+			}
+		}
+		prev = *iter;
+	}
+
+	if(soonest == NULL)
+	{
+		memset(now, 0, sizeof(struct timespec));
+		return NULL;
+	}
+
+	struct gd_fs_entry_t *entry = *soonest;
+	if(!journal.stopping && (entry->journal_due.tv_sec > now->tv_sec
+				|| (entry->journal_due.tv_sec == now->tv_sec
+					&& entry->journal_due.tv_nsec > now->tv_nsec)))
+	{
+		*now = entry->journal_due;
+		return NULL;
+	}
+
+	*soonest = entry->journal_next;
+	if(journal.tail == entry)
+		journal.tail = before;
+	entry->journal_next = NULL;
+	entry->journal_queued = 0;
+	return entry;
+}
+
+/** Replay queued entries as they come due.
+ *
+ *  Several of these run at once, each replaying a different entry, so the
+ *  changes to any one entry reach the server in order.
+ */
+void* gdj_worker(void* arg)
+{
+	pthread_mutex_lock(&journal.lock);
+	while(1)
+	{
+		struct timespec now;
+
+		if(journal.head == NULL && journal.stopping)
+			break;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		struct gd_fs_entry_t *entry = journal.head ? gdj_next(&now) : NULL;
+		if(entry == NULL)
+		{
+			if(journal.head && now.tv_sec)
+				pthread_cond_timedwait(&journal.cond, &journal.lock, &now);
+			else
+				pthread_cond_wait(&journal.cond, &journal.lock);
+			continue;
+		}
+
+		entry->journal_busy = 1;
+		pthread_mutex_unlock(&journal.lock);
+		gdj_replay(entry);
+		pthread_mutex_lock(&journal.lock);
+		entry->journal_busy = 0;
+		// Another worker may be waiting for this entry
+		pthread_cond_broadcast(&journal.cond);
+	}
+	pthread_mutex_unlock(&journal.lock);
+
+	return NULL;
+}
+
+struct gdj_record_t {
+	unsigned long seq;
+	char op;
+	char *key;
+	char *name;
+	// The escaped key of the folder an M record is in, NULL for the root
+	char *parent;
+};
+
+struct gdj_local_t {
+	char *key;
+	struct gd_fs_entry_t *entry;
+};
+
+/** Find the entry a recovered record is about.
+ *
+ *  @returns the entry, or NULL if it no longer exists
+ */
+static struct gd_fs_entry_t* gdj_recover_entry(const char* key,
+		const struct gdj_local_t* locals, size_t local_count)
+{
+	size_t iter;
+
+	for(iter = 0; iter < local_count; ++iter)
+		if(strcmp(locals[iter].key, key) == 0)
+			return locals[iter].entry;
+	if(strncmp(key, "local:", 6) == 0)
+		return NULL;
+	return gd_fs_entry_find_id(key, NULL);
+}
+
+/** Find the folder a recovered M record creates its folder in.
+ *
+ *  A folder created here is found by the key it had when the record was
+ *  written, even if it was created on the server since.
+ *
+ *  @returns the folder, or NULL if it no longer exists
+ */
+static struct gd_fs_entry_t* gdj_recover_folder(const char* parent,
+		const struct gdj_record_t* records, size_t record_count,
+		const struct gdj_local_t* locals, size_t local_count)
+{
+	struct gd_fs_entry_t *folder = NULL;
+	char *key = filenamedecode(parent, strlen(parent));
+	char *id = NULL;
+	size_t iter;
+
+	if(key == NULL)
+		return NULL;
+	for(iter = 0; iter < local_count && folder == NULL; ++iter)
+		if(strcmp(locals[iter].key, key) == 0)
+			folder = locals[iter].entry;
+	if(folder == NULL && strncmp(key, "local:", 6) == 0)
+	{
+		for(iter = 0; iter < record_count && id == NULL; ++iter)
+			if(records[iter].op == 'C' && strcmp(records[iter].name, "-")
+					&& strcmp(records[iter].key, key) == 0)
+				id = filenamedecode(records[iter].name, strlen(records[iter].name));
+	}
+	else if(folder == NULL)
+		id = strdup(key);
+	if(id)
+		folder = gdi_find_id(journal.gdi, id);
+
+	free(id);
+	free(key);
+	return (folder && folder->is_folder && !folder->deleted) ? folder : NULL;
+}
+
+/** Apply what an earlier mount left in the journal file to the index.
+ *
+ *  Records not marked done are applied in order, then the file is rewritten
+ *  with one record per outstanding change and those entries are queued.
+ *
+ *  @name const char* the path of the journal file, for messages
+ *
+ *  @returns 0 on success, 1 if the file could not be read or rewritten
+ */
+static int gdj_recover(const char* name)
+{
+	struct str_t contents;
+	char buf[4096];
+	ssize_t count;
+	struct gdj_record_t *records = NULL;
+	size_t record_count = 0;
+	struct gdj_local_t *locals = NULL;
+	size_t local_count = 0;
+	struct gd_fs_entry_t **pending = NULL;
+	size_t pending_count = 0;
+	size_t iter, scan;
+	int ret = 0;
+
+	str_init(&contents);
+	while((count = pread(journal.fd, buf, sizeof(buf), contents.len)) > 0)
+		str_char_concat(&contents, buf, count);
+	if(count < 0)
+	{
+		str_destroy(&contents);
+		return 1;
+	}
+
+	// Split into records, skipping anything malformed such as a torn last line
+	char *line = contents.str;
+	while(line && *line)
+	{
+		char *end = strchr(line, '\n');
+		if(end == NULL)
+			break;
+		*end = 0;
+
+		char *key = strchr(line, ' ');
+		char *value = key ? strchr(key + 1, ' ') : NULL;
+		char *field = value ? strchr(value + 1, ' ') : NULL;
+		if(key && value && field && value == key + 2)
+		{
+			struct gdj_record_t *grown = (struct gdj_record_t*) realloc(records,
+					sizeof(struct gdj_record_t) * (record_count + 1));
+			if(grown == NULL)
+				break;
+			records = grown;
+			records[record_count].seq = strtoul(line, NULL, 10);
+			records[record_count].op = key[1];
+			*field = 0;
+			records[record_count].key = value + 1;
+			records[record_count].name = field + 1;
+			records[record_count].parent = strchr(field + 1, ' ');
+			if(records[record_count].parent)
+				*records[record_count].parent++ = 0;
+			++record_count;
+		}
+		line = end + 1;
+	}
+
+	for(iter = 0; iter < record_count; ++iter)
+	{
+		struct gdj_record_t *record = &records[iter];
+		int done = (record->op == 'C');
+		if(record->seq > journal.seq)
+			journal.seq = record->seq;
+		for(scan = iter + 1; scan < record_count && !done; ++scan)
+			if(records[scan].op == 'C' && strcmp(records[scan].key, record->key) == 0)
+				done = 1;
+		if(done)
+			continue;
+
+		char *decoded = NULL;
+		if(strcmp(record->name, "-"))
+		{
+			decoded = filenamedecode(record->name, strlen(record->name));
+			if(decoded == NULL)
+				continue;
+		}
+
+		struct gd_fs_entry_t *entry = gdj_recover_entry(record->key, locals, local_count);
+		switch(record->op)
+		{
+			case 'M':
+				if(entry || decoded == NULL)
+					break;
+				fuse_ino_t parent = FUSE_ROOT_ID;
+				if(record->parent)
+				{
+					struct gd_fs_entry_t *folder = gdj_recover_folder(record->parent,
+							records, record_count, locals, local_count);
+					if(folder == NULL)
+					{
+						fprintf(stderr, "The folder %s was to be created in is gone\n", decoded);
+						break;
+					}
+					parent = folder->ino;
+				}
+				entry = gdi_create(journal.gdi, parent, decoded, 1);
+				if(entry == NULL)
+					break;
+				entry->journal_ops |= GDJ_MKDIR;
+				struct gdj_local_t *grown = (struct gdj_local_t*) realloc(locals,
+						sizeof(struct gdj_local_t) * (local_count + 1));
+				if(grown == NULL)
+					break;
+				locals = grown;
+				locals[local_count].key = record->key;
+				locals[local_count].entry = entry;
+				++local_count;
+				break;
+			case 'R':
+				if(entry && decoded && !entry->deleted
+						&& (strcmp(entry->filename.str, decoded) == 0
+							|| !gdi_rename(journal.gdi, entry, decoded)))
+					entry->journal_ops |= GDJ_RENAME;
+				break;
+			case 'D':
+				if(entry && !entry->deleted)
+				{
+					gd_fs_entry_remove(entry);
+					entry->deleted = 1;
+					entry->journal_ops = (entry->journal_ops & GDJ_MKDIR) &&
+						!entry->resourceID.len ? 0 : GDJ_DELETE;
+				}
+				break;
+			default:
+				break;
+		}
+		free(decoded);
+
+		// Not only the root has entries in lazy mode, so those with changes
+		// are kept track of here
+		for(scan = 0; entry && scan < pending_count && pending[scan] != entry; ++scan)
+			;
+		if(entry && entry->journal_ops && scan == pending_count)
+		{
+			struct gd_fs_entry_t **grown = (struct gd_fs_entry_t**) realloc(pending,
+					sizeof(struct gd_fs_entry_t*) * (pending_count + 1));
+			if(grown != NULL)
+			{
+				pending = grown;
+				pending[pending_count++] = entry;
+			}
+		}
+	}
+
+	// Everything still outstanding is now on the entries, start a fresh file
+	if(ftruncate(journal.fd, 0))
+		ret = 1;
+	for(iter = 0; iter < pending_count; ++iter)
+	{
+		struct gd_fs_entry_t *entry = pending[iter];
+		struct str_t parent;
+		if(!entry->journal_ops)
+			continue;
+		gdj_parent_key(entry, &parent);
+		str_destroy(&entry->journal_key);
+		gdj_rerecord(entry, &parent);
+		str_destroy(&parent);
+		gdj_queue(entry, 0);
+	}
+
+	free(pending);
+	free(locals);
+	free(records);
+	str_destroy(&contents);
+	return ret;
+}
@@ -0,0 +1,79 @@
+/*
+	fuse-google-drive: a fuse filesystem wrapper for Google Drive
+	Copyright (C) 2012  James Cline
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2 as
+ 	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef _GOOGLE_DRIVE_JOURNAL_H
+#define _GOOGLE_DRIVE_JOURNAL_H
+
+#include <pthread.h>
+
+#include "gd_cache.h"
+#include "gd_interface.h"
+
+// Entries replayed to the server at once, each by its own worker
+#define GDJ_WORKERS 4
+
+/** Metadata changes an entry can have waiting for the server.
+ *
+ *  Changes to one entry coalesce: renames collapse into the last one, and a
+ *  delete replaces everything before it.
+ */
+enum gdj_op_e {
+	GDJ_MKDIR  = 1,
+	GDJ_RENAME = 2,
+	GDJ_DELETE = 4,
+};
+
+/** The state of the metadata journal for this mount.
+ *
+ *  rename(), unlink(), mkdir() and rmdir() change the local index at once and
+ *  append a record to a journal file before replying. Workers then replay the
+ *  changes to the server in the background. Records still outstanding when
+ *  the mount ends are replayed at the next mount.
+ */
+struct gdj_state_t {
+	struct gdi_state *gdi;
+	// The journal file, appended to under lock
+	int fd;
+	// Sequence number of the last record written
+	unsigned long seq;
+
+	pthread_t workers[GDJ_WORKERS];
+	size_t started;
+	// Protects the journal file, seq, the queue and stopping
+	pthread_mutex_t lock;
+	// Signalled when an entry is queued or the workers should stop
+	pthread_cond_t cond;
+	// Entries with changes to replay, linked by journal_next
+	struct gd_fs_entry_t *head;
+	struct gd_fs_entry_t *tail;
+	// Set by gdj_destroy(), the workers drain the queue and exit
+	int stopping;
+};
+
+int gdj_init(struct gdi_state* state, const char* path);
+void gdj_destroy();
+
+int gdj_mkdir(struct gd_fs_entry_t* entry);
+int gdj_rename(struct gd_fs_entry_t* entry, const char* filename);
+int gdj_delete(struct gd_fs_entry_t* entry);
+int gdj_replace(struct gd_fs_entry_t* entry, struct gd_fs_entry_t* target,
+		const char* filename);
+int gdj_busy(struct gd_fs_entry_t* entry);
+
+#endif
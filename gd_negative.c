@@ -0,0 +1,269 @@
+/*
+	fuse-google-drive: a fuse filesystem wrapper for Google Drive
+	Copyright (C) 2012  James Cline
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2 as
+ 	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gd_negative.h"
+
+static struct gdn_state_t negative;
+
+// The kernel's negative entries are dropped as names are added, so they can
+// live longer than positive ones
+const double negative_timeout = 30.0;
+
+
+void* gdn_notifier(void* arg);
+
+static time_t gdn_now()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
+}
+
+/** Finds the slot a name in a folder hashes to, 64 bit FNV-1a.
+ */
+static struct gdn_slot_t* gdn_slot(uint64_t parent, const char* name)
+{
+	uint64_t hash = 14695981039346656037ULL ^ parent;
+	for(; *name; ++name)
+	{
+		hash ^= (unsigned char) *name;
+		hash *= 1099511628211ULL;
+	}
+	return &negative.slots[hash % GDN_SLOTS];
+}
+
+static void gdn_clear(struct gdn_slot_t* slot)
+{
+	free(slot->name);
+	slot->name = NULL;
+	slot->expires = 0;
+}
+
+/** Start the negative lookup cache, the notifier is started by gdn_start().
+ *
+ *  @returns 0 on success, 1 on failure
+ */
+int gdn_init()
+{
+	memset(&negative, 0, sizeof(struct gdn_state_t));
+	pthread_mutex_init(&negative.lock, NULL);
+	pthread_mutex_init(&negative.session_lock, NULL);
+	pthread_cond_init(&negative.cond, NULL);
+
+	return 0;
+}
+
+/** Start the notifier, in the process that serves the mount.
+ *
+ *  @returns 0 on success, 1 on failure
+ */
+int gdn_start()
+{
+	if(pthread_create(&negative.notifier, NULL, gdn_notifier, NULL))
+		return 1;
+	negative.started = 1;
+	return 0;
+}
+
+/** Stop the notifier and forget every name.
+ *
+ *  Notices still queued are dropped, the session is gone by now.
+ */
+void gdn_destroy()
+{
+	if(negative.started)
+	{
+		pthread_mutex_lock(&negative.lock);
+		negative.stopping = 1;
+		pthread_cond_broadcast(&negative.cond);
+		pthread_mutex_unlock(&negative.lock);
+		pthread_join(negative.notifier, NULL);
+		negative.started = 0;
+	}
+
+	while(negative.head)
+	{
+		struct gdn_notice_t *next = negative.head->next;
+		free(negative.head->name);
+		free(negative.head);
+		negative.head = next;
+	}
+	negative.tail = NULL;
+
+	size_t iter;
+	for(iter = 0; iter < GDN_SLOTS; ++iter)
+		gdn_clear(&negative.slots[iter]);
+
+	pthread_cond_destroy(&negative.cond);
+	pthread_mutex_destroy(&negative.session_lock);
+	pthread_mutex_destroy(&negative.lock);
+}
+
+/** Set the session the kernel is notified through.
+ *
+ *  Must be set to NULL before the session is unmounted, this waits for a
+ *  notice being sent.
+ *
+ *  @session the session, or NULL
+ */
+void gdn_set_session(struct fuse_session *session)
+{
+	pthread_mutex_lock(&negative.session_lock);
+	pthread_mutex_lock(&negative.lock);
+	negative.session = session;
+	pthread_mutex_unlock(&negative.lock);
+	pthread_mutex_unlock(&negative.session_lock);
+}
+
+/** Check if a name was recently found not to exist.
+ *
+ *  @parent the inode number of the folder
+ *  @name   the escaped filename
+ *
+ *  @returns nonzero if it is known not to exist
+ */
+int gdn_missing(uint64_t parent, const char* name)
+{
+	struct gdn_slot_t *slot = gdn_slot(parent, name);
+
+	pthread_mutex_lock(&negative.lock);
+	int missing = slot->name && slot->parent == parent
+		&& slot->expires > gdn_now() && strcmp(slot->name, name) == 0;
+	pthread_mutex_unlock(&negative.lock);
+
+	return missing;
+}
+
+/** Queue a notice for the kernel to drop its negative entry of a name.
+ *
+ *  Must be called with negative.lock held. The slot is cleared either way.
+ *
+ *  @slot the slot of the name, which the notice takes the name from
+ */
+static void gdn_notify(struct gdn_slot_t* slot)
+{
+	struct gdn_notice_t *notice = NULL;
+
+	// Only a name we replied was missing can be in the kernel's cache
+	if(slot->expires > gdn_now() && negative.session && !negative.stopping)
+		notice = (struct gdn_notice_t*) malloc(sizeof(struct gdn_notice_t));
+	if(notice)
+	{
+		notice->parent = slot->parent;
+		notice->name = slot->name;
+		notice->next = NULL;
+		slot->name = NULL;
+		if(negative.tail)
+			negative.tail->next = notice;
+		else
+			negative.head = notice;
+		negative.tail = notice;
+		pthread_cond_signal(&negative.cond);
+	}
+	gdn_clear(slot);
+}
+
+/** Remember that a name does not exist, for as long as the kernel will.
+ *
+ *  A different name still remembered in its slot is forgotten, and the
+ *  kernel is told to forget it too, as nothing would tell it once the name
+ *  is added.
+ *
+ *  @parent the inode number of the folder
+ *  @name   the escaped filename
+ */
+void gdn_miss(uint64_t parent, const char* name)
+{
+	struct gdn_slot_t *slot = gdn_slot(parent, name);
+	char *copy = strdup(name);
+	if(copy == NULL)
+		return;
+
+	pthread_mutex_lock(&negative.lock);
+	if(slot->name && (slot->parent != parent || strcmp(slot->name, name)))
+		gdn_notify(slot);
+	else
+		gdn_clear(slot);
+	slot->parent = parent;
+	slot->name = copy;
+	slot->expires = gdn_now() + (time_t) negative_timeout;
+	pthread_mutex_unlock(&negative.lock);
+}
+
+/** Forget that a name does not exist, it has just been added.
+ *
+ *  @parent the inode number of the folder
+ *  @name   the escaped filename
+ *  @notify nonzero to also have the kernel drop its negative entry. Names
+ *          added by a FUSE request need not, the kernel knows of them.
+ */
+void gdn_added(uint64_t parent, const char* name, int notify)
+{
+	struct gdn_slot_t *slot = gdn_slot(parent, name);
+
+	pthread_mutex_lock(&negative.lock);
+	if(slot->name && slot->parent == parent && strcmp(slot->name, name) == 0)
+	{
+		if(notify)
+			gdn_notify(slot);
+		else
+			gdn_clear(slot);
+	}
+	pthread_mutex_unlock(&negative.lock);
+}
+
+/** The body of the notifier thread, tells the kernel about added names.
+ */
+void* gdn_notifier(void* arg)
+{
+	pthread_mutex_lock(&negative.lock);
+	while(!negative.stopping)
+	{
+		if(negative.head == NULL)
+		{
+			pthread_cond_wait(&negative.cond, &negative.lock);
+			continue;
+		}
+
+		struct gdn_notice_t *notice = negative.head;
+		negative.head = notice->next;
+		if(negative.head == NULL)
+			negative.tail = NULL;
+		pthread_mutex_unlock(&negative.lock);
+
+		pthread_mutex_lock(&negative.session_lock);
+		// The session is read under lock too, gdn_set_session() takes both
+		if(negative.session)
+			fuse_lowlevel_notify_inval_entry(negative.session, notice->parent,
+					notice->name, strlen(notice->name));
+		pthread_mutex_unlock(&negative.session_lock);
+		free(notice->name);
+		free(notice);
+
+		pthread_mutex_lock(&negative.lock);
+	}
+	pthread_mutex_unlock(&negative.lock);
+
+	return NULL;
+}
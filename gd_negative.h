@@ -0,0 +1,91 @@
+/*
+	fuse-google-drive: a fuse filesystem wrapper for Google Drive
+	Copyright (C) 2012  James Cline
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2 as
+ 	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef _GOOGLE_DRIVE_NEGATIVE_H
+#define _GOOGLE_DRIVE_NEGATIVE_H
+
+#define FUSE_USE_VERSION 34
+
+#include <fuse_lowlevel.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+// Names remembered as missing, each hashes to one slot
+#define GDN_SLOTS 4096
+
+// How long the kernel and we may take a name to be missing
+extern const double negative_timeout;
+
+// A name a lookup was told does not exist
+struct gdn_slot_t {
+	uint64_t parent;
+	char *name;
+	// Monotonic seconds, the slot is free once past
+	time_t expires;
+};
+
+// A name the kernel has to forget it was told does not exist
+struct gdn_notice_t {
+	uint64_t parent;
+	char *name;
+	struct gdn_notice_t *next;
+};
+
+/** The negative lookup cache for this mount.
+ *
+ *  Lookups of names that do not exist are answered with a negative entry the
+ *  kernel caches for negative_timeout, and remembered here for as long, so a
+ *  probe for a missing name repeated by another process touches neither the
+ *  index nor the server. When the metadata sync adds a name remembered
+ *  here, it is forgotten and the kernel is told to drop its negative entry.
+ *  A name pushed out of its slot by another is dropped from the kernel too.
+ *  The kernel is notified from a thread of its own, as notifying from a FUSE
+ *  request on the same folder would deadlock.
+ */
+struct gdn_state_t {
+	struct gdn_slot_t slots[GDN_SLOTS];
+
+	// Set once the session exists, notices are dropped until then
+	struct fuse_session *session;
+
+	pthread_t notifier;
+	int started;
+	// Protects slots, session, the queue and stopping
+	pthread_mutex_t lock;
+	// Signalled when a notice is queued or the notifier should stop
+	pthread_cond_t cond;
+	// Notices for the kernel, linked by next
+	struct gdn_notice_t *head;
+	struct gdn_notice_t *tail;
+	int stopping;
+	// Held while a notice is sent, so the session is not destroyed under it
+	pthread_mutex_t session_lock;
+};
+
+int gdn_init();
+int gdn_start();
+void gdn_destroy();
+void gdn_set_session(struct fuse_session *session);
+
+int gdn_missing(uint64_t parent, const char* name);
+void gdn_miss(uint64_t parent, const char* name);
+void gdn_added(uint64_t parent, const char* name, int notify);
+
+#endif
@@ -0,0 +1,450 @@
+/*
+	fuse-google-drive: a fuse filesystem wrapper for Google Drive
+	Copyright (C) 2012  James Cline
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2 as
+ 	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gd_interface.h"
+#include "gd_virtual.h"
+
+static struct gdv_state_t virtual;
+
+// /.by-id/<resourceID> is the entry with that resourceID, see gdi_find_id().
+// /.search/<text> holds the files whose name or contents have text in them.
+// /.find/<text> holds the files held here whose name has text in it.
+static const struct gdv_folder_t folders[] = {
+	{ ".by-id", GDV_BY_ID_INO },
+	{ ".search", GDV_SEARCH_INO },
+	{ ".find", GDV_FIND_INO },
+};
+#define GDV_FOLDER_COUNT (sizeof(folders) / sizeof(folders[0]))
+
+// How long the results of a search are used before the server is asked again
+const time_t search_ttl_secs = 30;
+// Searches kept at once. Beyond this, ones the kernel holds no lookup of and
+// unused for search_ttl_secs are freed.
+const size_t search_max_count = 64;
+
+
+/** Find a virtual folder by name.
+ *
+ *  @parent the inode number of the folder to look in
+ *  @name   the name
+ *
+ *  @returns the inode number of the virtual folder, or 0 if there is none
+ */
+uint64_t gdv_find(uint64_t parent, const char* name)
+{
+	size_t iter;
+
+	// There are only virtual folders in the root
+	if(parent != FUSE_ROOT_ID)
+		return 0;
+	for(iter = 0; iter < GDV_FOLDER_COUNT; ++iter)
+		if(strcmp(folders[iter].name, name) == 0)
+			return folders[iter].ino;
+	return 0;
+}
+
+/** Check if an inode number is that of a virtual folder.
+ *
+ *  @ino the inode number
+ *
+ *  @returns nonzero if it is
+ */
+int gdv_is_folder(uint64_t ino)
+{
+	size_t iter;
+
+	for(iter = 0; iter < GDV_FOLDER_COUNT; ++iter)
+		if(folders[iter].ino == ino)
+			return 1;
+	return 0;
+}
+
+/** The monotonic clock in seconds, what search times are kept in.
+ */
+static time_t gdv_now()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
+}
+
+/** Start the virtual folders.
+ *
+ *  @state struct gdi_state* the state for this mount
+ *
+ *  @returns 0 on success
+ */
+int gdv_init(struct gdi_state* state)
+{
+	memset(&virtual, 0, sizeof(struct gdv_state_t));
+	virtual.gdi = state;
+	pthread_mutex_init(&virtual.lock, NULL);
+	pthread_cond_init(&virtual.cond, NULL);
+
+	return 0;
+}
+
+/** Free a search and the folder standing in for it.
+ *
+ *  The entries found are not freed, they are held elsewhere.
+ */
+static void gdv_free_search(struct gdv_search_t* search)
+{
+	size_t iter;
+
+	gd_fs_entry_destroy(search->folder);
+	free(search->folder);
+	for(iter = 0; iter < search->id_count; ++iter)
+		free(search->ids[iter]);
+	free(search->ids);
+	free(search->results);
+	free(search);
+}
+
+/** Look up the files a server search found, as .find looks up names.
+ *
+ *  Files that are gone since are left out. Must be called with virtual.lock
+ *  held.
+ *
+ *  @search the search
+ *
+ *  @returns 0 on success, -1 on failure
+ */
+static int gdv_resolve(struct gdv_search_t* search)
+{
+	struct gd_fs_entry_t **results = NULL;
+	struct gd_fs_entry_t *entry;
+	size_t count = 0;
+	size_t iter;
+
+	if(search->id_count)
+	{
+		results = (struct gd_fs_entry_t**) malloc(search->id_count * sizeof(struct gd_fs_entry_t*));
+		if(results == NULL)
+			return -1;
+	}
+	for(iter = 0; iter < search->id_count; ++iter)
+	{
+		entry = gd_fs_entry_find_id(search->ids[iter], NULL);
+		if(entry && !entry->deleted)
+			results[count++] = entry;
+	}
+
+	free(search->results);
+	search->results = results;
+	search->count = count;
+	return 0;
+}
+
+/** Free every search.
+ *
+ *  Must only be called once nothing uses them any more.
+ */
+void gdv_destroy()
+{
+	while(virtual.searches)
+	{
+		struct gdv_search_t *next = virtual.searches->next;
+		gdv_free_search(virtual.searches);
+		virtual.searches = next;
+	}
+	pthread_cond_destroy(&virtual.cond);
+	pthread_mutex_destroy(&virtual.lock);
+}
+
+/** Free one search nothing uses, if there are too many.
+ *
+ *  Must be called with virtual.lock held.
+ */
+static void gdv_trim(time_t now)
+{
+	struct gdv_search_t **link;
+	struct gdv_search_t **coldest = NULL;
+
+	if(virtual.search_count < search_max_count)
+		return;
+	for(link = &virtual.searches; *link != NULL; link = &(*link)->next)
+	{
+		struct gdv_search_t *search = *link;
+		// The kernel finds the folder by inode number until it forgets it
+		if(search->searching || search->folder->nlookup
+				|| now - search->used < search_ttl_secs)
+			continue;
+		if(coldest == NULL || search->used < (*coldest)->used)
+			coldest = link;
+	}
+	if(coldest == NULL)
+		return;
+
+	struct gdv_search_t *search = *coldest;
+	*coldest = search->next;
+	--virtual.search_count;
+	gd_fs_entry_drop(search->folder);
+	gdv_free_search(search);
+}
+
+/** Find a search by the inode number of its folder.
+ *
+ *  Must be called with virtual.lock held.
+ */
+static struct gdv_search_t* gdv_search_ino(uint64_t ino)
+{
+	struct gdv_search_t *search;
+
+	for(search = virtual.searches; search != NULL; search = search->next)
+		if(search->folder->ino == ino)
+			return search;
+	return NULL;
+}
+
+/** Get the folder of a search, /.search/<text> or /.find/<text>, making it
+ *  if it is new.
+ *
+ *  Nothing is searched until the folder is read.
+ *
+ *  @parent GDV_SEARCH_INO to search the server, GDV_FIND_INO to search the
+ *          filenames held here
+ *  @text   the escaped text to search for
+ *
+ *  @returns the folder, or NULL on failure
+ */
+struct gd_fs_entry_t* gdv_search(uint64_t parent, const char* text)
+{
+	struct gdv_search_t *search;
+	time_t now = gdv_now();
+	int local = parent == GDV_FIND_INO;
+
+	pthread_mutex_lock(&virtual.lock);
+	for(search = virtual.searches; search != NULL; search = search->next)
+		if(search->local == local && strcmp(search->folder->filename.str, text) == 0)
+			break;
+
+	if(search == NULL)
+	{
+		gdv_trim(now);
+		search = (struct gdv_search_t*) malloc(sizeof(struct gdv_search_t));
+		if(search != NULL)
+		{
+			memset(search, 0, sizeof(struct gdv_search_t));
+			search->local = local;
+			search->folder = gd_fs_entry_create(text);
+		}
+		if(search == NULL || search->folder == NULL)
+		{
+			pthread_mutex_unlock(&virtual.lock);
+			free(search);
+			return NULL;
+		}
+		search->folder->is_folder = 1;
+		gd_fs_entry_stat(search->folder);
+		// Only its inode number finds it, it has no place in any folder
+		if(gd_fs_entry_add(search->folder, 0))
+		{
+			pthread_mutex_unlock(&virtual.lock);
+			gdv_free_search(search);
+			return NULL;
+		}
+		search->next = virtual.searches;
+		virtual.searches = search;
+		++virtual.search_count;
+	}
+	search->used = now;
+	pthread_mutex_unlock(&virtual.lock);
+
+	return search->folder;
+}
+
+/** Check if an inode number is that of the folder of a search.
+ *
+ *  @ino the inode number
+ *
+ *  @returns nonzero if it is
+ */
+int gdv_is_search(uint64_t ino)
+{
+	// Entries are never given the virtual folders' numbers, so no search is
+	if(ino <= GD_RESERVED_INO)
+		return 0;
+
+	pthread_mutex_lock(&virtual.lock);
+	int found = gdv_search_ino(ino) != NULL;
+	pthread_mutex_unlock(&virtual.lock);
+
+	return found;
+}
+
+/** Search the server unless the results are fresh, or the filenames held.
+ *
+ *  While one thread searches the server others use the stale results, or
+ *  wait for the new ones if there are none. Must be called with
+ *  virtual.lock held, it is released while the server is asked.
+ *
+ *  @search  the search
+ *  @refresh nonzero to search again if the results are stale
+ *
+ *  @returns 0 on success, -1 if there are no results
+ */
+static int gdv_refresh(struct gdv_search_t* search, int refresh)
+{
+	struct gd_fs_entry_t *entries;
+	struct gd_fs_entry_t *entry;
+	time_t now = gdv_now();
+
+	search->used = now;
+	if(search->local)
+	{
+		// Lazy mode may free what an earlier search found, so the results
+		// are never kept from one use to the next
+		size_t count;
+		struct gd_fs_entry_t **results;
+		if(gd_fs_entry_grep(search->folder->filename.str, &results, &count))
+			return -1;
+		free(search->results);
+		search->results = results;
+		search->count = count;
+		return 0;
+	}
+	if(search->searching)
+	{
+		while(search->searching && !search->expires)
+			pthread_cond_wait(&virtual.cond, &virtual.lock);
+		return search->expires ? gdv_resolve(search) : search->result;
+	}
+	if(search->expires && (!refresh || now < search->expires))
+		return gdv_resolve(search);
+	search->searching = 1;
+	pthread_mutex_unlock(&virtual.lock);
+
+	char **ids = NULL;
+	size_t count = 0;
+	int ret = gdi_search(virtual.gdi, search->folder->filename.str, &entries);
+	for(entry = entries; entry != NULL; entry = entry->next)
+		++count;
+	if(!ret && count)
+	{
+		ids = (char**) malloc(count * sizeof(char*));
+		if(ids == NULL)
+			ret = -1;
+	}
+	count = 0;
+	while(entries != NULL)
+	{
+		entry = entries;
+		entries = entry->next;
+		entry->next = NULL;
+		if(ids == NULL)
+		{
+			gd_fs_entry_destroy(entry);
+			free(entry);
+		}
+		// Files held already are used rather than added twice
+		else if((entry = gdi_adopt(virtual.gdi, entry)) != NULL
+				&& (ids[count] = strdup(entry->resourceID.str)) != NULL)
+			++count;
+	}
+
+	pthread_mutex_lock(&virtual.lock);
+	if(!ret)
+	{
+		size_t iter;
+		for(iter = 0; iter < search->id_count; ++iter)
+			free(search->ids[iter]);
+		free(search->ids);
+		search->ids = ids;
+		search->id_count = count;
+		search->expires = gdv_now() + search_ttl_secs;
+	}
+	search->result = ret;
+	search->searching = 0;
+	pthread_cond_broadcast(&virtual.cond);
+	// Stale results are better than none
+	return search->expires ? gdv_resolve(search) : ret;
+}
+
+/** Find an entry in the results of a search by filename.
+ *
+ *  @ino  the inode number of the folder of the search
+ *  @name the escaped filename
+ *
+ *  @returns the entry, or NULL if the search did not find it
+ */
+struct gd_fs_entry_t* gdv_search_find(uint64_t ino, const char* name)
+{
+	struct gd_fs_entry_t *entry = NULL;
+	size_t iter;
+
+	pthread_mutex_lock(&virtual.lock);
+	struct gdv_search_t *search = gdv_search_ino(ino);
+	if(search && !gdv_refresh(search, 0))
+	{
+		for(iter = 0; iter < search->count; ++iter)
+		{
+			entry = search->results[iter];
+			if(!entry->deleted && strcmp(entry->filename.str, name) == 0)
+				break;
+		}
+		if(iter == search->count)
+			entry = NULL;
+	}
+	pthread_mutex_unlock(&virtual.lock);
+
+	return entry;
+}
+
+/** Get the results of a search.
+ *
+ *  @ino     the inode number of the folder of the search
+ *  @refresh nonzero to search again if the results are stale
+ *  @results set to a copy of the results, for the caller to free
+ *  @count   set to the number of results
+ *
+ *  @returns 0 on success, -ENOENT if there is no such search, -EIO if it
+ *           failed, -ENOMEM on failure
+ */
+int gdv_search_results(uint64_t ino, int refresh,
+		struct gd_fs_entry_t*** results, size_t* count)
+{
+	int ret = -ENOENT;
+
+	*results = NULL;
+	*count = 0;
+	pthread_mutex_lock(&virtual.lock);
+	struct gdv_search_t *search = gdv_search_ino(ino);
+	if(search)
+		ret = gdv_refresh(search, refresh) ? -EIO : 0;
+	if(!ret && search->count)
+	{
+		*results = (struct gd_fs_entry_t**) malloc(search->count * sizeof(struct gd_fs_entry_t*));
+		if(*results == NULL)
+			ret = -ENOMEM;
+		else
+		{
+			memcpy(*results, search->results, search->count * sizeof(struct gd_fs_entry_t*));
+			*count = search->count;
+		}
+	}
+	pthread_mutex_unlock(&virtual.lock);
+
+	return ret;
+}
@@ -0,0 +1,101 @@
+/*
+	fuse-google-drive: a fuse filesystem wrapper for Google Drive
+	Copyright (C) 2012  James Cline
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2 as
+ 	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef _GOOGLE_DRIVE_VIRTUAL_H
+#define _GOOGLE_DRIVE_VIRTUAL_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "gd_cache.h"
+#include "gd_interface.h"
+
+// Inode numbers of the virtual folders, below GD_RESERVED_INO
+#define GDV_BY_ID_INO 2
+#define GDV_SEARCH_INO 3
+#define GDV_FIND_INO 4
+
+/** A folder in the root that is not on the server.
+ *
+ *  Virtual folders are found by name but not listed in the root, so tools
+ *  walking the mount do not descend into them. A file on the server with
+ *  the same name is hidden by them.
+ */
+struct gdv_folder_t {
+	const char *name;
+	uint64_t ino;
+};
+
+/** The results of a search, the contents of /.search/<text> or /.find/<text>.
+ *
+ *  The server is searched when the folder is first read, and again once
+ *  the results are older than search_ttl_secs. Local searches look in the
+ *  filenames held, every time the results are used.
+ */
+struct gdv_search_t {
+	// Stands in for the folder in the inode table, its filename is the text
+	struct gd_fs_entry_t *folder;
+	// Set for /.find, which searches filenames here rather than the server
+	int local;
+	// The resourceIDs of the files the server found, in the order it gave
+	// them. Lazy mode may free the entries, so they are looked up again by
+	// resourceID every time the results are used.
+	char **ids;
+	size_t id_count;
+	// The entries found, as of the last use
+	struct gd_fs_entry_t **results;
+	size_t count;
+	// Set while a thread searches, and the result of the last search
+	int searching;
+	int result;
+	// When the results go stale, 0 until searched, monotonic seconds
+	time_t expires;
+	// When the search was last used, monotonic seconds
+	time_t used;
+
+	struct gdv_search_t *next;
+};
+
+/** The state of the virtual folders for this mount.
+ */
+struct gdv_state_t {
+	struct gdi_state *gdi;
+
+	// Protects the searches and everything in them
+	pthread_mutex_t lock;
+	// Signalled when a search completes
+	pthread_cond_t cond;
+	struct gdv_search_t *searches;
+	size_t search_count;
+};
+
+int gdv_init(struct gdi_state* state);
+void gdv_destroy();
+
+uint64_t gdv_find(uint64_t parent, const char* name);
+int gdv_is_folder(uint64_t ino);
+
+struct gd_fs_entry_t* gdv_search(uint64_t parent, const char* text);
+int gdv_is_search(uint64_t ino);
+struct gd_fs_entry_t* gdv_search_find(uint64_t ino, const char* name);
+int gdv_search_results(uint64_t ino, int refresh,
+		struct gd_fs_entry_t*** results, size_t* count);
+
+#endif
@@ -0,0 +1,1203 @@
+/*
+	fuse-google-drive: a fuse filesystem wrapper for Google Drive
+	Copyright (C) 2012  James Cline
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2 as
+ 	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h> // mkdir
+#include <unistd.h>
+
+#include "curl_interface.h"
+#include "gd_cache.h"
+#include "gd_dir.h"
+#include "gd_interface.h"
+#include "gd_writeback.h"
+#include "request_scheduler.h"
+#include "str.h"
+
+static struct gdw_state_t writeback;
+
+// Files created in a folder other than the root go to the contents feed of
+// that folder, which comes between these
+const char create_session_uri[] =
+	"https://docs.google.com/feeds/upload/create-session/default/private/full";
+const char create_session_query[] = "?convert=false";
+
+// Wait this long after a handle is released before uploading, so a file that
+// is closed and reopened for more writes in quick succession, as many editors
+// and build tools do, is uploaded once
+const long upload_delay_ms = 1000;
+// Time allowed for starting an upload session
+const long session_deadline_ms = 30000;
+// Each chunk gets session_deadline_ms plus the time it would take at this
+// many bytes/second
+const long upload_min_rate = 64 * 1024;
+// Files are sent this much at a time, the server wants a multiple of 512K.
+// A dropped connection costs at most one chunk.
+const off_t upload_chunk = 8 * 1024 * 1024;
+// Give up on an upload after this many failures in a row without progress
+const int max_resumes = 8;
+// Wait up to this long between resumes, doubling from resume_base_ms
+const long resume_base_ms = 500;
+const long resume_max_ms = 30000;
+// A failed upload is tried again after this long
+const long upload_retry_ms = 60000;
+// Ranged entries are copied into a staging file this much at a time, as it
+// is first read or written
+const size_t staging_chunk = 4 * 1024 * 1024;
+
+void* gdw_uploader(void* arg);
+
+/** Start the write-back cache.
+ *
+ *  Staging files are created in a directory under path, and unlinked as soon
+ *  as they are created so nothing is left behind however the mount ends.
+ *
+ *  @state struct gdi_state* the state for this mount
+ *  @path  const char*       the configuration directory, with a trailing '/'
+ *
+ *  @returns 0 on success, 1 on failure
+ */
+int gdw_init(struct gdi_state* state, const char* path)
+{
+	const char name[] = "staging";
+	pthread_condattr_t attr;
+
+	memset(&writeback, 0, sizeof(struct gdw_state_t));
+	writeback.gdi = state;
+
+	writeback.staging_dir = (char*) malloc(strlen(path) + sizeof(name));
+	if(writeback.staging_dir == NULL)
+		return 1;
+	memcpy(writeback.staging_dir, path, strlen(path));
+	memcpy(writeback.staging_dir + strlen(path), name, sizeof(name));
+	if(mkdir(writeback.staging_dir, S_IRWXU) == -1 && errno != EEXIST)
+	{
+		printf("mkdir(\"%s\"): %s\n", writeback.staging_dir, strerror(errno));
+		free(writeback.staging_dir);
+		return 1;
+	}
+
+	pthread_mutex_init(&writeback.lock, NULL);
+	// Upload due times are monotonic
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&writeback.cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	for(; writeback.started < GDW_UPLOADERS; ++writeback.started)
+		if(pthread_create(&writeback.uploaders[writeback.started], NULL,
+					gdw_uploader, NULL))
+			break;
+
+	// Make do with fewer uploaders, as long as there is one
+	if(!writeback.started)
+	{
+		pthread_cond_destroy(&writeback.cond);
+		pthread_mutex_destroy(&writeback.lock);
+		free(writeback.staging_dir);
+		return 1;
+	}
+
+	return 0;
+}
+
+/** Stop the write-back cache.
+ *
+ *  Every entry still queued is uploaded first, without waiting out its delay.
+ */
+void gdw_destroy()
+{
+	pthread_mutex_lock(&writeback.lock);
+	writeback.stopping = 1;
+	pthread_cond_broadcast(&writeback.cond);
+	pthread_mutex_unlock(&writeback.lock);
+
+	size_t iter;
+	for(iter = 0; iter < writeback.started; ++iter)
+		pthread_join(writeback.uploaders[iter], NULL);
+
+	pthread_cond_destroy(&writeback.cond);
+	pthread_mutex_destroy(&writeback.lock);
+	free(writeback.staging_dir);
+}
+
+/** Check if an entry is queued for upload or being uploaded.
+ */
+int gdw_busy(struct gd_fs_entry_t* entry)
+{
+	pthread_mutex_lock(&writeback.lock);
+	int busy = entry->upload_queued || entry->uploading;
+	pthread_mutex_unlock(&writeback.lock);
+	return busy;
+}
+
+/** Check if an entry may have writes the server does not have yet, which
+ *  is the case while it is staged.
+ */
+int gdw_pending(struct gd_fs_entry_t* entry)
+{
+	pthread_mutex_lock(&entry->lock);
+	int pending = entry->staging_fd >= 0
+		|| entry->write_generation != entry->upload_generation;
+	pthread_mutex_unlock(&entry->lock);
+	return pending;
+}
+
+/** Count the handles that have an entry open for writing.
+ */
+unsigned long gdw_writers(struct gd_fs_entry_t* entry)
+{
+	pthread_mutex_lock(&entry->lock);
+	unsigned long writers = entry->writers;
+	pthread_mutex_unlock(&entry->lock);
+	return writers;
+}
+
+/** Check if an entry is served from its staging file.
+ */
+int gdw_is_staged(const struct gd_fs_entry_t* entry)
+{
+	return entry->staging_fd >= 0;
+}
+
+/** Close the staging file of an entry the server has caught up with.
+ *
+ *  Only once nothing writes, reads or fills it any more. Reads are served
+ *  from the server's contents from then on, and the next writer stages the
+ *  entry again. Must be called with entry->lock held.
+ */
+static void gdw_unstage(struct gd_fs_entry_t* entry)
+{
+	if(entry->staging_fd < 0 || entry->writers || entry->staging_readers
+			|| entry->staging_busy || entry->staging_filling)
+		return;
+	if(entry->write_generation != entry->upload_generation || entry->deleted
+			|| !entry->md5set)
+		return;
+
+	close(entry->staging_fd);
+	entry->staging_fd = -1;
+	free(entry->staging_filled);
+	entry->staging_filled = NULL;
+	entry->staging_remote = 0;
+}
+
+/** Write all of buf to a file.
+ *
+ *  @returns 0 on success, or a negative errno
+ */
+static int gdw_pwrite_all(int fd, const char* buf, size_t size, off_t offset)
+{
+	while(size)
+	{
+		ssize_t count = pwrite(fd, buf, size, offset);
+		if(count < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			return -errno;
+		}
+		buf += count;
+		size -= count;
+		offset += count;
+	}
+	return 0;
+}
+
+/** Copy the first keep bytes of an entry that is not ranged into a staging
+ *  file. Such entries are downloaded whole anyway.
+ *
+ *  @returns 0 on success, or a negative errno
+ */
+static int gdw_copy(struct gd_fs_entry_t* entry, int fd, off_t keep)
+{
+	struct gdi_state *state = writeback.gdi;
+	int ret;
+
+	if(gdi_load(state, entry))
+		return gdi_interrupted() ? -EINTR : -EIO;
+
+	struct gd_content_t *content = gd_content_get(entry);
+	if(content == NULL)
+		return -EIO;
+	if(keep > content->data.len)
+		keep = content->data.len;
+	ret = gdw_pwrite_all(fd, content->data.str, keep, 0);
+	gd_content_put(content);
+	return ret;
+}
+
+/** Copy the server's bytes of a lazily staged entry into its staging file.
+ *
+ *  Every chunk overlapping [start, end) that has not been copied yet is
+ *  fetched. A chunk is copied before anything reads or writes it, so the
+ *  server's bytes never overwrite a local write.
+ *
+ *  @entry    struct gd_fs_entry_t*   the staged entry
+ *  @start    off_t                   the first byte about to be used
+ *  @end      off_t                   one past the last
+ *  @priority enum request_priority_e the scheduler class for the fetches
+ *
+ *  @returns 0 on success, or a negative errno
+ */
+static int gdw_fill(struct gd_fs_entry_t* entry, off_t start, off_t end,
+		enum request_priority_e priority)
+{
+	struct gdi_state *state = writeback.gdi;
+	int ret = 0;
+
+	pthread_mutex_lock(&entry->lock);
+	while(!ret)
+	{
+		off_t chunk = start / staging_chunk;
+		off_t last = (end < entry->staging_remote) ? end : entry->staging_remote;
+		while(chunk * (off_t) staging_chunk < last && entry->staging_filled[chunk])
+			++chunk;
+		if(chunk * (off_t) staging_chunk >= last)
+			break;
+		if(entry->staging_filling)
+		{
+			pthread_cond_wait(&entry->cond, &entry->lock);
+			continue;
+		}
+
+		entry->staging_filling = 1;
+		int fd = entry->staging_fd;
+		off_t offset = chunk * staging_chunk;
+		size_t length = (entry->staging_remote - offset < staging_chunk)
+			? entry->staging_remote - offset : staging_chunk;
+		pthread_mutex_unlock(&entry->lock);
+
+		struct str_t data;
+		str_init(&data);
+		ret = gdi_fetch_range(state, entry, &data, length, offset, priority);
+		// Short, there is nothing past it and the rest stays zero
+		if(!ret)
+			ret = gdw_pwrite_all(fd, data.str, data.len, offset);
+		str_destroy(&data);
+
+		pthread_mutex_lock(&entry->lock);
+		entry->staging_filling = 0;
+		if(!ret)
+			entry->staging_filled[chunk] = 1;
+		pthread_cond_broadcast(&entry->cond);
+	}
+	pthread_mutex_unlock(&entry->lock);
+
+	return ret;
+}
+
+/** Forget the server's bytes of a staged entry past size, it is being cut
+ *  short. Waits for a chunk being copied, which may reach past size.
+ */
+static void gdw_cut(struct gd_fs_entry_t* entry, off_t size)
+{
+	pthread_mutex_lock(&entry->lock);
+	while(entry->staging_filling)
+		pthread_cond_wait(&entry->cond, &entry->lock);
+	if(size < entry->staging_remote)
+		entry->staging_remote = size;
+	pthread_mutex_unlock(&entry->lock);
+}
+
+/** Make sure an entry has a staging file.
+ *
+ *  Only one thread creates the staging file of an entry, others wait for it.
+ *  Once it exists the entry's content version is dropped, handles that have
+ *  it pinned keep reading it and new handles read the staging file.
+ *
+ *  A ranged entry's staging file starts out empty, keep bytes long, and is
+ *  filled in as it is used, see gdw_fill(). Others are copied in at once.
+ *
+ *  @entry struct gd_fs_entry_t* the entry to stage
+ *  @keep  off_t                 how much of the current contents to copy in
+ *
+ *  @returns 0 on success, or a negative errno
+ */
+static int gdw_stage(struct gd_fs_entry_t* entry, off_t keep)
+{
+	int ret;
+
+	pthread_mutex_lock(&entry->lock);
+	while(entry->staging_busy)
+		pthread_cond_wait(&entry->cond, &entry->lock);
+	if(entry->staging_fd >= 0)
+	{
+		pthread_mutex_unlock(&entry->lock);
+		return 0;
+	}
+	entry->staging_busy = 1;
+	pthread_mutex_unlock(&entry->lock);
+
+	const char suffix[] = "/XXXXXX";
+	size_t length = strlen(writeback.staging_dir);
+	char *name = (char*) malloc(length + sizeof(suffix));
+	unsigned char *filled = NULL;
+	off_t remote = 0;
+	int fd = -1;
+	if(name == NULL)
+		ret = -ENOMEM;
+	else
+	{
+		memcpy(name, writeback.staging_dir, length);
+		memcpy(name + length, suffix, sizeof(suffix));
+		fd = mkstemp(name);
+		if(fd < 0)
+			ret = -errno;
+		else
+		{
+			unlink(name);
+			ret = 0;
+			if(keep > 0 && gdi_is_ranged(entry))
+			{
+				filled = (unsigned char*) calloc((keep + staging_chunk - 1)
+						/ staging_chunk, 1);
+				if(filled == NULL)
+					ret = -ENOMEM;
+				else if(ftruncate(fd, keep))
+					ret = -errno;
+				remote = keep;
+			}
+			else if(keep > 0)
+				ret = gdw_copy(entry, fd, keep);
+		}
+		free(name);
+	}
+
+	if(ret && fd >= 0)
+	{
+		close(fd);
+		fd = -1;
+	}
+	if(ret)
+	{
+		free(filled);
+		filled = NULL;
+		remote = 0;
+	}
+
+	pthread_mutex_lock(&entry->lock);
+	entry->staging_fd = fd;
+	free(entry->staging_filled);
+	entry->staging_filled = filled;
+	entry->staging_remote = remote;
+	entry->staging_busy = 0;
+	pthread_cond_broadcast(&entry->cond);
+	pthread_mutex_unlock(&entry->lock);
+
+	if(!ret)
+		gd_content_publish(entry, NULL);
+
+	return ret;
+}
+
+/** Queue an entry for upload.
+ *
+ *  An entry already queued stays queued once, at the earlier of its due times.
+ *
+ *  @entry    struct gd_fs_entry_t* the entry to upload
+ *  @delay_ms long                  how long to wait before uploading
+ */
+static void gdw_queue(struct gd_fs_entry_t* entry, long delay_ms)
+{
+	struct timespec due;
+	clock_gettime(CLOCK_MONOTONIC, &due);
+	due.tv_sec += delay_ms / 1000;
+	due.tv_nsec += (delay_ms % 1000) * 1000000;
+	if(due.tv_nsec >= 1000000000)
+	{
+		++due.tv_sec;
+		due.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&writeback.lock);
+	if(!entry->upload_queued)
+	{
+		entry->upload_queued = 1;
+		entry->upload_due = due;
+		entry->upload_next = NULL;
+		if(writeback.tail)
+			writeback.tail->upload_next = entry;
+		else
+			writeback.head = entry;
+		writeback.tail = entry;
+	}
+	else if(due.tv_sec < entry->upload_due.tv_sec || (due.tv_sec == entry->upload_due.tv_sec
+				&& due.tv_nsec < entry->upload_due.tv_nsec))
+		entry->upload_due = due;
+	pthread_cond_broadcast(&writeback.cond);
+	pthread_mutex_unlock(&writeback.lock);
+}
+
+/** Check if an entry has changes the server does not have yet.
+ *
+ *  Deleted entries have nothing left to send. Must be called with entry->lock
+ *  held.
+ */
+static int gdw_dirty(const struct gd_fs_entry_t* entry)
+{
+	return entry->write_generation != entry->upload_generation && !entry->deleted;
+}
+
+/** Open an entry for writing.
+ *
+ *  The first writer stages the current contents, unless truncate is set.
+ *  Ranged entries are not fetched here, only as their bytes are first read
+ *  or written. Google documents have no byte stream to write to.
+ *
+ *  @entry    struct gd_fs_entry_t* the entry to open
+ *  @truncate int                   nonzero to discard the current contents
+ *
+ *  @returns 0 on success, or a negative errno
+ */
+int gdw_open(struct gd_fs_entry_t* entry, int truncate)
+{
+	if(entry->resourceID.len && !entry->md5set)
+		return -EACCES;
+
+	pthread_mutex_lock(&entry->lock);
+	++entry->writers;
+	pthread_mutex_unlock(&entry->lock);
+
+	int ret = gdw_stage(entry, truncate ? 0 : entry->size);
+	if(!ret && truncate && entry->size)
+	{
+		gdw_cut(entry, 0);
+		if(ftruncate(entry->staging_fd, 0))
+			ret = -errno;
+	}
+
+	pthread_mutex_lock(&entry->lock);
+	if(ret)
+		--entry->writers;
+	else
+	{
+		if(truncate && entry->size)
+		{
+			gd_fs_entry_modified(entry, 0);
+			++entry->write_generation;
+		}
+		// Files created here must reach the server even if nothing is written
+		if(!entry->resourceID.len)
+			++entry->write_generation;
+	}
+	pthread_mutex_unlock(&entry->lock);
+
+	return ret;
+}
+
+/** Close a handle opened with gdw_open(), queueing the entry for upload.
+ */
+void gdw_release(struct gd_fs_entry_t* entry)
+{
+	pthread_mutex_lock(&entry->lock);
+	--entry->writers;
+	int dirty = gdw_dirty(entry);
+	gdw_unstage(entry);
+	pthread_mutex_unlock(&entry->lock);
+
+	if(dirty)
+		gdw_queue(entry, upload_delay_ms);
+}
+
+/** Read from the staging file of an entry.
+ *
+ *  @returns the number of bytes read, -ESTALE if the staging file has been
+ *           closed since the caller checked, or a negative errno
+ */
+int gdw_read(struct gd_fs_entry_t* entry, char* buf, size_t size, off_t offset)
+{
+	size_t done = 0;
+
+	pthread_mutex_lock(&entry->lock);
+	int fd = entry->staging_fd;
+	if(fd >= 0)
+		++entry->staging_readers;
+	pthread_mutex_unlock(&entry->lock);
+	if(fd < 0)
+		return -ESTALE;
+
+	int ret = gdw_fill(entry, offset, offset + size, PRIORITY_INTERACTIVE);
+
+	while(!ret && done < size)
+	{
+		ssize_t count = pread(fd, buf + done, size - done, offset + done);
+		if(count < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			ret = -errno;
+			break;
+		}
+		if(count == 0)
+			break;
+		done += count;
+	}
+
+	pthread_mutex_lock(&entry->lock);
+	// gdw_discard() waits for the last one
+	if(!--entry->staging_readers)
+		pthread_cond_broadcast(&entry->cond);
+	gdw_unstage(entry);
+	pthread_mutex_unlock(&entry->lock);
+
+	return (ret && !done) ? ret : (int) done;
+}
+
+/** Write to the staging file of an entry.
+ *
+ *  Returns as soon as the local file has the data, the server gets it when
+ *  the entry is next uploaded.
+ *
+ *  @returns the number of bytes written, or a negative errno
+ */
+int gdw_write(struct gd_fs_entry_t* entry, const char* buf, size_t size, off_t offset)
+{
+	// A server side copy replaced the staging file since this handle opened
+	int ret = gdw_stage(entry, entry->size);
+	if(!ret)
+		ret = gdw_fill(entry, offset, offset + size, PRIORITY_INTERACTIVE);
+	if(!ret)
+		ret = gdw_pwrite_all(entry->staging_fd, buf, size, offset);
+	if(ret)
+		return ret;
+
+	pthread_mutex_lock(&entry->lock);
+	gd_fs_entry_modified(entry, (offset + size > entry->size) ? offset + size : entry->size);
+	++entry->write_generation;
+	pthread_mutex_unlock(&entry->lock);
+
+	return size;
+}
+
+/** Change the size of an entry.
+ *
+ *  The entry is staged if it was not already, and queued for upload if no
+ *  handle has it open for writing.
+ *
+ *  @returns 0 on success, or a negative errno
+ */
+int gdw_truncate(struct gd_fs_entry_t* entry, off_t size)
+{
+	if(entry->resourceID.len && !entry->md5set)
+		return -EACCES;
+
+	// Counted as a writer meanwhile, so the staging file is not closed
+	pthread_mutex_lock(&entry->lock);
+	++entry->writers;
+	pthread_mutex_unlock(&entry->lock);
+
+	int ret = gdw_stage(entry, (size < entry->size) ? size : entry->size);
+	if(!ret)
+	{
+		gdw_cut(entry, size);
+		if(ftruncate(entry->staging_fd, size))
+			ret = -errno;
+	}
+
+	pthread_mutex_lock(&entry->lock);
+	--entry->writers;
+	if(!ret)
+	{
+		gd_fs_entry_modified(entry, size);
+		++entry->write_generation;
+	}
+	int writers = entry->writers;
+	gdw_unstage(entry);
+	pthread_mutex_unlock(&entry->lock);
+
+	if(ret)
+		return ret;
+
+	if(!writers)
+		gdw_queue(entry, upload_delay_ms);
+	return 0;
+}
+
+/** Upload an entry now and wait for the server to have it.
+ *
+ *  @returns 0 on success, or a negative errno
+ */
+int gdw_sync(struct gd_fs_entry_t* entry)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&entry->lock);
+	unsigned long target = entry->write_generation;
+	if(!gdw_dirty(entry))
+	{
+		pthread_mutex_unlock(&entry->lock);
+		return 0;
+	}
+	entry->upload_error = 0;
+	pthread_mutex_unlock(&entry->lock);
+
+	gdw_queue(entry, 0);
+
+	pthread_mutex_lock(&entry->lock);
+	while(entry->upload_generation < target && !entry->upload_error)
+	{
+		if(gdi_interrupted())
+		{
+			ret = -EINTR;
+			break;
+		}
+		// Wake up now and then to notice interruption
+		struct timespec wait;
+		clock_gettime(CLOCK_REALTIME, &wait);
+		++wait.tv_sec;
+		pthread_cond_timedwait(&entry->cond, &entry->lock, &wait);
+	}
+	if(!ret && entry->upload_generation < target)
+		ret = entry->upload_error;
+	pthread_mutex_unlock(&entry->lock);
+
+	return ret;
+}
+
+/** Drop the staging file of an entry whose contents were replaced on the
+ *  server, by a server side copy for instance. Nothing is uploaded for it.
+ *
+ *  Reads under way are waited for, writes are not, so no handle but the
+ *  caller's may have the entry open for writing.
+ */
+void gdw_discard(struct gd_fs_entry_t* entry)
+{
+	pthread_mutex_lock(&entry->lock);
+	while(entry->staging_filling || entry->staging_readers)
+		pthread_cond_wait(&entry->cond, &entry->lock);
+	int fd = entry->staging_fd;
+	entry->staging_fd = -1;
+	free(entry->staging_filled);
+	entry->staging_filled = NULL;
+	entry->staging_remote = 0;
+	entry->upload_generation = entry->write_generation;
+	entry->upload_error = 0;
+	pthread_cond_broadcast(&entry->cond);
+	pthread_mutex_unlock(&entry->lock);
+
+	if(fd >= 0)
+		close(fd);
+}
+
+/** Prepare a request for an upload.
+ *
+ *  @request     struct request_t*   the request to initialize
+ *  @uri         struct str_t*       the uri to send to
+ *  @body        const char*         the Atom document to POST, NULL for PUT
+ *  @type        enum request_type_e POST or PUT
+ *  @deadline_ms long                the time budget
+ *  @count       size_t              the number of elements in extra[]
+ *  @extra       const char*[]       headers sent besides the usual ones
+ */
+static void gdw_request_init(struct request_t* request, struct str_t* uri,
+		const char* body, enum request_type_e type, long deadline_ms,
+		size_t count, const char* extra[])
+{
+	struct str_t headers[8];
+	size_t iter;
+
+	headers[0] = *writeback.gdi->oauth_header;
+	str_init_create(&headers[1], "GData-Version: 3.0", 0);
+	// Without this curl waits for a 100 Continue, whose headers would be taken
+	// for the start of the body
+	str_init_create(&headers[2], "Expect:", 0);
+	for(iter = 0; iter < count; ++iter)
+		str_init_create(&headers[3 + iter], extra[iter], 0);
+
+	ci_init(request, uri, 3 + count, headers, body, type);
+	ci_set_priority(request, PRIORITY_UPLOAD);
+	ci_set_deadline(request, deadline_ms);
+
+	for(iter = 1; iter < 3 + count; ++iter)
+		str_destroy(&headers[iter]);
+}
+
+/** Start an upload session for an entry.
+ *
+ *  Entries the server does not have yet are created, others have their
+ *  contents replaced.
+ *
+ *  @entry   struct gd_fs_entry_t* the entry to upload
+ *  @size    off_t                 the number of bytes that will be sent
+ *  @session struct str_t*         receives the uri to send the contents to
+ *
+ *  @returns 0 on success, -EAGAIN if the folder a new file is in is not on
+ *           the server yet, or a negative errno
+ */
+static int gdw_start_session(struct gd_fs_entry_t* entry, off_t size,
+		struct str_t* session)
+{
+	int ret = 0;
+	struct request_t request;
+	struct str_t uri;
+	struct str_t body;
+	char length[64];
+
+	snprintf(length, sizeof(length), "X-Upload-Content-Length: %lld", (long long) size);
+	str_init(&body);
+
+	if(!entry->resourceID.len)
+	{
+		const char *extra[] = {
+			"Content-Type: application/atom+xml",
+			"X-Upload-Content-Type: application/octet-stream",
+			length
+		};
+		struct str_t parent;
+		struct str_t *escaped = NULL;
+
+		ret = gdd_parent_id(entry, &parent);
+		if(!ret && parent.len && (escaped = str_urlencode_str(&parent)) == NULL)
+			ret = -ENOMEM;
+		str_destroy(&parent);
+		if(ret)
+			return ret;
+
+		const char head[] = "<?xml version='1.0' encoding='UTF-8'?>"
+			"<entry xmlns=\"http://www.w3.org/2005/Atom\">";
+		str_char_concat(&body, head, sizeof(head) - 1);
+		if(gdi_atom_title(&body, &entry->filename))
+		{
+			str_destroy(&body);
+			str_destroy(escaped);
+			free(escaped);
+			return -ENOMEM;
+		}
+		str_char_concat(&body, "</entry>", 8);
+
+		str_init_create(&uri, create_session_uri, 0);
+		if(escaped)
+		{
+			str_char_concat(&uri, "/", 1);
+			str_char_concat(&uri, escaped->str, escaped->len);
+			str_char_concat(&uri, "/contents", 9);
+			str_destroy(escaped);
+			free(escaped);
+		}
+		str_char_concat(&uri, create_session_query, sizeof(create_session_query) - 1);
+		gdw_request_init(&request, &uri, body.str, POST, session_deadline_ms,
+				sizeof(extra) / sizeof(extra[0]), extra);
+	}
+	else
+	{
+		const char *extra[] = {
+			"If-Match: *",
+			"X-Upload-Content-Type: application/octet-stream",
+			length
+		};
+
+		if(!entry->edit_media.len)
+			return -EACCES;
+		str_init_create(&uri, entry->edit_media.str, entry->edit_media.len);
+		gdw_request_init(&request, &uri, NULL, PUT, session_deadline_ms,
+				sizeof(extra) / sizeof(extra[0]), extra);
+	}
+
+	if(!gdi_request_ok(&request, ci_request(&request))
+			|| ci_get_header(&request, "Location", session))
+		ret = -EIO;
+
+	ci_destroy(&request);
+	str_destroy(&uri);
+	str_destroy(&body);
+	return ret;
+}
+
+
+/** Find how much of an upload the server has from a 308 response.
+ *
+ *  @returns the offset of the first byte the server does not have
+ */
+static off_t gdw_received(const struct request_t* request)
+{
+	struct str_t range;
+	off_t received = 0;
+
+	// "Range: bytes=0-1048575", absent if nothing arrived
+	str_init(&range);
+	if(!ci_get_header(request, "Range", &range))
+	{
+		const char *last = strrchr(range.str, '-');
+		if(last)
+			received = strtoll(last + 1, NULL, 10) + 1;
+	}
+	str_destroy(&range);
+
+	return received;
+}
+
+/** Make sense of the server's reply to part of an upload.
+ *
+ *  @request struct request_t*      the completed request
+ *  @ret     int                    what ci_request() returned
+ *  @offset  off_t*                 set to what the server has if it wants more
+ *  @result  struct gd_fs_entry_t** set to the uploaded entry once it is done
+ *
+ *  @returns 1 if the upload is done, 0 if the server wants more, -ENOENT if
+ *           the session is gone, otherwise a negative errno
+ */
+static int gdw_reply(const struct request_t* request, int ret, off_t* offset,
+		struct gd_fs_entry_t** result)
+{
+	if(ret != CURLE_OK)
+		return -EIO;
+
+	switch(request->status)
+	{
+		case 308: // Resume Incomplete
+			*offset = gdw_received(request);
+			return 0;
+		case 200:
+		case 201:
+			*result = xml_parse_entry(&request->response.body);
+			return *result ? 1 : -EIO;
+		case 404:
+		case 410:
+			return -ENOENT;
+		default:
+			return -EIO;
+	}
+}
+
+/** Send the next chunk of a staging file to an upload session.
+ *
+ *  @session struct str_t*          the uri from gdw_start_session()
+ *  @fd      int                    the staging file
+ *  @size    off_t                  the size of the whole upload
+ *  @offset  off_t*                 where the chunk starts, updated to what
+ *                                  the server has afterwards
+ *  @result  struct gd_fs_entry_t** set to the uploaded entry once it is done
+ *
+ *  @returns as gdw_reply()
+ */
+static int gdw_send_chunk(struct str_t* session, int fd, off_t size,
+		off_t* offset, struct gd_fs_entry_t** result)
+{
+	struct request_t request;
+	char range[96];
+	const char *extra[] = {
+		"Content-Type: application/octet-stream",
+		range
+	};
+
+	off_t length = (size - *offset < upload_chunk) ? size - *offset : upload_chunk;
+	snprintf(range, sizeof(range), "Content-Range: bytes %lld-%lld/%lld",
+			(long long) *offset, (long long) (*offset + length - 1), (long long) size);
+	long deadline = session_deadline_ms + length / upload_min_rate * 1000;
+	// An empty file has no range to describe
+	gdw_request_init(&request, session, NULL, PUT, deadline, size ? 2 : 1, extra);
+	ci_set_upload(&request, fd, *offset, length);
+
+	int ret = gdw_reply(&request, ci_request(&request), offset, result);
+
+	ci_destroy(&request);
+	return ret;
+}
+
+/** Ask an upload session how much the server has.
+ *
+ *  Used after a chunk failed, the connection may have dropped after some or
+ *  all of it arrived.
+ *
+ *  @returns as gdw_reply()
+ */
+static int gdw_query(struct str_t* session, off_t size, off_t* offset,
+		struct gd_fs_entry_t** result)
+{
+	struct request_t request;
+	char range[64];
+	const char *extra[] = { range };
+
+	snprintf(range, sizeof(range), "Content-Range: bytes */%lld", (long long) size);
+	gdw_request_init(&request, session, NULL, PUT, session_deadline_ms, 1, extra);
+
+	int ret = gdw_reply(&request, ci_request(&request), offset, result);
+
+	ci_destroy(&request);
+	return ret;
+}
+
+/** Sleep before resuming a failed upload, backing off exponentially.
+ */
+static void gdw_backoff(int attempt)
+{
+	long delay = resume_base_ms << attempt;
+	if(delay > resume_max_ms || delay <= 0)
+		delay = resume_max_ms;
+
+	struct timespec wait = { delay / 1000, (delay % 1000) * 1000000 };
+	while(nanosleep(&wait, &wait) == -1 && errno == EINTR)
+		;
+}
+
+/** Check if an entry changed since an upload of it started.
+ */
+static int gdw_superseded(struct gd_fs_entry_t* entry, unsigned long generation)
+{
+	pthread_mutex_lock(&entry->lock);
+	int changed = entry->write_generation != generation || entry->deleted;
+	pthread_mutex_unlock(&entry->lock);
+	return changed;
+}
+
+/** Upload the staging file of an entry.
+ *
+ *  The file is sent in chunks of upload_chunk bytes. When a chunk fails the
+ *  server is asked how much it has and the upload carries on from there, an
+ *  expired session starts over once. If the upload still fails its session is
+ *  kept, so the next attempt resumes it unless the file changed meanwhile.
+ *
+ *  When it completes the entry takes the server's metadata, including the
+ *  new md5. An upload overtaken by new writes is abandoned, the entry is
+ *  queued again for the newer contents.
+ *
+ *  @entry struct gd_fs_entry_t* the entry to upload
+ */
+static void gdw_upload(struct gd_fs_entry_t* entry)
+{
+	struct str_t session;
+	struct gd_fs_entry_t *uploaded = NULL;
+	off_t offset = 0;
+	int failures = 0;
+	int restarted = 0;
+	int ret = 0;
+	int query = 0;
+
+	str_init(&session);
+
+	pthread_mutex_lock(&entry->lock);
+	unsigned long generation = entry->write_generation;
+	off_t size = entry->size;
+	int fd = entry->staging_fd;
+	int dirty = gdw_dirty(entry);
+	if(entry->session_generation == generation && entry->upload_session.len)
+	{
+		str_swap(&session, &entry->upload_session);
+		query = 1;
+	}
+	str_destroy(&entry->upload_session);
+	pthread_mutex_unlock(&entry->lock);
+
+	if(!dirty || fd < 0)
+	{
+		str_destroy(&session);
+		return;
+	}
+
+	// What was never read or written still has to be sent
+	ret = gdw_fill(entry, 0, size, PRIORITY_UPLOAD);
+	if(!ret && !query)
+		ret = gdw_start_session(entry, size, &session);
+
+	while(!ret)
+	{
+		if(gdw_superseded(entry, generation))
+		{
+			ret = -EAGAIN;
+			break;
+		}
+
+		off_t before = offset;
+		if(query)
+			ret = gdw_query(&session, size, &offset, &uploaded);
+		else
+			ret = gdw_send_chunk(&session, fd, size, &offset, &uploaded);
+
+		if(ret == 1)
+		{
+			ret = 0;
+			break;
+		}
+		if(ret == 0)
+		{
+			if(offset > before || !query)
+				failures = 0;
+			query = 0;
+			continue;
+		}
+
+		if(ret == -ENOENT && !restarted)
+		{
+			// The session expired, start a new one from the beginning
+			restarted = 1;
+			offset = 0;
+			query = 0;
+			str_clear(&session);
+			ret = gdw_start_session(entry, size, &session);
+			continue;
+		}
+
+		if(++failures > max_resumes)
+			break;
+		gdw_backoff(failures - 1);
+		query = 1;
+		ret = 0;
+	}
+
+	pthread_mutex_lock(&entry->lock);
+	if(ret == -EAGAIN)
+		; // Nothing is wrong, the newer contents are uploaded next
+	else if(ret)
+	{
+		entry->upload_error = ret;
+		if(session.len)
+		{
+			str_swap(&entry->upload_session, &session);
+			entry->session_generation = generation;
+		}
+		fprintf(stderr, "Upload of %s failed\n", entry->filename.str);
+	}
+	else
+	{
+		gd_fs_entry_swap_id(entry, &uploaded->resourceID);
+		str_swap(&entry->src, &uploaded->src);
+		str_swap(&entry->feed, &uploaded->feed);
+		str_swap(&entry->edit_media, &uploaded->edit_media);
+		str_swap(&entry->edit, &uploaded->edit);
+		str_swap(&entry->parent, &uploaded->parent);
+		str_swap(&entry->md5, &uploaded->md5);
+		str_swap(&entry->revision, &uploaded->revision);
+		entry->md5set = uploaded->md5set;
+		// Written to again since, the local size and time are newer
+		if(entry->write_generation == generation)
+		{
+			entry->size = uploaded->size;
+			entry->mtime = uploaded->mtime;
+			entry->ctime = uploaded->ctime;
+			gd_fs_entry_stat(entry);
+		}
+		if(entry->upload_generation < generation)
+			entry->upload_generation = generation;
+		entry->upload_error = 0;
+		// The server has it all, the staging file is not needed any more
+		gdw_unstage(entry);
+	}
+	pthread_cond_broadcast(&entry->cond);
+	pthread_mutex_unlock(&entry->lock);
+
+	str_destroy(&session);
+	if(uploaded)
+	{
+		gd_fs_entry_destroy(uploaded);
+		free(uploaded);
+	}
+
+	if(ret == -EAGAIN)
+		gdw_queue(entry, upload_delay_ms);
+	else if(ret && !writeback.stopping)
+		gdw_queue(entry, upload_retry_ms);
+}
+
+/** Take the entry due soonest off the upload queue.
+ *
+ *  Entries another uploader is sending are passed over. Must be called with
+ *  writeback.lock held.
+ *
+ *  @now struct timespec* the current time
+ *
+ *  @returns the entry if one is due. Otherwise NULL, with now set to when the
+ *           next one is due, or zeroed if there is none.
+ */
+static struct gd_fs_entry_t* gdw_next(struct timespec* now)
+{
+	struct gd_fs_entry_t **iter;
+	struct gd_fs_entry_t **soonest = NULL;
+	struct gd_fs_entry_t *prev = NULL;
+	struct gd_fs_entry_t *before = NULL;
+
+	for(iter = &writeback.head; *iter != NULL; iter = &(*iter)->upload_next)
+	{
+		if(!(*iter)->uploading)
+		{
+			const struct timespec *due = &(*iter)->upload_due;
+			const struct timespec *best = soonest ? &(*soonest)->upload_due : NULL;
+			if(best == NULL || due->tv_sec < best->tv_sec || (due->tv_sec == best->tv_sec
+						&& due->tv_nsec < best->tv_nsec))
+			{
+				soonest = iter;
+				before = prev;
+			}
+		}
+		prev = *iter;
+	}
+
+	if(soonest == NULL)
+	{
+		memset(now, 0, sizeof(struct timespec));
+		return NULL;
+	}
+
+	struct gd_fs_entry_t *entry = *soonest;
+	if(!writeback.stopping && (entry->upload_due.tv_sec > now->tv_sec
+				|| (entry->upload_due.tv_sec == now->tv_sec
+					&& entry->upload_due.tv_nsec > now->tv_nsec)))
+	{
+		*now = entry->upload_due;
+		return NULL;
+	}
+
+	*soonest = entry->upload_next;
+	if(writeback.tail == entry)
+		writeback.tail = before;
+	entry->upload_next = NULL;
+	entry->upload_queued = 0;
+	return entry;
+}
+
+/** Upload queued entries as they come due.
+ *
+ *  Several of these run at once, each sending a different entry. An entry
+ *  queued again while it is being uploaded is uploaded again after.
+ */
+void* gdw_uploader(void* arg)
+{
+	pthread_mutex_lock(&writeback.lock);
+	while(1)
+	{
+		struct timespec now;
+
+		if(writeback.head == NULL && writeback.stopping)
+			break;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		struct gd_fs_entry_t *entry = writeback.head ? gdw_next(&now) : NULL;
+		if(entry == NULL)
+		{
+			if(writeback.head && now.tv_sec)
+				pthread_cond_timedwait(&writeback.cond, &writeback.lock, &now);
+			else
+				pthread_cond_wait(&writeback.cond, &writeback.lock);
+			continue;
+		}
+
+		entry->uploading = 1;
+		pthread_mutex_unlock(&writeback.lock);
+		gdw_upload(entry);
+		pthread_mutex_lock(&writeback.lock);
+		entry->uploading = 0;
+		// Another uploader may be waiting for this entry
+		pthread_cond_broadcast(&writeback.cond);
+	}
+	pthread_mutex_unlock(&writeback.lock);
+
+	return NULL;
+}
@@ -0,0 +1,72 @@
+/*
+	fuse-google-drive: a fuse filesystem wrapper for Google Drive
+	Copyright (C) 2012  James Cline
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2 as
+ 	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef _GOOGLE_DRIVE_WRITEBACK_H
+#define _GOOGLE_DRIVE_WRITEBACK_H
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "gd_cache.h"
+#include "gd_interface.h"
+
+// Uploads running at once, each its own file. The chunks of one file have to
+// be sent in order, so this is where upload parallelism comes from.
+#define GDW_UPLOADERS 4
+
+/** The state of the write-back cache for this mount.
+ *
+ *  Writes land in a local staging file per entry and return as soon as the
+ *  local disk has them. A pool of uploader threads sends dirty entries to the
+ *  server once their handles are released or synced.
+ */
+struct gdw_state_t {
+	struct gdi_state *gdi;
+	// Where staging files are created
+	char *staging_dir;
+
+	pthread_t uploaders[GDW_UPLOADERS];
+	size_t started;
+	// Protects the queue and stopping
+	pthread_mutex_t lock;
+	// Signalled when an entry is queued or the uploader should stop
+	pthread_cond_t cond;
+	// Entries waiting for upload, linked by upload_next
+	struct gd_fs_entry_t *head;
+	struct gd_fs_entry_t *tail;
+	// Set by gdw_destroy(), the uploaders drain the queue and exit
+	int stopping;
+};
+
+int gdw_init(struct gdi_state* state, const char* path);
+void gdw_destroy();
+
+int gdw_open(struct gd_fs_entry_t* entry, int truncate);
+void gdw_release(struct gd_fs_entry_t* entry);
+int gdw_is_staged(const struct gd_fs_entry_t* entry);
+int gdw_busy(struct gd_fs_entry_t* entry);
+int gdw_pending(struct gd_fs_entry_t* entry);
+unsigned long gdw_writers(struct gd_fs_entry_t* entry);
+int gdw_read(struct gd_fs_entry_t* entry, char* buf, size_t size, off_t offset);
+int gdw_write(struct gd_fs_entry_t* entry, const char* buf, size_t size, off_t offset);
+int gdw_truncate(struct gd_fs_entry_t* entry, off_t size);
+int gdw_sync(struct gd_fs_entry_t* entry);
+void gdw_discard(struct gd_fs_entry_t* entry);
+
+#endif
@@ -0,0 +1,311 @@
+/*
+	fuse-google-drive: a fuse filesystem wrapper for Google Drive
+	Copyright (C) 2012  James Cline
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2 as
+ 	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "request_scheduler.h"
+
+static struct rs_state_t scheduler;
+
+// Ignore further throttling responses for this long after shrinking the
+// window, they were most likely sent before the shrink took effect
+const long decrease_holdoff_ms = 1000;
+
+// Hedge a request once it has waited longer than this percentile of recent
+// first byte latencies
+const size_t hedge_percentile = 95;
+// Never hedge before this many milliseconds, or with fewer samples than this
+const long hedge_min_delay_ms = 50;
+const size_t hedge_min_samples = 16;
+// Each hedgeable request earns this fraction of a hedge, so hedges add at
+// most this much load, with up to hedge_burst saved up
+const double hedge_ratio = 0.05;
+const double hedge_burst = 5;
+
+/** Initialize the global request scheduler.
+ *
+ *  Every class starts out allowed to use all of the slots, background classes
+ *  are then narrowed so they cannot crowd out the foreground.
+ *
+ *  @max_inflight size_t the number of requests allowed on the wire at once
+ *
+ *  @returns 0 on success, 1 on failure
+ */
+int rs_init(size_t max_inflight)
+{
+	memset(&scheduler, 0, sizeof(struct rs_state_t));
+	if(pthread_mutex_init(&scheduler.lock, NULL))
+		return 1;
+	if(pthread_cond_init(&scheduler.cond, NULL))
+	{
+		pthread_mutex_destroy(&scheduler.lock);
+		return 1;
+	}
+
+	if(max_inflight < 2)
+		max_inflight = 2;
+	scheduler.max_inflight = max_inflight;
+	scheduler.window = max_inflight;
+	scheduler.reserved = 1;
+
+	size_t count;
+	for(count = 0; count < PRIORITY_COUNT; ++count)
+		scheduler.classes[count].max_inflight = max_inflight;
+
+	// Background work gets at most half the connections, so it is never more
+	// than one slot away from yielding to the foreground.
+	scheduler.classes[PRIORITY_READAHEAD].max_inflight = max_inflight / 2;
+	scheduler.classes[PRIORITY_UPLOAD].max_inflight = max_inflight / 2;
+	scheduler.classes[PRIORITY_SYNC].max_inflight = max_inflight / 4 ? max_inflight / 4 : 1;
+
+	return 0;
+}
+
+/** Destroy the global request scheduler.
+ */
+void rs_destroy()
+{
+	pthread_cond_destroy(&scheduler.cond);
+	pthread_mutex_destroy(&scheduler.lock);
+}
+
+/** Set the concurrency and bandwidth caps for one priority class.
+ *
+ *  @priority       enum request_priority_e the class to change
+ *  @max_inflight   size_t                  requests of this class allowed at once
+ *  @max_recv_speed curl_off_t              bytes/second per transfer, 0 for no cap
+ */
+void rs_set_class_limits(enum request_priority_e priority,
+		size_t max_inflight, curl_off_t max_recv_speed)
+{
+	pthread_mutex_lock(&scheduler.lock);
+	scheduler.classes[priority].max_inflight = max_inflight ? max_inflight : 1;
+	scheduler.classes[priority].max_recv_speed = max_recv_speed;
+	pthread_cond_broadcast(&scheduler.cond);
+	pthread_mutex_unlock(&scheduler.lock);
+}
+
+/** Get the per transfer receive limit for a priority class.
+ *
+ *  @priority enum request_priority_e the class to look up
+ *
+ *  @returns bytes/second, 0 if unlimited
+ */
+curl_off_t rs_recv_speed(enum request_priority_e priority)
+{
+	pthread_mutex_lock(&scheduler.lock);
+	curl_off_t speed = scheduler.classes[priority].max_recv_speed;
+	pthread_mutex_unlock(&scheduler.lock);
+	return speed;
+}
+
+/** Checks if a request of the given class may start right now.
+ *
+ *  Must be called with scheduler.lock held.
+ */
+static int rs_can_start(enum request_priority_e priority)
+{
+	const struct rs_class_t *class = &scheduler.classes[priority];
+	size_t limit = (size_t) scheduler.window;
+	size_t count;
+
+	// With a tiny window there is nothing left to reserve
+	if(priority > PRIORITY_OPEN && limit > scheduler.reserved)
+		limit -= scheduler.reserved;
+
+	if(scheduler.inflight >= limit || class->inflight >= class->max_inflight)
+		return 0;
+
+	// Let anything more important that is queued go first, unless its class
+	// is at its own cap and could not start anyway
+	for(count = 0; count < priority; ++count)
+	{
+		const struct rs_class_t *other = &scheduler.classes[count];
+		if(other->waiting && other->inflight < other->max_inflight)
+			return 0;
+	}
+
+	return 1;
+}
+
+/** Wait for a slot to make a request in.
+ *
+ *  Blocks until the scheduler allows a request of this class on the wire. Every
+ *  call must be paired with a call to rs_release().
+ *
+ *  @priority enum request_priority_e the class of the request
+ */
+void rs_acquire(enum request_priority_e priority)
+{
+	struct rs_class_t *class = &scheduler.classes[priority];
+
+	pthread_mutex_lock(&scheduler.lock);
+	++class->waiting;
+	while(!rs_can_start(priority))
+		pthread_cond_wait(&scheduler.cond, &scheduler.lock);
+	--class->waiting;
+	++class->inflight;
+	++scheduler.inflight;
+	pthread_mutex_unlock(&scheduler.lock);
+}
+
+/** Give up a slot taken by rs_acquire().
+ *
+ *  @priority enum request_priority_e the class of the finished request
+ */
+void rs_release(enum request_priority_e priority)
+{
+	pthread_mutex_lock(&scheduler.lock);
+	--scheduler.classes[priority].inflight;
+	--scheduler.inflight;
+	// Waiters of several classes share one condition, wake all of them so the
+	// most important one can claim the slot.
+	pthread_cond_broadcast(&scheduler.cond);
+	pthread_mutex_unlock(&scheduler.lock);
+}
+
+/** Report a request the server handled without throttling us.
+ *
+ *  Grows the window by roughly one request per window's worth of successes.
+ */
+void rs_success()
+{
+	pthread_mutex_lock(&scheduler.lock);
+	size_t before = (size_t) scheduler.window;
+	scheduler.window += 1.0 / scheduler.window;
+	if(scheduler.window > scheduler.max_inflight)
+		scheduler.window = scheduler.max_inflight;
+	if((size_t) scheduler.window > before)
+		pthread_cond_broadcast(&scheduler.cond);
+	pthread_mutex_unlock(&scheduler.lock);
+}
+
+/** Report a request the server refused because of rate limiting.
+ *
+ *  Halves the window, at most once per decrease_holdoff_ms.
+ */
+void rs_throttled()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	pthread_mutex_lock(&scheduler.lock);
+	long elapsed = (now.tv_sec - scheduler.last_decrease.tv_sec) * 1000 +
+		(now.tv_nsec - scheduler.last_decrease.tv_nsec) / 1000000;
+	if(elapsed >= decrease_holdoff_ms)
+	{
+		scheduler.window /= 2;
+		if(scheduler.window < 1)
+			scheduler.window = 1;
+		scheduler.last_decrease = now;
+	}
+	pthread_mutex_unlock(&scheduler.lock);
+}
+
+/** Enable or disable request hedging.
+ *
+ *  @enabled int nonzero to allow hedged requests
+ */
+void rs_set_hedging(int enabled)
+{
+	pthread_mutex_lock(&scheduler.lock);
+	scheduler.hedging = enabled;
+	pthread_mutex_unlock(&scheduler.lock);
+}
+
+/** Record the time to first byte of a hedgeable request.
+ *
+ *  Each sample also earns a fraction of a hedge.
+ *
+ *  @latency_ms long milliseconds from sending the request to the first byte,
+ *                   or to when it was given up on if no byte arrived
+ */
+void rs_record_latency(long latency_ms)
+{
+	pthread_mutex_lock(&scheduler.lock);
+	scheduler.latency[scheduler.latency_next] = latency_ms;
+	scheduler.latency_next = (scheduler.latency_next + 1) % RS_LATENCY_SAMPLES;
+	if(scheduler.latency_count < RS_LATENCY_SAMPLES)
+		++scheduler.latency_count;
+
+	scheduler.hedge_tokens += hedge_ratio;
+	if(scheduler.hedge_tokens > hedge_burst)
+		scheduler.hedge_tokens = hedge_burst;
+	pthread_mutex_unlock(&scheduler.lock);
+}
+
+static int rs_compare_latency(const void *a, const void *b)
+{
+	long left = *(const long*) a;
+	long right = *(const long*) b;
+	return (left > right) - (left < right);
+}
+
+/** Find how long a hedgeable request should wait before it is hedged.
+ *
+ *  @returns the delay in milliseconds, or -1 if it should not be hedged at all
+ */
+long rs_hedge_delay()
+{
+	long sorted[RS_LATENCY_SAMPLES];
+	size_t count;
+
+	pthread_mutex_lock(&scheduler.lock);
+	count = scheduler.latency_count;
+	if(!scheduler.hedging || count < hedge_min_samples)
+	{
+		pthread_mutex_unlock(&scheduler.lock);
+		return -1;
+	}
+	memcpy(sorted, scheduler.latency, sizeof(long) * count);
+	pthread_mutex_unlock(&scheduler.lock);
+
+	qsort(sorted, count, sizeof(long), rs_compare_latency);
+	long delay = sorted[count * hedge_percentile / 100];
+	return delay < hedge_min_delay_ms ? hedge_min_delay_ms : delay;
+}
+
+/** Take a slot for a hedge without waiting.
+ *
+ *  A hedge is only sent if there is budget left and the class could start a
+ *  request right now, a hedge is never worth queueing for.
+ *
+ *  @priority enum request_priority_e the class of the hedged request
+ *
+ *  @returns 1 if the hedge may be sent, pair it with rs_release(), 0 otherwise
+ */
+int rs_acquire_hedge(enum request_priority_e priority)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&scheduler.lock);
+	if(scheduler.hedge_tokens >= 1 && rs_can_start(priority))
+	{
+		scheduler.hedge_tokens -= 1;
+		++scheduler.classes[priority].inflight;
+		++scheduler.inflight;
+		ret = 1;
+	}
+	pthread_mutex_unlock(&scheduler.lock);
+
+	return ret;
+}
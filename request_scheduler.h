@@ -0,0 +1,110 @@
+/*
+	fuse-google-drive: a fuse filesystem wrapper for Google Drive
+	Copyright (C) 2012  James Cline
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2 as
+ 	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef _REQUEST_SCHEDULER_H
+#define _REQUEST_SCHEDULER_H
+
+#include <curl/curl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+/** The priority class of an HTTP request.
+ *
+ *  Lower values are more important. A waiting request is never passed over by
+ *  a request from a less important class.
+ */
+enum request_priority_e {
+	// A read() the user is currently blocked on
+	PRIORITY_INTERACTIVE,
+	// open() and revalidation of cached data
+	PRIORITY_OPEN,
+	// Speculative reads ahead of the user
+	PRIORITY_READAHEAD,
+	// Write-back of locally staged files
+	PRIORITY_UPLOAD,
+	// Background metadata synchronization
+	PRIORITY_SYNC,
+
+	PRIORITY_COUNT
+};
+
+// How many recent first byte latencies hedging decisions are based on
+#define RS_LATENCY_SAMPLES 64
+
+struct rs_class_t {
+	// Maximum number of requests of this class allowed on the wire
+	size_t max_inflight;
+	// Per transfer receive limit in bytes/second, 0 for unlimited
+	curl_off_t max_recv_speed;
+
+	size_t inflight;
+	size_t waiting;
+};
+
+struct rs_state_t {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	// Maximum number of requests on the wire across every class
+	size_t max_inflight;
+	// Congestion window, the current limit on requests across every class.
+	// Grows additively as requests succeed and shrinks multiplicatively when
+	// the server tells us to slow down, never exceeding max_inflight.
+	double window;
+	// When the window was last shrunk, so one burst of throttled responses
+	// only shrinks it once
+	struct timespec last_decrease;
+	// Slots only PRIORITY_INTERACTIVE and PRIORITY_OPEN may use, so background
+	// traffic can never occupy every connection
+	size_t reserved;
+	size_t inflight;
+
+	struct rs_class_t classes[PRIORITY_COUNT];
+
+	// Milliseconds to first byte of recent hedgeable requests, a ring buffer
+	long latency[RS_LATENCY_SAMPLES];
+	size_t latency_count;
+	size_t latency_next;
+
+	// Whether duplicate requests may be sent for slow hedgeable requests
+	int hedging;
+	// Hedges we may still send, each hedgeable request earns a fraction of one
+	double hedge_tokens;
+};
+
+int rs_init(size_t max_inflight);
+void rs_destroy();
+
+void rs_set_class_limits(enum request_priority_e priority,
+		size_t max_inflight, curl_off_t max_recv_speed);
+curl_off_t rs_recv_speed(enum request_priority_e priority);
+
+void rs_acquire(enum request_priority_e priority);
+void rs_release(enum request_priority_e priority);
+
+void rs_success();
+void rs_throttled();
+
+void rs_set_hedging(int enabled);
+void rs_record_latency(long latency_ms);
+long rs_hedge_delay();
+int rs_acquire_hedge(enum request_priority_e priority);
+
+#endif
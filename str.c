@@ -82,10 +82,13 @@ void str_swap(struct str_t* a, struct str_t* b)
 {
 	char* tmp = a->str;
 	const size_t len = a->len;
+	const size_t reserved = a->reserved;
 	a->str = b->str;
 	a->len = b->len;
+	a->reserved = b->reserved;
 	b->str = tmp;
 	b->len = len;
+	b->reserved = reserved;
 }
 
 int str_char_concat(struct str_t* str, const char const* value, size_t size)